@@ -0,0 +1,595 @@
+/*
+    Headless batch processing of images through a project.
+
+    Loads a project, binds one of its bitmap nodes to each input image in
+    turn, and writes the output of a node as a PNG per input, without any UI,
+    windowing or GL dependencies. Images stream through three stages:
+    decoding, evaluation and encoding. Decodes and encodes run as background
+    jobs, which the workers pick up whenever evaluation leaves them idle,
+    while the main thread evaluates one image at a time on all of them.
+    Decoding runs ahead of evaluation as far as the memory budget allows. An
+    image counts against the budget from its decode until its PNG is written.
+
+    With --stream, images go through one at a time, without ever being held
+    whole: PNGs are decoded a row of tiles at a time, ahead of the strips of
+    rows that the graph is evaluated in, see papaya_stream_begin, and every
+    strip is encoded while the next is evaluated. Other formats, and
+    interlaced PNGs, are still decoded whole first.
+
+    Each output has the size of its input, and is named after it, with a .png
+    extension, in the output directory. Throughput is reported at the end.
+
+    Usage: batch [options] project.papaya output_dir [input...]
+
+    --bind NAME   Bitmap node that takes the inputs. Defaults to the first.
+    --node NAME   Node whose output is written. Defaults to the viewed one.
+    --list FILE   Also reads input paths from FILE, one per line.
+    --threads N   Threads, including the main one. Defaults to one per core.
+    --memory MB   Budget for the images in flight. Defaults to 1024.
+    --level L     PNG compression level, from 0 to 9. Defaults to 6.
+    --stream      Evaluates in strips of rows, for images too large to hold.
+*/
+
+#include "libpapaya.h"
+#include "jobs.h"
+#include "kernels.h"
+#include "png.h"
+#include "project.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libs/stb_image.h"
+
+struct Image {
+    char* path;
+    char* out_path;
+    int32_t w, h;
+    size_t bytes;     // Counted against the budget while in flight
+    uint8_t* pixels;  // Decoded, then replaced by the output in place
+    PapayaTask* task; // Decode or encode in progress
+    int32_t level;    // Of PNG compression
+    bool probed;      // Once w, h and bytes are known
+    bool failed;
+};
+
+struct Batch {
+    Image* images;
+    int32_t num_images, max_images;
+    size_t budget, in_flight; // Bytes
+    int32_t max_ahead;  // Decodes started ahead of evaluation, at most
+    int32_t decoded;    // Images whose decode has been started
+    int32_t retired;    // Images whose encode has been waited on
+    int32_t failures;
+    double mpix;        // Of the images written
+};
+
+static double now_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+static void add_image(Batch* b, const char* path, const char* out_dir,
+                      int32_t level)
+{
+    if (b->num_images == b->max_images) {
+        b->max_images = b->max_images ? 2 * b->max_images : 256;
+        b->images = (Image*) realloc(b->images,
+                                     b->max_images * sizeof(Image));
+    }
+    Image* img = &b->images[b->num_images++];
+    memset(img, 0, sizeof(*img));
+    img->path = strdup(path);
+    img->level = level;
+
+    // The file name without directories or extension
+    const char* name = path;
+    for (const char* p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') { name = p + 1; }
+    }
+    const char* dot = strrchr(name, '.');
+    int32_t len = dot && dot != name ? (int32_t)(dot - name)
+                                     : (int32_t)strlen(name);
+    size_t size = strlen(out_dir) + len + 6;
+    img->out_path = (char*) malloc(size);
+    snprintf(img->out_path, size, "%s/%.*s.png", out_dir, len, name);
+}
+
+// Adds the paths in the file at path, one per line. Returns false on failure.
+static bool add_list(Batch* b, const char* path, const char* out_dir,
+                     int32_t level)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = 0;
+        if (len) {
+            add_image(b, line, out_dir, level);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void decode_job(void* data, int32_t index)
+{
+    Image* img = (Image*)data;
+    int32_t w, h, c;
+    img->pixels = stbi_load(img->path, &w, &h, &c, 4);
+    if (!img->pixels || w != img->w || h != img->h) {
+        img->failed = true;
+        return;
+    }
+    // Nodes work on premultiplied alpha
+    papaya_premultiply(img->pixels, (int64_t)w * h);
+}
+
+static void encode_job(void* data, int32_t index)
+{
+    Image* img = (Image*)data;
+    size_t size;
+    uint8_t* png = papaya_encode_png(img->pixels, img->w, img->h, img->level,
+                                     &size, 0, 0);
+    stbi_image_free(img->pixels);
+    img->pixels = 0;
+
+    FILE* f = fopen(img->out_path, "wb");
+    img->failed = !f || fwrite(png, 1, size, f) != size;
+    if (f && fclose(f) != 0) {
+        img->failed = true;
+    }
+    free(png);
+}
+
+/*
+    Reads the size of the next image to decode from its header, and returns
+    whether it fits in the budget.
+*/
+static bool next_fits(Batch* b)
+{
+    Image* img = &b->images[b->decoded];
+    if (!img->probed) {
+        int32_t c;
+        img->probed = true;
+        if (stbi_info(img->path, &img->w, &img->h, &c)) {
+            img->bytes = 4 * (size_t)img->w * img->h;
+        } else {
+            img->failed = true;
+        }
+    }
+    return b->in_flight + img->bytes <= b->budget;
+}
+
+static void start_decode(Batch* b)
+{
+    next_fits(b);
+    Image* img = &b->images[b->decoded++];
+    b->in_flight += img->bytes;
+    if (!img->failed) {
+        img->task = papaya_run_async(decode_job, img);
+    }
+}
+
+static bool is_done(Image* img)
+{
+    return !img->task || papaya_task_done(img->task);
+}
+
+// Waits for the oldest image in flight to be written
+static void retire(Batch* b)
+{
+    Image* img = &b->images[b->retired++];
+    if (img->task) {
+        papaya_wait(img->task);
+        img->task = 0;
+    }
+    if (img->failed) {
+        fprintf(stderr, "Can't process %s\n", img->path);
+        stbi_image_free(img->pixels);
+        img->pixels = 0;
+        b->failures++;
+    } else {
+        b->mpix += (double)img->w * img->h / 1e6;
+    }
+    b->in_flight -= img->bytes;
+}
+
+static void evaluate(Batch* b, int32_t i, PapayaNode* bind, PapayaNode* out)
+{
+    Image* img = &b->images[i];
+    if (img->task) {
+        papaya_wait(img->task);
+        img->task = 0;
+    }
+    if (img->failed) {
+        return;
+    }
+
+    papaya_set_bitmap(bind, img->pixels, img->w, img->h);
+    const uint8_t* result = papaya_evaluate_cached(out, img->w, img->h, 0);
+    papaya_unpremultiply(result, img->pixels, (int64_t)img->w * img->h);
+    img->task = papaya_run_async(encode_job, img);
+}
+
+static void run(Batch* b, PapayaNode* bind, PapayaNode* out)
+{
+    for (int32_t i = 0; i < b->num_images; i++) {
+        // Makes room for the image to evaluate, if it hasn't been decoded
+        while (b->retired < i &&
+               (is_done(&b->images[b->retired]) ||
+                (b->decoded == i && !next_fits(b)))) {
+            retire(b);
+        }
+        // The image to evaluate is let in even if it alone is over budget
+        while (b->decoded < b->num_images &&
+               (b->decoded == i ||
+                (b->decoded - i < b->max_ahead && next_fits(b)))) {
+            start_decode(b);
+        }
+        evaluate(b, i, bind, out);
+    }
+    while (b->retired < b->num_images) {
+        retire(b);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+static size_t read_fn(void* data, void* p, size_t n)
+{
+    return fread(p, 1, n, (FILE*)data);
+}
+
+static bool write_fn(void* data, const void* p, size_t n)
+{
+    return fwrite(p, 1, n, (FILE*)data) == n;
+}
+
+/*
+    Rows of an image being streamed. PNGs are decoded a row of tiles ahead,
+    in the background, while the rows before are evaluated.
+*/
+struct StreamSource {
+    PapayaPngReader* png; // 0 if the image was decoded whole, to pixels
+    uint8_t* pixels;      // Premultiplied
+    int32_t w, h;
+    uint8_t* ahead;       // Rows decoded ahead
+    int32_t ahead_y, ahead_rows;
+    PapayaTask* task;     // Decoding ahead
+    bool failed;
+};
+
+static void decode_rows(StreamSource* s, int32_t y, int32_t rows,
+                        uint8_t* out)
+{
+    size_t n = (size_t)s->w * rows;
+    if (!s->png) {
+        memcpy(out, s->pixels + 4 * (size_t)y * s->w, 4 * n);
+        return;
+    }
+    if (!papaya_png_reader_rows(s->png, out, rows)) {
+        s->failed = true;
+        memset(out, 0, 4 * n);
+    }
+    papaya_premultiply(out, (int64_t)n);
+}
+
+static void decode_ahead_job(void* data, int32_t index)
+{
+    StreamSource* s = (StreamSource*)data;
+    decode_rows(s, s->ahead_y, s->ahead_rows, s->ahead);
+}
+
+static void read_rows(void* data, int32_t y, int32_t rows, uint8_t* out)
+{
+    StreamSource* s = (StreamSource*)data;
+    if (s->task) {
+        papaya_wait(s->task);
+        s->task = 0;
+    }
+    if (s->ahead_rows && s->ahead_y == y && s->ahead_rows == rows) {
+        memcpy(out, s->ahead, 4 * (size_t)s->w * rows);
+    } else {
+        decode_rows(s, y, rows, out);
+    }
+
+    s->ahead_rows = 0;
+    if (s->png && y + rows < s->h) {
+        s->ahead_y = y + rows;
+        s->ahead_rows = s->h - s->ahead_y < PAPAYA_TILE_SIZE ?
+                        s->h - s->ahead_y : PAPAYA_TILE_SIZE;
+        s->task = papaya_run_async(decode_ahead_job, s);
+    }
+}
+
+// Strips being encoded, one at a time, in the background
+struct StreamSink {
+    PapayaPngWriter* png;
+    uint8_t* strips[2]; // The one being encoded and the one being filled
+    size_t sizes[2];
+    int32_t cur;        // Strip to fill next
+    int32_t rows;       // Of the strip being encoded
+    PapayaTask* task;
+    bool ok;
+};
+
+static void encode_rows_job(void* data, int32_t index)
+{
+    StreamSink* s = (StreamSink*)data;
+    if (!papaya_png_writer_rows(s->png, s->strips[s->cur ^ 1], s->rows)) {
+        s->ok = false;
+    }
+}
+
+static void finish_task(PapayaTask** task)
+{
+    if (*task) {
+        papaya_wait(*task);
+        *task = 0;
+    }
+}
+
+static void stream_strips(Image* img, PapayaNode* bind, PapayaNode* out,
+                          StreamSource* src, FILE* f)
+{
+    StreamSink sink = {};
+    sink.png = papaya_png_writer_begin(img->w, img->h, img->level, write_fn,
+                                       f);
+    sink.ok = true;
+    src->ahead = (uint8_t*) malloc(4 * (size_t)img->w * PAPAYA_TILE_SIZE);
+
+    PapayaStream* s = papaya_stream_begin(out, img->w, img->h, bind,
+                                          read_rows, src);
+    const uint8_t* pixels;
+    int32_t rows;
+    while (papaya_stream_next(s, &pixels, &rows) >= 0 && !src->failed) {
+        size_t size = 4 * (size_t)img->w * rows;
+        int32_t i = sink.cur;
+        if (sink.sizes[i] < size) {
+            sink.strips[i] = (uint8_t*) realloc(sink.strips[i], size);
+            sink.sizes[i] = size;
+        }
+        papaya_unpremultiply(pixels, sink.strips[i], (int64_t)img->w * rows);
+
+        // Strips go to the writer in order
+        finish_task(&sink.task);
+        sink.rows = rows;
+        sink.cur ^= 1;
+        sink.task = papaya_run_async(encode_rows_job, &sink);
+    }
+    finish_task(&sink.task);
+    finish_task(&src->task);
+    papaya_stream_end(s);
+
+    bool ok = papaya_png_writer_end(sink.png) && sink.ok;
+    img->failed = !ok || src->failed;
+    free(sink.strips[0]);
+    free(sink.strips[1]);
+    free(src->ahead);
+}
+
+static void stream_image(Image* img, PapayaNode* bind, PapayaNode* out)
+{
+    StreamSource src = {};
+    FILE* in = fopen(img->path, "rb");
+    if (in) {
+        src.png = papaya_png_reader_begin(read_fn, in, &src.w, &src.h);
+    }
+    if (!src.png) {
+        // Not a PNG that decodes by rows
+        int32_t c;
+        src.pixels = stbi_load(img->path, &src.w, &src.h, &c, 4);
+        if (src.pixels) {
+            papaya_premultiply(src.pixels, (int64_t)src.w * src.h);
+        }
+    }
+
+    img->failed = true;
+    if (src.png || src.pixels) {
+        img->w = src.w;
+        img->h = src.h;
+        FILE* f = fopen(img->out_path, "wb");
+        if (f) {
+            stream_strips(img, bind, out, &src, f);
+            if (fclose(f) != 0) {
+                img->failed = true;
+            }
+            if (img->failed) {
+                remove(img->out_path);
+            }
+        }
+    }
+
+    if (src.png) {
+        papaya_png_reader_end(src.png);
+    }
+    stbi_image_free(src.pixels);
+    if (in) {
+        fclose(in);
+    }
+}
+
+static void run_streamed(Batch* b, PapayaNode* bind, PapayaNode* out)
+{
+    for (int32_t i = 0; i < b->num_images; i++) {
+        Image* img = &b->images[i];
+        stream_image(img, bind, out);
+        if (img->failed) {
+            fprintf(stderr, "Can't process %s\n", img->path);
+            b->failures++;
+        } else {
+            b->mpix += (double)img->w * img->h / 1e6;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+static PapayaNode* find_node(PapayaGraph* g, const char* name)
+{
+    for (int32_t i = 0; i < g->num_nodes; i++) {
+        if (!strcmp(g->nodes[i].name, name)) { return &g->nodes[i]; }
+    }
+    return 0;
+}
+
+static uint8_t* read_file(const char* path, size_t* size)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = len > 0 ? (uint8_t*) malloc(len) : 0;
+    if (data && fread(data, 1, len, f) != (size_t)len) {
+        free(data);
+        data = 0;
+    }
+    fclose(f);
+    *size = (size_t)len;
+    return data;
+}
+
+static int usage(const char* exe)
+{
+    fprintf(stderr, "Usage: %s [--bind NAME] [--node NAME] [--list FILE] "
+            "[--threads N] [--memory MB] [--level L] [--stream] "
+            "project.papaya output_dir [input...]\n", exe);
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    const char* bind_name = 0;
+    const char* node_name = 0;
+    const char* lists[16];
+    int32_t num_lists = 0;
+    int32_t threads = 0;
+    int32_t memory_mb = 1024;
+    int32_t level = PAPAYA_PNG_DEFAULT_LEVEL;
+    bool stream = false;
+    const char* paths[2] = {};
+    int32_t num_paths = 0;
+    int32_t first_input = argc;
+
+    for (int32_t i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "--bind") && has_value) {
+            bind_name = argv[++i];
+        } else if (!strcmp(arg, "--node") && has_value) {
+            node_name = argv[++i];
+        } else if (!strcmp(arg, "--list") && has_value && num_lists < 16) {
+            lists[num_lists++] = argv[++i];
+        } else if (!strcmp(arg, "--threads") && has_value) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--memory") && has_value) {
+            memory_mb = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--level") && has_value) {
+            level = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--stream")) {
+            stream = true;
+        } else if (arg[0] == '-') {
+            return usage(argv[0]);
+        } else {
+            paths[num_paths++] = arg;
+            if (num_paths == 2) {
+                first_input = i + 1;
+                break;
+            }
+        }
+    }
+    if (num_paths < 2 || memory_mb <= 0 || level < 0 || level > 9) {
+        return usage(argv[0]);
+    }
+
+    Batch b = {};
+    const char* out_dir = paths[1];
+    for (int32_t i = first_input; i < argc; i++) {
+        add_image(&b, argv[i], out_dir, level);
+    }
+    for (int32_t i = 0; i < num_lists; i++) {
+        if (!add_list(&b, lists[i], out_dir, level)) {
+            fprintf(stderr, "Can't read %s\n", lists[i]);
+            return 1;
+        }
+    }
+
+    size_t size = 0;
+    uint8_t* file = read_file(paths[0], &size);
+    PapayaProjectInfo info;
+    if (!file || !papaya_project_info(file, size, &info)) {
+        fprintf(stderr, "Can't open the project %s\n", paths[0]);
+        return 1;
+    }
+    PapayaGraph graph;
+    papaya_graph_init(&graph, info.num_nodes, info.num_nodes);
+    papaya_project_load(file, &graph);
+
+    PapayaNode* bind = 0;
+    for (int32_t i = 0; !bind_name && !bind && i < graph.num_nodes; i++) {
+        if (graph.nodes[i].type == PapayaNodeType_Bitmap) {
+            bind = &graph.nodes[i];
+        }
+    }
+    if (bind_name) {
+        bind = find_node(&graph, bind_name);
+    }
+    PapayaNode* out = node_name ? find_node(&graph, node_name) :
+                      info.view_node >= 0 && info.view_node < graph.num_nodes ?
+                      &graph.nodes[info.view_node] : 0;
+    int status = 0;
+    if (!bind || bind->type != PapayaNodeType_Bitmap) {
+        fprintf(stderr, bind_name ? "The project has no bitmap node %s\n" :
+                "The project has no bitmap node\n", bind_name);
+        status = 1;
+    } else if (!out) {
+        fprintf(stderr, "The project has no node %s\n",
+                node_name ? node_name : "to view");
+        status = 1;
+    }
+
+    if (!status) {
+        papaya_jobs_init(threads);
+        b.budget = (size_t)memory_mb << 20;
+        b.max_ahead = 2 * papaya_jobs_num_threads();
+
+        double start = now_ms();
+        if (stream) {
+            run_streamed(&b, bind, out);
+        } else {
+            run(&b, bind, out);
+        }
+        double s = (now_ms() - start) / 1000.0;
+        papaya_jobs_shutdown();
+
+        int32_t written = b.num_images - b.failures;
+        fprintf(stderr, "%d images in %.2f s, %.2f images/s, %.1f MP/s",
+                written, s, s > 0.0 ? written / s : 0.0,
+                s > 0.0 ? b.mpix / s : 0.0);
+        if (b.failures) {
+            fprintf(stderr, ", %d failed", b.failures);
+            status = 1;
+        }
+        fprintf(stderr, "\n");
+    }
+
+    papaya_graph_destroy(&graph);
+    free(file);
+    for (int32_t i = 0; i < b.num_images; i++) {
+        free(b.images[i].path);
+        free(b.images[i].out_path);
+    }
+    free(b.images);
+    return status;
+}
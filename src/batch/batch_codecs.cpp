@@ -0,0 +1,4 @@
+// The image decoders of the batch tool, which doesn't link the UI's
+// single_header_libs.cpp
+#define STB_IMAGE_IMPLEMENTATION
+#include "libs/stb_image.h"
@@ -0,0 +1,284 @@
+/*
+    Headless benchmark of node graph evaluation.
+
+    Builds synthetic graphs at several resolutions and times full
+    re-evaluations of them with papaya_evaluate_node, for every thread count
+    from 1 up to the number of hardware threads, in powers of two. Results go
+    to a JSON file, one entry per graph, resolution and thread count, so that
+    runs on different revisions can be compared by a script.
+
+    Usage: benchmark [--quick] [output.json]
+
+    --quick only runs the smaller resolutions, with fewer repetitions.
+*/
+
+#include "libpapaya.h"
+#include "jobs.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NODES 8
+
+enum Graph_ {
+    Graph_Bitmap,      // A single bitmap
+    Graph_InvertChain, // Bitmap, then four inverts in a row
+    Graph_InvertMask,  // Invert of a bitmap, masked by another bitmap
+    Graph_FanOut,      // Bitmap feeding four inverts, each masking the next
+    Graph_Rotate,      // Bitmap turned by ten degrees, through Lanczos
+    Graph_BlurSmall,   // Bitmap blurred by a radius of 4, by convolution
+    Graph_BlurLarge,   // Bitmap blurred by a radius of 100, by box passes
+    Graph_Levels,      // Bitmap through levels and an invert, in one pass
+    Graph_BlurLevels,  // Bitmap blurred by a radius of 60, then levels
+    Graph_COUNT
+};
+
+static const char* graph_names[] = {
+    "bitmap",
+    "invert_chain",
+    "invert_mask",
+    "fan_out",
+    "rotate",
+    "blur_small",
+    "blur_large",
+    "levels",
+    "blur_levels",
+};
+
+struct Bench {
+    PapayaGraph graph;   // Of MAX_NODES nodes, the first num_nodes in use
+    int32_t num_nodes;
+    int32_t num_sources; // Bitmaps, which come first
+    PapayaNode* out;     // Node that is evaluated
+};
+
+/*
+    Fills a w*h premultiplied RGBA image with gradients, noise and alpha
+    variation, so that no kernel can take a shortcut on uniform input.
+*/
+static uint8_t* make_image(int32_t w, int32_t h, uint32_t seed)
+{
+    uint8_t* img = (uint8_t*) malloc(4 * (size_t)w * h);
+    for (int32_t y = 0; y < h; y++) {
+        for (int32_t x = 0; x < w; x++) {
+            seed = seed * 1664525 + 1013904223;
+            uint8_t* p = img + 4 * ((size_t)y * w + x);
+            p[0] = (uint8_t)(x * 255 / w);
+            p[1] = (uint8_t)(y * 255 / h);
+            p[2] = (uint8_t)(seed >> 24);
+            p[3] = (uint8_t)(((x ^ y) & 64) ? 255 : 128 + (seed >> 25));
+        }
+    }
+    papaya_premultiply(img, (int64_t)w * h);
+    return img;
+}
+
+static PapayaNode* add_invert(Bench* b, PapayaNode* in, PapayaNode* mask)
+{
+    PapayaNode* n = &b->graph.nodes[b->num_nodes++];
+    init_invert_color_node(n, "Invert");
+    papaya_connect(&in->slots[1], &n->slots[0]);
+    if (mask) {
+        papaya_connect(&mask->slots[1], &n->slots[2]);
+    }
+    return n;
+}
+
+static void init_bench(Bench* b, Graph_ graph, int32_t w, int32_t h)
+{
+    memset(b, 0, sizeof(*b));
+    papaya_graph_init(&b->graph, MAX_NODES, MAX_NODES);
+    b->num_sources = graph == Graph_InvertMask ? 2 : 1;
+    for (int32_t i = 0; i < b->num_sources; i++) {
+        uint8_t* img = make_image(w, h, 1234 + i);
+        init_bitmap_node(&b->graph.nodes[i], "Bitmap", img, w, h, 4);
+        free(img);
+    }
+    b->num_nodes = b->num_sources;
+
+    PapayaNode* src = &b->graph.nodes[0];
+    b->out = src;
+    switch (graph) {
+        case Graph_Bitmap: break;
+        case Graph_InvertChain: {
+            for (int32_t i = 0; i < 4; i++) {
+                b->out = add_invert(b, b->out, 0);
+            }
+        } break;
+        case Graph_InvertMask: {
+            b->out = add_invert(b, src, &b->graph.nodes[1]);
+        } break;
+        case Graph_FanOut: {
+            // The bitmap's output slot connects to all four
+            PapayaNode* prev = 0;
+            for (int32_t i = 0; i < 4; i++) {
+                prev = add_invert(b, src, prev);
+            }
+            b->out = prev;
+        } break;
+        case Graph_Rotate: {
+            PapayaNode* n = &b->graph.nodes[b->num_nodes++];
+            init_transform_node(n, "Rotate");
+            TransformNode* t = &n->params.transform;
+            t->angle = 10.0f * 3.14159265f / 180.0f;
+            t->src_x = t->dst_x = w * 0.5f;
+            t->src_y = t->dst_y = h * 0.5f;
+            t->filter = PapayaFilter_Lanczos;
+            papaya_connect(&src->slots[1], &n->slots[0]);
+            b->out = n;
+        } break;
+        case Graph_BlurSmall:
+        case Graph_BlurLarge: {
+            PapayaNode* n = &b->graph.nodes[b->num_nodes++];
+            init_blur_node(n, "Blur");
+            n->params.blur.radius = graph == Graph_BlurSmall ? 4.0f : 100.0f;
+            papaya_connect(&src->slots[1], &n->slots[0]);
+            b->out = n;
+        } break;
+        case Graph_Levels: {
+            PapayaNode* n = &b->graph.nodes[b->num_nodes++];
+            init_levels_node(n, "Levels");
+            LevelsNode* l = &n->params.levels;
+            l->in_black[PAPAYA_LEVELS_ALL] = 0.1f;
+            l->gamma[PAPAYA_LEVELS_ALL] = 1.4f;
+            l->out_white[0] = 0.9f;
+            papaya_connect(&src->slots[1], &n->slots[0]);
+            b->out = add_invert(b, n, 0);
+        } break;
+        case Graph_BlurLevels: {
+            PapayaNode* blur = &b->graph.nodes[b->num_nodes++];
+            init_blur_node(blur, "Blur");
+            blur->params.blur.radius = 60.0f;
+            papaya_connect(&src->slots[1], &blur->slots[0]);
+            PapayaNode* n = &b->graph.nodes[b->num_nodes++];
+            init_levels_node(n, "Levels");
+            n->params.levels.gamma[PAPAYA_LEVELS_ALL] = 1.4f;
+            papaya_connect(&blur->slots[1], &n->slots[0]);
+            b->out = n;
+        } break;
+        case Graph_COUNT: break;
+    }
+}
+
+static void destroy_bench(Bench* b)
+{
+    papaya_graph_destroy(&b->graph);
+}
+
+static double now_ms()
+{
+    using namespace std::chrono;
+    return duration<double, std::milli>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+struct Timing {
+    int32_t reps;
+    double min_ms, median_ms;
+};
+
+/*
+    Marks the sources as changed before every evaluation, so that every rep
+    recomputes the whole graph, as after opening a document.
+*/
+static Timing time_bench(Bench* b, int32_t w, int32_t h, uint8_t* out,
+                         bool quick)
+{
+    const int32_t max_reps = quick ? 5 : 50;
+    const double min_total_ms = quick ? 200.0 : 1000.0;
+    double times[50];
+
+    // Warms up the caches of the nodes, which are then reused
+    papaya_evaluate_node(b->out, w, h, out);
+
+    Timing t = {};
+    double total = 0.0;
+    while (t.reps < max_reps && (t.reps < 3 || total < min_total_ms)) {
+        for (int32_t i = 0; i < b->num_sources; i++) {
+            papaya_touch_node(&b->graph.nodes[i]);
+        }
+        double start = now_ms();
+        papaya_evaluate_node(b->out, w, h, out);
+        times[t.reps] = now_ms() - start;
+        total += times[t.reps];
+        t.reps++;
+    }
+
+    std::sort(times, times + t.reps);
+    t.min_ms = times[0];
+    t.median_ms = times[t.reps / 2];
+    return t;
+}
+
+int main(int argc, char** argv)
+{
+    bool quick = false;
+    const char* path = "benchmark.json";
+    for (int32_t i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            quick = true;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [--quick] [output.json]\n", argv[0]);
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return 1;
+    }
+
+    int32_t max_threads = (int32_t)std::thread::hardware_concurrency();
+    if (max_threads < 1) { max_threads = 1; }
+    const int32_t sizes[] = { 512, 1024, 2048, 4096 };
+    int32_t num_sizes = quick ? 2 : 4;
+
+    fprintf(f, "{\n  \"hardware_threads\": %d,\n  \"results\": [", max_threads);
+    bool first = true;
+    for (int32_t s = 0; s < num_sizes; s++) {
+        int32_t w = sizes[s], h = sizes[s];
+        uint8_t* out = (uint8_t*) malloc(4 * (size_t)w * h);
+
+        for (int32_t g = 0; g < Graph_COUNT; g++) {
+            Bench b;
+            init_bench(&b, (Graph_)g, w, h);
+
+            for (int32_t n = 1; ; n = n * 2 < max_threads ? n * 2 :
+                                                            max_threads) {
+                papaya_jobs_init(n);
+                Timing t = time_bench(&b, w, h, out, quick);
+                papaya_jobs_shutdown();
+
+                double mpix = (double)w * h / 1e6 / (t.median_ms / 1000.0);
+                fprintf(stderr, "%-14s %5dx%-5d %3d threads %9.3f ms "
+                        "%9.1f MP/s\n", graph_names[g], w, h, n,
+                        t.median_ms, mpix);
+                fprintf(f, "%s\n    { \"graph\": \"%s\", \"width\": %d, "
+                        "\"height\": %d, \"threads\": %d, \"reps\": %d, "
+                        "\"min_ms\": %.4f, \"median_ms\": %.4f, "
+                        "\"mpix_per_s\": %.2f }", first ? "" : ",",
+                        graph_names[g], w, h, n, t.reps, t.min_ms,
+                        t.median_ms, mpix);
+                first = false;
+                if (n == max_threads) { break; }
+            }
+            destroy_bench(&b);
+        }
+        free(out);
+    }
+    fprintf(f, "\n  ]\n}\n");
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return 1;
+    }
+    return 0;
+}
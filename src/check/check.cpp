@@ -0,0 +1,283 @@
+/*
+    Headless checks of libpapaya.
+
+    Compares every dispatched pixel kernel with its scalar version, which is
+    the reference the SIMD versions must match bit for bit, on random pixels
+    and on the alphas where rounding goes wrong first, and histograms with
+    the colors of papaya_unpremultiply. Also saves a project to the temporary
+    directory and opens it again, and checks that changes to the input of a
+    transform reach its output. Prints the checks that fail and returns 1 if
+    any did.
+
+    Usage: check
+*/
+
+#include "libpapaya.h"
+#include "jobs.h"
+#include "kernels.h"
+#include "project.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest run of pixels a kernel is given, past the widest SIMD step so that
+// both the vector loops and their scalar tails are covered
+#define MAX_PIXELS 67
+#define NUM_ROUNDS 2000
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng()
+{
+    rng_state = rng_state * 1664525 + 1013904223;
+    return rng_state >> 8;
+}
+
+/*
+    Fills n premultiplied RGBA pixels. With edges, alphas are only 0, 1, 254
+    and 255, and some colors are just above alpha, which SIMD versions
+    saturate like the scalar ones.
+*/
+static void random_pixels(uint8_t* p, int32_t n, bool edges)
+{
+    static const uint8_t edge_alphas[] = { 0, 1, 254, 255 };
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t a = edges ? edge_alphas[rng() & 3] : rng() & 255;
+        for (int32_t c = 0; c < 3; c++) {
+            uint32_t v = a ? rng() % (a + 1) : 0;
+            if (edges && (rng() & 7) == 0) {
+                v = a < 255 ? a + 1 : 255;
+            }
+            p[4 * i + c] = (uint8_t)v;
+        }
+        p[4 * i + 3] = (uint8_t)a;
+    }
+}
+
+static bool check_kernels()
+{
+    uint8_t src[4 * MAX_PIXELS], dst[2][4 * MAX_PIXELS];
+    uint16_t src16[4 * MAX_PIXELS], avg[2][4 * MAX_PIXELS];
+    uint32_t acc[2][4 * MAX_PIXELS], sub[4 * MAX_PIXELS];
+    uint8_t lut[3 * 256 + PAPAYA_LUT_PADDING];
+    bool ok[6] = { true, true, true, true, true, true };
+
+    // Every other round checks the edges
+    for (int32_t round = 0; round < NUM_ROUNDS; round++) {
+        bool edges = round & 1;
+        int32_t n = (int32_t)(rng() % (MAX_PIXELS + 1));
+        int32_t m = 4 * n; // Values, for the kernels of channels
+
+        random_pixels(src, n, edges);
+        random_pixels(dst[0], n, edges);
+        memcpy(dst[1], dst[0], 4 * n);
+        papaya_blend_over(src, dst[0], n);
+        papaya_blend_over_scalar(src, dst[1], n);
+        ok[0] = ok[0] && !memcmp(dst[0], dst[1], 4 * n);
+
+        uint16_t w = (uint16_t)(rng() % 4096);
+        for (int32_t i = 0; i < m; i++) {
+            src16[i] = (uint16_t)rng();
+            acc[0][i] = acc[1][i] = rng() & 0xFFFFF;
+        }
+        papaya_accumulate_u8(src, w, acc[0], m);
+        papaya_accumulate_u8_scalar(src, w, acc[1], m);
+        ok[1] = ok[1] && !memcmp(acc[0], acc[1], 4 * m);
+        w = (uint16_t)(rng() % 64);
+        papaya_accumulate_u16(src16, w, acc[0], m);
+        papaya_accumulate_u16_scalar(src16, w, acc[1], m);
+        ok[2] = ok[2] && !memcmp(acc[0], acc[1], 4 * m);
+
+        // Sums of width values of 16 bits, after the prefix sums b if given
+        int32_t width = 1 + (int32_t)(rng() % 2000);
+        const uint32_t* b = edges ? 0 : sub;
+        for (int32_t i = 0; i < m; i++) {
+            uint32_t sum = (uint32_t)(((uint64_t)rng() * rng()) %
+                                      ((uint64_t)width * 65535 + 1));
+            sub[i] = b ? rng() << 8 : 0;
+            acc[0][i] = sub[i] + sum;
+        }
+        papaya_box_average(acc[0], b, width, avg[0], m);
+        papaya_box_average_scalar(acc[0], b, width, avg[1], m);
+        ok[3] = ok[3] && !memcmp(avg[0], avg[1], 2 * m);
+
+        memcpy(acc[1], acc[0], 4 * m);
+        papaya_slide_sums(acc[0], src16, avg[0], m);
+        papaya_slide_sums_scalar(acc[1], src16, avg[0], m);
+        ok[4] = ok[4] && !memcmp(acc[0], acc[1], 4 * m);
+
+        for (int32_t i = 0; i < 3 * 256 + PAPAYA_LUT_PADDING; i++) {
+            lut[i] = (uint8_t)rng();
+        }
+        memcpy(dst[0], src, 4 * n);
+        memcpy(dst[1], src, 4 * n);
+        papaya_apply_luts(dst[0], lut, n);
+        papaya_apply_luts_scalar(dst[1], lut, n);
+        ok[5] = ok[5] && !memcmp(dst[0], dst[1], 4 * n);
+    }
+
+    static const char* names[] = { "blend_over", "accumulate_u8",
+                                   "accumulate_u16", "box_average",
+                                   "slide_sums", "apply_luts" };
+    bool all = true;
+    for (int32_t i = 0; i < 6; i++) {
+        if (!ok[i]) {
+            fprintf(stderr, "papaya_%s (%s) differs from its scalar version\n",
+                    names[i], papaya_kernels_isa());
+        }
+        all = all && ok[i];
+    }
+    return all;
+}
+
+/*
+    Compares papaya_histogram with the histogram of the pixels after
+    papaya_unpremultiply, which must round colors the same way.
+*/
+static bool check_histogram()
+{
+    const int32_t n = 4096;
+    uint8_t img[4 * n], straight[4 * n];
+    uint32_t hist[2][4 * 256];
+    bool ok = true;
+    for (int32_t round = 0; round < 8; round++) {
+        random_pixels(img, n, round & 1);
+        papaya_unpremultiply(img, straight, n);
+        memset(hist, 0, sizeof(hist));
+        papaya_histogram(img, n, 1, hist[0]);
+        for (int32_t i = 0; i < n; i++) {
+            const uint8_t* p = straight + 4 * i;
+            hist[1][3 * 256 + p[3]]++;
+            for (int32_t c = 0; c < 3 && p[3]; c++) {
+                hist[1][256 * c + p[c]]++;
+            }
+        }
+        ok = ok && !memcmp(hist[0], hist[1], sizeof(hist[0]));
+    }
+    if (!ok) {
+        fprintf(stderr, "papaya_histogram doesn't count colors as "
+                "papaya_unpremultiply makes them\n");
+    }
+    return ok;
+}
+
+/*
+    Saves a bitmap feeding more inverts than outputs had room for before
+    links were chained per slot, then reads the file back and loads it.
+    Returns false if the project is rejected or its links come back wrong.
+*/
+static bool check_project_round_trip(const char* path)
+{
+    const int32_t fan_out = 20;
+    PapayaGraph g;
+    papaya_graph_init(&g, fan_out + 1, fan_out + 1);
+    uint8_t img[4 * 64 * 64];
+    random_pixels(img, 64 * 64, false);
+    init_bitmap_node(&g.nodes[0], "Bitmap", img, 64, 64, 4);
+    for (int32_t i = 1; i <= fan_out; i++) {
+        init_invert_color_node(&g.nodes[i], "Invert");
+        papaya_connect(&g.nodes[0].slots[1], &g.nodes[i].slots[0]);
+    }
+    PapayaProjectSnapshot* s = papaya_project_snapshot(&g, 64, 64, 0);
+    bool ok = papaya_project_write(s, path, 0, 0);
+    papaya_project_release(s);
+    papaya_graph_destroy(&g);
+
+    FILE* f = ok ? fopen(path, "rb") : 0;
+    uint8_t* file = 0;
+    size_t size = 0;
+    if (f) {
+        fseek(f, 0, SEEK_END);
+        size = (size_t)ftell(f);
+        fseek(f, 0, SEEK_SET);
+        file = (uint8_t*) malloc(size);
+        ok = fread(file, 1, size, f) == size;
+        fclose(f);
+    }
+    remove(path);
+
+    PapayaProjectInfo info;
+    ok = ok && file && papaya_project_info(file, size, &info) &&
+         info.num_nodes == fan_out + 1;
+    if (ok) {
+        papaya_graph_init(&g, info.num_nodes, info.num_nodes);
+        papaya_project_load(file, &g);
+        for (int32_t i = 1; i <= fan_out; i++) {
+            PapayaSlot* from = papaya_slot_source(&g.nodes[i].slots[0]);
+            ok = ok && from && from->node == &g.nodes[0];
+        }
+        papaya_graph_destroy(&g);
+    }
+    free(file);
+    return ok;
+}
+
+/*
+    Evaluates a bitmap turned by the transform, then gives the bitmap a new
+    image and compares the output with that of a new graph of the image, at
+    angles all around. Touches spread through the transform as huge rects,
+    which must stay nonempty however they turn, and through the blur after
+    it, which grows them further.
+*/
+static bool check_touched_transform()
+{
+    const int32_t size = 64;
+    uint8_t img[2][4 * size * size], out[2][4 * size * size];
+    random_pixels(img[0], size * size, false);
+    random_pixels(img[1], size * size, false);
+
+    bool ok = true;
+    for (int32_t i = 0; i < 48 && ok; i++) {
+        PapayaGraph g[2];
+        for (int32_t j = 0; j < 2; j++) {
+            papaya_graph_init(&g[j], 3, 3);
+            init_bitmap_node(&g[j].nodes[0], "Bitmap", img[j], size, size, 4);
+            init_transform_node(&g[j].nodes[1], "Rotate");
+            TransformNode* t = &g[j].nodes[1].params.transform;
+            t->angle = i * 7.5f * 3.14159265f / 180.0f;
+            t->src_x = t->dst_x = t->src_y = t->dst_y = size * 0.5f;
+            papaya_connect(&g[j].nodes[0].slots[1], &g[j].nodes[1].slots[0]);
+            init_blur_node(&g[j].nodes[2], "Blur");
+            papaya_connect(&g[j].nodes[1].slots[1], &g[j].nodes[2].slots[0]);
+        }
+        papaya_evaluate_node(&g[0].nodes[2], size, size, out[0]);
+        papaya_set_bitmap(&g[0].nodes[0], img[1], size, size);
+        papaya_evaluate_node(&g[0].nodes[2], size, size, out[0]);
+        papaya_evaluate_node(&g[1].nodes[2], size, size, out[1]);
+        ok = !memcmp(out[0], out[1], sizeof(out[0]));
+        if (!ok) {
+            fprintf(stderr, "A blur after a transform by %.1f degrees kept "
+                    "the output of its old input\n", i * 7.5);
+        }
+        papaya_graph_destroy(&g[0]);
+        papaya_graph_destroy(&g[1]);
+    }
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) {
+        fprintf(stderr, "Usage: %s\n", argv[0]);
+        return 1;
+    }
+
+    bool ok = check_kernels();
+    ok = check_histogram() && ok;
+
+    const char* tmp = getenv("TMPDIR");
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/papaya-check.papaya", tmp ? tmp : "/tmp");
+    papaya_jobs_init(0);
+    if (!check_project_round_trip(path)) {
+        fprintf(stderr, "A saved project failed to load again\n");
+        ok = false;
+    }
+    ok = check_touched_transform() && ok;
+    papaya_jobs_shutdown();
+
+    printf("%s checks with %s kernels\n", ok ? "Passed" : "Failed",
+           papaya_kernels_isa());
+    return ok ? 0 : 1;
+}
@@ -39,10 +39,12 @@
 #include <windows.h>
 #define GLDECL WINAPI
 
+#define GL_ALREADY_SIGNALED               0x911A
 #define GL_ARRAY_BUFFER                   0x8892 // Acquired from:
 #define GL_ARRAY_BUFFER_BINDING           0x8894 // https://www.opengl.org/registry/api/GL/glext.h
 #define GL_COLOR_ATTACHMENT0              0x8CE0
 #define GL_COMPILE_STATUS                 0x8B81
+#define GL_CONDITION_SATISFIED            0x911C
 #define GL_CURRENT_PROGRAM                0x8B8D
 #define GL_DYNAMIC_DRAW                   0x88E8
 #define GL_ELEMENT_ARRAY_BUFFER           0x8893
@@ -52,16 +54,35 @@
 #define GL_FRAMEBUFFER_COMPLETE           0x8CD5
 #define GL_FUNC_ADD                       0x8006
 #define GL_INVALID_FRAMEBUFFER_OPERATION  0x0506
+#define GL_LINK_STATUS                    0x8B82
 #define GL_MAJOR_VERSION                  0x821B
+#define GL_MAX                            0x8008
 #define GL_MINOR_VERSION                  0x821C
+#define GL_NUM_PROGRAM_BINARY_FORMATS     0x87FE
+#define GL_PIXEL_PACK_BUFFER              0x88EB
+#define GL_PIXEL_UNPACK_BUFFER            0x88EC
+#define GL_PROGRAM_BINARY_LENGTH          0x8741
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_QUERY_RESULT                   0x8866
+#define GL_QUERY_RESULT_AVAILABLE         0x8867
+#define GL_READ_ONLY                      0x88B8
 #define GL_STATIC_DRAW                    0x88E4
 #define GL_STREAM_DRAW                    0x88E0
+#define GL_STREAM_READ                    0x88E1
+#define GL_SYNC_FLUSH_COMMANDS_BIT        0x00000001
+#define GL_SYNC_GPU_COMMANDS_COMPLETE     0x9117
 #define GL_TEXTURE0                       0x84C0
+#define GL_TEXTURE1                       0x84C1
+#define GL_TIME_ELAPSED                   0x88BF
+#define GL_TIMEOUT_EXPIRED                0x911B
 #define GL_VERTEX_SHADER                  0x8B31
+#define GL_WRITE_ONLY                     0x88B9
 
 typedef char GLchar;
 typedef ptrdiff_t GLintptr;
 typedef ptrdiff_t GLsizeiptr;
+typedef unsigned __int64 GLuint64;
+typedef struct __GLsync* GLsync;
 
 #define PAPAYA_GL_LIST_WIN32 \
     /* ret, name, params */ \
@@ -83,34 +104,62 @@ typedef ptrdiff_t GLsizeiptr;
     GLE(void,      BufferSubData,           GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid * data) \
     GLE(GLenum,    CheckFramebufferStatus,  GLenum target) \
     GLE(void,      ClearBufferfv,           GLenum buffer, GLint drawbuffer, const GLfloat * value) \
+    GLE(GLenum,    ClientWaitSync,          GLsync sync, GLbitfield flags, GLuint64 timeout) \
     GLE(void,      CompileShader,           GLuint shader) \
     GLE(GLuint,    CreateProgram,           void) \
     GLE(GLuint,    CreateShader,            GLenum type) \
     GLE(void,      DeleteBuffers,           GLsizei n, const GLuint *buffers) \
     GLE(void,      DeleteFramebuffers,      GLsizei n, const GLuint *framebuffers) \
+    GLE(void,      DeleteSync,              GLsync sync) \
+    GLE(void,      DisableVertexAttribArray, GLuint index) \
     GLE(void,      EnableVertexAttribArray, GLuint index) \
     GLE(void,      DrawBuffers,             GLsizei n, const GLenum *bufs) \
+    GLE(GLsync,    FenceSync,               GLenum condition, GLbitfield flags) \
     GLE(void,      FramebufferTexture2D,    GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level) \
     GLE(void,      GenBuffers,              GLsizei n, GLuint *buffers) \
     GLE(void,      GenFramebuffers,         GLsizei n, GLuint * framebuffers) \
     GLE(GLint,     GetAttribLocation,       GLuint program, const GLchar *name) \
+    GLE(void,      GetProgramInfoLog,       GLuint program, GLsizei bufSize, GLsizei *length, GLchar *infoLog) \
+    GLE(void,      GetProgramiv,            GLuint program, GLenum pname, GLint *params) \
     GLE(void,      GetShaderInfoLog,        GLuint shader, GLsizei bufSize, GLsizei *length, GLchar *infoLog) \
     GLE(void,      GetShaderiv,             GLuint shader, GLenum pname, GLint *params) \
     GLE(GLint,     GetUniformLocation,      GLuint program, const GLchar *name) \
     GLE(void,      LinkProgram,             GLuint program) \
+    GLE(void*,     MapBuffer,               GLenum target, GLenum access) \
     GLE(void,      ShaderSource,            GLuint shader, GLsizei count, const GLchar* const *string, const GLint *length) \
     GLE(void,      Uniform1i,               GLint location, GLint v0) \
     GLE(void,      Uniform1f,               GLint location, GLfloat v0) \
     GLE(void,      Uniform2f,               GLint location, GLfloat v0, GLfloat v1) \
     GLE(void,      Uniform4f,               GLint location, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3) \
     GLE(void,      UniformMatrix4fv,        GLint location, GLsizei count, GLboolean transpose, const GLfloat *value) \
+    GLE(GLboolean, UnmapBuffer,             GLenum target) \
     GLE(void,      UseProgram,              GLuint program) \
+    GLE(void,      VertexAttrib4f,          GLuint index, GLfloat x, GLfloat y, GLfloat z, GLfloat w) \
     GLE(void,      VertexAttribPointer,     GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid * pointer) \
     /* end */
 
+/*
+    Functions that may be missing. They are 0 if so, and have to be checked.
+*/
+#define PAPAYA_GL_LIST_OPTIONAL \
+    /* ret, name, params */ \
+    GLE(void,      BeginQuery,              GLenum target, GLuint id) \
+    GLE(void,      DeleteQueries,           GLsizei n, const GLuint *ids) \
+    GLE(void,      DrawArraysInstanced,     GLenum mode, GLint first, GLsizei count, GLsizei instancecount) \
+    GLE(void,      EndQuery,                GLenum target) \
+    GLE(void,      GenQueries,              GLsizei n, GLuint *ids) \
+    GLE(void,      GetProgramBinary,        GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary) \
+    GLE(void,      GetQueryObjectiv,        GLuint id, GLenum pname, GLint *params) \
+    GLE(void,      GetQueryObjectui64v,     GLuint id, GLenum pname, GLuint64 *params) \
+    GLE(void,      ProgramBinary,           GLuint program, GLenum binaryFormat, const void *binary, GLsizei length) \
+    GLE(void,      ProgramParameteri,       GLuint program, GLenum pname, GLint value) \
+    GLE(void,      VertexAttribDivisor,     GLuint index, GLuint divisor) \
+    /* end */
+
 #define GLE(ret, name, ...) typedef ret GLDECL name##proc(__VA_ARGS__); extern name##proc * gl##name;
 PAPAYA_GL_LIST
 PAPAYA_GL_LIST_WIN32
+PAPAYA_GL_LIST_OPTIONAL
 #undef GLE
 
 bool gl_lite_init();
@@ -128,6 +177,7 @@ bool gl_lite_init();
 #define GLE(ret, name, ...) name##proc * gl##name;
 PAPAYA_GL_LIST
 PAPAYA_GL_LIST_WIN32
+PAPAYA_GL_LIST_OPTIONAL
 #undef GLE
 
 bool gl_lite_init()
@@ -149,6 +199,11 @@ bool gl_lite_init()
         PAPAYA_GL_LIST
     #undef GLE
 
+    #define GLE(ret, name, ...) \
+            gl##name = (name##proc *) dlsym(libGL, "gl" #name);
+        PAPAYA_GL_LIST_OPTIONAL
+    #undef GLE
+
 #elif defined(_WIN32)
 
     HINSTANCE dll = LoadLibraryA("opengl32.dll");
@@ -170,6 +225,11 @@ bool gl_lite_init()
         PAPAYA_GL_LIST_WIN32
     #undef GLE
 
+    #define GLE(ret, name, ...) \
+            gl##name = (name##proc *)wglGetProcAddress("gl" #name);
+        PAPAYA_GL_LIST_OPTIONAL
+    #undef GLE
+
 #else
     #error "GL loading for this platform is not implemented yet."
 #endif
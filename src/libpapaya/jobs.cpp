@@ -0,0 +1,264 @@
+#include "jobs.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct Job {
+    PapayaJobFn fn;
+    void* data;
+    int32_t index;
+    std::atomic<int32_t>* pending; // Decremented when the job completes
+};
+
+struct JobQueue {
+    std::mutex lock;
+    std::deque<Job> jobs;
+};
+
+struct PapayaTask {
+    std::atomic<int32_t> pending;
+};
+
+/*
+    Queue 0 belongs to the thread that called papaya_jobs_init, as well as to
+    any other non-worker thread. Queues 1..n-1 belong to the workers.
+*/
+static JobQueue* queues;
+static std::thread* threads;
+static int32_t num_threads;
+static thread_local int32_t queue_index;
+static JobQueue background; // Jobs started by papaya_run_async
+
+static std::mutex sleep_lock;
+static std::condition_variable sleep_cv;
+static std::atomic<int32_t> num_queued;
+static std::atomic<bool> quit;
+
+static void push_job(Job job)
+{
+    JobQueue* q = &queues[queue_index];
+    {
+        std::lock_guard<std::mutex> guard(q->lock);
+        q->jobs.push_back(job);
+    }
+    num_queued++;
+}
+
+/*
+    Pops the most recently pushed job of the own queue, or steals the oldest
+    job of another queue.
+*/
+static bool get_job(Job* job)
+{
+    if (num_queued.load() == 0) {
+        return false;
+    }
+
+    for (int32_t i = 0; i < num_threads; i++) {
+        int32_t idx = (queue_index + i) % num_threads;
+        JobQueue* q = &queues[idx];
+        std::lock_guard<std::mutex> guard(q->lock);
+        if (q->jobs.empty()) {
+            continue;
+        }
+
+        if (i == 0) {
+            *job = q->jobs.back();
+            q->jobs.pop_back();
+        } else {
+            *job = q->jobs.front();
+            q->jobs.pop_front();
+        }
+        num_queued--;
+        return true;
+    }
+    return false;
+}
+
+static bool get_background_job(Job* job)
+{
+    std::lock_guard<std::mutex> guard(background.lock);
+    if (background.jobs.empty()) {
+        return false;
+    }
+
+    *job = background.jobs.front();
+    background.jobs.pop_front();
+    num_queued--;
+    return true;
+}
+
+/*
+    Takes the background job of the task, if no worker has started it yet
+*/
+static bool take_background_job(PapayaTask* task, Job* job)
+{
+    std::lock_guard<std::mutex> guard(background.lock);
+    std::deque<Job>& jobs = background.jobs;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].pending == &task->pending) {
+            *job = jobs[i];
+            jobs.erase(jobs.begin() + i);
+            num_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void wake_workers()
+{
+    {
+        // Take the lock so that the notification can't slip between a
+        // worker's predicate check and its sleep
+        std::lock_guard<std::mutex> guard(sleep_lock);
+    }
+    sleep_cv.notify_all();
+}
+
+static void run_job(Job* job)
+{
+    job->fn(job->data, job->index);
+    job->pending->fetch_sub(1);
+}
+
+static void worker_main(int32_t index)
+{
+    queue_index = index;
+    while (true) {
+        Job job;
+        if (get_job(&job) || get_background_job(&job)) {
+            run_job(&job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        sleep_cv.wait(guard, [] { return quit.load() || num_queued.load(); });
+        if (quit.load()) {
+            return;
+        }
+    }
+}
+
+void papaya_jobs_init(int32_t n)
+{
+    if (queues) {
+        return;
+    }
+
+    if (n <= 0) {
+        n = (int32_t)std::thread::hardware_concurrency();
+        if (n <= 0) { n = 1; }
+    }
+
+    num_threads = n;
+    queue_index = 0;
+    quit = false;
+    queues = new JobQueue[n];
+    threads = new std::thread[n];
+    for (int32_t i = 1; i < n; i++) {
+        threads[i] = std::thread(worker_main, i);
+    }
+}
+
+void papaya_jobs_shutdown()
+{
+    if (!queues) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        quit = true;
+    }
+    sleep_cv.notify_all();
+    for (int32_t i = 1; i < num_threads; i++) {
+        threads[i].join();
+    }
+
+    delete[] threads;
+    delete[] queues;
+    threads = 0;
+    queues = 0;
+    num_threads = 0;
+}
+
+int32_t papaya_jobs_num_threads()
+{
+    return queues ? num_threads : 1;
+}
+
+void papaya_parallel_for(int32_t count, PapayaJobFn fn, void* data)
+{
+    if (!queues || count <= 1) {
+        for (int32_t i = 0; i < count; i++) {
+            fn(data, i);
+        }
+        return;
+    }
+
+    std::atomic<int32_t> pending(count);
+
+    // Pushed in reverse, so that the own thread pops them in order
+    for (int32_t i = count - 1; i > 0; i--) {
+        Job job = { fn, data, i, &pending };
+        push_job(job);
+    }
+    wake_workers();
+
+    Job first = { fn, data, 0, &pending };
+    run_job(&first);
+
+    // Help out until all jobs of this batch have completed
+    while (pending.load() > 0) {
+        Job job;
+        if (get_job(&job)) {
+            run_job(&job);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+PapayaTask* papaya_run_async(PapayaJobFn fn, void* data)
+{
+    PapayaTask* task = new PapayaTask;
+    task->pending = 1;
+    if (!queues || num_threads <= 1) {
+        // No workers to run it on
+        fn(data, 0);
+        task->pending = 0;
+        return task;
+    }
+
+    Job job = { fn, data, 0, &task->pending };
+    {
+        std::lock_guard<std::mutex> guard(background.lock);
+        background.jobs.push_back(job);
+    }
+    num_queued++;
+    wake_workers();
+    return task;
+}
+
+bool papaya_task_done(PapayaTask* task)
+{
+    return task->pending.load() == 0;
+}
+
+void papaya_wait(PapayaTask* task)
+{
+    while (task->pending.load() > 0) {
+        Job job;
+        // Other tasks are left to the workers, as they may take long
+        if (take_background_job(task, &job) || get_job(&job)) {
+            run_job(&job);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    delete task;
+}
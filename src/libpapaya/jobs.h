@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+    Work-stealing job system used by libpapaya to spread evaluation across all
+    cores.
+
+    Every worker thread owns a queue. Jobs are pushed to and popped from the
+    back of the owning thread's queue, and idle threads steal from the front of
+    other queues. Threads that wait for jobs to finish execute queued jobs in
+    the meantime, so jobs may themselves spawn and wait on more jobs.
+
+    If papaya_jobs_init has not been called, all jobs run inline on the calling
+    thread.
+*/
+
+#include <stdint.h>
+
+typedef void (*PapayaJobFn)(void* data, int32_t index);
+
+// Reports the completed fraction of long-running work, from any thread
+typedef void (*PapayaProgressFn)(void* data, float done);
+
+struct PapayaTask;
+
+/*
+    Starts the worker threads. num_threads includes the calling thread. Pass 0
+    to use one thread per hardware core.
+*/
+void papaya_jobs_init(int32_t num_threads);
+void papaya_jobs_shutdown();
+int32_t papaya_jobs_num_threads();
+
+/*
+    Calls fn(data, i) for every i in [0, count), distributed over all threads,
+    and returns when all calls have completed.
+*/
+void papaya_parallel_for(int32_t count, PapayaJobFn fn, void* data);
+
+/*
+    Calls fn(data, 0) in the background and returns immediately. Workers run
+    background jobs after all queued parallel_for jobs, so that they never
+    delay a parallel_for on the calling thread. papaya_wait has to be called
+    once for every task, which also frees it. It runs the task itself if no
+    worker has started it yet, and meanwhile helps with parallel_for jobs,
+    but never runs other tasks. All tasks must be waited on before
+    papaya_jobs_shutdown.
+*/
+PapayaTask* papaya_run_async(PapayaJobFn fn, void* data);
+bool papaya_task_done(PapayaTask* task);
+void papaya_wait(PapayaTask* task);
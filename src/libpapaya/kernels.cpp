@@ -0,0 +1,666 @@
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define PAPAYA_X86
+    #include <emmintrin.h>
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define PAPAYA_NEON
+    #include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__)
+    #define PAPAYA_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define PAPAYA_TARGET_AVX2
+#endif
+
+/*
+    Rounded x / 255, exact for all x <= 255 * 255. The SIMD versions below use
+    the same formula, so that they match the scalar version bit for bit.
+*/
+static inline uint32_t div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+void papaya_blend_over_scalar(const uint8_t* src, uint8_t* dst, int32_t n)
+{
+    for (int32_t i = 0; i < 4 * n; i += 4) {
+        uint32_t inv_a = 255 - src[i+3];
+        for (int32_t c = 0; c < 4; c++) {
+            // Saturate like the SIMD packs do, in case the color exceeds alpha
+            uint32_t v = src[i+c] + div255(dst[i+c] * inv_a);
+            dst[i+c] = (uint8_t)(v > 255 ? 255 : v);
+        }
+    }
+}
+
+void papaya_blend_over_alpha(const uint8_t* src, uint8_t* dst, int32_t n)
+{
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t a = src[4 * i + 3];
+        uint32_t v = a + div255(dst[i] * (255 - a));
+        dst[i] = (uint8_t)(v > 255 ? 255 : v);
+    }
+}
+
+void papaya_accumulate_u8_scalar(const uint8_t* src, uint16_t w,
+                                 uint32_t* acc, int32_t n)
+{
+    for (int32_t i = 0; i < n; i++) {
+        acc[i] += (uint32_t)w * src[i];
+    }
+}
+
+void papaya_accumulate_u16_scalar(const uint16_t* src, uint16_t w,
+                                  uint32_t* acc, int32_t n)
+{
+    for (int32_t i = 0; i < n; i++) {
+        acc[i] += (uint32_t)w * src[i];
+    }
+}
+
+void papaya_box_average_scalar(const uint32_t* a, const uint32_t* b,
+                               int32_t w, uint16_t* dst, int32_t n)
+{
+    float inv = 1.0f / w;
+    for (int32_t i = 0; i < n; i++) {
+        int32_t sum = (int32_t)(a[i] - (b ? b[i] : 0)) + w / 2;
+        dst[i] = (uint16_t)(int32_t)((float)sum * inv);
+    }
+}
+
+void papaya_slide_sums_scalar(uint32_t* sums, const uint16_t* in,
+                              const uint16_t* out, int32_t n)
+{
+    for (int32_t i = 0; i < n; i++) {
+        sums[i] += in[i] - out[i];
+    }
+}
+
+/*
+    Straight color (c * 255 + a / 2) / a, rounded as by papaya_unpremultiply,
+    is (c * recips[a] + 32768) >> 16 for every c <= a, which leaves opaque
+    colors as they are. Each reciprocal is the smallest that gets all of them
+    right, found from the range of reciprocals each c allows.
+*/
+struct RecipTable {
+    uint32_t r[256];
+};
+
+static RecipTable make_recips()
+{
+    RecipTable t;
+    t.r[0] = 0;
+    for (uint32_t a = 1; a < 256; a++) {
+        uint32_t lo = 0;
+        for (uint32_t c = 1; c <= a; c++) {
+            uint32_t s = (c * 255 + a / 2) / a;
+            uint32_t min = (s * 65536 - 32768 + c - 1) / c;
+            lo = min > lo ? min : lo;
+        }
+        t.r[a] = lo;
+    }
+    return t;
+}
+
+static const RecipTable recips = make_recips();
+
+void papaya_apply_luts_scalar(uint8_t* img, const uint8_t* lut, int32_t n)
+{
+    for (int32_t i = 0; i < 4 * n; i += 4) {
+        uint32_t a = img[i+3];
+        uint32_t r = recips.r[a];
+        for (int32_t c = 0; c < 3; c++) {
+            uint32_t s = (img[i+c] * r + 32768) >> 16;
+            s = s > 255 ? 255 : s; // For colors above alpha
+            img[i+c] = (uint8_t)div255(lut[256 * c + s] * a);
+        }
+    }
+}
+
+void papaya_histogram(const uint8_t* img, int32_t n, int32_t step,
+                      uint32_t* hist)
+{
+    for (int32_t i = 0; i < 4 * n; i += 4 * step) {
+        uint32_t a = img[i+3];
+        hist[3 * 256 + a]++;
+        if (!a) {
+            continue;
+        }
+        uint32_t r = recips.r[a];
+        for (int32_t c = 0; c < 3; c++) {
+            uint32_t s = (img[i+c] * r + 32768) >> 16;
+            hist[256 * c + (s > 255 ? 255 : s)]++;
+        }
+    }
+}
+
+void papaya_premultiply(uint8_t* img, int64_t n)
+{
+    for (int64_t i = 0; i < 4 * n; i += 4) {
+        uint32_t a = img[i+3];
+        img[i]   = (uint8_t)div255(img[i]   * a);
+        img[i+1] = (uint8_t)div255(img[i+1] * a);
+        img[i+2] = (uint8_t)div255(img[i+2] * a);
+    }
+}
+
+void papaya_unpremultiply(const uint8_t* src, uint8_t* dst, int64_t n)
+{
+    for (int64_t i = 0; i < 4 * n; i += 4) {
+        uint32_t a = src[i+3];
+        for (int32_t c = 0; c < 3; c++) {
+            uint32_t v = a ? (src[i+c] * 255 + a / 2) / a : 0;
+            dst[i+c] = (uint8_t)(v > 255 ? 255 : v);
+        }
+        dst[i+3] = (uint8_t)a;
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef PAPAYA_X86
+
+static inline __m128i div255_sse2(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static inline __m128i broadcast_alpha_sse2(__m128i x)
+{
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+/*
+    Blends two pixels, unpacked to one 16-bit lane per channel.
+*/
+static inline __m128i blend2_sse2(__m128i s, __m128i d)
+{
+    __m128i inv_a = _mm_sub_epi16(_mm_set1_epi16(255), broadcast_alpha_sse2(s));
+    return _mm_add_epi16(s, div255_sse2(_mm_mullo_epi16(d, inv_a)));
+}
+
+static void blend_over_sse2(const uint8_t* src, uint8_t* dst, int32_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + 4 * i));
+        __m128i lo = blend2_sse2(_mm_unpacklo_epi8(s, zero),
+                                 _mm_unpacklo_epi8(d, zero));
+        __m128i hi = blend2_sse2(_mm_unpackhi_epi8(s, zero),
+                                 _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_packus_epi16(lo, hi));
+    }
+    papaya_blend_over_scalar(src + 4 * i, dst + 4 * i, n - i);
+}
+
+/*
+    Adds the 32-bit products of eight 16-bit values and w to two accumulators.
+    The low and high halves of the products are interleaved back together.
+*/
+static inline void accumulate8_sse2(__m128i v, __m128i w, uint32_t* acc)
+{
+    __m128i lo = _mm_mullo_epi16(v, w);
+    __m128i hi = _mm_mulhi_epu16(v, w);
+    __m128i* a = (__m128i*)acc;
+    _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a),
+                                      _mm_unpacklo_epi16(lo, hi)));
+    _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1),
+                                          _mm_unpackhi_epi16(lo, hi)));
+}
+
+static void accumulate_u8_sse2(const uint8_t* src, uint16_t w, uint32_t* acc,
+                               int32_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wv = _mm_set1_epi16((short)w);
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        accumulate8_sse2(_mm_unpacklo_epi8(v, zero), wv, acc + i);
+        accumulate8_sse2(_mm_unpackhi_epi8(v, zero), wv, acc + i + 8);
+    }
+    papaya_accumulate_u8_scalar(src + i, w, acc + i, n - i);
+}
+
+static void accumulate_u16_sse2(const uint16_t* src, uint16_t w,
+                                uint32_t* acc, int32_t n)
+{
+    const __m128i wv = _mm_set1_epi16((short)w);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        accumulate8_sse2(v, wv, acc + i);
+    }
+    papaya_accumulate_u16_scalar(src + i, w, acc + i, n - i);
+}
+
+static void box_average_sse2(const uint32_t* a, const uint32_t* b, int32_t w,
+                             uint16_t* dst, int32_t n)
+{
+    const __m128 inv = _mm_set1_ps(1.0f / w);
+    const __m128i half = _mm_set1_epi32(w / 2);
+    const __m128i bias = _mm_set1_epi32(32768);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i s0 = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i s1 = _mm_loadu_si128((const __m128i*)(a + i + 4));
+        if (b) {
+            s0 = _mm_sub_epi32(s0, _mm_loadu_si128((const __m128i*)(b + i)));
+            s1 = _mm_sub_epi32(s1,
+                               _mm_loadu_si128((const __m128i*)(b + i + 4)));
+        }
+        s0 = _mm_cvttps_epi32(_mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_add_epi32(s0, half)), inv));
+        s1 = _mm_cvttps_epi32(_mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_add_epi32(s1, half)), inv));
+
+        // SSE2 only packs signed, so the values are moved into its range
+        // and back
+        __m128i p = _mm_packs_epi32(_mm_sub_epi32(s0, bias),
+                                    _mm_sub_epi32(s1, bias));
+        _mm_storeu_si128((__m128i*)(dst + i),
+                         _mm_add_epi16(p, _mm_set1_epi16(-32768)));
+    }
+    papaya_box_average_scalar(a + i, b ? b + i : 0, w, dst + i, n - i);
+}
+
+static void slide_sums_sse2(uint32_t* sums, const uint16_t* in,
+                            const uint16_t* out, int32_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i vi = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i vo = _mm_loadu_si128((const __m128i*)(out + i));
+        __m128i* s = (__m128i*)(sums + i);
+        __m128i lo = _mm_sub_epi32(_mm_unpacklo_epi16(vi, zero),
+                                   _mm_unpacklo_epi16(vo, zero));
+        __m128i hi = _mm_sub_epi32(_mm_unpackhi_epi16(vi, zero),
+                                   _mm_unpackhi_epi16(vo, zero));
+        _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), lo));
+        _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), hi));
+    }
+    papaya_slide_sums_scalar(sums + i, in + i, out + i, n - i);
+}
+
+// AVX2 versions work on two independent 128-bit lanes of the same layout
+
+PAPAYA_TARGET_AVX2
+static inline __m256i div255_avx2(__m256i x)
+{
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+PAPAYA_TARGET_AVX2
+static inline __m256i broadcast_alpha_avx2(__m256i x)
+{
+    x = _mm256_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm256_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+PAPAYA_TARGET_AVX2
+static inline __m256i blend4_avx2(__m256i s, __m256i d)
+{
+    __m256i inv_a = _mm256_sub_epi16(_mm256_set1_epi16(255),
+                                     broadcast_alpha_avx2(s));
+    return _mm256_add_epi16(s, div255_avx2(_mm256_mullo_epi16(d, inv_a)));
+}
+
+PAPAYA_TARGET_AVX2
+static void blend_over_avx2(const uint8_t* src, uint8_t* dst, int32_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + 4 * i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + 4 * i));
+        __m256i lo = blend4_avx2(_mm256_unpacklo_epi8(s, zero),
+                                 _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = blend4_avx2(_mm256_unpackhi_epi8(s, zero),
+                                 _mm256_unpackhi_epi8(d, zero));
+        _mm256_storeu_si256((__m256i*)(dst + 4 * i),
+                            _mm256_packus_epi16(lo, hi));
+    }
+    blend_over_sse2(src + 4 * i, dst + 4 * i, n - i);
+}
+
+// The accumulations widen to 32 bits first, which keeps the values in order
+
+PAPAYA_TARGET_AVX2
+static void accumulate_u8_avx2(const uint8_t* src, uint16_t w, uint32_t* acc,
+                               int32_t n)
+{
+    const __m256i wv = _mm256_set1_epi32(w);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i*)(src + i)));
+        __m256i* a = (__m256i*)(acc + i);
+        _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a),
+                                                _mm256_mullo_epi32(v, wv)));
+    }
+    papaya_accumulate_u8_scalar(src + i, w, acc + i, n - i);
+}
+
+PAPAYA_TARGET_AVX2
+static void accumulate_u16_avx2(const uint16_t* src, uint16_t w,
+                                uint32_t* acc, int32_t n)
+{
+    const __m256i wv = _mm256_set1_epi32(w);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i*)(src + i)));
+        __m256i* a = (__m256i*)(acc + i);
+        _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a),
+                                                _mm256_mullo_epi32(v, wv)));
+    }
+    papaya_accumulate_u16_scalar(src + i, w, acc + i, n - i);
+}
+
+PAPAYA_TARGET_AVX2
+static void box_average_avx2(const uint32_t* a, const uint32_t* b, int32_t w,
+                             uint16_t* dst, int32_t n)
+{
+    const __m256 inv = _mm256_set1_ps(1.0f / w);
+    const __m256i half = _mm256_set1_epi32(w / 2);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(a + i));
+        if (b) {
+            s = _mm256_sub_epi32(s,
+                                 _mm256_loadu_si256((const __m256i*)(b + i)));
+        }
+        s = _mm256_cvttps_epi32(_mm256_mul_ps(
+            _mm256_cvtepi32_ps(_mm256_add_epi32(s, half)), inv));
+        __m128i p = _mm_packus_epi32(_mm256_castsi256_si128(s),
+                                     _mm256_extracti128_si256(s, 1));
+        _mm_storeu_si128((__m128i*)(dst + i), p);
+    }
+    papaya_box_average_scalar(a + i, b ? b + i : 0, w, dst + i, n - i);
+}
+
+PAPAYA_TARGET_AVX2
+static void slide_sums_avx2(uint32_t* sums, const uint16_t* in,
+                            const uint16_t* out, int32_t n)
+{
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i vi = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i*)(in + i)));
+        __m256i vo = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i*)(out + i)));
+        __m256i* s = (__m256i*)(sums + i);
+        _mm256_storeu_si256(s, _mm256_add_epi32(_mm256_loadu_si256(s),
+                                                _mm256_sub_epi32(vi, vo)));
+    }
+    papaya_slide_sums_scalar(sums + i, in + i, out + i, n - i);
+}
+
+/*
+    Gathers the reciprocals and the table entries of eight pixels at a time.
+    Entries are read as 32 bits from their byte offsets, hence the padding.
+*/
+PAPAYA_TARGET_AVX2
+static void apply_luts_avx2(uint8_t* img, const uint8_t* lut, int32_t n)
+{
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    const __m256i max = _mm256_set1_epi32(255);
+    const __m256i half = _mm256_set1_epi32(32768);
+    const __m256i round = _mm256_set1_epi32(128);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i* p = (__m256i*)(img + 4 * i);
+        __m256i px = _mm256_loadu_si256(p);
+        __m256i a = _mm256_srli_epi32(px, 24);
+        __m256i r = _mm256_i32gather_epi32((const int*)recips.r, a, 4);
+        __m256i res = _mm256_andnot_si256(_mm256_set1_epi32(0xFFFFFF), px);
+        for (int32_t c = 0; c < 3; c++) {
+            __m256i v = _mm256_and_si256(_mm256_srli_epi32(px, 8 * c), byte);
+            __m256i s = _mm256_srli_epi32(
+                _mm256_add_epi32(_mm256_mullo_epi32(v, r), half), 16);
+            s = _mm256_min_epu32(s, max);
+            __m256i l = _mm256_and_si256(
+                _mm256_i32gather_epi32((const int*)(lut + 256 * c), s, 1),
+                byte);
+            __m256i x = _mm256_add_epi32(_mm256_mullo_epi32(l, a), round);
+            x = _mm256_srli_epi32(
+                _mm256_add_epi32(x, _mm256_srli_epi32(x, 8)), 8);
+            res = _mm256_or_si256(res, _mm256_slli_epi32(x, 8 * c));
+        }
+        _mm256_storeu_si256(p, res);
+    }
+    papaya_apply_luts_scalar(img + 4 * i, lut, n - i);
+}
+
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) { return false; }
+
+    // The OS must save the YMM registers on context switches
+    __cpuid(r, 1);
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28))) { return false; }
+    if ((_xgetbv(0) & 6) != 6) { return false; }
+
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // PAPAYA_X86
+
+// -----------------------------------------------------------------------------
+
+#ifdef PAPAYA_NEON
+
+static inline uint16x8_t div255_neon(uint16x8_t x)
+{
+    x = vaddq_u16(x, vdupq_n_u16(128));
+    return vshrq_n_u16(vaddq_u16(x, vshrq_n_u16(x, 8)), 8);
+}
+
+static void blend_over_neon(const uint8_t* src, uint8_t* dst, int32_t n)
+{
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // De-interleaved loads: one register per channel
+        uint8x8x4_t s = vld4_u8(src + 4 * i);
+        uint8x8x4_t d = vld4_u8(dst + 4 * i);
+        uint8x8_t inv_a = vsub_u8(vdup_n_u8(255), s.val[3]);
+
+        for (int32_t c = 0; c < 4; c++) {
+            uint16x8_t t = div255_neon(vmull_u8(d.val[c], inv_a));
+            d.val[c] = vqmovn_u16(vaddw_u8(t, s.val[c]));
+        }
+        vst4_u8(dst + 4 * i, d);
+    }
+    papaya_blend_over_scalar(src + 4 * i, dst + 4 * i, n - i);
+}
+
+static void accumulate_u8_neon(const uint8_t* src, uint16_t w, uint32_t* acc,
+                               int32_t n)
+{
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        vst1q_u32(acc + i, vmlal_n_u16(vld1q_u32(acc + i),
+                                       vget_low_u16(lo), w));
+        vst1q_u32(acc + i + 4, vmlal_n_u16(vld1q_u32(acc + i + 4),
+                                           vget_high_u16(lo), w));
+        vst1q_u32(acc + i + 8, vmlal_n_u16(vld1q_u32(acc + i + 8),
+                                           vget_low_u16(hi), w));
+        vst1q_u32(acc + i + 12, vmlal_n_u16(vld1q_u32(acc + i + 12),
+                                            vget_high_u16(hi), w));
+    }
+    papaya_accumulate_u8_scalar(src + i, w, acc + i, n - i);
+}
+
+static void accumulate_u16_neon(const uint16_t* src, uint16_t w,
+                                uint32_t* acc, int32_t n)
+{
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vld1q_u16(src + i);
+        vst1q_u32(acc + i, vmlal_n_u16(vld1q_u32(acc + i),
+                                       vget_low_u16(v), w));
+        vst1q_u32(acc + i + 4, vmlal_n_u16(vld1q_u32(acc + i + 4),
+                                           vget_high_u16(v), w));
+    }
+    papaya_accumulate_u16_scalar(src + i, w, acc + i, n - i);
+}
+
+static void box_average_neon(const uint32_t* a, const uint32_t* b, int32_t w,
+                             uint16_t* dst, int32_t n)
+{
+    const float32x4_t inv = vdupq_n_f32(1.0f / w);
+    const int32x4_t half = vdupq_n_s32(w / 2);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint32x4_t s0 = vld1q_u32(a + i);
+        uint32x4_t s1 = vld1q_u32(a + i + 4);
+        if (b) {
+            s0 = vsubq_u32(s0, vld1q_u32(b + i));
+            s1 = vsubq_u32(s1, vld1q_u32(b + i + 4));
+        }
+        int32x4_t q0 = vcvtq_s32_f32(vmulq_f32(
+            vcvtq_f32_s32(vaddq_s32(vreinterpretq_s32_u32(s0), half)), inv));
+        int32x4_t q1 = vcvtq_s32_f32(vmulq_f32(
+            vcvtq_f32_s32(vaddq_s32(vreinterpretq_s32_u32(s1), half)), inv));
+        vst1q_u16(dst + i, vcombine_u16(vqmovun_s32(q0), vqmovun_s32(q1)));
+    }
+    papaya_box_average_scalar(a + i, b ? b + i : 0, w, dst + i, n - i);
+}
+
+static void slide_sums_neon(uint32_t* sums, const uint16_t* in,
+                            const uint16_t* out, int32_t n)
+{
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t vi = vld1q_u16(in + i);
+        uint16x8_t vo = vld1q_u16(out + i);
+        uint32x4_t lo = vsubl_u16(vget_low_u16(vi), vget_low_u16(vo));
+        uint32x4_t hi = vsubl_u16(vget_high_u16(vi), vget_high_u16(vo));
+        vst1q_u32(sums + i, vaddq_u32(vld1q_u32(sums + i), lo));
+        vst1q_u32(sums + i + 4, vaddq_u32(vld1q_u32(sums + i + 4), hi));
+    }
+    papaya_slide_sums_scalar(sums + i, in + i, out + i, n - i);
+}
+
+#endif // PAPAYA_NEON
+
+// -----------------------------------------------------------------------------
+
+typedef void (*BlendOverFn)(const uint8_t* src, uint8_t* dst, int32_t n);
+typedef void (*AccumulateU8Fn)(const uint8_t* src, uint16_t w, uint32_t* acc,
+                               int32_t n);
+typedef void (*AccumulateU16Fn)(const uint16_t* src, uint16_t w,
+                                uint32_t* acc, int32_t n);
+typedef void (*BoxAverageFn)(const uint32_t* a, const uint32_t* b, int32_t w,
+                             uint16_t* dst, int32_t n);
+typedef void (*SlideSumsFn)(uint32_t* sums, const uint16_t* in,
+                            const uint16_t* out, int32_t n);
+typedef void (*ApplyLutsFn)(uint8_t* img, const uint8_t* lut, int32_t n);
+
+struct KernelTable {
+    BlendOverFn blend_over;
+    AccumulateU8Fn accumulate_u8;
+    AccumulateU16Fn accumulate_u16;
+    BoxAverageFn box_average;
+    SlideSumsFn slide_sums;
+    ApplyLutsFn apply_luts; // Without gathers, SSE2 and NEON use scalar
+    const char* isa;
+};
+
+static KernelTable select_kernels()
+{
+    KernelTable k = { papaya_blend_over_scalar, papaya_accumulate_u8_scalar,
+                      papaya_accumulate_u16_scalar, papaya_box_average_scalar,
+                      papaya_slide_sums_scalar, papaya_apply_luts_scalar,
+                      "Scalar" };
+#if defined(PAPAYA_X86)
+    k.blend_over = blend_over_sse2;
+    k.accumulate_u8 = accumulate_u8_sse2;
+    k.accumulate_u16 = accumulate_u16_sse2;
+    k.box_average = box_average_sse2;
+    k.slide_sums = slide_sums_sse2;
+    k.isa = "SSE2";
+    if (cpu_has_avx2()) {
+        k.blend_over = blend_over_avx2;
+        k.accumulate_u8 = accumulate_u8_avx2;
+        k.accumulate_u16 = accumulate_u16_avx2;
+        k.box_average = box_average_avx2;
+        k.slide_sums = slide_sums_avx2;
+        k.apply_luts = apply_luts_avx2;
+        k.isa = "AVX2";
+    }
+#elif defined(PAPAYA_NEON)
+    k.blend_over = blend_over_neon;
+    k.accumulate_u8 = accumulate_u8_neon;
+    k.accumulate_u16 = accumulate_u16_neon;
+    k.box_average = box_average_neon;
+    k.slide_sums = slide_sums_neon;
+    k.isa = "NEON";
+#endif
+    return k;
+}
+
+static const KernelTable kernels = select_kernels();
+
+void papaya_blend_over(const uint8_t* src, uint8_t* dst, int32_t n)
+{
+    kernels.blend_over(src, dst, n);
+}
+
+void papaya_accumulate_u8(const uint8_t* src, uint16_t w, uint32_t* acc,
+                          int32_t n)
+{
+    kernels.accumulate_u8(src, w, acc, n);
+}
+
+void papaya_accumulate_u16(const uint16_t* src, uint16_t w, uint32_t* acc,
+                           int32_t n)
+{
+    kernels.accumulate_u16(src, w, acc, n);
+}
+
+void papaya_box_average(const uint32_t* a, const uint32_t* b, int32_t w,
+                        uint16_t* dst, int32_t n)
+{
+    kernels.box_average(a, b, w, dst, n);
+}
+
+void papaya_slide_sums(uint32_t* sums, const uint16_t* in,
+                       const uint16_t* out, int32_t n)
+{
+    kernels.slide_sums(sums, in, out, n);
+}
+
+void papaya_apply_luts(uint8_t* img, const uint8_t* lut, int32_t n)
+{
+    kernels.apply_luts(img, lut, n);
+}
+
+const char* papaya_kernels_isa()
+{
+    return kernels.isa;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+/*
+    Pixel kernels shared by the node evaluators.
+
+    Every kernel has a portable scalar version and, where available, SIMD
+    versions (SSE2 and AVX2 on x86, NEON on AArch64). The fastest version
+    supported by the CPU is selected at startup. All versions produce
+    bit-identical results, so the scalar version serves as the reference.
+*/
+
+#include <stdint.h>
+
+/*
+    Composites n RGBA pixels of src over dst, writing the result to dst. Both
+    buffers hold premultiplied alpha, so every channel is src + dst * (1 - a_s).
+*/
+void papaya_blend_over(const uint8_t* src, uint8_t* dst, int32_t n);
+void papaya_blend_over_scalar(const uint8_t* src, uint8_t* dst, int32_t n);
+
+/*
+    Alpha-only version of papaya_blend_over, used when evaluating masks. src is
+    RGBA and dst holds one alpha byte per pixel.
+*/
+void papaya_blend_over_alpha(const uint8_t* src, uint8_t* dst, int32_t n);
+
+/*
+    Adds w * src[i] to acc[i] for n values, for the taps of separable blurs.
+    Callers keep the sums within 32 bits.
+*/
+void papaya_accumulate_u8(const uint8_t* src, uint16_t w, uint32_t* acc,
+                          int32_t n);
+void papaya_accumulate_u16(const uint16_t* src, uint16_t w, uint32_t* acc,
+                           int32_t n);
+void papaya_accumulate_u8_scalar(const uint8_t* src, uint16_t w,
+                                 uint32_t* acc, int32_t n);
+void papaya_accumulate_u16_scalar(const uint16_t* src, uint16_t w,
+                                  uint32_t* acc, int32_t n);
+
+/*
+    Averages for the box passes of blurs. dst[i] is (a[i] - b[i]) / w rounded,
+    where a[i] - b[i] sums w values, or a[i] / w if b is 0. Quotients are
+    taken through a single float multiply, which every version rounds alike.
+*/
+void papaya_box_average(const uint32_t* a, const uint32_t* b, int32_t w,
+                        uint16_t* dst, int32_t n);
+void papaya_box_average_scalar(const uint32_t* a, const uint32_t* b,
+                               int32_t w, uint16_t* dst, int32_t n);
+
+/*
+    Moves the running sums of box passes along by one row, adding in[i] to
+    sums[i] and taking out[i] away
+*/
+void papaya_slide_sums(uint32_t* sums, const uint16_t* in,
+                       const uint16_t* out, int32_t n);
+void papaya_slide_sums_scalar(uint32_t* sums, const uint16_t* in,
+                              const uint16_t* out, int32_t n);
+
+/*
+    Maps the colors of n premultiplied RGBA pixels through lookup tables of
+    straight colors, 256 entries for each of red, green and blue in a row,
+    leaving alpha as is. Colors are unpremultiplied for the lookups through
+    tabulated reciprocals of alpha, which round like papaya_unpremultiply.
+    The tables are followed by
+    PAPAYA_LUT_PADDING bytes, which SIMD versions read past the last entry.
+*/
+#define PAPAYA_LUT_PADDING 4
+
+void papaya_apply_luts(uint8_t* img, const uint8_t* lut, int32_t n);
+void papaya_apply_luts_scalar(uint8_t* img, const uint8_t* lut, int32_t n);
+
+/*
+    Adds every step-th of n premultiplied RGBA pixels to histograms of 256
+    entries each for red, green, blue and alpha, in a row. Colors are counted
+    straight, as papaya_apply_luts looks them up, and only for pixels that
+    aren't fully transparent. Lookups into counters don't vectorize, so there
+    are no SIMD versions.
+*/
+void papaya_histogram(const uint8_t* img, int32_t n, int32_t step,
+                      uint32_t* hist);
+
+/*
+    Conversions between straight and premultiplied alpha. Node images are
+    premultiplied. Images are converted once on import and once on export.
+*/
+void papaya_premultiply(uint8_t* img, int64_t n);
+void papaya_unpremultiply(const uint8_t* src, uint8_t* dst, int64_t n);
+
+/*
+    Name of the instruction set used by the kernels, e.g. "AVX2".
+*/
+const char* papaya_kernels_isa();
@@ -1,14 +1,44 @@
 #include "libpapaya.h"
+#include "jobs.h"
+#include "kernels.h"
 
+#include <atomic>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdint.h>
 
 /*
-    TODO:
-    - Add destroy functions to nodes
+    Buffers read and written by a node kernel. All buffers span the full frame
+    and are stride pixels wide. Buffers hold either RGBA or, when only the alpha
+    of a node is needed (e.g. by a mask), a single alpha channel. in is indexed
+    by slot, and contains 0 for output slots and for unconnected or unneeded
+    inputs.
 */
+struct EvalBuffers {
+    const uint8_t* in[PAPAYA_MAX_NODE_SLOTS];
+    int32_t in_channels[PAPAYA_MAX_NODE_SLOTS];
+    uint8_t* out;
+    int32_t channels; // Of out. 4 for RGBA, 1 for alpha only.
+    int32_t stride;
+    int32_t height; // Of the frame, which is stride pixels wide
+    int32_t level; // Pyramid level of the evaluation
+    const uint8_t* lut; // Of levels nodes, see compile_levels
+};
+
+static PapayaZoneEnterFn zone_enter;
+static PapayaZoneLeaveFn zone_leave;
+
+struct Zone {
+    Zone(const char* name) { if (zone_enter) { zone_enter(name); } }
+    ~Zone() { if (zone_leave) { zone_leave(); } }
+};
+
+static inline uint8_t alpha_at(const uint8_t* buf, int32_t channels, int64_t i)
+{
+    return buf[i * channels + channels - 1];
+}
 
 /*
     Assumes that the slot struct is zeroed out. If it isn't, pointers may have
@@ -20,6 +50,7 @@ static void init_slot(PapayaSlot* slot, PapayaNode* node, uint8_t is_out,
     slot->node = node;
     slot->is_out = is_out;
     slot->pos = pos;
+    slot->link = -1;
 
     switch (pos) {
         case PapayaSlotPos_In:     slot->pos_x = 0.5f; slot->pos_y = 1;    break;
@@ -32,67 +63,68 @@ static void init_slot(PapayaSlot* slot, PapayaNode* node, uint8_t is_out,
 // -----------------------------------------------------------------------------
 
 void init_bitmap_node(PapayaNode* node, const char* name,
-                      uint8_t* img, int w, int h, int c)
+                      const uint8_t* img, int w, int h, int c,
+                      uint8_t* mem)
 {
     BitmapNode* b = &node->params.bitmap;
 
     node->num_slots = 2;
-    node->slots = (PapayaSlot*) calloc(node->num_slots * sizeof(PapayaSlot), 1);
     init_slot(&node->slots[0], node, false, PapayaSlotPos_In);
     init_slot(&node->slots[1], node, true, PapayaSlotPos_Out);
 
     node->type = PapayaNodeType_Bitmap;
     node->name = name;
 
-    b->image = img;
-    b->width = w;
-    b->height = h;
-
+    if (mem) {
+        papaya_tiles_init_mapped(&b->image, img, w, h, mem);
+    } else {
+        papaya_tiles_init(&b->image, img, w, h);
+    }
 }
 
-static void papaya_evaluate_bitmap_node(PapayaNode* node, int w, int h,
-                                        uint8_t* out)
+void papaya_set_bitmap(PapayaNode* node, const uint8_t* img, int w, int h)
 {
-    PapayaSlot* from = node->slots[0].to[0];
-
-    if (!from) {
-        // No input
-        memcpy(out, node->params.bitmap.image, 4 * w * h);
-        return;
-    }
-
-    PapayaNode* in = from->node;
-    papaya_evaluate_node(in, w, h, out);
-
-    // Code is extremely unoptimized. Only proof-of-concept for nailing down
-    // the API.
-    for (int64_t i = 0; i < 4 * w * h; i += 4) {
-        float r_d = out[i]   / 255.0f;
-        float g_d = out[i+1] / 255.0f;
-        float b_d = out[i+2] / 255.0f;
-        float a_d = out[i+3] / 255.0f;
+    BitmapNode* b = &node->params.bitmap;
+    papaya_tiles_destroy(&b->image);
+    papaya_pyramid_destroy(&b->pyramid);
+    papaya_tiles_init(&b->image, img, w, h);
+    papaya_touch_node(node);
+}
 
-        float r_s = node->params.bitmap.image[i]   / 255.0f;
-        float g_s = node->params.bitmap.image[i+1] / 255.0f;
-        float b_s = node->params.bitmap.image[i+2] / 255.0f;
-        float a_s = node->params.bitmap.image[i+3] / 255.0f;
+/*
+    Blends the bitmap over the rect r of the output, which holds the input.
+*/
+static void papaya_evaluate_bitmap_node(PapayaNode* node, PapayaRect r,
+                                        const EvalBuffers* b)
+{
+    BitmapNode* bitmap = &node->params.bitmap;
+    PapayaTiles* img = b->level ? &bitmap->pyramid.levels[b->level]
+                                : &bitmap->image;
+    int32_t stride = b->stride;
 
-        // Alpha
-        float a_f = (a_s + a_d * (1.0f - a_s));
-        int a = 255.0f * a_f;
-        if (a < 0) { a = 0; }
-        else if (a > 255) { a = 255; }
-        out[i+3] = (uint8_t) a;
+    // Only the part of r covered by the bitmap is affected by the blend.
+    // Transparent tiles leave the input unchanged, so they are skipped.
+    int32_t x_end = img->width  - r.x;
+    int32_t y_end = img->height - r.y;
+    if (x_end > r.w) { x_end = r.w; }
+    if (y_end > r.h) { y_end = r.h; }
+    if (x_end < 0) { x_end = 0; }
+    if (y_end < 0) { y_end = 0; }
 
-        if (a == 0) {
-            out[i] = out[i+1] = out[i+2] = 0;
-        } else {
-            int r = 255.0f * (r_s*a_s + r_d*a_d*(1.0f-a_s)) / a_f;
-            int g = 255.0f * (g_s*a_s + g_d*a_d*(1.0f-a_s)) / a_f;
-            int b = 255.0f * (b_s*a_s + b_d*a_d*(1.0f-a_s)) / a_f;
-            out[i]   = (uint8_t) r;
-            out[i+1] = (uint8_t) g;
-            out[i+2] = (uint8_t) b;
+    for (int32_t y = 0; y < y_end; y++) {
+        int64_t row = (int64_t)(r.y + y) * stride + r.x;
+        for (int32_t x = 0, n; x < x_end; x += n) {
+            const uint8_t* s = papaya_tiles_row(img, r.x + x, r.y + y, &n);
+            if (n > x_end - x) { n = x_end - x; }
+            if (!s) {
+                continue;
+            }
+            if (b->channels == 1) {
+                // Alpha only. The result alpha is a_s + a_d * (1 - a_s).
+                papaya_blend_over_alpha(s, b->out + row + x, n);
+            } else {
+                papaya_blend_over(s, b->out + 4 * (row + x), n);
+            }
         }
     }
 }
@@ -104,7 +136,6 @@ void init_invert_color_node(PapayaNode* node, const char* name)
     InvertColorNode* i = &node->params.invert_color;
 
     node->num_slots = 3;
-    node->slots = (PapayaSlot*) calloc(node->num_slots * sizeof(PapayaSlot), 1);
     init_slot(&node->slots[0], node, false, PapayaSlotPos_In);
     init_slot(&node->slots[1], node, true, PapayaSlotPos_Out);
     init_slot(&node->slots[2], node, false, PapayaSlotPos_InMask);
@@ -114,119 +145,2360 @@ void init_invert_color_node(PapayaNode* node, const char* name)
     i->invert_r = i->invert_g = i->invert_b = 1;
 }
 
-static void papaya_evaluate_invert_color_node(PapayaNode* node, int w, int h,
-                                              uint8_t* out)
+/*
+    Inverts the colors in the rect r of the output, which holds the input.
+    Inversion leaves alpha unchanged, so alpha-only outputs are left as they
+    are and the mask isn't read.
+*/
+static void papaya_evaluate_invert_color_node(PapayaNode* node, PapayaRect r,
+                                              const EvalBuffers* b)
 {
-    PapayaSlot* in = node->slots[0].to[0];
-    if (!in) {
+    int32_t stride = b->stride;
+    if (b->channels == 1 || !b->in[0]) {
+        // Nothing to invert
         return;
     }
-    papaya_evaluate_node(in->node, w, h, out);
 
-    PapayaSlot* mask = node->slots[2].to[0];
-    if (mask) {
+    const uint8_t* m = b->in[2];
+    if (m) {
         // Mask is provided
-        uint8_t* m = (uint8_t*) malloc(4 * w * h);
+        int32_t mc = b->in_channels[2];
+        for (int32_t y = 0; y < r.h; y++) {
+            int64_t row = (int64_t)(r.y + y) * stride + r.x;
+            uint8_t* o = b->out + 4 * row;
 
-        papaya_evaluate_node(mask->node, w, h, m);
-        for (int64_t i = 0; i < 4 * w * h; i += 4) {
-            float t = (float)m[i+3] / 255.0f;
+            for (int32_t x = 0; x < r.w; x++) {
+                int32_t i = 4 * x;
+                float t = (float)alpha_at(m, mc, row + x) / 255.0f;
+                float a = (float)o[i+3] / 255.0f;
 
-            if (node->params.invert_color.invert_r) {
-                float r = (float)out[i] / 255.0f;
-                r = t * (1.0f - r) + (1.0f - t) * r;
-                out[i]   = r * 255.0f;
-            }
+                if (node->params.invert_color.invert_r) {
+                    float r = (float)o[i] / 255.0f;
+                    r = t * (a - r) + (1.0f - t) * r;
+                    o[i]   = r * 255.0f;
+                }
 
-            if (node->params.invert_color.invert_g) {
-                float g = (float)out[i+1] / 255.0f;
-                g = t * (1.0f - g) + (1.0f - t) * g;
-                out[i+1] = g * 255.0f;
-            }
+                if (node->params.invert_color.invert_g) {
+                    float g = (float)o[i+1] / 255.0f;
+                    g = t * (a - g) + (1.0f - t) * g;
+                    o[i+1] = g * 255.0f;
+                }
 
-            if (node->params.invert_color.invert_b) {
-                float b = (float)out[i+2] / 255.0f;
-                b = t * (1.0f - b) + (1.0f - t) * b;
-                out[i+2] = b * 255.0f;
+                if (node->params.invert_color.invert_b) {
+                    float b = (float)o[i+2] / 255.0f;
+                    b = t * (a - b) + (1.0f - t) * b;
+                    o[i+2] = b * 255.0f;
+                }
             }
         }
-
-        free(m);
     } else {
         // No mask provided
-        for (int64_t i = 0; i < 4 * w * h; i += 4) {
-            out[i]   = 255 - out[i];
-            out[i+1] = 255 - out[i+1];
-            out[i+2] = 255 - out[i+2];
+        for (int32_t y = 0; y < r.h; y++) {
+            uint8_t* o = b->out + 4 * ((int64_t)(r.y + y) * stride + r.x);
+            for (int32_t i = 0; i < 4 * r.w; i += 4) {
+                // Inverting a premultiplied color c gives a - c
+                uint8_t a = o[i+3];
+                o[i]   = a > o[i]   ? a - o[i]   : 0;
+                o[i+1] = a > o[i+1] ? a - o[i+1] : 0;
+                o[i+2] = a > o[i+2] ? a - o[i+2] : 0;
+            }
         }
     }
 }
 
 // -----------------------------------------------------------------------------
 
-void papaya_evaluate_node(PapayaNode* node, int w, int h, uint8_t* out)
+void init_transform_node(PapayaNode* node, const char* name)
 {
-    switch (node->type) {
-        case PapayaNodeType_Bitmap:
-            papaya_evaluate_bitmap_node(node, w, h, out);
-            break;
-        case PapayaNodeType_InvertColor:
-            papaya_evaluate_invert_color_node(node, w, h, out);
-            break;
+    node->num_slots = 2;
+    init_slot(&node->slots[0], node, false, PapayaSlotPos_In);
+    init_slot(&node->slots[1], node, true, PapayaSlotPos_Out);
+
+    node->type = PapayaNodeType_Transform;
+    node->name = name;
+    node->params.transform.filter = PapayaFilter_Bicubic;
+}
+
+/*
+    Filter weights of the 2 * radius pixels around a sample, tabulated for
+    FILTER_PHASES + 1 positions of the sample between two pixels. Each row is
+    normalized, so that flat areas stay flat.
+*/
+#define FILTER_PHASES 64
+#define FILTER_MAX_RADIUS 3
+
+struct FilterTable {
+    int32_t radius;
+    float w[FILTER_PHASES + 1][2 * FILTER_MAX_RADIUS];
+};
+
+static FilterTable filter_tables[PapayaFilter_COUNT];
+
+static float filter_weight(int32_t filter, float x)
+{
+    const float pi = 3.14159265f;
+    x = fabsf(x);
+    switch (filter) {
+        case PapayaFilter_Bilinear: {
+            return x < 1.0f ? 1.0f - x : 0.0f;
+        }
+        case PapayaFilter_Bicubic: {
+            if (x < 1.0f) { return (1.5f * x - 2.5f) * x * x + 1.0f; }
+            if (x < 2.0f) { return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f; }
+            return 0.0f;
+        }
+        case PapayaFilter_Lanczos: {
+            if (x < 1e-5f) { return 1.0f; }
+            if (x >= 3.0f) { return 0.0f; }
+            float t = pi * x;
+            return 3.0f * sinf(t) * sinf(t / 3.0f) / (t * t);
+        }
     }
+    return 0.0f;
 }
 
-bool papaya_connect(PapayaSlot* s1, PapayaSlot* s2)
+/*
+    Fills the tables on first use, from the main thread, before any tile of a
+    transform is computed
+*/
+static void init_filter_tables()
 {
-    PapayaSlot* out, *in;
-    if (s1->is_out) {
-        out = s1;
-        in = s2;
-    } else {
-        out = s2;
-        in = s1;
+    static const int32_t radii[PapayaFilter_COUNT] = { 1, 2, 3 };
+    if (filter_tables[0].radius) {
+        return;
     }
 
-    if (in) {
-        if (in->to[0]) {
-            if (in->to[0]->node == out->node) {
-                // in and out are already connected
-                return true;
+    for (int32_t f = 0; f < PapayaFilter_COUNT; f++) {
+        FilterTable* t = &filter_tables[f];
+        t->radius = radii[f];
+        for (int32_t p = 0; p <= FILTER_PHASES; p++) {
+            float frac = (float)p / FILTER_PHASES, sum = 0.0f;
+            for (int32_t i = 0; i < 2 * t->radius; i++) {
+                t->w[p][i] = filter_weight(f, i - (t->radius - 1) - frac);
+                sum += t->w[p][i];
+            }
+            for (int32_t i = 0; i < 2 * t->radius; i++) {
+                t->w[p][i] /= sum;
             }
-            papaya_disconnect(in->to[0], in);
         }
-        in->to[0] = out;
     }
+}
 
-    for (int32_t i = 0; i < 16; i++) {
-        if (out->to[i] == 0) {
-            out->to[i] = in;
-            break;
+/*
+    Resamples the input into the rect r of the output. Every output pixel
+    reads the 2 * radius by 2 * radius input pixels around its position in
+    the input, through the tabulated filter. Pixels outside the frame are
+    transparent.
+*/
+static void papaya_evaluate_transform_node(PapayaNode* node, PapayaRect r,
+                                           const EvalBuffers* b)
+{
+    const TransformNode* t = &node->params.transform;
+    const uint8_t* in = b->in[0];
+    int32_t oc = b->channels;
+    int32_t stride = b->stride;
+    if (!in) {
+        for (int32_t y = 0; y < r.h; y++) {
+            memset(b->out + oc * ((int64_t)(r.y + y) * stride + r.x), 0,
+                   oc * r.w);
         }
+        return;
     }
 
-    return true;
+    int32_t ic = b->in_channels[0];
+    const FilterTable* ft =
+        &filter_tables[t->filter < PapayaFilter_COUNT ? t->filter : 0];
+    int32_t rad = ft->radius;
+    float scale = 1.0f / (float)(1 << b->level);
+    float c = cosf(t->angle), s = sinf(t->angle);
+    float src_x = t->src_x * scale, src_y = t->src_y * scale;
+    float dst_x = t->dst_x * scale, dst_y = t->dst_y * scale;
+
+    for (int32_t y = 0; y < r.h; y++) {
+        uint8_t* o = b->out + oc * ((int64_t)(r.y + y) * stride + r.x);
+
+        // Input position of the pixel center, turned back by the angle. Pixel
+        // centers of the input are at whole coordinates.
+        float qx = r.x + 0.5f - dst_x, qy = r.y + y + 0.5f - dst_y;
+        float u = src_x + c * qx + s * qy - 0.5f;
+        float v = src_y - s * qx + c * qy - 0.5f;
+
+        for (int32_t x = 0; x < r.w; x++, o += oc, u += c, v -= s) {
+            if (u <= -rad || v <= -rad || u >= stride + rad ||
+                v >= b->height + rad) {
+                memset(o, 0, oc);
+                continue;
+            }
+            float fu = floorf(u), fv = floorf(v);
+            int32_t x0 = (int32_t)fu - rad + 1, y0 = (int32_t)fv - rad + 1;
+            const float* wx = ft->w[(int32_t)((u - fu) * FILTER_PHASES + 0.5f)];
+            const float* wy = ft->w[(int32_t)((v - fv) * FILTER_PHASES + 0.5f)];
+
+            // Taps within the frame
+            int32_t i1 = x0 < 0 ? -x0 : 0, j1 = y0 < 0 ? -y0 : 0;
+            int32_t i2 = 2 * rad, j2 = 2 * rad;
+            if (x0 + i2 > stride) { i2 = stride - x0; }
+            if (y0 + j2 > b->height) { j2 = b->height - y0; }
+
+            float acc[4] = {};
+            for (int32_t j = j1; j < j2; j++) {
+                const uint8_t* p =
+                    in + ic * ((int64_t)(y0 + j) * stride + x0 + i1);
+                float sum[4] = {};
+                if (ic == 4) {
+                    for (int32_t i = i1; i < i2; i++, p += 4) {
+                        sum[0] += wx[i] * p[0];
+                        sum[1] += wx[i] * p[1];
+                        sum[2] += wx[i] * p[2];
+                        sum[3] += wx[i] * p[3];
+                    }
+                } else {
+                    for (int32_t i = i1; i < i2; i++, p++) {
+                        sum[0] += wx[i] * p[0];
+                    }
+                }
+                for (int32_t k = 0; k < 4; k++) { acc[k] += wy[j] * sum[k]; }
+            }
+
+            // Sharp filters overshoot, so colors are clamped to stay valid
+            // premultiplied values
+            float a = acc[ic - 1];
+            a = a < 0.0f ? 0.0f : a > 255.0f ? 255.0f : a;
+            if (oc == 1) {
+                o[0] = (uint8_t)(a + 0.5f);
+                continue;
+            }
+            for (int32_t k = 0; k < 3; k++) {
+                float v = acc[k] < 0.0f ? 0.0f : acc[k] > a ? a : acc[k];
+                o[k] = (uint8_t)(v + 0.5f);
+            }
+            o[3] = (uint8_t)(a + 0.5f);
+        }
+    }
 }
 
-void papaya_disconnect(PapayaSlot* s1, PapayaSlot* s2)
+/*
+    Rect from x1, y1 to x2, y2, clamped to [-2^30, 2^30 - 1], so that its size
+    and far edges fit in 32 bits even when it spans the whole range
+*/
+static PapayaRect bounded_rect(double x1, double y1, double x2, double y2)
 {
-    PapayaSlot* out, *in;
-    if (s1->is_out) {
-        out = s1;
-        in = s2;
-    } else {
-        out = s2;
-        in = s1;
+    const double lo = -(double)(1 << 30), hi = (double)(1 << 30) - 1;
+    x1 = x1 < lo ? lo : x1 > hi ? hi : x1;
+    y1 = y1 < lo ? lo : y1 > hi ? hi : y1;
+    x2 = x2 < lo ? lo : x2 > hi ? hi : x2;
+    y2 = y2 < lo ? lo : y2 > hi ? hi : y2;
+    PapayaRect m = { (int32_t)x1, (int32_t)y1,
+                     (int32_t)((int64_t)x2 - (int64_t)x1),
+                     (int32_t)((int64_t)y2 - (int64_t)y1) };
+    return m;
+}
+
+/*
+    Bounds of the rect r moved by the transform, from the input to the output,
+    or back if inverse, at the given scale and grown by pad pixels. Bounds are
+    clamped, so that the huge rects of papaya_touch_node stay meaningful.
+*/
+static PapayaRect transform_rect(const TransformNode* t, PapayaRect r,
+                                 bool inverse, double scale, int32_t pad)
+{
+    double c = cos(t->angle), s = inverse ? -sin(t->angle) : sin(t->angle);
+    double ax = (inverse ? t->dst_x : t->src_x) * scale;
+    double ay = (inverse ? t->dst_y : t->src_y) * scale;
+    double bx = (inverse ? t->src_x : t->dst_x) * scale;
+    double by = (inverse ? t->src_y : t->dst_y) * scale;
+
+    double x1 = 1e300, y1 = 1e300, x2 = -1e300, y2 = -1e300;
+    for (int32_t i = 0; i < 4; i++) {
+        double px = (i & 1 ? (double)r.x + r.w : r.x) - ax;
+        double py = (i & 2 ? (double)r.y + r.h : r.y) - ay;
+        double x = bx + c * px - s * py;
+        double y = by + s * px + c * py;
+        if (x < x1) { x1 = x; }
+        if (y < y1) { y1 = y; }
+        if (x > x2) { x2 = x; }
+        if (y > y2) { y2 = y; }
+    }
+
+    return bounded_rect(floor(x1) - pad, floor(y1) - pad,
+                        ceil(x2) + pad, ceil(y2) + pad);
+}
+
+// -----------------------------------------------------------------------------
+
+void init_blur_node(PapayaNode* node, const char* name)
+{
+    node->num_slots = 2;
+    init_slot(&node->slots[0], node, false, PapayaSlotPos_In);
+    init_slot(&node->slots[1], node, true, PapayaSlotPos_Out);
+
+    node->type = PapayaNodeType_Blur;
+    node->name = name;
+    node->params.blur.radius = 8.0f;
+}
+
+#define BLUR_MAX_TAPS 17 // Of the convolution. Larger blurs use boxes.
+
+/*
+    Blur at one pyramid level. The halo is the number of pixels read on each
+    side of an output pixel. It is at most the radius at that level rounded
+    down, so that it is within the radius once scaled to full resolution.
+*/
+struct BlurKernel {
+    int32_t halo; // 0 if the blur is too small to change anything
+    int32_t box[3]; // Half widths of the box passes. 0 when convolving.
+    uint16_t w[BLUR_MAX_TAPS]; // Convolution weights, summing to 1 << 14
+};
+
+// Radius of the node, within the range the kernels support
+static float blur_radius(const BlurNode* b)
+{
+    return b->radius >= 0.0f ? (b->radius < 4096.0f ? b->radius : 4096.0f)
+                             : 0.0f;
+}
+
+static BlurKernel blur_kernel(const BlurNode* b, int32_t level)
+{
+    BlurKernel k = {};
+    float r = blur_radius(b) / (float)(1 << level);
+    int32_t halo = (int32_t)r;
+    float sigma = r / 3.0f;
+    if (halo == 0) {
+        return k;
+    }
+
+    if (2 * halo + 1 <= BLUR_MAX_TAPS) {
+        float w[BLUR_MAX_TAPS], sum = 0.0f;
+        for (int32_t i = 0; i <= 2 * halo; i++) {
+            float x = (float)(i - halo);
+            w[i] = expf(-x * x / (2.0f * sigma * sigma));
+            sum += w[i];
+        }
+
+        // The center takes the rounding error, so that flat areas stay flat
+        int32_t total = 0;
+        for (int32_t i = 0; i <= 2 * halo; i++) {
+            k.w[i] = (uint16_t)(w[i] / sum * (1 << 14) + 0.5f);
+            total += k.w[i];
+        }
+        k.w[halo] = (uint16_t)(k.w[halo] + (1 << 14) - total);
+        k.halo = halo;
+        return k;
+    }
+
+    // Three boxes whose variances add up to that of the Gaussian. The first
+    // ones are narrower, by two pixels.
+    float var = 12.0f * sigma * sigma;
+    int32_t wl = (int32_t)sqrtf(var / 3.0f + 1.0f);
+    if (wl % 2 == 0) { wl--; }
+    float m = (var - 3.0f * wl * wl - 12.0f * wl - 9.0f) / (-4.0f * wl - 4.0f);
+    for (int32_t i = 0; i < 3; i++) {
+        int32_t width = i < (int32_t)(m + 0.5f) ? wl : wl + 2;
+        k.box[i] = (width - 1) / 2;
+        k.halo += k.box[i];
+    }
+    for (int32_t i = 2; k.halo > halo; i = (i + 2) % 3) {
+        k.box[i]--;
+        k.halo--;
     }
+    return k;
+}
+
+/*
+    Scratch memory of the blur, one per thread, grown to the largest size
+    asked for
+*/
+struct BlurScratch {
+    uint8_t* data;
+    size_t size;
+    ~BlurScratch() { free(data); }
+};
+
+static thread_local BlurScratch blur_scratch;
+
+static uint8_t* get_blur_scratch(size_t size)
+{
+    BlurScratch* s = &blur_scratch;
+    if (s->size < size) {
+        free(s->data);
+        s->data = (uint8_t*) malloc(size);
+        s->size = size;
+    }
+    return s->data;
+}
+
+/*
+    Box passes along a row of len pixels of c channels, in place. Every pass
+    averages 2 * box[p] + 1 pixels, so its output is 2 * box[p] pixels
+    shorter than its input. Averages are differences of the prefix sums, so
+    that only the sums depend on each other. Their rounding keeps them in
+    order, so colors stay within alpha.
+*/
+static void box_passes(uint16_t* v, int32_t len, int32_t c,
+                       const int32_t* box, uint32_t* prefix)
+{
+    for (int32_t p = 0; p < 3; p++) {
+        // The sums of the channels are kept apart in registers
+        int32_t n = len * c;
+        if (c == 4) {
+            uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+            prefix[0] = prefix[1] = prefix[2] = prefix[3] = 0;
+            for (int32_t i = 0; i < n; i += 4) {
+                prefix[i + 4] = s0 += v[i];
+                prefix[i + 5] = s1 += v[i + 1];
+                prefix[i + 6] = s2 += v[i + 2];
+                prefix[i + 7] = s3 += v[i + 3];
+            }
+        } else {
+            for (int32_t ch = 0; ch < c; ch++) { prefix[ch] = 0; }
+            for (int32_t i = 0; i < n; i++) {
+                prefix[i + c] = prefix[i] + v[i];
+            }
+        }
+
+        int32_t width = 2 * box[p] + 1;
+        len -= 2 * box[p];
+        papaya_box_average(prefix + width * c, prefix, width, v, len * c);
+    }
+}
+
+/*
+    Like box_passes, down the columns of rows of n values, a row at a time so
+    that memory is read in order. The running sums of the columns change by
+    one row in and one out per output row. avg is a row of scratch.
+*/
+static void box_passes_down(uint16_t* rows, int32_t len, int32_t n,
+                            const int32_t* box, uint32_t* sums, uint16_t* avg)
+{
+    for (int32_t p = 0; p < 3; p++) {
+        int32_t width = 2 * box[p] + 1;
+        memset(sums, 0, 4 * (size_t)n);
+        for (int32_t j = 0; j < width; j++) {
+            papaya_accumulate_u16(rows + (size_t)j * n, 1, sums, n);
+        }
+
+        // Row j leaves the sums after its average is taken, so the average
+        // waits in avg until then
+        len -= 2 * box[p];
+        for (int32_t j = 0; j < len; j++) {
+            uint16_t* row = rows + (size_t)j * n;
+            if (j + 1 == len) {
+                papaya_box_average(sums, 0, width, row, n);
+                break;
+            }
+            papaya_box_average(sums, 0, width, avg, n);
+            papaya_slide_sums(sums, row + (size_t)width * n, row, n);
+            memcpy(row, avg, 2 * (size_t)n);
+        }
+    }
+}
+
+/*
+    Blurs the rect r of the input into the output, in a horizontal pass over
+    the rows that the vertical pass reads, followed by the vertical pass.
+    Intermediate values have 8 fractional bits.
+*/
+static void papaya_evaluate_blur_node(PapayaNode* node, PapayaRect r,
+                                      const EvalBuffers* b)
+{
+    const uint8_t* in = b->in[0];
+    int32_t c = b->channels;
+    int32_t ic = b->in_channels[0]; // May have color where only alpha is needed
+    int32_t stride = b->stride;
+    BlurKernel k = blur_kernel(&node->params.blur, b->level);
+    if (!in || !k.halo) {
+        for (int32_t y = 0; y < r.h; y++) {
+            int64_t row = c * ((int64_t)(r.y + y) * stride + r.x);
+            if (in && ic == c) {
+                memcpy(b->out + row, in + row, c * r.w);
+            } else if (in) {
+                int64_t i = (int64_t)(r.y + y) * stride + r.x;
+                for (int32_t x = 0; x < r.w; x++) {
+                    b->out[row + x] = alpha_at(in, ic, i + x);
+                }
+            } else {
+                memset(b->out + row, 0, c * r.w);
+            }
+        }
+        return;
+    }
+
+    int32_t halo = k.halo;
+    int32_t n = c * r.w;
+    int32_t line_len = c * (r.w + 2 * halo);
+    int32_t num_rows = r.h + 2 * halo;
+    size_t line_size = ((size_t)line_len + c) * 4;
+    uint8_t* mem = get_blur_scratch(3 * line_size + 2 * (size_t)num_rows * n);
+    uint32_t* acc = (uint32_t*)mem; // Also the prefix sums of box passes
+    uint8_t* line = mem + line_size;
+    uint16_t* line16 = (uint16_t*)(line + line_size);
+    uint16_t* tmp = (uint16_t*)(line + 2 * line_size);
+
+    // Horizontal pass
+    int32_t x1 = r.x - halo, x2 = r.x + r.w + halo;
+    int32_t lo = x1 < 0 ? -x1 : 0;
+    int32_t hi = x2 > stride ? x2 - stride : 0;
+    for (int32_t j = 0; j < num_rows; j++) {
+        int32_t y = r.y - halo + j;
+        uint16_t* t = tmp + (size_t)j * n;
+        if (y < 0 || y >= b->height) {
+            memset(t, 0, 2 * (size_t)n);
+            continue;
+        }
+
+        // Copies the row to the line, transparent outside the frame
+        memset(line, 0, c * lo);
+        int64_t i = (int64_t)y * stride + x1 + lo;
+        if (ic == c) {
+            memcpy(line + c * lo, in + c * i, line_len - c * (lo + hi));
+        } else {
+            for (int32_t x = lo; x < line_len - hi; x++) {
+                line[x] = alpha_at(in, ic, i + x - lo);
+            }
+        }
+        memset(line + line_len - c * hi, 0, c * hi);
+
+        if (k.box[0] || k.box[1] || k.box[2]) {
+            for (int32_t i = 0; i < line_len; i++) {
+                line16[i] = (uint16_t)(line[i] << 8);
+            }
+            box_passes(line16, r.w + 2 * halo, c, k.box, acc);
+            memcpy(t, line16, 2 * (size_t)n);
+        } else {
+            memset(acc, 0, 4 * (size_t)n);
+            for (int32_t i = 0; i <= 2 * halo; i++) {
+                papaya_accumulate_u8(line + c * i, k.w[i], acc, n);
+            }
+            for (int32_t i = 0; i < n; i++) {
+                t[i] = (uint16_t)((acc[i] + 32) >> 6);
+            }
+        }
+    }
+
+    // Vertical pass
+    if (k.box[0] || k.box[1] || k.box[2]) {
+        box_passes_down(tmp, num_rows, n, k.box, acc, line16);
+        for (int32_t y = 0; y < r.h; y++) {
+            uint8_t* o = b->out + c * ((int64_t)(r.y + y) * stride + r.x);
+            const uint16_t* t = tmp + (size_t)y * n;
+            for (int32_t i = 0; i < n; i++) {
+                o[i] = (uint8_t)((t[i] + 128) >> 8);
+            }
+        }
+        return;
+    }
+
+    for (int32_t y = 0; y < r.h; y++) {
+        memset(acc, 0, 4 * (size_t)n);
+        for (int32_t i = 0; i <= 2 * halo; i++) {
+            papaya_accumulate_u16(tmp + (size_t)(y + i) * n, k.w[i], acc, n);
+        }
+        uint8_t* o = b->out + c * ((int64_t)(r.y + y) * stride + r.x);
+        for (int32_t i = 0; i < n; i++) {
+            o[i] = (uint8_t)((acc[i] + (1 << 21)) >> 22);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
 
-    for (int32_t i = 0; i < 16; i++) {
-        if (out->to[i] == in) {
-            out->to[i] = 0;
-            break; // Assumption: only one such connection exists
+void init_levels_node(PapayaNode* node, const char* name)
+{
+    LevelsNode* l = &node->params.levels;
+
+    node->num_slots = 2;
+    init_slot(&node->slots[0], node, false, PapayaSlotPos_In);
+    init_slot(&node->slots[1], node, true, PapayaSlotPos_Out);
+
+    node->type = PapayaNodeType_Levels;
+    node->name = name;
+    for (int32_t c = 0; c < 4; c++) {
+        l->in_black[c] = l->out_black[c] = 0.0f;
+        l->in_white[c] = l->out_white[c] = l->gamma[c] = 1.0f;
+    }
+}
+
+#define LEVELS_LUT_SIZE (3 * 256 + PAPAYA_LUT_PADDING)
+
+static float clamp01(float x)
+{
+    return x > 0.0f ? (x < 1.0f ? x : 1.0f) : 0.0f; // NaN gives 0
+}
+
+static float levels_curve(const LevelsNode* l, int32_t c, float x)
+{
+    float range = l->in_white[c] - l->in_black[c];
+    float t = range > 0.0f ? clamp01((x - l->in_black[c]) / range) :
+                             (x >= l->in_black[c] ? 1.0f : 0.0f);
+    float gamma = l->gamma[c] > 0.01f ? l->gamma[c] : 0.01f;
+    t = powf(t, 1.0f / gamma);
+    return l->out_black[c] + t * (l->out_white[c] - l->out_black[c]);
+}
+
+/*
+    Tabulates the adjustment of every straight color of every channel, in the
+    layout of papaya_apply_luts
+*/
+static void compile_levels(const LevelsNode* l, uint8_t* lut)
+{
+    for (int32_t c = 0; c < 3; c++) {
+        for (int32_t v = 0; v < 256; v++) {
+            float x = levels_curve(l, c, v / 255.0f);
+            x = levels_curve(l, PAPAYA_LEVELS_ALL, clamp01(x));
+            lut[256 * c + v] = (uint8_t)(clamp01(x) * 255.0f + 0.5f);
         }
     }
+    memset(lut + 3 * 256, 0, PAPAYA_LUT_PADDING);
+}
+
+/*
+    Adjusts the colors in the rect r of the output, which holds the input.
+    Alpha is left as it is, so alpha-only outputs are too.
+*/
+static void papaya_evaluate_levels_node(PapayaNode* node, PapayaRect r,
+                                        const EvalBuffers* b)
+{
+    if (b->channels == 1 || !b->in[0]) {
+        return;
+    }
+    for (int32_t y = 0; y < r.h; y++) {
+        uint8_t* o = b->out + 4 * ((int64_t)(r.y + y) * b->stride + r.x);
+        papaya_apply_luts(o, b->lut, r.w);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+static size_t cache_budget = (size_t)1024 * 1024 * 1024;
+static size_t cache_usage;
+static uint64_t eval_stamp; // Incremented on every top-level evaluation
+static PapayaNode* lru_head; // Most recently used
+static PapayaNode* lru_tail; // Least recently used
+
+static size_t memory_budget = SIZE_MAX;
+static std::atomic<int64_t> mem_usage[PapayaMem_COUNT];
+static std::atomic<int64_t> mem_peak[PapayaMem_COUNT];
+
+static const char* mem_names[] = {
+    "Image tiles",
+    "Pyramids",
+    "Node caches",
+    "Eval scratch",
+    "Undo buffer",
+    "GPU textures",
+    "GPU buffers",
+};
+
+void papaya_mem_add(int32_t category, int64_t bytes)
+{
+    int64_t usage = mem_usage[category].fetch_add(bytes) + bytes;
+    int64_t peak = mem_peak[category].load();
+    while (usage > peak &&
+           !mem_peak[category].compare_exchange_weak(peak, usage)) {}
+}
+
+size_t papaya_mem_usage(int32_t category)
+{
+    int64_t usage = mem_usage[category].load();
+    return usage > 0 ? (size_t)usage : 0;
+}
+
+size_t papaya_mem_peak(int32_t category)
+{
+    return (size_t)mem_peak[category].load();
+}
+
+const char* papaya_mem_name(int32_t category)
+{
+    return mem_names[category];
+}
+
+// Whether size more bytes would take the CPU categories over the budget
+static bool over_memory_budget(size_t size)
+{
+    size_t total = size;
+    for (int32_t i = 0; i < PAPAYA_MEM_FIRST_GPU; i++) {
+        total += papaya_mem_usage(i);
+    }
+    return total > memory_budget;
+}
+
+/*
+    Node kernels modify their output in place. The output starts out as a copy
+    of the input of slot 0, so that a chain of nodes can also be computed in
+    one pass over a single buffer, see execute_plan.
+*/
+static void apply_node(PapayaNode* node, PapayaRect r, const EvalBuffers* b)
+{
+    switch (node->type) {
+        case PapayaNodeType_Bitmap: {
+            papaya_evaluate_bitmap_node(node, r, b);
+        } break;
+        case PapayaNodeType_InvertColor: {
+            papaya_evaluate_invert_color_node(node, r, b);
+        } break;
+        case PapayaNodeType_Transform: {
+            papaya_evaluate_transform_node(node, r, b);
+        } break;
+        case PapayaNodeType_Blur: {
+            papaya_evaluate_blur_node(node, r, b);
+        } break;
+        case PapayaNodeType_Levels: {
+            papaya_evaluate_levels_node(node, r, b);
+        } break;
+    }
+}
 
-    if (in->to[0] == out) {
-        in->to[0] = 0;
+/*
+    True if the node computes every pixel from the same pixel of its slot 0
+    input, in place, so that it can share a pass with the node feeding it
+*/
+static bool works_in_place(PapayaNode* node)
+{
+    switch (node->type) {
+        case PapayaNodeType_Bitmap:
+        case PapayaNodeType_InvertColor:
+        case PapayaNodeType_Levels: return true;
+        case PapayaNodeType_Transform:
+        case PapayaNodeType_Blur: return false;
     }
+    return false;
+}
+
+/*
+    True if computing a rect of the node costs about as much as computing its
+    rows one at a time, so that it can run in a pass that goes row by row.
+    Blurs aren't, since every call blurs a halo of rows around the rect.
+*/
+static bool runs_by_rows(PapayaNode* node)
+{
+    return node->type != PapayaNodeType_Blur;
+}
+
+/*
+    Region of the input slot's output that the node reads to compute the
+    region r of its own output, at the given level
+*/
+static PapayaRect input_region(PapayaNode* node, int32_t slot, PapayaRect r,
+                               int32_t level)
+{
+    if (node->type == PapayaNodeType_Transform && slot == 0) {
+        const TransformNode* t = &node->params.transform;
+        int32_t f = t->filter < PapayaFilter_COUNT ? t->filter : 0;
+        return transform_rect(t, r, true, 1.0 / (1 << level),
+                              filter_tables[f].radius + 1);
+    }
+    if (node->type == PapayaNodeType_Blur && r.w > 0 && r.h > 0) {
+        int32_t halo = blur_kernel(&node->params.blur, level).halo;
+        PapayaRect g = { r.x - halo, r.y - halo, r.w + 2 * halo,
+                         r.h + 2 * halo };
+        return g;
+    }
+    return r;
+}
+
+/*
+    Region of the node's output that depends on the region r of its inputs,
+    at full resolution
+*/
+static PapayaRect output_region(PapayaNode* node, PapayaRect r)
+{
+    if (node->type == PapayaNodeType_Transform) {
+        const TransformNode* t = &node->params.transform;
+        if (r.w <= 0 || r.h <= 0) {
+            return r;
+        }
+        return transform_rect(t, r, false, 1.0, FILTER_MAX_RADIUS + 1);
+    }
+    if (node->type == PapayaNodeType_Blur && r.w > 0 && r.h > 0) {
+        // Covers the halos of all levels, see blur_kernel
+        double g = ceil(blur_radius(&node->params.blur));
+        return bounded_rect((double)r.x - g, (double)r.y - g,
+                            (double)r.x + r.w + g, (double)r.y + r.h + g);
+    }
+    return r;
+}
+
+/*
+    Computes the rect r of the node's output, given the full-frame outputs of
+    its input slots.
+*/
+static void compute_rect(PapayaNode* node, PapayaRect r, const EvalBuffers* b)
+{
+    const uint8_t* in = b->in[0];
+    int32_t stride = b->stride;
+
+    if (!works_in_place(node)) {
+        // Writes all of r itself
+        apply_node(node, r, b);
+        return;
+    }
+
+    if (node->type == PapayaNodeType_Bitmap && !in && b->channels == 4) {
+        // Nothing to blend over
+        BitmapNode* bitmap = &node->params.bitmap;
+        PapayaTiles* img = b->level ? &bitmap->pyramid.levels[b->level]
+                                    : &bitmap->image;
+        papaya_tiles_read(img, r, b->out + 4 * ((int64_t)r.y * stride + r.x),
+                          stride);
+        return;
+    }
+
+    int32_t ic = b->in_channels[0];
+    for (int32_t y = 0; y < r.h; y++) {
+        int64_t row = (int64_t)(r.y + y) * stride + r.x;
+        uint8_t* o = b->out + b->channels * row;
+        if (!in) {
+            // No input. Output is transparent.
+            memset(o, 0, b->channels * r.w);
+        } else if (ic == b->channels) {
+            memcpy(o, in + ic * row, ic * r.w);
+        } else {
+            for (int32_t x = 0; x < r.w; x++) {
+                o[x] = alpha_at(in, ic, row + x);
+            }
+        }
+    }
+    apply_node(node, r, b);
+}
+
+/*
+    Like compute_rect, with a profiler zone
+*/
+static void evaluate_rect(PapayaNode* node, PapayaRect r, const EvalBuffers* b)
+{
+    switch (node->type) {
+        case PapayaNodeType_Bitmap: {
+            Zone z("Bitmap node");
+            compute_rect(node, r, b);
+        } break;
+        case PapayaNodeType_InvertColor: {
+            Zone z("Invert color node");
+            compute_rect(node, r, b);
+        } break;
+        case PapayaNodeType_Transform: {
+            Zone z("Transform node");
+            compute_rect(node, r, b);
+        } break;
+        case PapayaNodeType_Blur: {
+            Zone z("Blur node");
+            compute_rect(node, r, b);
+        } break;
+        case PapayaNodeType_Levels: {
+            Zone z("Levels node");
+            compute_rect(node, r, b);
+        } break;
+    }
+}
+
+/*
+    Number of channels of the input slot that are needed to compute the given
+    channels of the node's output. 0 if the input isn't read at all.
+*/
+static int32_t input_channels(PapayaNode* node, int32_t slot, int32_t channels)
+{
+    if (node->type == PapayaNodeType_InvertColor && slot == 2) {
+        // The mask only contributes its alpha, and only to the color
+        return channels == 4 ? 1 : 0;
+    }
+    return channels;
+}
+
+static PapayaRect intersect_rects(PapayaRect a, PapayaRect b)
+{
+    int32_t x1 = a.x > b.x ? a.x : b.x;
+    int32_t y1 = a.y > b.y ? a.y : b.y;
+    int64_t x2 = (int64_t)a.x + a.w < (int64_t)b.x + b.w ?
+                 (int64_t)a.x + a.w : (int64_t)b.x + b.w;
+    int64_t y2 = (int64_t)a.y + a.h < (int64_t)b.y + b.h ?
+                 (int64_t)a.y + a.h : (int64_t)b.y + b.h;
+
+    PapayaRect r = {};
+    if (x2 > x1 && y2 > y1) {
+        r.x = x1;
+        r.y = y1;
+        r.w = (int32_t)(x2 - x1);
+        r.h = (int32_t)(y2 - y1);
+    }
+    return r;
+}
+
+static PapayaRect union_rects(PapayaRect a, PapayaRect b)
+{
+    if (a.w <= 0 || a.h <= 0) { return b; }
+    if (b.w <= 0 || b.h <= 0) { return a; }
+
+    int32_t x1 = a.x < b.x ? a.x : b.x;
+    int32_t y1 = a.y < b.y ? a.y : b.y;
+    int64_t x2 = (int64_t)a.x + a.w > (int64_t)b.x + b.w ?
+                 (int64_t)a.x + a.w : (int64_t)b.x + b.w;
+    int64_t y2 = (int64_t)a.y + a.h > (int64_t)b.y + b.h ?
+                 (int64_t)a.y + a.h : (int64_t)b.y + b.h;
+
+    PapayaRect r;
+    r.x = x1;
+    r.y = y1;
+    r.w = (int32_t)(x2 - x1 > INT32_MAX ? INT32_MAX : x2 - x1);
+    r.h = (int32_t)(y2 - y1 > INT32_MAX ? INT32_MAX : y2 - y1);
+    return r;
+}
+
+static bool rect_contains(PapayaRect a, PapayaRect b)
+{
+    return a.w > 0 && a.h > 0 &&
+           b.x >= a.x && b.y >= a.y &&
+           (int64_t)b.x + b.w <= (int64_t)a.x + a.w &&
+           (int64_t)b.y + b.h <= (int64_t)a.y + a.h;
+}
+
+static void lru_unlink(PapayaNode* node)
+{
+    PapayaCache* c = &node->cache;
+    if (c->prev) { c->prev->cache.next = c->next; } else { lru_head = c->next; }
+    if (c->next) { c->next->cache.prev = c->prev; } else { lru_tail = c->prev; }
+    c->prev = c->next = 0;
+}
+
+static void lru_push_front(PapayaNode* node)
+{
+    PapayaCache* c = &node->cache;
+    c->prev = 0;
+    c->next = lru_head;
+    if (lru_head) { lru_head->cache.prev = node; } else { lru_tail = node; }
+    lru_head = node;
+}
+
+static void free_cache(PapayaNode* node)
+{
+    PapayaCache* c = &node->cache;
+    if (!c->data) {
+        return;
+    }
+
+    lru_unlink(node);
+    free(c->data);
+    size_t size = (size_t)c->channels * c->w * c->h;
+    cache_usage -= size;
+    papaya_mem_add(PapayaMem_Caches, -(int64_t)size);
+    c->data = 0;
+    c->w = c->h = 0;
+}
+
+/*
+    Evicts least recently used caches until size more bytes fit in both the
+    cache budget and the memory budget, then pyramids, which are slower to
+    rebuild, until they fit in the memory budget. Caches and pyramids used by
+    the current evaluation are kept even if over budget. Returns the number of
+    bytes freed.
+*/
+static size_t reserve_cache(size_t size)
+{
+    size_t before = 0;
+    for (int32_t i = 0; i < PAPAYA_MEM_FIRST_GPU; i++) {
+        before += papaya_mem_usage(i);
+    }
+
+    while (lru_tail && lru_tail->cache.last_used != eval_stamp &&
+           (cache_usage + size > cache_budget || over_memory_budget(size))) {
+        free_cache(lru_tail);
+    }
+    while (over_memory_budget(size)) {
+        PapayaPyramid* p = papaya_pyramid_oldest();
+        if (!p || p->last_used == eval_stamp) {
+            break;
+        }
+        papaya_pyramid_destroy(p);
+    }
+
+    size_t after = 0;
+    for (int32_t i = 0; i < PAPAYA_MEM_FIRST_GPU; i++) {
+        after += papaya_mem_usage(i);
+    }
+    return before > after ? before - after : 0;
+}
+
+/*
+    Evaluation runs a plan compiled from the graph upstream of the evaluated
+    node: the nodes it needs in topological order, inputs first, and whether
+    their color is needed or only their alpha. Plans only depend on the
+    topology, so they are kept until a connection changes.
+
+    Only the evaluated node keeps its output, in its cache. Upstream nodes that
+    are recomputed write to scratch buffers instead, and a buffer is handed to
+    another node once all consumers of the first one have run, so memory grows
+    with the width of the graph rather than with its number of nodes. Upstream
+    nodes with up-to-date caches, e.g. from having been evaluated themselves,
+    are read from their caches and not recomputed.
+
+    A node whose only consumer works on it in place is fused into the pass of
+    the consumer. The pass computes the whole chain row by row in the output
+    buffer of its last node, so the rows of the nodes before it never leave
+    the cache, and they need no buffers of their own. Blurs aren't fused, as
+    they would blur their halo again for every row.
+
+    Passes run in waves, and the passes of a wave don't depend on each other,
+    so independent branches (e.g. the image and mask inputs of a node) run
+    concurrently alongside the tiles within each node.
+*/
+struct PlanStep {
+    PapayaNode* node;
+    int32_t in[PAPAYA_MAX_NODE_SLOTS]; // Step of every input slot. -1 if not read.
+    int32_t channels;  // Needed of the output. 4 for RGBA, 1 for alpha only.
+    int32_t fused_into; // Consumer whose pass computes this step. -1 if none.
+    int32_t wave;      // Of the pass. Higher than those of all inputs.
+    int32_t last_wave; // Highest wave among the consumers
+};
+
+struct PapayaPlan {
+    PlanStep* steps; // The evaluated node is the last step
+    int32_t num_steps, capacity;
+    int32_t num_waves;
+    uint64_t topology; // Value of topology_version the plan was compiled for
+};
+
+static uint64_t topology_version = 1; // Incremented when connections change
+static uint64_t walk_id; // Incremented by every walk of the graph
+
+/*
+    State of a step for the evaluation in progress.
+*/
+struct EvalStep {
+    PapayaRect d; // Tile-aligned region to recompute
+    EvalBuffers b;
+    bool used;   // Read by a step that is recomputed
+    bool cached; // Read from the node's cache, which is up to date
+    int32_t head; // First step of the pass that ends with this step
+};
+
+struct TileJob {
+    int32_t step; // Last step of the pass
+    PapayaRect r;
+};
+
+/*
+    Linear allocator for the scratch memory of an evaluation, reset at the start
+    of every evaluation. Allocations that don't fit are served from the heap,
+    and the next reset grows the arena to the high-water mark, so steady-state
+    evaluation doesn't allocate.
+*/
+struct ScratchBlock {
+    ScratchBlock* next;
+    size_t size; // Including the header
+    // Padded to 16 bytes, data goes after this
+};
+
+struct EvalScratch {
+    uint8_t* base;
+    size_t size, used, high_water;
+    ScratchBlock* overflow;
+};
+
+static EvalScratch scratch;
+
+static void* scratch_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    size_t offset = scratch.used;
+    scratch.used += size;
+    if (scratch.used > scratch.high_water) { scratch.high_water = scratch.used; }
+
+    if (offset + size <= scratch.size) {
+        return scratch.base + offset;
+    }
+
+    ScratchBlock* b = (ScratchBlock*) malloc(16 + size);
+    b->size = 16 + size;
+    papaya_mem_add(PapayaMem_Scratch, (int64_t)b->size);
+    b->next = scratch.overflow;
+    scratch.overflow = b;
+    return (uint8_t*)b + 16;
+}
+
+static void scratch_reset()
+{
+    if (scratch.overflow) {
+        while (scratch.overflow) {
+            ScratchBlock* b = scratch.overflow;
+            ScratchBlock* next = b->next;
+            papaya_mem_add(PapayaMem_Scratch, -(int64_t)b->size);
+            free(b);
+            scratch.overflow = next;
+        }
+        free(scratch.base);
+        papaya_mem_add(PapayaMem_Scratch, (int64_t)scratch.high_water -
+                                          (int64_t)scratch.size);
+        scratch.size = scratch.high_water;
+        scratch.base = (uint8_t*) malloc(scratch.size);
+    }
+    scratch.used = 0;
+}
+
+/*
+    State of the evaluation in progress. Evaluations must not run concurrently.
+*/
+struct EvalContext {
+    PapayaPlan* plan;
+    EvalStep* steps; // Allocated from the scratch arena, one per plan step
+    TileJob* jobs;
+    int w, h; // Size of the level
+    int32_t level;
+};
+
+static EvalContext ctx;
+
+static PapayaRect align_to_tiles(PapayaRect r, PapayaRect frame)
+{
+    if (r.w <= 0 || r.h <= 0) {
+        return PapayaRect();
+    }
+
+    int32_t x1 = r.x / PAPAYA_TILE_SIZE * PAPAYA_TILE_SIZE;
+    int32_t y1 = r.y / PAPAYA_TILE_SIZE * PAPAYA_TILE_SIZE;
+    int64_t x2 = (int64_t)r.x + r.w + PAPAYA_TILE_SIZE - 1;
+    int64_t y2 = (int64_t)r.y + r.h + PAPAYA_TILE_SIZE - 1;
+    x2 -= x2 % PAPAYA_TILE_SIZE;
+    y2 -= y2 % PAPAYA_TILE_SIZE;
+
+    PapayaRect t = { x1, y1, (int32_t)(x2 - x1), (int32_t)(y2 - y1) };
+    return intersect_rects(t, frame);
+}
+
+/*
+    Scales a full-resolution rect down to the given pyramid level, rounding
+    outwards so that every pixel touched by r is covered.
+*/
+static PapayaRect scale_to_level(PapayaRect r, int32_t level)
+{
+    if (level == 0 || r.w <= 0 || r.h <= 0) {
+        return r;
+    }
+
+    int64_t round = ((int64_t)1 << level) - 1;
+    int64_t x1 = (int64_t)r.x >> level;
+    int64_t y1 = (int64_t)r.y >> level;
+    int64_t x2 = ((int64_t)r.x + r.w + round) >> level;
+    int64_t y2 = ((int64_t)r.y + r.h + round) >> level;
+
+    PapayaRect s = { (int32_t)x1, (int32_t)y1,
+                     (int32_t)(x2 - x1), (int32_t)(y2 - y1) };
+    return s;
+}
+
+/*
+    Inverse of scale_to_level. Covers every full-resolution pixel that maps to
+    a pixel of r.
+*/
+static PapayaRect scale_from_level(PapayaRect r, int32_t level)
+{
+    int64_t x1 = (int64_t)r.x << level;
+    int64_t y1 = (int64_t)r.y << level;
+    int64_t w = (int64_t)r.w << level;
+    int64_t h = (int64_t)r.h << level;
+
+    PapayaRect s = { (int32_t)x1, (int32_t)y1,
+                     (int32_t)(w > INT32_MAX ? INT32_MAX : w),
+                     (int32_t)(h > INT32_MAX ? INT32_MAX : h) };
+    return s;
+}
+
+/*
+    Appends the node to the plan after the nodes it reads from, and returns its
+    step. Inputs that would close a cycle are left out.
+*/
+static int32_t add_steps(PapayaPlan* p, PapayaNode* node)
+{
+    if (node->walk_id == walk_id) {
+        // Already added, or -1 if the walk is still below it
+        return node->walk_step;
+    }
+    node->walk_id = walk_id;
+    node->walk_step = -1;
+
+    int32_t in[PAPAYA_MAX_NODE_SLOTS];
+    for (int32_t i = 0; i < PAPAYA_MAX_NODE_SLOTS; i++) {
+        PapayaSlot* s = i < node->num_slots ? &node->slots[i] : 0;
+        PapayaSlot* from = s && !s->is_out ? papaya_slot_source(s) : 0;
+        in[i] = from ? add_steps(p, from->node) : -1;
+    }
+
+    if (p->num_steps == p->capacity) {
+        p->capacity = p->capacity ? 2 * p->capacity : 8;
+        p->steps = (PlanStep*) realloc(p->steps,
+                                       p->capacity * sizeof(PlanStep));
+    }
+    PlanStep* step = &p->steps[p->num_steps];
+    memset(step, 0, sizeof(*step));
+    step->node = node;
+    memcpy(step->in, in, sizeof(in));
+    node->walk_step = p->num_steps;
+    return p->num_steps++;
+}
+
+static void compile_plan(PapayaPlan* p, PapayaNode* node)
+{
+    Zone z("Compile plan");
+    p->num_steps = 0;
+    walk_id++;
+    add_steps(p, node);
+
+    // Channels flow from the consumers to their inputs, which come earlier.
+    // Inputs that aren't read for the channels needed are dropped.
+    PlanStep* s = p->steps;
+    int32_t n = p->num_steps;
+    s[n - 1].channels = 4;
+    for (int32_t i = n - 1; i >= 0; i--) {
+        for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+            int32_t ch = input_channels(s[i].node, j, s[i].channels);
+            if (s[i].in[j] < 0 || !ch) {
+                s[i].in[j] = -1;
+                continue;
+            }
+            PlanStep* from = &s[s[i].in[j]];
+            if (ch > from->channels) { from->channels = ch; }
+        }
+    }
+
+    // Removes the steps that aren't needed
+    int32_t count = 0;
+    for (int32_t i = 0; i < n; i++) {
+        s[i].node->walk_step = s[i].channels ? count++ : -1;
+    }
+    for (int32_t i = 0; i < n; i++) {
+        for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+            if (s[i].in[j] >= 0) { s[i].in[j] = s[s[i].in[j]].node->walk_step; }
+        }
+    }
+    for (int32_t i = 0, k = 0; i < n; i++) {
+        if (s[i].channels) { s[k++] = s[i]; }
+    }
+    p->num_steps = n = count;
+
+    // Steps read once, through slot 0 of a node working in place, are fused,
+    // if they can run row by row
+    int32_t* reads = (int32_t*) calloc(n, sizeof(int32_t));
+    for (int32_t i = 0; i < n; i++) {
+        s[i].fused_into = -1;
+        for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+            if (s[i].in[j] >= 0) { reads[s[i].in[j]]++; }
+        }
+    }
+    for (int32_t i = 0; i < n; i++) {
+        int32_t k = s[i].in[0];
+        if (k >= 0 && reads[k] == 1 && works_in_place(s[i].node) &&
+            runs_by_rows(s[k].node)) {
+            s[k].fused_into = i;
+        }
+    }
+    free(reads);
+
+    p->num_waves = 0;
+    for (int32_t i = 0; i < n; i++) {
+        s[i].wave = 1;
+        for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+            int32_t k = s[i].in[j];
+            if (k >= 0 && s[k].wave >= s[i].wave) { s[i].wave = s[k].wave + 1; }
+        }
+        if (s[i].wave > p->num_waves) { p->num_waves = s[i].wave; }
+    }
+
+    // Fused steps run with the last step of their pass, so their inputs have
+    // to be kept until then
+    for (int32_t i = n - 1; i >= 0; i--) {
+        if (s[i].fused_into >= 0) { s[i].wave = s[s[i].fused_into].wave; }
+    }
+    for (int32_t i = 0; i < n; i++) {
+        s[i].last_wave = 0;
+        for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+            int32_t k = s[i].in[j];
+            if (k >= 0 && s[i].wave > s[k].last_wave) {
+                s[k].last_wave = s[i].wave;
+            }
+        }
+    }
+    p->topology = topology_version;
+}
+
+static bool cache_matches(const PapayaCache* c, int32_t channels)
+{
+    return c->data && c->w == ctx.w && c->h == ctx.h &&
+           c->level == ctx.level && c->channels >= channels;
+}
+
+/*
+    Brings the cache of the evaluated node to the size of the evaluation, and
+    returns the region of it to recompute.
+*/
+static PapayaRect prepare_root_cache(PapayaNode* node)
+{
+    PapayaRect frame = { 0, 0, ctx.w, ctx.h };
+    PapayaCache* c = &node->cache;
+    PapayaRect d;
+
+    if (!cache_matches(c, 4)) {
+        free_cache(node);
+        size_t size = 4 * (size_t)ctx.w * ctx.h;
+        reserve_cache(size);
+        c->data = (uint8_t*) malloc(size);
+        c->w = ctx.w;
+        c->h = ctx.h;
+        c->channels = 4;
+        c->level = ctx.level;
+        cache_usage += size;
+        papaya_mem_add(PapayaMem_Caches, (int64_t)size);
+        d = frame;
+    } else {
+        lru_unlink(node);
+        PapayaRect r = scale_to_level(node->dirty, ctx.level);
+        d = align_to_tiles(intersect_rects(r, frame), frame);
+    }
+    lru_push_front(node);
+    c->last_used = eval_stamp;
+    c->generation = node->generation;
+    node->dirty = PapayaRect();
+    return d;
+}
+
+/*
+    Marks the steps to recompute and the regions to recompute of them, from
+    the region d of the evaluated node. Every region covers what the consumers
+    read of it for their own regions, see input_region.
+*/
+static void plan_regions(PapayaRect d)
+{
+    PapayaRect frame = { 0, 0, ctx.w, ctx.h };
+    PlanStep* ps = ctx.plan->steps;
+    EvalStep* es = ctx.steps;
+    int32_t n = ctx.plan->num_steps;
+
+    es[n - 1].d = d;
+    es[n - 1].used = true;
+    for (int32_t i = n - 1; i >= 0; i--) {
+        EvalStep* e = &es[i];
+        if (!e->used || e->cached) {
+            continue;
+        }
+
+        PapayaNode* node = ps[i].node;
+        if (i < n - 1 && papaya_is_dirty(node)) {
+            // The node is brought up to date in scratch memory only, so a
+            // cache it has left from earlier evaluations is now stale
+            node->dirty = PapayaRect();
+            free_cache(node);
+        }
+
+        for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+            int32_t k = ps[i].in[j];
+            if (k < 0) {
+                continue;
+            }
+            es[k].used = true;
+            if (!es[k].cached) {
+                PapayaRect r = input_region(node, j, e->d, ctx.level);
+                es[k].d = union_rects(es[k].d, align_to_tiles(r, frame));
+            }
+        }
+    }
+}
+
+/*
+    Adds r to the dirty region of the node, and the parts of their outputs
+    that depend on it to those of all its consumers, see output_region.
+    changed is false if the output is stale without having changed, e.g. when
+    an evaluation leaves parts of it for later.
+*/
+static void spread_dirty(PapayaNode* node, PapayaRect r, bool changed)
+{
+    // Stopping at nodes that already contain r also terminates on cycles
+    if (r.w <= 0 || r.h <= 0 || rect_contains(node->dirty, r)) {
+        return;
+    }
+
+    node->dirty = union_rects(node->dirty, r);
+    if (changed) { node->generation++; }
+
+    // Propagate to all consumers
+    PapayaGraph* g = node->graph;
+    for (int i = 0; i < node->num_slots; i++) {
+        PapayaSlot* s = &node->slots[i];
+        if (!s->is_out) {
+            continue;
+        }
+        for (int32_t l = s->link; l >= 0; l = g->links[l].next) {
+            PapayaNode* to = g->slots[g->links[l].to].node;
+            spread_dirty(to, output_region(to, r), changed);
+        }
+    }
+}
+
+/*
+    Runs the pass ending with the given step over the rect r. Passes of more
+    than one step go row by row, from the first step to the last.
+*/
+static void run_pass(int32_t step, PapayaRect r)
+{
+    const PlanStep* ps = ctx.plan->steps;
+    const EvalStep* es = ctx.steps;
+    int32_t head = es[step].head;
+    if (head == step) {
+        evaluate_rect(ps[step].node, r, &es[step].b);
+        return;
+    }
+
+    Zone z("Fused nodes");
+    for (int32_t y = r.y; y < r.y + r.h; y++) {
+        PapayaRect row = { r.x, y, r.w, 1 };
+        compute_rect(ps[head].node, row, &es[head].b);
+        for (int32_t i = head; i != step; ) {
+            i = ps[i].fused_into;
+            apply_node(ps[i].node, row, &es[i].b);
+        }
+    }
+}
+
+static void run_tile_job(void* data, int32_t index)
+{
+    TileJob* t = &ctx.jobs[index];
+    run_pass(t->step, t->r);
+}
+
+/*
+    Scratch buffers for the outputs of upstream steps, each held by one step at
+    a time
+*/
+struct StepBuffers {
+    uint8_t** data;
+    size_t* size;
+    int32_t* holder; // Step holding the buffer. -1 if free.
+    int32_t count;
+};
+
+static uint8_t* acquire_buffer(StepBuffers* bufs, int32_t step, size_t size)
+{
+    for (int32_t i = 0; i < bufs->count; i++) {
+        if (bufs->holder[i] < 0 && bufs->size[i] >= size) {
+            bufs->holder[i] = step;
+            return bufs->data[i];
+        }
+    }
+    int32_t i = bufs->count++;
+    bufs->data[i] = (uint8_t*) scratch_alloc(size);
+    bufs->size[i] = size;
+    bufs->holder[i] = step;
+    return bufs->data[i];
+}
+
+/*
+    Output of the last step of a pass, which the whole pass writes to
+*/
+typedef uint8_t* (*StepOutputFn)(int32_t step, void* data);
+
+/*
+    Full-frame outputs: the cache of the evaluated node, and scratch buffers
+    for the others. Buffers of steps whose consumers have all run in earlier
+    waves are handed on.
+*/
+static uint8_t* frame_output(int32_t step, void* data)
+{
+    StepBuffers* bufs = (StepBuffers*)data;
+    const PlanStep* ps = ctx.plan->steps;
+    if (step == ctx.plan->num_steps - 1) {
+        return ps[step].node->cache.data;
+    }
+    for (int32_t i = 0; i < bufs->count; i++) {
+        int32_t h = bufs->holder[i];
+        if (h >= 0 && ps[h].last_wave < ps[step].wave) { bufs->holder[i] = -1; }
+    }
+    size_t size = (size_t)ps[step].channels * ctx.w * ctx.h;
+    return acquire_buffer(bufs, step, size);
+}
+
+/*
+    Sets up the buffers of a step, whose output goes to out
+*/
+static void prepare_step(int32_t step, uint8_t* out)
+{
+    const PlanStep* ps = ctx.plan->steps;
+    EvalStep* e = &ctx.steps[step];
+    e->b.stride = ctx.w;
+    e->b.height = ctx.h;
+    e->b.level = ctx.level;
+    e->b.channels = ps[step].channels;
+    e->b.out = out;
+    for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+        int32_t k = ps[step].in[j];
+        if (k >= 0) {
+            e->b.in[j] = ctx.steps[k].b.out;
+            e->b.in_channels[j] = ctx.steps[k].b.channels;
+        }
+    }
+
+    PapayaNode* node = ps[step].node;
+    if (node->type == PapayaNodeType_Transform) {
+        init_filter_tables();
+    }
+    if (node->type == PapayaNodeType_Levels) {
+        uint8_t* lut = (uint8_t*) scratch_alloc(LEVELS_LUT_SIZE);
+        compile_levels(&node->params.levels, lut);
+        e->b.lut = lut;
+    }
+    if (node->type == PapayaNodeType_Bitmap && ctx.level > 0) {
+        BitmapNode* b = &node->params.bitmap;
+        papaya_pyramid_update(&b->pyramid, &b->image, ctx.level);
+    }
+}
+
+/*
+    Steps are fused into the pass of their consumer unless their input has
+    to be read from its cache
+*/
+static void find_pass_heads()
+{
+    const PlanStep* ps = ctx.plan->steps;
+    EvalStep* es = ctx.steps;
+    for (int32_t i = 0; i < ctx.plan->num_steps; i++) {
+        int32_t k = ps[i].in[0];
+        es[i].head = i;
+        if (k >= 0 && ps[k].fused_into == i && !es[k].cached) {
+            es[i].head = es[k].head;
+        }
+    }
+}
+
+// True if the step is computed by the pass of a later step
+static bool is_fused(int32_t step)
+{
+    int32_t next = ctx.plan->steps[step].fused_into;
+    return next >= 0 && ctx.steps[next].head == ctx.steps[step].head;
+}
+
+/*
+    Recomputes the region d of every step that is used and not cached, in
+    tiles, writing the passes to the buffers given by output
+*/
+static void execute_plan(StepOutputFn output, void* data)
+{
+    PapayaRect frame = { 0, 0, ctx.w, ctx.h };
+    PlanStep* ps = ctx.plan->steps;
+    EvalStep* es = ctx.steps;
+    int32_t n = ctx.plan->num_steps;
+
+    int32_t max_tiles = 0;
+    for (int32_t i = 0; i < n; i++) {
+        EvalStep* e = &es[i];
+        if (e->used && !e->cached) {
+            max_tiles += ((e->d.w + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE) *
+                         ((e->d.h + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE);
+        }
+    }
+    if (max_tiles == 0) {
+        return;
+    }
+    find_pass_heads();
+
+    Zone z("Execute plan");
+    ctx.jobs = (TileJob*) scratch_alloc(max_tiles * sizeof(TileJob));
+    for (int32_t wave = 1; wave <= ctx.plan->num_waves; wave++) {
+        int32_t count = 0;
+        for (int32_t i = 0; i < n; i++) {
+            EvalStep* e = &es[i];
+            if (ps[i].wave != wave || !e->used || e->cached ||
+                e->d.w <= 0 || e->d.h <= 0 || is_fused(i)) {
+                // Not recomputed, or computed by a later step of its pass
+                continue;
+            }
+
+            uint8_t* out = output(i, data);
+            for (int32_t k = e->head; ; k = ps[k].fused_into) {
+                prepare_step(k, out);
+                if (k == i) { break; }
+            }
+
+            for (int32_t y = e->d.y; y < e->d.y + e->d.h;
+                 y += PAPAYA_TILE_SIZE) {
+                for (int32_t x = e->d.x; x < e->d.x + e->d.w;
+                     x += PAPAYA_TILE_SIZE) {
+                    PapayaRect t = { x, y, PAPAYA_TILE_SIZE, PAPAYA_TILE_SIZE };
+                    ctx.jobs[count].step = i;
+                    ctx.jobs[count].r = intersect_rects(t, frame);
+                    count++;
+                }
+            }
+        }
+        papaya_parallel_for(count, run_tile_job, 0);
+    }
+}
+
+/*
+    Marks the upstream steps whose caches are up to date, to be read instead
+    of recomputed. They are stamped before the cache of the evaluated node is
+    allocated, so that making room for it doesn't evict them.
+*/
+static void find_cached_steps()
+{
+    const PapayaPlan* p = ctx.plan;
+    for (int32_t i = 0; i < p->num_steps - 1; i++) {
+        PapayaNode* n = p->steps[i].node;
+        PapayaCache* c = &n->cache;
+        if (cache_matches(c, p->steps[i].channels) && !papaya_is_dirty(n)) {
+            EvalStep* e = &ctx.steps[i];
+            e->cached = true;
+            e->b.out = c->data;
+            e->b.channels = c->channels;
+            c->last_used = eval_stamp;
+            lru_unlink(n);
+            lru_push_front(n);
+        }
+    }
+}
+
+/*
+    Marks the pyramids that the evaluation reads, so that making room for its
+    cache doesn't drop them
+*/
+static void stamp_pyramids()
+{
+    if (ctx.level == 0) {
+        return;
+    }
+    for (int32_t i = 0; i < ctx.plan->num_steps; i++) {
+        PapayaNode* n = ctx.plan->steps[i].node;
+        if (n->type == PapayaNodeType_Bitmap) {
+            n->params.bitmap.pyramid.last_used = eval_stamp;
+        }
+    }
+}
+
+// Plan of the node, compiled if the topology has changed since
+static PapayaPlan* get_plan(PapayaNode* node)
+{
+    PapayaPlan* p = node->plan;
+    if (!p) {
+        p = node->plan = (PapayaPlan*) calloc(1, sizeof(PapayaPlan));
+    }
+    if (p->topology != topology_version) {
+        compile_plan(p, node);
+    }
+    return p;
+}
+
+void papaya_evaluate_node(PapayaNode* node, int w, int h, uint8_t* out)
+{
+    const uint8_t* img = papaya_evaluate_cached(node, w, h, 0);
+    memcpy(out, img, 4 * (size_t)w * h);
+}
+
+const uint8_t* papaya_evaluate_cached(PapayaNode* node, int w, int h,
+                                      PapayaRect* updated)
+{
+    return papaya_evaluate_level(node, w, h, 0, updated);
+}
+
+const uint8_t* papaya_evaluate_level(PapayaNode* node, int w, int h, int level,
+                                     PapayaRect* updated)
+{
+    return papaya_evaluate_partial(node, w, h, level, INT32_MAX, updated);
+}
+
+const uint8_t* papaya_evaluate_partial(PapayaNode* node, int w, int h,
+                                       int level, int max_rows,
+                                       PapayaRect* updated)
+{
+    Zone z("Evaluate");
+    if (level < 0) { level = 0; }
+    if (level >= PAPAYA_MAX_LEVELS) { level = PAPAYA_MAX_LEVELS - 1; }
+
+    PapayaPlan* p = get_plan(node);
+    eval_stamp++;
+    scratch_reset();
+    ctx.plan = p;
+    ctx.w = papaya_level_size(w, level);
+    ctx.h = papaya_level_size(h, level);
+    ctx.level = level;
+    ctx.steps = (EvalStep*) scratch_alloc(p->num_steps * sizeof(EvalStep));
+    memset(ctx.steps, 0, p->num_steps * sizeof(EvalStep));
+    find_cached_steps();
+    stamp_pyramids();
+
+    PapayaRect d = prepare_root_cache(node);
+    if (max_rows < INT32_MAX && d.w > 0 && d.h > 0) {
+        // The rows below the limit stay stale, for later evaluations
+        int64_t end = d.y + (int64_t)max_rows * PAPAYA_TILE_SIZE;
+        if (end < (int64_t)d.y + d.h) {
+            PapayaRect rest = { d.x, (int32_t)end, d.w,
+                                (int32_t)(d.y + d.h - end) };
+            d.h = (int32_t)(end - d.y);
+            spread_dirty(node, scale_from_level(rest, level), false);
+        }
+    }
+    plan_regions(d);
+
+    int32_t n = p->num_steps;
+    StepBuffers bufs = {};
+    bufs.data = (uint8_t**) scratch_alloc(n * sizeof(uint8_t*));
+    bufs.size = (size_t*) scratch_alloc(n * sizeof(size_t));
+    bufs.holder = (int32_t*) scratch_alloc(n * sizeof(int32_t));
+    execute_plan(frame_output, &bufs);
+
+    if (updated) { *updated = d; }
+    return node->cache.data;
+}
+
+// -----------------------------------------------------------------------------
+
+/*
+    Rows y1 to y2 of the output of a step, for streaming evaluation. Windows
+    are always full rows wide.
+*/
+struct StreamWindow {
+    uint8_t* data;
+    int32_t y1, y2;
+    size_t capacity; // Of data, in bytes
+};
+
+struct PapayaStream {
+    PapayaNode* node;
+    PapayaNode* source;
+    PapayaRowsFn read;
+    void* read_data;
+    int w, h;
+    int32_t strip_rows;
+    int32_t strip, num_strips; // Next strip to evaluate
+    int32_t source_step; // -1 if the node doesn't read the source
+    int32_t read_y; // Rows of the source read so far
+    int32_t* last_use; // Last strip reading each row of tiles of the source
+    uint8_t* feed; // Rows of a tile, as written by read
+    EvalStep* steps;
+    StreamWindow* windows; // Per step. Unused by cached and fused steps.
+    PapayaRect* need; // Per step, of the strip being planned
+};
+
+/*
+    Buffer holding the rows of the window at their place in a full frame of
+    stride pixels, as the kernels expect. Only the rows of the window may be
+    accessed through it.
+*/
+static uint8_t* window_view(const StreamWindow* win, int32_t channels,
+                            int32_t stride)
+{
+    if (!win->data) {
+        return 0;
+    }
+    return (uint8_t*)((uintptr_t)win->data -
+                      (uintptr_t)channels * stride * win->y1);
+}
+
+/*
+    Moves the window down to cover the rows of need, keeping the rows it
+    already has that are still needed, and returns the rows to compute. The
+    pixels are only moved if move is set, otherwise just the rows are
+    tracked, to plan ahead.
+*/
+static PapayaRect slide_window(StreamWindow* win, PapayaRect need,
+                               int32_t channels, bool move)
+{
+    int32_t y1 = need.y, y2 = need.y + need.h;
+    int32_t from = y1;
+    if (y1 >= win->y1 && y1 <= win->y2) {
+        // Rows from win->y2 on are new. A need that ends within the window
+        // keeps the rows down to its end, which later strips read.
+        from = win->y2;
+        if (y2 < win->y2) { y2 = win->y2; }
+    }
+
+    size_t row = (size_t)channels * ctx.w;
+    if (move) {
+        if (from > y1) {
+            memmove(win->data, win->data + row * (y1 - win->y1),
+                    row * (from - y1));
+        }
+        size_t size = row * (y2 - y1);
+        if (size > win->capacity) {
+            win->data = (uint8_t*) realloc(win->data, size);
+            papaya_mem_add(PapayaMem_Scratch,
+                           (int64_t)size - (int64_t)win->capacity);
+            win->capacity = size;
+        }
+    }
+    win->y1 = y1;
+    win->y2 = y2;
+
+    PapayaRect r = { 0, from, ctx.w, y2 - from };
+    return r;
+}
+
+/*
+    Plans the given strip of the node's output like plan_regions, except
+    that steps with windows only recompute the rows their windows lack.
+*/
+static void plan_strip(PapayaStream* s, PapayaRect strip,
+                       StreamWindow* windows, bool move)
+{
+    PapayaRect frame = { 0, 0, ctx.w, ctx.h };
+    const PlanStep* ps = ctx.plan->steps;
+    EvalStep* es = ctx.steps;
+    int32_t n = ctx.plan->num_steps;
+
+    memset(s->need, 0, n * sizeof(PapayaRect));
+    s->need[n - 1] = strip;
+    for (int32_t i = n - 1; i >= 0; i--) {
+        EvalStep* e = &es[i];
+        if (!e->used || e->cached) {
+            continue;
+        }
+        e->d = s->need[i];
+        if (!is_fused(i) && e->d.h > 0) {
+            e->d = slide_window(&windows[i], e->d, ps[i].channels, move);
+        }
+        if (e->d.h <= 0) {
+            e->d = PapayaRect();
+            continue;
+        }
+
+        PapayaNode* node = ps[i].node;
+        for (int32_t j = 0; j < PAPAYA_MAX_NODE_SLOTS; j++) {
+            int32_t k = ps[i].in[j];
+            if (k < 0 || es[k].cached) {
+                continue;
+            }
+            PapayaRect r = align_to_tiles(input_region(node, j, e->d, 0),
+                                          frame);
+            if (r.h > 0) {
+                // Windows hold full rows
+                r.x = 0;
+                r.w = ctx.w;
+                s->need[k] = union_rects(s->need[k], r);
+            }
+        }
+    }
+}
+
+static PapayaRect strip_rect(const PapayaStream* s, int32_t strip)
+{
+    int32_t y = strip * s->strip_rows;
+    int32_t rows = s->h - y < s->strip_rows ? s->h - y : s->strip_rows;
+    PapayaRect r = { 0, y, s->w, rows };
+    return r;
+}
+
+static uint8_t* stream_output(int32_t step, void* data)
+{
+    PapayaStream* s = (PapayaStream*)data;
+    return window_view(&s->windows[step], ctx.plan->steps[step].channels,
+                       ctx.w);
+}
+
+/*
+    Reads the rows of the source up to the end of the region the strip
+    computes of it, and keeps those that this or a later strip reads.
+    Tiles no longer read are released first.
+*/
+static void feed_source(PapayaStream* s)
+{
+    PapayaTiles* img = &s->source->params.bitmap.image;
+    int32_t tile_rows = (s->h + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE;
+    const int32_t per_tile = PAPAYA_TILE_SIZE / PAPAYA_IMAGE_TILE_SIZE;
+    for (int32_t t = 0; t < tile_rows; t++) {
+        if (s->last_use[t] >= s->strip || t * PAPAYA_TILE_SIZE >= s->read_y) {
+            continue;
+        }
+        int32_t y_end = (t + 1) * per_tile;
+        if (y_end > img->tiles_y) { y_end = img->tiles_y; }
+        for (int32_t i = t * per_tile * img->tiles_x;
+             i < y_end * img->tiles_x; i++) {
+            PapayaTile* old = papaya_tiles_swap(img, i, 0);
+            if (old) { papaya_tile_release(old); }
+        }
+    }
+
+    PapayaRect d = ctx.steps[s->source_step].d;
+    while (d.h > 0 && s->read_y < d.y + d.h) {
+        int32_t y = s->read_y;
+        int32_t rows = s->h - y < PAPAYA_TILE_SIZE ? s->h - y
+                                                  : PAPAYA_TILE_SIZE;
+        s->read(s->read_data, y, rows, s->feed);
+        if (s->last_use[y / PAPAYA_TILE_SIZE] >= s->strip) {
+            PapayaRect r = { 0, y, s->w, rows };
+            papaya_tiles_write_rect(img, r, s->feed, s->w);
+        }
+        s->read_y += rows;
+    }
+}
+
+PapayaStream* papaya_stream_begin(PapayaNode* node, int w, int h,
+                                  PapayaNode* source, PapayaRowsFn read,
+                                  void* read_data)
+{
+    PapayaStream* s = (PapayaStream*) calloc(1, sizeof(PapayaStream));
+    s->node = node;
+    s->source = source;
+    s->read = read;
+    s->read_data = read_data;
+    s->w = w;
+    s->h = h;
+    s->source_step = -1;
+
+    BitmapNode* b = &source->params.bitmap;
+    papaya_tiles_destroy(&b->image);
+    papaya_pyramid_destroy(&b->pyramid);
+    papaya_tiles_init(&b->image, 0, w, h);
+    papaya_touch_node(source);
+    if (w <= 0 || h <= 0) {
+        return s;
+    }
+
+    PapayaPlan* p = get_plan(node);
+    int32_t n = p->num_steps;
+    eval_stamp++;
+    scratch_reset();
+    ctx.plan = p;
+    ctx.w = w;
+    ctx.h = h;
+    ctx.level = 0;
+    s->steps = (EvalStep*) calloc(n, sizeof(EvalStep));
+    s->windows = (StreamWindow*) calloc(n, sizeof(StreamWindow));
+    s->need = (PapayaRect*) malloc(n * sizeof(PapayaRect));
+    ctx.steps = s->steps;
+    find_cached_steps();
+
+    // Marks the steps that are used, dropping their stale caches
+    PapayaRect frame = { 0, 0, w, h };
+    plan_regions(frame);
+    free_cache(node);
+    node->dirty = PapayaRect();
+    find_pass_heads();
+    for (int32_t i = 0; i < n; i++) {
+        if (p->steps[i].node == source && s->steps[i].used) {
+            s->source_step = i;
+        }
+    }
+
+    // Enough tiles for every thread to have work, in strips of a few rows
+    int32_t tiles_x = (w + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE;
+    int32_t rows = (2 * papaya_jobs_num_threads() + tiles_x - 1) / tiles_x;
+    rows = rows < 1 ? 1 : rows > 8 ? 8 : rows;
+    s->strip_rows = rows * PAPAYA_TILE_SIZE;
+    s->num_strips = (h + s->strip_rows - 1) / s->strip_rows;
+
+    // Plans all strips ahead, for the last strip to read each source row
+    int32_t tile_rows = (h + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE;
+    s->last_use = (int32_t*) malloc(tile_rows * sizeof(int32_t));
+    for (int32_t t = 0; t < tile_rows; t++) { s->last_use[t] = -1; }
+    StreamWindow* plan = (StreamWindow*) calloc(n, sizeof(StreamWindow));
+    for (int32_t i = 0; i < s->num_strips && s->source_step >= 0; i++) {
+        plan_strip(s, strip_rect(s, i), plan, false);
+        PapayaRect d = s->steps[s->source_step].d;
+        for (int32_t y = d.y; y < d.y + d.h; y += PAPAYA_TILE_SIZE) {
+            s->last_use[y / PAPAYA_TILE_SIZE] = i;
+        }
+    }
+    free(plan);
+    s->feed = (uint8_t*) malloc(4 * (size_t)w * PAPAYA_TILE_SIZE);
+    return s;
+}
+
+int32_t papaya_stream_next(PapayaStream* s, const uint8_t** pixels,
+                           int32_t* rows)
+{
+    if (s->strip >= s->num_strips) {
+        return -1;
+    }
+
+    Zone z("Evaluate strip");
+    scratch_reset();
+    ctx.plan = s->node->plan;
+    ctx.steps = s->steps;
+    ctx.w = s->w;
+    ctx.h = s->h;
+    ctx.level = 0;
+
+    PapayaRect strip = strip_rect(s, s->strip);
+    plan_strip(s, strip, s->windows, true);
+    if (s->source_step >= 0) {
+        feed_source(s);
+    }
+
+    // Steps that compute nothing this time are still read through their
+    // windows, which may have moved
+    const PlanStep* ps = ctx.plan->steps;
+    for (int32_t i = 0; i < ctx.plan->num_steps; i++) {
+        EvalStep* e = &s->steps[i];
+        if (e->used && !e->cached && !is_fused(i)) {
+            e->b.out = window_view(&s->windows[i], ps[i].channels, s->w);
+            e->b.channels = ps[i].channels;
+        }
+    }
+    execute_plan(stream_output, s);
+    s->strip++;
+
+    *pixels = s->windows[ctx.plan->num_steps - 1].data;
+    *rows = strip.h;
+    return strip.y;
+}
+
+void papaya_stream_end(PapayaStream* s)
+{
+    if (s->windows) {
+        for (int32_t i = 0; i < s->node->plan->num_steps; i++) {
+            free(s->windows[i].data);
+            papaya_mem_add(PapayaMem_Scratch,
+                           -(int64_t)s->windows[i].capacity);
+        }
+    }
+    free(s->windows);
+    free(s->steps);
+    free(s->need);
+    free(s->last_use);
+    free(s->feed);
+
+    BitmapNode* b = &s->source->params.bitmap;
+    papaya_tiles_destroy(&b->image);
+    papaya_tiles_init(&b->image, 0, s->w, s->h);
+    papaya_touch_node(s->source);
+    free(s);
+}
+
+void papaya_mark_dirty(PapayaNode* node, PapayaRect r)
+{
+    spread_dirty(node, r, true);
+}
+
+bool papaya_is_dirty(PapayaNode* node)
+{
+    return node->dirty.w > 0 && node->dirty.h > 0;
+}
+
+struct StatsJob {
+    const uint8_t* img;
+    int32_t w, h, step;
+    int32_t rows; // Per block
+    uint32_t (*hists)[4 * 256]; // Per block
+};
+
+static void stats_block(void* data, int32_t index)
+{
+    StatsJob* j = (StatsJob*)data;
+    uint32_t* hist = j->hists[index];
+    memset(hist, 0, sizeof(j->hists[index]));
+    int32_t y_end = (index + 1) * j->rows;
+    if (y_end > j->h) { y_end = j->h; }
+    for (int32_t y = index * j->rows; y < y_end; y += j->step) {
+        papaya_histogram(j->img + 4 * (int64_t)y * j->w, j->w, j->step, hist);
+    }
+}
+
+void papaya_image_stats(const uint8_t* img, int w, int h, int step,
+                        PapayaStats* s)
+{
+    memset(s, 0, sizeof(*s));
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+    if (step < 1) { step = 1; }
+
+    // A few blocks per thread, of whole steps, so that the work evens out
+    StatsJob j = { img, w, h, step, 0, 0 };
+    int32_t num_blocks = 4 * papaya_jobs_num_threads();
+    j.rows = (h + num_blocks - 1) / num_blocks;
+    j.rows = (j.rows + step - 1) / step * step;
+    num_blocks = (h + j.rows - 1) / j.rows;
+    j.hists = (uint32_t (*)[4 * 256]) malloc(num_blocks * sizeof(*j.hists));
+    papaya_parallel_for(num_blocks, stats_block, &j);
+
+    for (int32_t b = 0; b < num_blocks; b++) {
+        for (int32_t c = 0; c < 4; c++) {
+            for (int32_t v = 0; v < 256; v++) {
+                s->histogram[c][v] += j.hists[b][256 * c + v];
+            }
+        }
+    }
+    free(j.hists);
+
+    for (int32_t c = 0; c < 4; c++) {
+        uint64_t sum = 0;
+        int32_t lo = -1, hi = -1;
+        for (int32_t v = 0; v < 256; v++) {
+            uint32_t n = s->histogram[c][v];
+            if (!n) { continue; }
+            if (lo < 0) { lo = v; }
+            hi = v;
+            s->count[c] += n;
+            sum += (uint64_t)n * v;
+        }
+        if (s->count[c]) {
+            s->min[c] = (uint8_t)lo;
+            s->max[c] = (uint8_t)hi;
+            s->mean[c] = (float)((double)sum / s->count[c]);
+        }
+    }
+}
+
+bool papaya_node_stats(PapayaNode* node, int w, int h, int level, int max_rows,
+                       PapayaStats* s)
+{
+    PapayaCache* c = &node->cache;
+    if (c->data && c->channels == 4 && c->level <= level &&
+        c->generation == node->generation && !papaya_is_dirty(node)) {
+        int32_t step = 1 << (level - c->level < 30 ? level - c->level : 30);
+        papaya_image_stats(c->data, c->w, c->h, step, s);
+        return true;
+    }
+
+    const uint8_t* img = papaya_evaluate_partial(node, w, h, level, max_rows,
+                                                 0);
+    if (papaya_is_dirty(node)) {
+        return false;
+    }
+    papaya_image_stats(img, papaya_level_size(w, level),
+                       papaya_level_size(h, level), 1, s);
+    return true;
+}
+
+void papaya_touch_node(PapayaNode* node)
+{
+    PapayaRect all = { 0, 0, INT32_MAX, INT32_MAX };
+    papaya_mark_dirty(node, all);
+}
+
+void papaya_set_cache_budget(size_t bytes)
+{
+    cache_budget = bytes;
+    reserve_cache(0);
+}
+
+void papaya_set_memory_budget(size_t bytes)
+{
+    memory_budget = bytes;
+    reserve_cache(0);
+}
+
+size_t papaya_get_memory_budget()
+{
+    return memory_budget;
+}
+
+size_t papaya_trim_memory()
+{
+    return reserve_cache(0);
+}
+
+size_t papaya_get_cache_usage()
+{
+    return cache_usage;
+}
+
+size_t papaya_get_scratch_high_water()
+{
+    return scratch.high_water;
+}
+
+void papaya_set_profiler(PapayaZoneEnterFn enter, PapayaZoneLeaveFn leave)
+{
+    zone_enter = enter;
+    zone_leave = leave;
+}
+
+/*
+    Frees the memory owned by the node. Does not free bitmap images.
+*/
+static void destroy_node(PapayaNode* node)
+{
+    free_cache(node);
+    if (node->type == PapayaNodeType_Bitmap) {
+        papaya_tiles_destroy(&node->params.bitmap.image);
+        papaya_pyramid_destroy(&node->params.bitmap.pyramid);
+    }
+    if (node->plan) {
+        free(node->plan->steps);
+        free(node->plan);
+        node->plan = 0;
+    }
+}
+
+void papaya_graph_init(PapayaGraph* g, int32_t num_nodes, int32_t max_nodes)
+{
+    if (max_nodes < num_nodes) { max_nodes = num_nodes; }
+    memset(g, 0, sizeof(*g));
+    g->nodes = (PapayaNode*) calloc(max_nodes, sizeof(PapayaNode));
+    g->num_nodes = num_nodes;
+    g->max_nodes = max_nodes;
+    g->slots = (PapayaSlot*) calloc((size_t)max_nodes * PAPAYA_MAX_NODE_SLOTS,
+                                    sizeof(PapayaSlot));
+    g->free_link = -1;
+    for (int32_t i = 0; i < max_nodes; i++) {
+        g->nodes[i].graph = g;
+        g->nodes[i].slots = &g->slots[i * PAPAYA_MAX_NODE_SLOTS];
+    }
+    for (int32_t i = 0; i < max_nodes * PAPAYA_MAX_NODE_SLOTS; i++) {
+        g->slots[i].link = -1;
+    }
+}
+
+PapayaNode* papaya_graph_add_node(PapayaGraph* g)
+{
+    return g->num_nodes < g->max_nodes ? &g->nodes[g->num_nodes++] : 0;
+}
+
+void papaya_graph_destroy(PapayaGraph* g)
+{
+    for (int32_t i = 0; i < g->num_nodes; i++) {
+        destroy_node(&g->nodes[i]);
+    }
+    free(g->nodes);
+    free(g->slots);
+    free(g->links);
+    memset(g, 0, sizeof(*g));
+    topology_version++;
+}
+
+void papaya_graph_copy(PapayaGraph* dst, const PapayaGraph* src)
+{
+    papaya_graph_init(dst, src->num_nodes, src->max_nodes);
+    int32_t num_slots = src->max_nodes * PAPAYA_MAX_NODE_SLOTS;
+    memcpy(dst->slots, src->slots, num_slots * sizeof(PapayaSlot));
+    for (int32_t i = 0; i < num_slots; i++) {
+        dst->slots[i].node = &dst->nodes[i / PAPAYA_MAX_NODE_SLOTS];
+    }
+    if (src->max_links) {
+        dst->links = (PapayaLink*) malloc(src->max_links * sizeof(PapayaLink));
+        memcpy(dst->links, src->links, src->num_links * sizeof(PapayaLink));
+    }
+    dst->num_links = src->num_links;
+    dst->max_links = src->max_links;
+    dst->free_link = src->free_link;
+
+    for (int32_t i = 0; i < src->num_nodes; i++) {
+        const PapayaNode* s = &src->nodes[i];
+        PapayaNode* d = &dst->nodes[i];
+        d->type = s->type;
+        d->name = s->name;
+        d->pos_x = s->pos_x;
+        d->pos_y = s->pos_y;
+        d->is_active = s->is_active;
+        d->num_slots = s->num_slots;
+        d->params = s->params;
+        if (s->type == PapayaNodeType_Bitmap) {
+            const BitmapNode* b = &s->params.bitmap;
+            papaya_tiles_copy(&d->params.bitmap.image, &b->image);
+            papaya_pyramid_copy(&d->params.bitmap.pyramid, &b->pyramid);
+        }
+        papaya_touch_node(d);
+    }
+}
+
+PapayaSlot* papaya_slot_source(const PapayaSlot* in)
+{
+    if (in->link < 0) {
+        return 0;
+    }
+    PapayaGraph* g = in->node->graph;
+    return &g->slots[g->links[in->link].from];
+}
+
+/*
+    True if target is the node or lies upstream of it
+*/
+static bool is_upstream(PapayaNode* target, PapayaNode* node)
+{
+    if (node == target) {
+        return true;
+    }
+    if (node->walk_id == walk_id) {
+        return false;
+    }
+    node->walk_id = walk_id;
+
+    for (int i = 0; i < node->num_slots; i++) {
+        PapayaSlot* s = &node->slots[i];
+        PapayaSlot* from = s->is_out ? 0 : papaya_slot_source(s);
+        if (from && is_upstream(target, from->node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool papaya_connect(PapayaSlot* s1, PapayaSlot* s2)
+{
+    PapayaSlot* out, *in;
+    if (s1->is_out) {
+        out = s1;
+        in = s2;
+    } else {
+        out = s2;
+        in = s1;
+    }
+
+    PapayaGraph* g = out->node->graph;
+    if (!in || !out->is_out || in->is_out || in->node->graph != g) {
+        return false;
+    }
+
+    PapayaSlot* prev = papaya_slot_source(in);
+    if (prev && prev->node == out->node) {
+        // in and out are already connected
+        return true;
+    }
+    walk_id++;
+    if (is_upstream(in->node, out->node)) {
+        return false;
+    }
+    if (prev) {
+        papaya_disconnect(prev, in);
+    }
+    papaya_link_slots(out, in);
+    topology_version++;
+    return true;
+}
+
+void papaya_link_slots(PapayaSlot* out, PapayaSlot* in)
+{
+    PapayaGraph* g = out->node->graph;
+    int32_t l = g->free_link;
+    if (l >= 0) {
+        g->free_link = g->links[l].next;
+    } else {
+        if (g->num_links == g->max_links) {
+            g->max_links = g->max_links ? 2 * g->max_links : 16;
+            g->links = (PapayaLink*) realloc(g->links,
+                                             g->max_links * sizeof(PapayaLink));
+        }
+        l = g->num_links++;
+    }
+    g->links[l].from = (int32_t)(out - g->slots);
+    g->links[l].to = (int32_t)(in - g->slots);
+    g->links[l].next = out->link;
+    out->link = l;
+    in->link = l;
+    papaya_touch_node(in->node);
+}
+
+void papaya_disconnect(PapayaSlot* s1, PapayaSlot* s2)
+{
+    PapayaSlot* out, *in;
+    if (s1->is_out) {
+        out = s1;
+        in = s2;
+    } else {
+        out = s2;
+        in = s1;
+    }
+
+    if (!in || in->is_out || papaya_slot_source(in) != out) {
+        return;
+    }
+
+    PapayaGraph* g = out->node->graph;
+    int32_t l = in->link;
+    int32_t* prev = &out->link;
+    while (*prev != l) {
+        prev = &g->links[*prev].next;
+    }
+    *prev = g->links[l].next;
+    g->links[l].from = -1;
+    g->links[l].next = g->free_link;
+    g->free_link = l;
+    in->link = -1;
+
+    papaya_touch_node(in->node);
+    topology_version++;
 }
@@ -9,10 +9,26 @@
 #include <stdlib.h>
 
 struct PapayaNode;
+struct PapayaGraph;
+struct PapayaPlan;
+
+/*
+    Evaluation is split into square tiles of this size. Tiles are the unit of
+    incremental re-evaluation: only tiles overlapping a dirty region are
+    recomputed.
+*/
+#define PAPAYA_TILE_SIZE 256
+
+struct PapayaRect {
+    int32_t x, y, w, h;
+};
 
 enum PapayaNodeType_ {
     PapayaNodeType_Bitmap,
-    PapayaNodeType_InvertColor
+    PapayaNodeType_InvertColor,
+    PapayaNodeType_Transform,
+    PapayaNodeType_Blur,
+    PapayaNodeType_Levels
 };
 
 enum PapayaSlotType_ {
@@ -42,26 +58,193 @@ struct PapayaSlot {
     PapayaSlotPos_ pos; // Enum used to denote commonly used slot positions
 
     /*
-        Slot(s) that this slot is connected to. 0 if not connected.
+        Link of the slot, as an index into the links of the graph. -1 if not
+        connected. An input slot has at most one link. An output slot may have
+        any number of them, chained through PapayaLink::next.
+    */
+    int32_t link;
+};
 
-        If this is an input slot, only one connection may exist, which will be
-        stored in to[0]. If this is an output slot, then multiple connections
-        may exist.
+/*
+    Connection from an output slot to an input slot. Slots are indexed in the
+    slots of the graph.
+*/
+struct PapayaLink {
+    int32_t from, to; // Output and input slot. from is -1 for unused links.
+    int32_t next; // Next link of the same output slot, or next unused link
+};
 
-        TODO: Move to dynamically sized array
-    */
-    PapayaSlot* to[16]; 
+// -----------------------------------------------------------------------------
+
+/*
+    Images stored as a grid of square tiles. Tiles are reference counted and
+    copied on write, so copies of an image (e.g. the states kept by the undo
+    history) share all tiles that haven't changed between them. Fully
+    transparent tiles aren't allocated. Reference counts must only be changed
+    on the main thread. Images whose tiles aren't shared yet, e.g. one being
+    loaded, may be initialized on any thread.
+*/
+#define PAPAYA_IMAGE_TILE_SIZE 64
+
+struct PapayaTile {
+    uint8_t* pixels; // PAPAYA_IMAGE_TILE_SIZE squared RGBA pixels
+    uint64_t id; // Unique for the lifetime of the process. Changes on writes.
+    int32_t refs;
+    int32_t category; // PapayaMem_ the pixels count towards. -1 if not heap.
 };
 
+struct PapayaTiles {
+    PapayaTile** tiles; // Row-major. 0 for transparent tiles.
+    int32_t width, height;
+    int32_t tiles_x, tiles_y;
+    int32_t category; // PapayaMem_ of the tiles allocated for the image
+};
+
+/*
+    Splits the w*h image img into tiles. img may be 0 for a transparent image.
+    The image isn't referenced afterwards.
+*/
+void papaya_tiles_init(PapayaTiles* t, const uint8_t* img, int32_t w,
+                       int32_t h);
+
+/*
+    Like papaya_tiles_init, but the pixels of the tiles are stored in mem, tile
+    after tile, instead of on the heap. mem is meant to be a mapped file, so
+    that only tiles in use stay resident and the rest are paged out by the OS.
+    Transparent tiles are skipped and leave their part of mem untouched. mem
+    must hold papaya_tiles_mapped_size bytes and outlive the tiles. Tiles that
+    are copied on write move to the heap.
+*/
+void papaya_tiles_init_mapped(PapayaTiles* t, const uint8_t* img, int32_t w,
+                              int32_t h, uint8_t* mem);
+size_t papaya_tiles_mapped_size(int32_t w, int32_t h);
+
+void papaya_tiles_destroy(PapayaTiles* t);
+
+/*
+    Makes dst a copy of src that shares all of its tiles
+*/
+void papaya_tiles_copy(PapayaTiles* dst, const PapayaTiles* src);
+
+/*
+    Returns a new tile with one reference and uninitialized pixels. If mem is
+    given, the pixels are stored there instead of on the heap, in which case
+    mem must hold a tile and outlive it.
+*/
+PapayaTile* papaya_tile_alloc(uint8_t* mem = 0);
+
+PapayaTile* papaya_tile_ref(PapayaTile* tile);
+void papaya_tile_release(PapayaTile* tile);
+
+/*
+    Returns the pixels of tile index for writing. The tile is copied first if
+    it is shared, and allocated if it is transparent. Either way the tile gets a
+    new id, so an unchanged id always means unchanged pixels.
+*/
+uint8_t* papaya_tiles_write(PapayaTiles* t, int32_t index);
+
+/*
+    Puts tile at index, handing over the reference held by the caller. Returns
+    the tile that was there before, along with its reference.
+*/
+PapayaTile* papaya_tiles_swap(PapayaTiles* t, int32_t index, PapayaTile* tile);
+
+/*
+    Region of the image covered by tile index, clipped to the image.
+*/
+PapayaRect papaya_tiles_rect(const PapayaTiles* t, int32_t index);
+
+/*
+    Returns the pixel at x, y and writes the number of pixels that follow it
+    contiguously in the same row to n, up to the edge of its tile or of the
+    image. Returns 0 if the pixel lies in a transparent tile. x, y must lie
+    within the image.
+*/
+const uint8_t* papaya_tiles_row(const PapayaTiles* t, int32_t x, int32_t y,
+                                int32_t* n);
+
+/*
+    Copies the rect r of the image to out, whose rows are stride pixels apart.
+    Pixels of r that lie outside the image are transparent.
+*/
+void papaya_tiles_read(const PapayaTiles* t, PapayaRect r, uint8_t* out,
+                       int32_t stride);
+
+/*
+    Copies src, whose rows are stride pixels apart, to the rect r of the image.
+    r must lie within the image.
+*/
+void papaya_tiles_write_rect(PapayaTiles* t, PapayaRect r, const uint8_t* src,
+                             int32_t stride);
+
+/*
+    Downsampled copies of a tiled image, each level half the size of the one
+    before it, rounded up. Level 0 is the image itself and isn't stored. Every
+    tile of a level is made from 2x2 tiles of the level below, and remembers
+    their ids, so updating the pyramid after an edit only rebuilds the tiles
+    that depend on replaced tiles.
+*/
+#define PAPAYA_MAX_LEVELS 16
+
+struct PapayaPyramid {
+    PapayaTiles levels[PAPAYA_MAX_LEVELS]; // levels[0] is unused
+    uint64_t* src_ids[PAPAYA_MAX_LEVELS]; // 4 per tile. 0 for transparent.
+    int32_t num_levels; // Including level 0
+    uint64_t last_used; // Evaluation stamp of the last use
+    PapayaPyramid* prev, *next; // In the list of pyramids with levels
+};
+
+/*
+    Size of a dimension at the given level of a pyramid.
+*/
+int32_t papaya_level_size(int32_t size, int32_t level);
+
+/*
+    Builds the levels of the pyramid, up to and including level, from the
+    current tiles of image. Pixels are averaged in premultiplied alpha.
+*/
+void papaya_pyramid_update(PapayaPyramid* p, const PapayaTiles* image,
+                           int32_t level);
+void papaya_pyramid_destroy(PapayaPyramid* p);
+
+/*
+    Makes dst a copy of src that shares all of its tiles, so that neither needs
+    rebuilding until the images they are updated from diverge
+*/
+void papaya_pyramid_copy(PapayaPyramid* dst, const PapayaPyramid* src);
+
+/*
+    Pyramids form a list, most recently updated first, from which the oldest
+    are dropped under memory pressure. papaya_pyramid_update moves the pyramid
+    to the front, so the list is only changed on the thread that evaluates.
+    Returns 0 if there is none.
+*/
+PapayaPyramid* papaya_pyramid_oldest();
+
 // -----------------------------------------------------------------------------
 
+/*
+    All images passed between nodes, including bitmap images, are RGBA with
+    premultiplied alpha. See papaya_premultiply in kernels.h.
+*/
 struct BitmapNode {
-    uint8_t* image;
-    int64_t width, height;
+    PapayaTiles image;
+    PapayaPyramid pyramid; // Built on demand by evaluations below level 0
 };
 
+/*
+    Copies img into the node, so the caller keeps ownership of it. If mem is
+    given, the tiles are kept there, see papaya_tiles_init_mapped.
+*/
 void init_bitmap_node(PapayaNode* node, const char* name,
-                      uint8_t* img, int w, int h, int c);
+                      const uint8_t* img, int w, int h, int c,
+                      uint8_t* mem = 0);
+
+/*
+    Replaces the image of a bitmap node with a copy of the w*h image img, and
+    marks the node's output as changed.
+*/
+void papaya_set_bitmap(PapayaNode* node, const uint8_t* img, int w, int h);
 
 // -----------------------------------------------------------------------------
 
@@ -74,23 +257,364 @@ void init_invert_color_node(PapayaNode* node, const char* name);
 
 // -----------------------------------------------------------------------------
 
+/*
+    Resampling filters, from the fastest to the sharpest
+*/
+enum PapayaFilter_ {
+    PapayaFilter_Bilinear,
+    PapayaFilter_Bicubic, // Catmull-Rom
+    PapayaFilter_Lanczos, // 3 lobes
+    PapayaFilter_COUNT
+};
+
+/*
+    Rotates the input about the point src, which lands on the point dst of the
+    output, e.g. to rotate an image and crop it to the canvas. Points are in
+    full-resolution pixels, and positive angles turn clockwise on screen. Parts
+    of the output that come from outside the canvas are transparent.
+*/
+struct TransformNode {
+    float angle; // Radians
+    float src_x, src_y;
+    float dst_x, dst_y;
+    uint8_t filter; // PapayaFilter_
+};
+
+void init_transform_node(PapayaNode* node, const char* name);
+
+// -----------------------------------------------------------------------------
+
+/*
+    Gaussian blur. Small radii are convolved with the Gaussian, and larger ones
+    with three box filters of the same variance, which take the same time per
+    pixel at any width. Every tile still reads a halo of input around it, as
+    wide as the blur, so large radii cost more in proportion to the halo.
+    Parts of the input outside the canvas count as transparent.
+*/
+struct BlurNode {
+    float radius; // Three standard deviations, in full-resolution pixels
+};
+
+void init_blur_node(PapayaNode* node, const char* name);
+
+// -----------------------------------------------------------------------------
+
+/*
+    Levels adjustment of the colors. Inputs from black to white are stretched
+    to the outputs from black to white, bent by gamma. Index 0 to 2 of every
+    parameter adjusts red, green and blue, and index 3 all three of them
+    after that. The adjustments are compiled into a lookup table per channel,
+    so any of them costs one lookup per channel, and the node shares its pass
+    with the nodes before it.
+*/
+#define PAPAYA_LEVELS_ALL 3
+
+struct LevelsNode {
+    float in_black[4], in_white[4]; // 0 to 1
+    float gamma[4]; // Above 1 brightens the midtones
+    float out_black[4], out_white[4]; // 0 to 1
+};
+
+void init_levels_node(PapayaNode* node, const char* name);
+
+// -----------------------------------------------------------------------------
+
+/*
+    Cached output of an evaluated node. Only the tiles of it that are stale are
+    recomputed by the next evaluation. Nodes upstream of an evaluated node are
+    recomputed in scratch memory, unless they have an up-to-date cache of their
+    own, which is read instead. Cached nodes form an LRU list that is trimmed
+    to the budget set via papaya_set_cache_budget.
+*/
+struct PapayaCache {
+    uint8_t* data; // Output. 0 if the node is not cached.
+    int32_t w, h;
+    int32_t channels; // Of data. 4 for RGBA, 1 if only the alpha was needed.
+    int32_t level;    // Pyramid level of data, see papaya_evaluate_level
+    uint64_t generation; // Generation of the node that data corresponds to
+    uint64_t last_used;  // Evaluation stamp of the last use
+    PapayaNode* prev, *next; // Neighbours in the LRU list
+};
+
+// -----------------------------------------------------------------------------
+
 struct PapayaNode {
     PapayaNodeType_ type;
     const char* name;
     float pos_x, pos_y;
     uint8_t is_active;
 
-    PapayaSlot* slots;
+    PapayaGraph* graph; // Graph that the node belongs to
+    PapayaSlot* slots;  // In the slots of the graph
     int num_slots;
 
+    /*
+        Region of this node's cached output that is stale because the node's
+        parameters or upstream nodes have changed. Zero width or height means
+        the cache is up to date. Changes propagate downstream, so every
+        consumer of a node is marked dirty along with it.
+    */
+    PapayaRect dirty;
+    uint64_t generation; // Incremented every time the node's output changes
+    PapayaCache cache;
+
+    /*
+        Evaluation order of the nodes upstream of this one, compiled when the
+        node is first evaluated and again after connections change.
+    */
+    PapayaPlan* plan;
+    uint64_t walk_id;  // Internal to walks of the graph
+    int32_t walk_step;
+
     union {
         BitmapNode bitmap;
         InvertColorNode invert_color;
+        TransformNode transform;
+        BlurNode blur;
+        LevelsNode levels;
     } params;
 };
 
 // -----------------------------------------------------------------------------
 
+/*
+    Storage of a node graph. Nodes, slots and links are kept in contiguous
+    arrays and refer to each other by index, so that walks of the graph touch
+    little memory, and copying the topology copies one array. Node i owns the
+    PAPAYA_MAX_NODE_SLOTS slots starting at slot i * PAPAYA_MAX_NODE_SLOTS.
+    Output slots may have any number of links.
+*/
+#define PAPAYA_MAX_NODE_SLOTS 4
+
+struct PapayaGraph {
+    PapayaNode* nodes;
+    int32_t num_nodes, max_nodes;
+    PapayaSlot* slots;
+    PapayaLink* links;
+    int32_t num_links, max_links; // Including unused links
+    int32_t free_link; // First unused link. -1 if none.
+};
+
+/*
+    Allocates room for max_nodes nodes, of which the first num_nodes are in
+    use, and are then initialized with init_*_node. The arrays never move, so
+    pointers to nodes and slots stay valid until the graph is destroyed.
+*/
+void papaya_graph_init(PapayaGraph* g, int32_t num_nodes, int32_t max_nodes);
+
+/*
+    Adds a node at the end of the graph, to be initialized with init_*_node.
+    Returns 0 if the graph already has max_nodes nodes.
+*/
+PapayaNode* papaya_graph_add_node(PapayaGraph* g);
+
+/*
+    Frees the nodes and the memory they own. Does not free bitmap images.
+*/
+void papaya_graph_destroy(PapayaGraph* g);
+
+/*
+    Initializes dst as a copy of the nodes and connections of src. Bitmaps
+    share the tiles of their images and pyramids with src, which are copied
+    on write, so a copy costs little more than its arrays. Caches aren't
+    copied, and every node of dst starts out dirty. Names point to the same
+    strings as those of src.
+*/
+void papaya_graph_copy(PapayaGraph* dst, const PapayaGraph* src);
+
+/*
+    Returns the output slot that the input slot is connected to. 0 if the slot
+    isn't connected.
+*/
+PapayaSlot* papaya_slot_source(const PapayaSlot* in);
+
+// -----------------------------------------------------------------------------
+
+/*
+    Evaluates the whole w*h output of the node into out.
+*/
 void papaya_evaluate_node(PapayaNode* node, int w, int h, uint8_t* out);
+
+/*
+    Brings the cached w*h output of the node up to date and returns it. Only
+    the tiles overlapping dirty regions are recomputed. The buffer is owned by
+    libpapaya and stays valid until the next evaluation call. If updated is not
+    null, it receives the tile-aligned rect that was recomputed by this call,
+    which is empty if nothing changed. Tiles are spread over the threads started
+    by papaya_jobs_init.
+*/
+const uint8_t* papaya_evaluate_cached(PapayaNode* node, int w, int h,
+                                      PapayaRect* updated);
+
+/*
+    Like papaya_evaluate_cached, but evaluates the graph at a pyramid level,
+    where bitmaps are downsampled by a factor of 2^level. This is meant for
+    previews of zoomed out views, and takes time roughly proportional to the
+    number of pixels of the level. w and h are the full-resolution size. The
+    output is papaya_level_size(w, level) by papaya_level_size(h, level) pixels,
+    and updated is in the coordinates of the level. Nodes cache one level at a
+    time, so changing the level recomputes the whole output.
+*/
+const uint8_t* papaya_evaluate_level(PapayaNode* node, int w, int h, int level,
+                                     PapayaRect* updated);
+
+/*
+    Like papaya_evaluate_level, but recomputes at most max_rows rows of tiles,
+    starting at the top of the stale region, for evaluations that have to fit
+    in a time budget. The rest stays stale and is left to later calls, and
+    until then the output has the previous contents there. Evaluation is
+    complete once papaya_is_dirty returns false.
+*/
+const uint8_t* papaya_evaluate_partial(PapayaNode* node, int w, int h,
+                                       int level, int max_rows,
+                                       PapayaRect* updated);
+
+/*
+    True if parts of the node's cached output are stale.
+*/
+bool papaya_is_dirty(PapayaNode* node);
+
+/*
+    Streaming evaluation, for images too large to hold decoded. The w*h
+    output of the node is produced in strips of full rows, top to bottom,
+    while the pixels of the bitmap node source are pulled in as the strips
+    need them instead of being held whole. Every node keeps only a window of
+    the rows its consumers still read: none beyond the strip for nodes that
+    work pixel by pixel, and a few halos for blurs. Transforms may need
+    windows as tall as the image, e.g. for a half turn.
+
+    papaya_stream_begin replaces the image of source with a transparent w*h
+    one. read is then called with successive rows, up to PAPAYA_TILE_SIZE at
+    a time, and writes them to out, premultiplied and tightly packed. Rows
+    are dropped again once no later strip reads them.
+
+    papaya_stream_next evaluates the next strip and returns its first row,
+    with its pixels in *pixels and its number of rows in *rows, or -1 once
+    the whole output has been returned. The pixels stay valid until the next
+    call. Nothing else may be evaluated until papaya_stream_end, which leaves
+    the source transparent and the nodes below it without caches.
+*/
+typedef void (*PapayaRowsFn)(void* data, int32_t y, int32_t rows,
+                             uint8_t* out);
+struct PapayaStream;
+
+PapayaStream* papaya_stream_begin(PapayaNode* node, int w, int h,
+                                  PapayaNode* source, PapayaRowsFn read,
+                                  void* read_data);
+int32_t papaya_stream_next(PapayaStream* s, const uint8_t** pixels,
+                           int32_t* rows);
+void papaya_stream_end(PapayaStream* s);
+
+/*
+    Per-channel statistics of an image, for levels and auto-contrast. Colors
+    are straight. Pixels that are fully transparent only count towards alpha.
+*/
+struct PapayaStats {
+    uint32_t histogram[4][256]; // Red, green, blue and alpha
+    uint64_t count[4]; // Pixels in each histogram
+    uint8_t min[4], max[4]; // 0 for empty histograms
+    float mean[4];
+};
+
+/*
+    Computes the statistics of every step-th pixel of every step-th row of
+    w by h premultiplied RGBA pixels, on all threads. Blocks of rows are
+    counted into histograms of their own, which are merged at the end.
+*/
+void papaya_image_stats(const uint8_t* img, int w, int h, int step,
+                        PapayaStats* s);
+
+/*
+    Statistics of the node's output at a pyramid level. An up-to-date cache
+    at the level or a finer one is used as is, subsampled to the level.
+    Otherwise the node is evaluated like papaya_evaluate_partial, and false is
+    returned until the evaluation is complete.
+*/
+bool papaya_node_stats(PapayaNode* node, int w, int h, int level, int max_rows,
+                       PapayaStats* s);
+
+/*
+    Marks a region of the node's output as changed. papaya_touch_node marks the
+    entire output, and should be called after modifying node parameters. Rects
+    are in full-resolution coordinates, whatever level is evaluated.
+*/
+void papaya_mark_dirty(PapayaNode* node, PapayaRect r);
+void papaya_touch_node(PapayaNode* node);
+
+/*
+    Sets the memory budget for cached node outputs, in bytes. Least recently
+    used caches are evicted when the budget is exceeded. Caches needed by the
+    evaluation in progress are never evicted, so the budget is soft.
+*/
+void papaya_set_cache_budget(size_t bytes);
+size_t papaya_get_cache_usage();
+
+/*
+    Peak scratch memory used by a single evaluation, in bytes, including the
+    outputs of upstream nodes. Scratch memory is kept between evaluations, so
+    steady-state evaluation doesn't allocate.
+*/
+size_t papaya_get_scratch_high_water();
+
+/*
+    Memory in use, by category, for the whole process, so that several
+    documents can share one budget. libpapaya accounts for its own categories.
+    The GPU ones are reported by the UI, which owns the GL objects. Counters
+    can be changed from any thread.
+*/
+enum PapayaMem_ {
+    PapayaMem_Tiles,       // Heap tiles of images, including the undo history
+    PapayaMem_Pyramids,    // Heap tiles of pyramid levels
+    PapayaMem_Caches,      // Cached node outputs
+    PapayaMem_Scratch,     // Evaluation scratch memory and stream windows
+    PapayaMem_Undo,        // Undo buffers, as far as they have been written
+    PapayaMem_GpuTextures,
+    PapayaMem_GpuBuffers,
+    PapayaMem_COUNT
+};
+
+#define PAPAYA_MEM_FIRST_GPU PapayaMem_GpuTextures
+
+void papaya_mem_add(int32_t category, int64_t bytes);
+size_t papaya_mem_usage(int32_t category);
+size_t papaya_mem_peak(int32_t category);
+const char* papaya_mem_name(int32_t category);
+
+/*
+    Sets the budget for the CPU categories together, in bytes. Evaluations
+    that would exceed it evict the least recently used node caches, and then
+    the pyramids of bitmaps that they don't read, which are rebuilt when next
+    needed. The other categories can't be evicted, but count towards the
+    budget, so there is less room for caches as they grow. Like the cache
+    budget, it is soft. papaya_trim_memory evicts right away, and returns the
+    number of bytes freed. Must not be called during an evaluation.
+*/
+void papaya_set_memory_budget(size_t bytes);
+size_t papaya_get_memory_budget();
+size_t papaya_trim_memory();
+
+/*
+    Hooks for a profiler. enter is called when libpapaya starts a piece of
+    work, e.g. evaluating a tile of a node, and leave when it is done, on the
+    thread doing it. Zones nest, and their names are string literals. Both
+    hooks are 0 by default. Set before evaluating anything.
+*/
+typedef void (*PapayaZoneEnterFn)(const char* name);
+typedef void (*PapayaZoneLeaveFn)();
+void papaya_set_profiler(PapayaZoneEnterFn enter, PapayaZoneLeaveFn leave);
+
+/*
+    Connects an output slot to an input slot of the same graph, replacing the
+    input's previous connection. Returns false, leaving the graph unchanged,
+    if the slots can't be connected or the connection would create a cycle.
+*/
 bool papaya_connect(PapayaSlot* out, PapayaSlot* in);
 void papaya_disconnect(PapayaSlot* out, PapayaSlot* in);
+
+/*
+    Links an output slot to an input slot that isn't connected, without the
+    checks of papaya_connect and without the state shared between graphs, so
+    that a graph nothing else uses yet, e.g. one being loaded, may be linked
+    on any thread. The caller makes sure that the link creates no cycle.
+*/
+void papaya_link_slots(PapayaSlot* out, PapayaSlot* in);
@@ -0,0 +1,11 @@
+/*
+    All of libpapaya as a single translation unit, for unity builds. See
+    build/linux/makefile. Keep in sync with the sources listed there.
+*/
+
+#include "libpapaya.cpp"
+#include "jobs.cpp"
+#include "kernels.cpp"
+#include "png.cpp"
+#include "project.cpp"
+#include "tiles.cpp"
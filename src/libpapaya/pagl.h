@@ -12,15 +12,38 @@ enum Pagl_UniformType_ {
     Pagl_UniformType_Matrix4,
     Pagl_UniformType_Color,
     Pagl_UniformType_Tex0,
+    Pagl_UniformType_Tex1,
     Pagl_UniformType_COUNT
 };
 
+/*
+    Uniforms are described once per program, by a layout of types and names
+    that is resolved to locations when the program is created. Draws then pass
+    values in the order of the layout, made with the pagl_* value helpers
+    below. Samplers are assigned their texture unit when the program is
+    created, and their values are the texture to bind there.
+*/
+struct PaglUniformDesc {
+    Pagl_UniformType_ type;
+    const char* name;
+};
+
+struct PaglUniform {
+    u32 type; // Pagl_UniformType_
+    union {
+        f32 f[16];
+        u32 tex;
+    };
+};
+
 struct PaglProgram {
     u32 id;
     const char* name;
     i32 num_attribs, num_uniforms;
     i32* attribs;
     i32* uniforms;
+    u8* uniform_types;   // Pagl_UniformType_ of each uniform
+    PaglUniform* values; // Last values set, so that unchanged ones are skipped
 };
 
 struct PaglMesh {
@@ -29,8 +52,15 @@ struct PaglMesh {
     u32 vbo_handle, elements_handle;
 };
 
-// TODO: Turn this off in release mode
+#define PAGL_COUNT(a) ((i32)(sizeof(a) / sizeof((a)[0])))
+#define PAGL_TEXTURE_UNITS 2
+
+// glGetError waits for the driver, so release builds don't check
+#ifdef NDEBUG
+#define GLCHK(stmt) stmt
+#else
 #define GLCHK(stmt) stmt; pagl_check_error(#stmt, __FILE__, __LINE__)
+#endif
 
 // State management
 void pagl_check_error(const char* expr, const char* file, i32 line);
@@ -41,22 +71,141 @@ void pagl_pop_state(void);
 void pagl_enable(i32 count, ...);
 void pagl_disable(i32 count, ...);
 
+/*
+    State cache. pagl shadows the program, the GL_ARRAY_BUFFER and GL_TEXTURE_2D
+    bindings, the enabled vertex attributes and the caps known to cap_to_mask,
+    and skips calls that wouldn't change them. GL is never queried for them.
+    Code that changes these through GL directly has to call
+    pagl_invalidate_state afterwards. Objects that may be bound have to be
+    deleted through pagl, since GL unbinds them behind the cache's back.
+*/
+void pagl_invalidate_state(void);
+void pagl_use_program(u32 id);
+void pagl_bind_vbo(u32 vbo);
+void pagl_bind_texture(i32 unit, u32 tex); // Leaves unit active
+void pagl_set_cap(u32 cap, bool on);
+void pagl_enable_attrib(i32 location, bool on);
+void pagl_delete_texture(u32* tex);
+void pagl_delete_buffer(u32* buf);
+
+/*
+    Program binary cache. Once dir is set, linked programs are saved to a
+    directory in it for the driver, and loaded from there by later runs where
+    the sources and attributes match. While caching, pagl_compile_shader only
+    sets the source, and shaders are compiled by the first pagl_init_program
+    that misses the cache, so a launch that hits it compiles nothing. Without
+    program binary support, or with a dir of 0, shaders are always compiled.
+*/
+void pagl_set_program_cache(const char* dir);
+
 // Shaders
 u32 pagl_compile_shader(const char* name, const char* src, u32 type);
 PaglProgram* pagl_init_program(const char* name, u32 vert_id, u32 frag_id,
-                               i32 num_attribs, i32 num_uniforms, ...);
+                               i32 num_attribs, const char* const* attribs,
+                               i32 num_uniforms,
+                               const PaglUniformDesc* uniforms);
 void pagl_destroy_program(PaglProgram* p);
 void pagl_set_vertex_attribs(PaglProgram* p);
+// Uses the program and sets its first n uniforms
+void pagl_set_uniforms(PaglProgram* p, i32 n, const PaglUniform* values);
+
+static inline PaglUniform pagl_float(f32 x)
+{
+    PaglUniform u = {};
+    u.type = Pagl_UniformType_Float;
+    u.f[0] = x;
+    return u;
+}
+
+static inline PaglUniform pagl_vec2(Vec2 v)
+{
+    PaglUniform u = {};
+    u.type = Pagl_UniformType_Vec2;
+    u.f[0] = v.x;
+    u.f[1] = v.y;
+    return u;
+}
+
+static inline PaglUniform pagl_mat4(const f32* m)
+{
+    PaglUniform u = {};
+    u.type = Pagl_UniformType_Matrix4;
+    for (i32 i = 0; i < 16; i++) { u.f[i] = m[i]; }
+    return u;
+}
+
+static inline PaglUniform pagl_color(Color c)
+{
+    PaglUniform u = {};
+    u.type = Pagl_UniformType_Color;
+    u.f[0] = c.r; u.f[1] = c.g; u.f[2] = c.b; u.f[3] = c.a;
+    return u;
+}
+
+static inline PaglUniform pagl_tex0(u32 tex)
+{
+    PaglUniform u = {};
+    u.type = Pagl_UniformType_Tex0;
+    u.tex = tex;
+    return u;
+}
+
+static inline PaglUniform pagl_tex1(u32 tex)
+{
+    PaglUniform u = {};
+    u.type = Pagl_UniformType_Tex1;
+    u.tex = tex;
+    return u;
+}
 
 // Meshes
 PaglMesh* pagl_init_quad_mesh(Vec2 pos, Vec2 sz, u32 usage);
 void pagl_destroy_mesh(PaglMesh* mesh);
 void pagl_transform_quad_mesh(PaglMesh* mesh, Vec2 pos, Vec2 sz);
-void pagl_draw_mesh(PaglMesh* mesh, PaglProgram* pgm, i32 num_uniforms, ...);
+void pagl_draw_mesh(PaglMesh* mesh, PaglProgram* pgm, i32 num_uniforms,
+                    const PaglUniform* uniforms);
 
 // Textures
 u32 pagl_alloc_texture(i32 w, i32 h, u8* data);
 
+/*
+    GPU memory accounting. Textures from pagl_alloc_texture are counted as they
+    are created. The storage of objects specified with GL directly is reported
+    with pagl_track_texture and pagl_track_buffer, and replaces the size the
+    object had before. Objects stop counting once deleted through pagl.
+*/
+void pagl_track_texture(u32 tex, size_t bytes);
+void pagl_track_buffer(u32 buf, size_t bytes);
+void pagl_get_memory(size_t* textures, size_t* buffers);
+
+/*
+    GPU timing. The GL commands issued between pagl_gpu_begin and pagl_gpu_end
+    are timed with GL_TIME_ELAPSED queries. Only one query of the kind can be
+    active at a time, so zones don't nest, and inner zones are ignored.
+    Queries are kept for PAGL_GPU_FRAMES frames before their results are read,
+    and results that still aren't available then are dropped, so reading them
+    never waits on the GPU. pagl_gpu_frame starts a frame. pagl_gpu_ms gives
+    the total time of the zones with the given name in the last frame that has
+    results. Without timer query support, zones do nothing.
+*/
+#define PAGL_GPU_FRAMES 3
+#define PAGL_GPU_QUERIES 32 // Per frame
+
+void pagl_gpu_begin(const char* name);
+void pagl_gpu_end(void);
+void pagl_gpu_frame(void);
+bool pagl_gpu_ms(const char* name, f64* ms);
+
+struct PaglGpuScope {
+    PaglGpuScope(const char* name) { pagl_gpu_begin(name); }
+    ~PaglGpuScope() { pagl_gpu_end(); }
+};
+
+#define PAGL_JOIN2(a, b) a##b
+#define PAGL_JOIN(a, b) PAGL_JOIN2(a, b)
+#define PAGL_GPU_ZONE(name) \
+    PaglGpuScope PAGL_JOIN(pagl_gpu_zone_, __LINE__)(name)
+
 #endif // PAGL_H
 
 
@@ -67,6 +216,11 @@ u32 pagl_alloc_texture(i32 w, i32 h, u8* data);
 
 #include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 /*
     SECTION: State management
@@ -81,6 +235,21 @@ static pagl_state* state_stack;
 static i32 stack_idx;
 static i32 stack_size;
 
+#define PAGL_UNKNOWN 0xffffffffu // GL never names an object this
+
+struct PaglCache {
+    u32 program;
+    u32 vbo;
+    u32 textures[PAGL_TEXTURE_UNITS];
+    u32 active_unit;
+    u32 caps_known, caps_on;       // Masks of cap_to_mask
+    u32 attribs_known, attribs_on; // Masks of attribute locations
+    u32 attribs_vbo, attribs_pgm;  // Whose attribute pointers are set
+    f32 line_width;
+};
+
+static PaglCache cache;
+
 void pagl_check_error(const char* expr, const char* file, i32 line)
 {
     const char* s;
@@ -109,11 +278,20 @@ void pagl_init()
     stack_idx = -1;
     stack_size = 4;
     state_stack = (pagl_state*) calloc(1, sizeof(pagl_state) * stack_size);
+    pagl_invalidate_state();
 }
 
+static void destroy_gpu_timing();
+static void destroy_program_cache();
+static void track_object(u32 name, bool buffer, size_t bytes);
+static void destroy_tracking();
+
 void pagl_destroy()
 {
+    destroy_program_cache();
     free(state_stack);
+    destroy_gpu_timing();
+    destroy_tracking();
 }
 
 void pagl_push_state()
@@ -137,17 +315,24 @@ static u32 cap_to_mask(u32 gl_cap)
     }
 }
 
+static bool cap_is_on(u32 gl_cap)
+{
+    u32 m = cap_to_mask(gl_cap);
+    if (!(cache.caps_known & m)) {
+        u8 on;
+        GLCHK( glGetBooleanv(gl_cap, &on) );
+        cache.caps_known |= m;
+        cache.caps_on = on ? (cache.caps_on | m) : (cache.caps_on & ~m);
+    }
+    return (cache.caps_on & m) != 0;
+}
+
 static void revert_cap(u32 gl_cap)
 {
     u32 m = cap_to_mask(gl_cap);
     pagl_state* s = &state_stack[stack_idx];
     if (s->caps_edited & m) {
-        u8 was_on = s->caps_state & m;
-        if (was_on) {
-            GLCHK( glEnable(gl_cap) );
-        } else {
-            GLCHK( glDisable(gl_cap) );
-        }
+        pagl_set_cap(gl_cap, (s->caps_state & m) != 0);
     }
 }
 
@@ -171,11 +356,8 @@ void pagl_enable(i32 count, ...)
 
     for (i32 i = 0; i < count; i++) {
         u32 gl_cap = va_arg(args, u32);
-
-        u8 on;
-        GLCHK( glGetBooleanv(gl_cap, &on) );
-        if (on) {
-            return;
+        if (cap_is_on(gl_cap)) {
+            continue;
         }
 
         pagl_state* s = &state_stack[stack_idx];
@@ -186,7 +368,7 @@ void pagl_enable(i32 count, ...)
         s->caps_edited |= m;
         // No need to set bit in caps_state because it will already be zero.
 
-        GLCHK( glEnable(gl_cap) );
+        pagl_set_cap(gl_cap, true);
     }
 
     va_end(args);
@@ -200,11 +382,8 @@ void pagl_disable(i32 count, ...)
 
     for (i32 i = 0; i < count; i++) {
         u32 gl_cap = va_arg(args, u32);
-
-        u8 on;
-        GLCHK( glGetBooleanv(gl_cap, &on) );
-        if (!on) {
-            return;
+        if (!cap_is_on(gl_cap)) {
+            continue;
         }
 
         pagl_state* s = &state_stack[stack_idx];
@@ -215,20 +394,183 @@ void pagl_disable(i32 count, ...)
         s->caps_edited |= m;
         s->caps_state |= m;
 
-        GLCHK( glDisable(gl_cap) );
+        pagl_set_cap(gl_cap, false);
     }
 
     va_end(args);
 }
 
+void pagl_invalidate_state()
+{
+    cache.program = PAGL_UNKNOWN;
+    cache.vbo = PAGL_UNKNOWN;
+    for (i32 i = 0; i < PAGL_TEXTURE_UNITS; i++) {
+        cache.textures[i] = PAGL_UNKNOWN;
+    }
+    cache.active_unit = PAGL_UNKNOWN;
+    cache.caps_known = 0;
+    cache.attribs_known = 0;
+    cache.attribs_vbo = PAGL_UNKNOWN;
+    cache.attribs_pgm = PAGL_UNKNOWN;
+    cache.line_width = -1.0f;
+}
+
+void pagl_use_program(u32 id)
+{
+    if (cache.program != id) {
+        GLCHK( glUseProgram(id) );
+        cache.program = id;
+    }
+}
+
+void pagl_bind_vbo(u32 vbo)
+{
+    if (cache.vbo != vbo) {
+        GLCHK( glBindBuffer(GL_ARRAY_BUFFER, vbo) );
+        cache.vbo = vbo;
+    }
+}
+
+void pagl_bind_texture(i32 unit, u32 tex)
+{
+    if (cache.active_unit != (u32)unit) {
+        GLCHK( glActiveTexture(GL_TEXTURE0 + unit) );
+        cache.active_unit = unit;
+    }
+    if (cache.textures[unit] != tex) {
+        GLCHK( glBindTexture(GL_TEXTURE_2D, tex) );
+        cache.textures[unit] = tex;
+    }
+}
+
+void pagl_set_cap(u32 cap, bool on)
+{
+    u32 m = cap_to_mask(cap);
+    if ((cache.caps_known & m) && ((cache.caps_on & m) != 0) == on) {
+        return;
+    }
+    if (on) {
+        GLCHK( glEnable(cap) );
+    } else {
+        GLCHK( glDisable(cap) );
+    }
+    cache.caps_known |= m;
+    cache.caps_on = on ? (cache.caps_on | m) : (cache.caps_on & ~m);
+}
+
+void pagl_enable_attrib(i32 location, bool on)
+{
+    u32 m = (location >= 0 && location < 32) ? 1u << location : 0;
+    if ((cache.attribs_known & m) && ((cache.attribs_on & m) != 0) == on) {
+        return;
+    }
+    if (on) {
+        GLCHK( glEnableVertexAttribArray(location) );
+    } else {
+        GLCHK( glDisableVertexAttribArray(location) );
+    }
+    cache.attribs_known |= m;
+    cache.attribs_on = on ? (cache.attribs_on | m) : (cache.attribs_on & ~m);
+}
+
+/*
+    Deleting a bound object binds 0 in its place, and the name may be reused
+    by the next object created
+*/
+void pagl_delete_texture(u32* tex)
+{
+    for (i32 i = 0; i < PAGL_TEXTURE_UNITS; i++) {
+        if (cache.textures[i] == *tex) { cache.textures[i] = 0; }
+    }
+    track_object(*tex, false, 0);
+    GLCHK( glDeleteTextures(1, tex) );
+    *tex = 0;
+}
+
+void pagl_delete_buffer(u32* buf)
+{
+    if (cache.vbo == *buf) { cache.vbo = 0; }
+    if (cache.attribs_vbo == *buf) { cache.attribs_vbo = PAGL_UNKNOWN; }
+    track_object(*buf, true, 0);
+    GLCHK( glDeleteBuffers(1, buf) );
+    *buf = 0;
+}
+
 /*
     SECTION: Shaders
 */
 
-u32 pagl_compile_shader(const char* name, const char* src, u32 type)
+struct PaglShader {
+    u32 id;
+    u64 hash; // Of the type and source
+    const char* name;
+    bool compiled;
+};
+
+struct PaglProgramCache {
+    char* dir; // For the driver. 0 when not caching.
+    PaglShader* shaders; // Created while caching
+    i32 num_shaders, max_shaders;
+};
+
+static PaglProgramCache programs;
+
+static void destroy_program_cache()
+{
+    free(programs.dir);
+    free(programs.shaders);
+    programs = PaglProgramCache();
+}
+
+// FNV-1a, continued from h
+static u64 hash_bytes(u64 h, const void* data, size_t size)
+{
+    const u8* p = (const u8*)data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static u64 hash_str(u64 h, const char* s)
+{
+    return hash_bytes(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+#define PAGL_HASH_SEED 0xcbf29ce484222325ull
+
+void pagl_set_program_cache(const char* dir)
+{
+    free(programs.dir);
+    programs.dir = 0;
+    i32 num_formats = 0;
+    if (!dir || !glGetProgramBinary || !glProgramBinary ||
+        !glProgramParameteri) {
+        return;
+    }
+    GLCHK( glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats) );
+    if (num_formats <= 0) {
+        return;
+    }
+
+    // Binaries only load on the driver that made them
+    u64 h = PAGL_HASH_SEED;
+    h = hash_str(h, (const char*)glGetString(GL_VENDOR));
+    h = hash_str(h, (const char*)glGetString(GL_RENDERER));
+    h = hash_str(h, (const char*)glGetString(GL_VERSION));
+    size_t len = strlen(dir) + 32;
+    programs.dir = (char*) malloc(len);
+    snprintf(programs.dir, len, "%s/programs-%016llx", dir,
+             (unsigned long long)h);
+#if defined(_WIN32)
+    _mkdir(programs.dir);
+#else
+    mkdir(programs.dir, 0755);
+#endif
+}
+
+static void compile_shader(u32 id, const char* name)
 {
-    u32 id = GLCHK( glCreateShader(type) );
-    GLCHK( glShaderSource (id, 1, &src, 0) );
     GLCHK( glCompileShader(id) );
 
     // Print compilation errors
@@ -241,12 +583,164 @@ u32 pagl_compile_shader(const char* name, const char* src, u32 type)
         GLCHK( glGetShaderInfoLog(id, 4096, &len, log) );
         printf("Compilation error in %s shader\n%s\n", name, log);
     }
+}
 
+u32 pagl_compile_shader(const char* name, const char* src, u32 type)
+{
+    u32 id = GLCHK( glCreateShader(type) );
+    GLCHK( glShaderSource (id, 1, &src, 0) );
+    if (!programs.dir) {
+        compile_shader(id, name);
+        return id;
+    }
+
+    if (programs.num_shaders == programs.max_shaders) {
+        programs.max_shaders = programs.max_shaders ?
+                               2 * programs.max_shaders : 32;
+        programs.shaders = (PaglShader*)
+            realloc(programs.shaders, programs.max_shaders * sizeof(PaglShader));
+    }
+    PaglShader* s = &programs.shaders[programs.num_shaders++];
+    s->id = id;
+    s->hash = hash_str(hash_bytes(PAGL_HASH_SEED, &type, sizeof(type)), src);
+    s->name = name;
+    s->compiled = false;
     return id;
 }
 
+static PaglShader* find_shader(u32 id)
+{
+    for (i32 i = 0; i < programs.num_shaders; i++) {
+        if (programs.shaders[i].id == id) { return &programs.shaders[i]; }
+    }
+    return 0;
+}
+
+struct PaglBinaryHeader {
+    char magic[4]; // "PGLB"
+    u32 format;
+    u32 size; // Of the binary that follows
+    u32 unused;
+    u64 key;
+};
+
+static void binary_path(char* path, size_t size, u64 key)
+{
+    snprintf(path, size, "%s/%016llx.bin", programs.dir,
+             (unsigned long long)key);
+}
+
+/*
+    Loads a cached binary into the program. Binaries that don't match the key
+    or that the driver rejects, e.g. after an update, are misses.
+*/
+static bool load_binary(u32 id, u64 key)
+{
+    char path[1024];
+    binary_path(path, sizeof(path), key);
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+
+    PaglBinaryHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+              !memcmp(h.magic, "PGLB", 4) && h.key == key &&
+              h.size > 0 && h.size < (1 << 26);
+    void* data = ok ? malloc(h.size) : 0;
+    ok = ok && fread(data, h.size, 1, f) == 1;
+    fclose(f);
+    if (ok) {
+        GLCHK( glProgramBinary(id, h.format, data, (i32)h.size) );
+        i32 linked;
+        GLCHK( glGetProgramiv(id, GL_LINK_STATUS, &linked) );
+        ok = linked == GL_TRUE;
+    }
+    free(data);
+    return ok;
+}
+
+static void save_binary(u32 id, u64 key)
+{
+    i32 size;
+    GLCHK( glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &size) );
+    if (size <= 0) {
+        return;
+    }
+    void* data = malloc(size);
+    PaglBinaryHeader h = {};
+    memcpy(h.magic, "PGLB", 4);
+    h.key = key;
+    GLCHK( glGetProgramBinary(id, size, 0, &h.format, data) );
+    h.size = (u32)size;
+
+    char path[1024];
+    binary_path(path, sizeof(path), key);
+    FILE* f = fopen(path, "wb");
+    if (f) {
+        fwrite(&h, sizeof(h), 1, f);
+        fwrite(data, size, 1, f);
+        fclose(f);
+    }
+    free(data);
+}
+
+/*
+    Key of a program in the cache. 0 if a shader wasn't made while caching.
+*/
+static u64 program_key(u32 vert_id, u32 frag_id, i32 num_attribs,
+                       const char* const* attribs)
+{
+    PaglShader* v = find_shader(vert_id);
+    PaglShader* f = find_shader(frag_id);
+    if (!programs.dir || !v || !f) {
+        return 0;
+    }
+    u64 h = hash_bytes(PAGL_HASH_SEED, &v->hash, sizeof(v->hash));
+    h = hash_bytes(h, &f->hash, sizeof(f->hash));
+    for (i32 i = 0; i < num_attribs; i++) {
+        h = hash_str(h, attribs[i]);
+    }
+    return h ? h : 1;
+}
+
+static void link_program(u32 id, u32 vert_id, u32 frag_id, const char* name,
+                         u64 key)
+{
+    u32 ids[] = { vert_id, frag_id };
+    for (i32 i = 0; i < 2; i++) {
+        PaglShader* s = find_shader(ids[i]);
+        if (s && !s->compiled) {
+            compile_shader(s->id, s->name);
+            s->compiled = true;
+        }
+    }
+
+    GLCHK( glAttachShader (id, vert_id) );
+    GLCHK( glAttachShader (id, frag_id) );
+    if (key) {
+        GLCHK( glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                                   GL_TRUE) );
+    }
+    GLCHK( glLinkProgram(id) );
+
+    i32 linked;
+    GLCHK( glGetProgramiv(id, GL_LINK_STATUS, &linked) );
+    if (linked != GL_TRUE) {
+        char log[4096];
+        i32 len;
+
+        GLCHK( glGetProgramInfoLog(id, 4096, &len, log) );
+        printf("Linking error in %s program\n%s\n", name, log);
+    } else if (key) {
+        save_binary(id, key);
+    }
+}
+
 PaglProgram* pagl_init_program(const char* name, u32 vert_id, u32 frag_id,
-                               i32 num_attribs, i32 num_uniforms, ...)
+                               i32 num_attribs, const char* const* attribs,
+                               i32 num_uniforms,
+                               const PaglUniformDesc* uniforms)
 {
     PaglProgram* p = (PaglProgram*) calloc(sizeof(*p), 1);
     p->name = name;
@@ -254,33 +748,39 @@ PaglProgram* pagl_init_program(const char* name, u32 vert_id, u32 frag_id,
     p->num_uniforms = num_uniforms;
     p->attribs = (i32*) calloc(sizeof(i32) * num_attribs, 1);
     p->uniforms = (i32*) calloc(sizeof(i32) * num_uniforms, 1);
+    p->uniform_types = (u8*) calloc(num_uniforms, 1);
+    p->values = (PaglUniform*) calloc(sizeof(PaglUniform) * num_uniforms, 1);
     p->id = GLCHK( glCreateProgram() );
 
-    GLCHK( glAttachShader (p->id, vert_id) );
-    GLCHK( glAttachShader (p->id, frag_id) );
-    GLCHK( glLinkProgram(p->id) );
-    // TODO: Print linking errors
+    u64 key = program_key(vert_id, frag_id, num_attribs, attribs);
+    if (!key || !load_binary(p->id, key)) {
+        link_program(p->id, vert_id, frag_id, name, key);
+    }
 
-    va_list args;
-    va_start(args, num_uniforms);
     for (i32 i = 0; i < num_attribs; i++) {
-        const char* arg = va_arg(args, const char*);
-        p->attribs[i] = GLCHK( glGetAttribLocation(p->id, arg) );
+        p->attribs[i] = GLCHK( glGetAttribLocation(p->id, attribs[i]) );
 
         if (p->attribs[i] == -1) {
-            printf("Attribute %s not found in %s program\n", arg, name);
+            printf("Attribute %s not found in %s program\n", attribs[i], name);
         }
     }
 
+    pagl_use_program(p->id);
     for (i32 i = 0; i < num_uniforms; i++) {
-        const char* arg = va_arg(args, const char*);
-        p->uniforms[i] = GLCHK( glGetUniformLocation(p->id, arg) );
+        const PaglUniformDesc* u = &uniforms[i];
+        p->uniforms[i] = GLCHK( glGetUniformLocation(p->id, u->name) );
+        p->uniform_types[i] = (u8)u->type;
+        p->values[i].type = Pagl_UniformType_COUNT; // Not set yet
 
         if (p->uniforms[i] == -1) {
-            printf("Uniform %s not found in %s program\n", arg, name);
+            printf("Uniform %s not found in %s program\n", u->name, name);
+        }
+        if (u->type == Pagl_UniformType_Tex0) {
+            GLCHK( glUniform1i(p->uniforms[i], 0) );
+        } else if (u->type == Pagl_UniformType_Tex1) {
+            GLCHK( glUniform1i(p->uniforms[i], 1) );
         }
     }
-    va_end(args);
 
     return p;
 }
@@ -289,16 +789,27 @@ void pagl_destroy_program(PaglProgram* p)
 {
     free(p->attribs);
     free(p->uniforms);
+    free(p->uniform_types);
+    free(p->values);
     free(p);
 }
 
+/*
+    Attribute pointers are kept from the last call, when it was for the same
+    program and buffer
+*/
 void pagl_set_vertex_attribs(PaglProgram* p)
 {
     // Vertex attribs
     i32* a = p->attribs;
     for (i32 i = 0; i < p->num_attribs; i++) {
-        GLCHK( glEnableVertexAttribArray(a[i]) );
+        pagl_enable_attrib(a[i], true);
     }
+    if (cache.attribs_vbo == cache.vbo && cache.attribs_pgm == p->id) {
+        return;
+    }
+    cache.attribs_vbo = cache.vbo;
+    cache.attribs_pgm = p->id;
 
     // Pos
     GLCHK( glVertexAttribPointer(a[0], 2, GL_FLOAT, GL_FALSE,
@@ -316,6 +827,62 @@ void pagl_set_vertex_attribs(PaglProgram* p)
     }
 }
 
+static i32 uniform_floats(u32 type)
+{
+    switch (type) {
+        case Pagl_UniformType_Float:   return 1;
+        case Pagl_UniformType_Vec2:    return 2;
+        case Pagl_UniformType_Color:   return 4;
+        case Pagl_UniformType_Matrix4: return 16;
+        default:                       return 0;
+    }
+}
+
+void pagl_set_uniforms(PaglProgram* p, i32 n, const PaglUniform* values)
+{
+    assert(n <= p->num_uniforms);
+    pagl_use_program(p->id);
+    for (i32 i = 0; i < n; i++) {
+        const PaglUniform* v = &values[i];
+        assert(v->type == p->uniform_types[i]);
+        i32 u = p->uniforms[i];
+
+        if (v->type == Pagl_UniformType_Tex0) {
+            pagl_bind_texture(0, v->tex);
+            continue;
+        } else if (v->type == Pagl_UniformType_Tex1) {
+            pagl_bind_texture(1, v->tex);
+            continue;
+        }
+
+        // Uniforms are kept by the program, so unchanged ones are skipped
+        PaglUniform* last = &p->values[i];
+        size_t size = uniform_floats(v->type) * sizeof(f32);
+        if (last->type == v->type && !memcmp(last->f, v->f, size)) {
+            continue;
+        }
+        memcpy(last, v, sizeof(PaglUniform));
+
+        switch (v->type) {
+            case Pagl_UniformType_Float: {
+                GLCHK( glUniform1f(u, v->f[0]) );
+            } break;
+
+            case Pagl_UniformType_Vec2: {
+                GLCHK( glUniform2f(u, v->f[0], v->f[1]) );
+            } break;
+
+            case Pagl_UniformType_Matrix4: {
+                GLCHK( glUniformMatrix4fv(u, 1, GL_FALSE, v->f) );
+            } break;
+
+            case Pagl_UniformType_Color: {
+                GLCHK( glUniform4f(u, v->f[0], v->f[1], v->f[2], v->f[3]) );
+            } break;
+        }
+    }
+}
+
 /*
     SECTION: Meshes
 */
@@ -324,7 +891,7 @@ PaglMesh* pagl_init_quad_mesh(Vec2 pos, Vec2 sz, u32 usage)
 {
     PaglMesh* m = (PaglMesh*) calloc(sizeof(*m), 1);
     GLCHK( glGenBuffers  (1, &m->vbo_handle) );
-    GLCHK( glBindBuffer  (GL_ARRAY_BUFFER, m->vbo_handle) );
+    pagl_bind_vbo(m->vbo_handle);
     GLCHK( glBufferData(GL_ARRAY_BUFFER, sizeof(ImDrawVert) * 6,
                         0, (GLenum)usage) );
     m->type = GL_TRIANGLES;
@@ -336,7 +903,7 @@ PaglMesh* pagl_init_quad_mesh(Vec2 pos, Vec2 sz, u32 usage)
 void pagl_destroy_mesh(PaglMesh* mesh)
 {
     if (mesh->vbo_handle) {
-        GLCHK( glDeleteBuffers(1, &mesh->vbo_handle) );
+        pagl_delete_buffer(&mesh->vbo_handle);
     }
     free(mesh);
 }
@@ -358,55 +925,23 @@ void pagl_transform_quad_mesh(PaglMesh* mesh, Vec2 pos, Vec2 sz)
     v[4].pos = Vec2(x2, y2); v[4].uv = Vec2(1.0f, 1.0f); v[4].col = col;
     v[5].pos = Vec2(x1, y1); v[5].uv = Vec2(0.0f, 0.0f); v[5].col = col;
 
-    GLCHK( glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_handle) );
+    pagl_bind_vbo(mesh->vbo_handle);
     GLCHK( glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(v), v) );
 }
 
-void pagl_draw_mesh(PaglMesh* mesh, PaglProgram* pgm, i32 num_uniforms, ...)
+void pagl_draw_mesh(PaglMesh* mesh, PaglProgram* pgm, i32 num_uniforms,
+                    const PaglUniform* uniforms)
 {
-    GLint last_program, last_texture;
-    GLCHK( glGetIntegerv(GL_CURRENT_PROGRAM, &last_program) );
-    GLCHK( glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture) );
-    GLCHK( glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_handle) );
-    GLCHK( glUseProgram(pgm->id) );
-
-    // Uniforms
-    va_list args;
-    va_start(args, num_uniforms);
-    for (i32 i = 0; i < num_uniforms; i++) {
-        i32 u = pgm->uniforms[i];
-
-        switch (va_arg(args, int)) {
-            case Pagl_UniformType_Float: {
-                GLCHK( glUniform1f(u, (float)va_arg(args, double)) );
-            } break;
-
-            case Pagl_UniformType_Matrix4: {
-                GLCHK( glUniformMatrix4fv(u, 1, GL_FALSE, va_arg(args, float*)) );
-            } break;
-
-            case Pagl_UniformType_Vec2: {
-                Vec2 vec = va_arg(args, Vec2);
-                GLCHK( glUniform2f(u, vec.x, vec.y) );
-            } break;
-
-            case Pagl_UniformType_Color: {
-                Color col = va_arg(args, Color);
-                GLCHK( glUniform4f(u, col.r, col.g, col.b, col.a) );
-            } break;
-
-            case Pagl_UniformType_Tex0: {
-                u32 tex = va_arg(args, u32);
-                GLCHK( glActiveTexture(GL_TEXTURE0) );
-                GLCHK( glBindTexture(GL_TEXTURE_2D, tex) );
-            } break;
-        }
-    }
-    va_end(args);
-
+    pagl_bind_vbo(mesh->vbo_handle);
+    pagl_set_uniforms(pgm, num_uniforms, uniforms);
     pagl_set_vertex_attribs(pgm);
 
-    GLCHK( glLineWidth(2.0f) ); // TODO: Move to callee
+    bool lines = mesh->type == GL_LINES || mesh->type == GL_LINE_STRIP ||
+                 mesh->type == GL_LINE_LOOP;
+    if (lines && cache.line_width != 2.0f) {
+        GLCHK( glLineWidth(2.0f) ); // TODO: Move to callee
+        cache.line_width = 2.0f;
+    }
     GLCHK( glDrawArrays(mesh->type, 0, mesh->index_count) );
 }
 
@@ -418,12 +953,197 @@ u32 pagl_alloc_texture(i32 w, i32 h, u8* data)
 {
     u32 tex;
     GLCHK( glGenTextures(1, &tex) );
-    GLCHK( glBindTexture(GL_TEXTURE_2D, tex) );
+    pagl_bind_texture(0, tex);
     GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR) );
     GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR) );
     GLCHK( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA,
                         GL_UNSIGNED_BYTE, data) );
+    track_object(tex, false, 4 * (size_t)w * h);
     return tex;
 }
 
+/*
+    Sizes of the tracked objects, searched linearly, as there are only a few
+    dozen and they change at most a few times per frame
+*/
+struct PaglTracked {
+    u32 name;
+    bool buffer;
+    size_t bytes;
+};
+
+static PaglTracked* tracked;
+static i32 num_tracked, max_tracked;
+static size_t tracked_bytes[2]; // Of textures and of buffers
+
+// Sets the size of the object. Objects of size 0 are untracked.
+static void track_object(u32 name, bool buffer, size_t bytes)
+{
+    i32 i = 0;
+    while (i < num_tracked &&
+           (tracked[i].name != name || tracked[i].buffer != buffer)) {
+        i++;
+    }
+    if (i == num_tracked) {
+        if (!bytes) {
+            return;
+        }
+        if (num_tracked == max_tracked) {
+            max_tracked = max_tracked ? 2 * max_tracked : 64;
+            size_t size = max_tracked * sizeof(PaglTracked);
+            tracked = (PaglTracked*) realloc(tracked, size);
+        }
+        tracked[num_tracked].name = name;
+        tracked[num_tracked].buffer = buffer;
+        tracked[num_tracked].bytes = 0;
+        num_tracked++;
+    }
+
+    tracked_bytes[buffer] += bytes - tracked[i].bytes;
+    tracked[i].bytes = bytes;
+    if (!bytes) {
+        tracked[i] = tracked[--num_tracked];
+    }
+}
+
+static void destroy_tracking()
+{
+    free(tracked);
+    tracked = 0;
+    num_tracked = max_tracked = 0;
+}
+
+void pagl_track_texture(u32 tex, size_t bytes)
+{
+    track_object(tex, false, bytes);
+}
+
+void pagl_track_buffer(u32 buf, size_t bytes)
+{
+    track_object(buf, true, bytes);
+}
+
+void pagl_get_memory(size_t* textures, size_t* buffers)
+{
+    *textures = tracked_bytes[0];
+    *buffers = tracked_bytes[1];
+}
+
+/*
+    SECTION: GPU timing
+*/
+
+struct PaglGpuFrame {
+    u32 queries[PAGL_GPU_QUERIES];
+    const char* names[PAGL_GPU_QUERIES];
+    i32 count;
+};
+
+struct PaglGpuResult {
+    const char* name;
+    f64 ms;
+};
+
+static PaglGpuFrame gpu_frames[PAGL_GPU_FRAMES];
+static i32 gpu_frame;
+static i32 gpu_depth; // Of zones, counting the ignored inner ones
+static bool gpu_active; // A query of the outermost zone is running
+static PaglGpuResult gpu_results[PAGL_GPU_QUERIES];
+static i32 gpu_num_results;
+
+static bool has_timer_queries()
+{
+    return glGenQueries && glBeginQuery && glEndQuery &&
+           glGetQueryObjectiv && glGetQueryObjectui64v && glDeleteQueries;
+}
+
+void pagl_gpu_begin(const char* name)
+{
+    PaglGpuFrame* f = &gpu_frames[gpu_frame];
+    if (gpu_depth++ > 0 || !has_timer_queries() ||
+        f->count == PAGL_GPU_QUERIES) {
+        return;
+    }
+
+    u32* q = &f->queries[f->count];
+    if (!*q) {
+        GLCHK( glGenQueries(1, q) );
+    }
+    f->names[f->count++] = name;
+    GLCHK( glBeginQuery(GL_TIME_ELAPSED, *q) );
+    gpu_active = true;
+}
+
+void pagl_gpu_end()
+{
+    if (--gpu_depth == 0 && gpu_active) {
+        GLCHK( glEndQuery(GL_TIME_ELAPSED) );
+        gpu_active = false;
+    }
+}
+
+/*
+    Queries complete in order, so the frame's results are all available once
+    its last query is.
+*/
+void pagl_gpu_frame()
+{
+    gpu_frame = (gpu_frame + 1) % PAGL_GPU_FRAMES;
+    PaglGpuFrame* f = &gpu_frames[gpu_frame];
+    if (!f->count || !has_timer_queries()) {
+        f->count = 0;
+        return;
+    }
+
+    GLint available = 0;
+    GLCHK( glGetQueryObjectiv(f->queries[f->count - 1],
+                              GL_QUERY_RESULT_AVAILABLE, &available) );
+    if (available) {
+        gpu_num_results = 0;
+        for (i32 i = 0; i < f->count; i++) {
+            GLuint64 ns = 0;
+            GLCHK( glGetQueryObjectui64v(f->queries[i], GL_QUERY_RESULT,
+                                         &ns) );
+            i32 r = 0;
+            while (r < gpu_num_results &&
+                   strcmp(gpu_results[r].name, f->names[i])) {
+                r++;
+            }
+            if (r == gpu_num_results) {
+                gpu_results[r].name = f->names[i];
+                gpu_results[r].ms = 0.0;
+                gpu_num_results++;
+            }
+            gpu_results[r].ms += ns / 1000000.0;
+        }
+    }
+    f->count = 0;
+}
+
+bool pagl_gpu_ms(const char* name, f64* ms)
+{
+    for (i32 i = 0; i < gpu_num_results; i++) {
+        if (!strcmp(gpu_results[i].name, name)) {
+            *ms = gpu_results[i].ms;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void destroy_gpu_timing()
+{
+    for (i32 i = 0; i < PAGL_GPU_FRAMES; i++) {
+        for (i32 j = 0; j < PAGL_GPU_QUERIES; j++) {
+            u32* q = &gpu_frames[i].queries[j];
+            if (*q && glDeleteQueries) {
+                GLCHK( glDeleteQueries(1, q) );
+            }
+            *q = 0;
+        }
+        gpu_frames[i].count = 0;
+    }
+    gpu_num_results = 0;
+}
+
 #endif // PAGL_IMPLEMENTATION
@@ -0,0 +1,1493 @@
+#include "png.h"
+#include "jobs.h"
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+
+#define PNG_WINDOW        32768
+#define PNG_HASH_BITS     15
+#define PNG_MIN_MATCH     3
+#define PNG_MAX_MATCH     258
+#define PNG_TOO_FAR       4096  // Length 3 matches further away cost more
+#define PNG_MAX_TOKENS    16384 // Tokens per deflate block
+#define PNG_BLOCK_BYTES   (512 * 1024) // Filtered bytes per parallel block
+#define PNG_NUM_LIT       286
+#define PNG_NUM_DIST      30
+#define PNG_NUM_CODELEN   19
+#define PNG_MAX_CODE_BITS 15
+#define PNG_MAX_SIZE      (1 << 24) // Of either dimension, like stb_image
+
+/*
+    Match finder settings per level, like zlib's. Chains are searched for at
+    most chain candidates, searching stops at matches of nice bytes, and lazy
+    levels check whether a match at the next byte is longer before taking one.
+*/
+static const struct {
+    int32_t chain;
+    int32_t nice;
+    bool lazy;
+} png_levels[10] = {
+    {    0,   0, false }, // Stored
+    {    4,  16, false },
+    {    8,  32, false },
+    {   16,  32, false },
+    {   16,  64, true  },
+    {   32, 128, true  },
+    {  128, 258, true  },
+    {  256, 258, true  },
+    { 1024, 258, true  },
+    { 4096, 258, true  },
+};
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+    5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+    769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+    11, 11, 12, 12, 13, 13
+};
+static const uint8_t codelen_order[PNG_NUM_CODELEN] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static uint16_t reverse_bits(uint32_t code, int32_t len)
+{
+    uint32_t r = 0;
+    for (int32_t i = 0; i < len; i++) {
+        r = (r << 1) | ((code >> i) & 1);
+    }
+    return (uint16_t)r;
+}
+
+/*
+    Canonical Huffman codes for the given code lengths, bit-reversed since
+    deflate writes codes starting from their most significant bit.
+*/
+static void build_codes(const uint8_t* lens, int32_t n, uint16_t* codes)
+{
+    int32_t count[PNG_MAX_CODE_BITS + 1] = {0};
+    uint32_t next[PNG_MAX_CODE_BITS + 1];
+    for (int32_t i = 0; i < n; i++) { count[lens[i]]++; }
+    count[0] = 0;
+
+    uint32_t code = 0;
+    for (int32_t b = 1; b <= PNG_MAX_CODE_BITS; b++) {
+        code = (code + count[b - 1]) << 1;
+        next[b] = code;
+    }
+    for (int32_t i = 0; i < n; i++) {
+        codes[i] = lens[i] ? reverse_bits(next[lens[i]]++, lens[i]) : 0;
+    }
+}
+
+/*
+    Tables that don't depend on the image. Function-local statics are
+    initialized once even when encoders run concurrently.
+*/
+struct PngTables {
+    uint8_t len_code[PNG_MAX_MATCH + 1];
+    uint8_t dist_code[PNG_WINDOW + 1];
+    uint8_t fixed_lit_lens[288];
+    uint16_t fixed_lit_codes[288];
+    uint8_t fixed_dist_lens[PNG_NUM_DIST];
+    uint16_t fixed_dist_codes[PNG_NUM_DIST];
+    uint32_t crc[256];
+
+    PngTables()
+    {
+        for (int32_t c = 0; c < 28; c++) {
+            for (int32_t l = 0; l < (1 << len_extra[c]); l++) {
+                len_code[len_base[c] + l] = (uint8_t)c;
+            }
+        }
+        len_code[PNG_MAX_MATCH] = 28;
+        for (int32_t c = 0; c < PNG_NUM_DIST; c++) {
+            for (int32_t d = 0; d < (1 << dist_extra[c]); d++) {
+                dist_code[dist_base[c] + d] = (uint8_t)c;
+            }
+        }
+
+        for (int32_t i = 0; i < 288; i++) {
+            fixed_lit_lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        }
+        build_codes(fixed_lit_lens, 288, fixed_lit_codes);
+        memset(fixed_dist_lens, 5, sizeof(fixed_dist_lens));
+        build_codes(fixed_dist_lens, PNG_NUM_DIST, fixed_dist_codes);
+
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int32_t k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            crc[i] = c;
+        }
+    }
+};
+
+static const PngTables& tables()
+{
+    static PngTables t;
+    return t;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t* p, size_t n)
+{
+    const uint32_t* t = tables().crc;
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        crc = t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#define ADLER_MOD 65521
+
+static uint32_t adler32(const uint8_t* p, size_t n)
+{
+    uint32_t a = 1, b = 0;
+    while (n > 0) {
+        // Largest run whose sums can't overflow before the modulo
+        size_t run = n < 5552 ? n : 5552;
+        n -= run;
+        for (size_t i = 0; i < run; i++) {
+            a += *p++;
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return (b << 16) | a;
+}
+
+/*
+    Adler-32 of the concatenation of two buffers from the checksums of both,
+    where n2 is the length of the second. Same as zlib's adler32_combine.
+*/
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t n2)
+{
+    uint32_t rem = (uint32_t)(n2 % ADLER_MOD);
+    uint32_t a = adler1 & 0xffff;
+    uint32_t b = (rem * a) % ADLER_MOD;
+    a += (adler2 & 0xffff) + ADLER_MOD - 1;
+    b += (adler1 >> 16) + (adler2 >> 16) + ADLER_MOD - rem;
+    if (a >= ADLER_MOD) { a -= ADLER_MOD; }
+    if (a >= ADLER_MOD) { a -= ADLER_MOD; }
+    if (b >= 2 * ADLER_MOD) { b -= 2 * ADLER_MOD; }
+    if (b >= ADLER_MOD) { b -= ADLER_MOD; }
+    return (b << 16) | a;
+}
+
+// -----------------------------------------------------------------------------
+
+struct PngBuffer {
+    uint8_t* data;
+    size_t size, cap;
+    uint64_t bits;
+    int32_t num_bits;
+};
+
+static void reserve(PngBuffer* b, size_t n)
+{
+    if (b->size + n <= b->cap) {
+        return;
+    }
+    b->cap = b->cap * 2 > b->size + n ? b->cap * 2 : b->size + n;
+    b->data = (uint8_t*) realloc(b->data, b->cap);
+}
+
+static void put_bytes(PngBuffer* b, const void* p, size_t n)
+{
+    if (n == 0) {
+        return;
+    }
+    reserve(b, n);
+    memcpy(b->data + b->size, p, n);
+    b->size += n;
+}
+
+static void put_u32_be(PngBuffer* b, uint32_t v)
+{
+    uint8_t p[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16),
+                     (uint8_t)(v >> 8), (uint8_t)v };
+    put_bytes(b, p, 4);
+}
+
+// Codes of up to 16 bits, least significant bit first
+static void put_bits(PngBuffer* b, uint32_t v, int32_t n)
+{
+    b->bits |= (uint64_t)v << b->num_bits;
+    b->num_bits += n;
+    if (b->num_bits >= 8) {
+        reserve(b, 8);
+        while (b->num_bits >= 8) {
+            b->data[b->size++] = (uint8_t)b->bits;
+            b->bits >>= 8;
+            b->num_bits -= 8;
+        }
+    }
+}
+
+static void align_bits(PngBuffer* b)
+{
+    if (b->num_bits > 0) {
+        put_bits(b, 0, 8 - b->num_bits);
+    }
+}
+
+/*
+    Non-final stored blocks. Called with an empty range, this is the sync
+    flush that ends every parallel block on a byte boundary.
+*/
+static void put_stored(PngBuffer* b, const uint8_t* p, size_t n)
+{
+    do {
+        uint32_t len = n < 65535 ? (uint32_t)n : 65535;
+        put_bits(b, 0, 3);
+        align_bits(b);
+        uint8_t hdr[4] = { (uint8_t)len, (uint8_t)(len >> 8),
+                           (uint8_t)~len, (uint8_t)(~len >> 8) };
+        put_bytes(b, hdr, 4);
+        put_bytes(b, p, len);
+        p += len;
+        n -= len;
+    } while (n > 0);
+}
+
+// -----------------------------------------------------------------------------
+
+/*
+    Huffman code lengths of at most max_len bits for the symbol frequencies.
+    The tree is built with two queues over the symbols sorted by frequency,
+    then over-long codes are shortened by moving leaves down the tree, as in
+    miniz. A lone symbol gets a sibling, since decoders reject some incomplete
+    codes.
+*/
+static void build_lengths(uint32_t* freq, int32_t n, int32_t max_len,
+                          uint8_t* lens)
+{
+    int32_t syms[PNG_NUM_LIT];
+    int32_t m = 0;
+    for (int32_t i = 0; i < n; i++) {
+        lens[i] = 0;
+        if (freq[i]) { syms[m++] = i; }
+    }
+    if (m == 0) {
+        return;
+    }
+    if (m == 1) {
+        lens[syms[0]] = 1;
+        lens[syms[0] == 0 ? 1 : 0] = 1;
+        return;
+    }
+
+    // Insertion sort by frequency. n is at most 286.
+    for (int32_t i = 1; i < m; i++) {
+        int32_t s = syms[i], j = i;
+        for (; j > 0 && freq[syms[j - 1]] > freq[s]; j--) {
+            syms[j] = syms[j - 1];
+        }
+        syms[j] = s;
+    }
+
+    // Leaves are [0, m), internal nodes [m, 2m - 1), created in order of
+    // weight, so both queues stay sorted
+    uint32_t weight[2 * PNG_NUM_LIT];
+    int32_t parent[2 * PNG_NUM_LIT];
+    for (int32_t i = 0; i < m; i++) { weight[i] = freq[syms[i]]; }
+    int32_t leaf = 0, node = m;
+    for (int32_t next = m; next < 2 * m - 1; next++) {
+        int32_t pick[2];
+        for (int32_t k = 0; k < 2; k++) {
+            if (leaf < m && (node >= next || weight[leaf] <= weight[node])) {
+                pick[k] = leaf++;
+            } else {
+                pick[k] = node++;
+            }
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = next;
+    }
+
+    int32_t depth[2 * PNG_NUM_LIT];
+    int32_t count[2 * PNG_NUM_LIT] = {0};
+    depth[2 * m - 2] = 0;
+    for (int32_t i = 2 * m - 3; i >= 0; i--) {
+        depth[i] = depth[parent[i]] + 1;
+        if (i < m) { count[depth[i]]++; }
+    }
+
+    for (int32_t i = max_len + 1; i < m; i++) {
+        count[max_len] += count[i];
+        count[i] = 0;
+    }
+    uint32_t total = 0;
+    for (int32_t i = max_len; i > 0; i--) {
+        total += (uint32_t)count[i] << (max_len - i);
+    }
+    while (total != (1u << max_len)) {
+        count[max_len]--;
+        for (int32_t i = max_len - 1; i > 0; i--) {
+            if (count[i]) {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The least frequent symbols get the longest codes
+    int32_t s = 0;
+    for (int32_t len = max_len; len > 0; len--) {
+        for (int32_t k = 0; k < count[len]; k++) {
+            lens[syms[s++]] = (uint8_t)len;
+        }
+    }
+}
+
+struct PngToken {
+    uint16_t lit; // Literal byte, or match length if dist isn't 0
+    uint16_t dist;
+};
+
+struct PngHuffman {
+    uint8_t lit_lens[PNG_NUM_LIT];
+    uint16_t lit_codes[PNG_NUM_LIT];
+    uint8_t dist_lens[PNG_NUM_DIST];
+    uint16_t dist_codes[PNG_NUM_DIST];
+};
+
+static void put_tokens(PngBuffer* b, const PngToken* tokens, int32_t n,
+                       const uint8_t* lit_lens, const uint16_t* lit_codes,
+                       const uint8_t* dist_lens, const uint16_t* dist_codes)
+{
+    const PngTables& t = tables();
+    for (int32_t i = 0; i < n; i++) {
+        PngToken k = tokens[i];
+        if (!k.dist) {
+            put_bits(b, lit_codes[k.lit], lit_lens[k.lit]);
+            continue;
+        }
+        int32_t lc = t.len_code[k.lit];
+        put_bits(b, lit_codes[257 + lc], lit_lens[257 + lc]);
+        put_bits(b, k.lit - len_base[lc], len_extra[lc]);
+        int32_t dc = t.dist_code[k.dist];
+        put_bits(b, dist_codes[dc], dist_lens[dc]);
+        put_bits(b, k.dist - dist_base[dc], dist_extra[dc]);
+    }
+    put_bits(b, lit_codes[256], lit_lens[256]);
+}
+
+/*
+    Writes the tokens covering raw[0, n) as one non-final block, whichever of
+    dynamic Huffman, fixed Huffman or stored is smallest.
+*/
+static void put_block(PngBuffer* b, const PngToken* tokens, int32_t num_tokens,
+                      const uint8_t* raw, size_t n)
+{
+    const PngTables& t = tables();
+    uint32_t lit_freq[PNG_NUM_LIT] = {0};
+    uint32_t dist_freq[PNG_NUM_DIST] = {0};
+    for (int32_t i = 0; i < num_tokens; i++) {
+        if (tokens[i].dist) {
+            lit_freq[257 + t.len_code[tokens[i].lit]]++;
+            dist_freq[t.dist_code[tokens[i].dist]]++;
+        } else {
+            lit_freq[tokens[i].lit]++;
+        }
+    }
+    lit_freq[256] = 1;
+
+    PngHuffman h;
+    build_lengths(lit_freq, PNG_NUM_LIT, PNG_MAX_CODE_BITS, h.lit_lens);
+    build_lengths(dist_freq, PNG_NUM_DIST, PNG_MAX_CODE_BITS, h.dist_lens);
+    build_codes(h.lit_lens, PNG_NUM_LIT, h.lit_codes);
+    build_codes(h.dist_lens, PNG_NUM_DIST, h.dist_codes);
+
+    int32_t num_lit = PNG_NUM_LIT, num_dist = PNG_NUM_DIST;
+    while (num_lit > 257 && !h.lit_lens[num_lit - 1]) { num_lit--; }
+    while (num_dist > 1 && !h.dist_lens[num_dist - 1]) { num_dist--; }
+
+    // Run-length encoded code lengths of both trees, as symbol | extra << 8
+    uint8_t all[PNG_NUM_LIT + PNG_NUM_DIST];
+    memcpy(all, h.lit_lens, num_lit);
+    memcpy(all + num_lit, h.dist_lens, num_dist);
+    int32_t num_all = num_lit + num_dist;
+    uint16_t rle[PNG_NUM_LIT + PNG_NUM_DIST];
+    int32_t num_rle = 0;
+    uint32_t cl_freq[PNG_NUM_CODELEN] = {0};
+    for (int32_t i = 0; i < num_all;) {
+        int32_t run = 1;
+        while (i + run < num_all && all[i + run] == all[i]) { run++; }
+        if (all[i] == 0 && run >= 3) {
+            run = run > 138 ? 138 : run;
+            rle[num_rle++] = run <= 10 ? 17 | (run - 3) << 8
+                                       : 18 | (run - 11) << 8;
+        } else if (all[i] != 0 && run >= 4) {
+            run = run > 7 ? 7 : run;
+            rle[num_rle++] = all[i];
+            rle[num_rle++] = 16 | (run - 4) << 8;
+        } else {
+            run = 1;
+            rle[num_rle++] = all[i];
+        }
+        i += run;
+    }
+    for (int32_t i = 0; i < num_rle; i++) { cl_freq[rle[i] & 0xff]++; }
+
+    uint8_t cl_lens[PNG_NUM_CODELEN];
+    uint16_t cl_codes[PNG_NUM_CODELEN];
+    build_lengths(cl_freq, PNG_NUM_CODELEN, 7, cl_lens);
+    build_codes(cl_lens, PNG_NUM_CODELEN, cl_codes);
+    int32_t num_cl = PNG_NUM_CODELEN;
+    while (num_cl > 4 && !cl_lens[codelen_order[num_cl - 1]]) { num_cl--; }
+
+    // Sizes in bits of the three choices
+    static const uint8_t rle_extra[3] = { 2, 3, 7 };
+    uint64_t dynamic = 17 + 3 * num_cl;
+    for (int32_t i = 0; i < PNG_NUM_CODELEN; i++) {
+        dynamic += (uint64_t)cl_freq[i] *
+                   (cl_lens[i] + (i >= 16 ? rle_extra[i - 16] : 0));
+    }
+    uint64_t fixed = 3;
+    for (int32_t i = 0; i < PNG_NUM_LIT; i++) {
+        uint64_t extra = i > 256 ? len_extra[i - 257] : 0;
+        dynamic += (uint64_t)lit_freq[i] * (h.lit_lens[i] + extra);
+        fixed += (uint64_t)lit_freq[i] * (t.fixed_lit_lens[i] + extra);
+    }
+    for (int32_t i = 0; i < PNG_NUM_DIST; i++) {
+        dynamic += (uint64_t)dist_freq[i] * (h.dist_lens[i] + dist_extra[i]);
+        fixed += (uint64_t)dist_freq[i] * (5 + dist_extra[i]);
+    }
+    uint64_t stored = 8 * (uint64_t)n + 40 * (n / 65535 + 1);
+
+    if (stored <= dynamic && stored <= fixed) {
+        put_stored(b, raw, n);
+    } else if (fixed <= dynamic) {
+        put_bits(b, 1 << 1, 3);
+        put_tokens(b, tokens, num_tokens, t.fixed_lit_lens,
+                   t.fixed_lit_codes, t.fixed_dist_lens, t.fixed_dist_codes);
+    } else {
+        put_bits(b, 2 << 1, 3);
+        put_bits(b, num_lit - 257, 5);
+        put_bits(b, num_dist - 1, 5);
+        put_bits(b, num_cl - 4, 4);
+        for (int32_t i = 0; i < num_cl; i++) {
+            put_bits(b, cl_lens[codelen_order[i]], 3);
+        }
+        for (int32_t i = 0; i < num_rle; i++) {
+            int32_t s = rle[i] & 0xff;
+            put_bits(b, cl_codes[s], cl_lens[s]);
+            if (s >= 16) { put_bits(b, rle[i] >> 8, rle_extra[s - 16]); }
+        }
+        put_tokens(b, tokens, num_tokens, h.lit_lens, h.lit_codes,
+                   h.dist_lens, h.dist_codes);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+struct PngMatcher {
+    int32_t head[1 << PNG_HASH_BITS];
+    int32_t prev[PNG_WINDOW];
+};
+
+static uint32_t hash3(const uint8_t* p)
+{
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << PNG_HASH_BITS) - 1);
+}
+
+static void insert(PngMatcher* m, const uint8_t* data, int32_t i)
+{
+    uint32_t h = hash3(data + i);
+    m->prev[i & (PNG_WINDOW - 1)] = m->head[h];
+    m->head[h] = i;
+}
+
+// Longest earlier match for data[i], before i is inserted
+static int32_t find_match(PngMatcher* m, const uint8_t* data, int32_t n,
+                          int32_t i, int32_t level, int32_t* dist)
+{
+    int32_t max = n - i < PNG_MAX_MATCH ? n - i : PNG_MAX_MATCH;
+    if (max < PNG_MIN_MATCH) {
+        return 0;
+    }
+
+    int32_t best = 0;
+    int32_t nice = png_levels[level].nice;
+    int32_t chain = png_levels[level].chain;
+    const uint8_t* p = data + i;
+    for (int32_t c = m->head[hash3(p)]; c >= 0 && i - c <= PNG_WINDOW;
+         c = m->prev[c & (PNG_WINDOW - 1)]) {
+        const uint8_t* q = data + c;
+        if (q[best] == p[best]) {
+            int32_t len = 0;
+            while (len < max && q[len] == p[len]) { len++; }
+            if (len > best) {
+                best = len;
+                *dist = i - c;
+                if (len >= nice || len == max) { break; }
+            }
+        }
+        if (--chain == 0) { break; }
+    }
+
+    if (best < PNG_MIN_MATCH ||
+        (best == PNG_MIN_MATCH && *dist > PNG_TOO_FAR)) {
+        return 0;
+    }
+    return best;
+}
+
+/*
+    LZ77 over data[0, n), with hash chains as in zlib, flushing a block every
+    PNG_MAX_TOKENS tokens.
+*/
+static void deflate(PngBuffer* b, const uint8_t* data, int32_t n,
+                    int32_t level)
+{
+    if (level == 0) {
+        put_stored(b, data, n);
+        return;
+    }
+
+    PngMatcher* m = (PngMatcher*) malloc(sizeof(PngMatcher));
+    PngToken* tokens = (PngToken*) malloc(PNG_MAX_TOKENS * sizeof(PngToken));
+    memset(m->head, 0xff, sizeof(m->head));
+
+    int32_t num_tokens = 0, block_start = 0;
+    int32_t i = 0;
+    int32_t len = 0, dist = 0;
+    bool have_next = false; // len and dist already hold the match at i
+    while (i < n) {
+        if (num_tokens >= PNG_MAX_TOKENS - 1) {
+            put_block(b, tokens, num_tokens, data + block_start,
+                      i - block_start);
+            num_tokens = 0;
+            block_start = i;
+        }
+
+        if (!have_next) {
+            len = find_match(m, data, n, i, level, &dist);
+        }
+        have_next = false;
+        if (i + PNG_MIN_MATCH <= n) { insert(m, data, i); }
+
+        if (len && png_levels[level].lazy && len < png_levels[level].nice) {
+            int32_t next_dist = 0;
+            int32_t next = find_match(m, data, n, i + 1, level, &next_dist);
+            if (next > len) {
+                tokens[num_tokens++] = { data[i], 0 };
+                len = next;
+                dist = next_dist;
+                have_next = true;
+                i++;
+                continue;
+            }
+        }
+
+        if (len) {
+            tokens[num_tokens++] = { (uint16_t)len, (uint16_t)dist };
+            for (int32_t k = 1; k < len; k++) {
+                if (i + k + PNG_MIN_MATCH <= n) { insert(m, data, i + k); }
+            }
+            i += len;
+        } else {
+            tokens[num_tokens++] = { data[i], 0 };
+            i++;
+        }
+    }
+    if (num_tokens) {
+        put_block(b, tokens, num_tokens, data + block_start, n - block_start);
+    }
+
+    free(tokens);
+    free(m);
+}
+
+// -----------------------------------------------------------------------------
+
+static int32_t paeth(int32_t a, int32_t b, int32_t c)
+{
+    int32_t p = a + b - c;
+    int32_t pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) { return a; }
+    if (pb <= pc) { return b; }
+    return c;
+}
+
+static uint8_t predict(int32_t type, int32_t a, int32_t b, int32_t c)
+{
+    switch (type) {
+        case 1: return (uint8_t)a;
+        case 2: return (uint8_t)b;
+        case 3: return (uint8_t)((a + b) >> 1);
+        case 4: return (uint8_t)paeth(a, b, c);
+    }
+    return 0;
+}
+
+/*
+    Writes the filter type and the filtered n bytes of row. up is the previous
+    row, or 0 for the first. Like stb_image_write, the filter with the lowest
+    sum of residuals taken as signed bytes is picked, the first one on ties.
+*/
+static void filter_row(const uint8_t* row, const uint8_t* up, int32_t n,
+                       uint8_t* out)
+{
+    int32_t sums[5] = {0};
+    for (int32_t i = 0; i < n; i++) {
+        int32_t a = i >= 4 ? row[i - 4] : 0;
+        int32_t b = up ? up[i] : 0;
+        int32_t c = up && i >= 4 ? up[i - 4] : 0;
+        int32_t x = row[i];
+        sums[0] += abs((int8_t)x);
+        sums[1] += abs((int8_t)(uint8_t)(x - a));
+        sums[2] += abs((int8_t)(uint8_t)(x - b));
+        sums[3] += abs((int8_t)(uint8_t)(x - ((a + b) >> 1)));
+        sums[4] += abs((int8_t)(uint8_t)(x - paeth(a, b, c)));
+    }
+
+    int32_t best = 0;
+    for (int32_t type = 1; type < 5; type++) {
+        if (sums[type] < sums[best]) { best = type; }
+    }
+
+    out[0] = (uint8_t)best;
+    for (int32_t i = 0; i < n; i++) {
+        int32_t a = i >= 4 ? row[i - 4] : 0;
+        int32_t b = up ? up[i] : 0;
+        int32_t c = up && i >= 4 ? up[i - 4] : 0;
+        out[1 + i] = (uint8_t)(row[i] - predict(best, a, b, c));
+    }
+}
+
+struct PngEncoder {
+    const uint8_t* img; // Rows to encode
+    const uint8_t* up;  // Row above img, 0 at the top of the image
+    int32_t w, h;       // h is the number of rows of img
+    int32_t level;
+    int32_t rows_per_block;
+    int32_t num_blocks;
+    PngBuffer* blocks; // IDAT chunks
+    uint32_t* adlers;  // Of the filtered bytes of every block
+    std::atomic<int32_t> num_done;
+    PapayaProgressFn progress;
+    void* progress_data;
+};
+
+static void encode_block(void* data, int32_t index)
+{
+    PngEncoder* e = (PngEncoder*) data;
+    size_t stride = 4 * (size_t)e->w;
+    int32_t y0 = index * e->rows_per_block;
+    int32_t y1 = y0 + e->rows_per_block < e->h ? y0 + e->rows_per_block
+                                                : e->h;
+
+    size_t n = (stride + 1) * (y1 - y0);
+    uint8_t* filtered = (uint8_t*) malloc(n);
+    for (int32_t y = y0; y < y1; y++) {
+        const uint8_t* row = e->img + stride * y;
+        filter_row(row, y ? row - stride : e->up, (int32_t)stride,
+                   filtered + (stride + 1) * (y - y0));
+    }
+    e->adlers[index] = adler32(filtered, n);
+
+    PngBuffer* b = &e->blocks[index];
+    put_u32_be(b, 0); // Length, filled in below
+    put_bytes(b, "IDAT", 4);
+    if (index == 0 && !e->up) {
+        // zlib header: deflate with a 32K window, level hint in FLEVEL
+        static const uint8_t flg[4] = { 0x01, 0x5e, 0x9c, 0xda };
+        uint8_t hdr[2] = { 0x78, flg[e->level < 2 ? 0 :
+                                     e->level < 6 ? 1 :
+                                     e->level == 6 ? 2 : 3] };
+        put_bytes(b, hdr, 2);
+    }
+    deflate(b, filtered, (int32_t)n, e->level);
+    put_stored(b, 0, 0);
+    free(filtered);
+
+    uint32_t len = (uint32_t)(b->size - 8);
+    uint8_t* p = b->data;
+    p[0] = (uint8_t)(len >> 24); p[1] = (uint8_t)(len >> 16);
+    p[2] = (uint8_t)(len >> 8);  p[3] = (uint8_t)len;
+    put_u32_be(b, crc32(0, b->data + 4, b->size - 4));
+
+    int32_t done = ++e->num_done;
+    if (e->progress) {
+        e->progress(e->progress_data, (float)done / e->num_blocks);
+    }
+}
+
+static void put_chunk(PngBuffer* b, const char* type, const uint8_t* data,
+                      uint32_t n)
+{
+    put_u32_be(b, n);
+    size_t start = b->size;
+    put_bytes(b, type, 4);
+    put_bytes(b, data, n);
+    put_u32_be(b, crc32(0, b->data + start, n + 4));
+}
+
+static void init_encoder(PngEncoder* e, int32_t w, int32_t level)
+{
+    size_t stride = 4 * (size_t)w + 1;
+    e->img = e->up = 0;
+    e->w = w;
+    e->h = 0;
+    e->level = level < 0 ? 0 : level > 9 ? 9 : level;
+    e->rows_per_block = stride < PNG_BLOCK_BYTES ?
+                        (int32_t)(PNG_BLOCK_BYTES / stride) : 1;
+    e->progress = 0;
+    e->progress_data = 0;
+}
+
+static void put_header(PngBuffer* out, int32_t w, int32_t h)
+{
+    static const uint8_t signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    put_bytes(out, signature, 8);
+
+    uint8_t ihdr[13] = {
+        (uint8_t)(w >> 24), (uint8_t)(w >> 16), (uint8_t)(w >> 8), (uint8_t)w,
+        (uint8_t)(h >> 24), (uint8_t)(h >> 16), (uint8_t)(h >> 8), (uint8_t)h,
+        8, 6, 0, 0, 0 // 8-bit RGBA, deflate, adaptive filtering, progressive
+    };
+    put_chunk(out, "IHDR", ihdr, 13);
+}
+
+/*
+    Deflates the rows of e->img in parallel blocks and appends their IDAT
+    chunks to out, folding the checksums of the blocks into *adler
+*/
+static void put_rows(PngEncoder* e, PngBuffer* out, uint32_t* adler)
+{
+    size_t stride = 4 * (size_t)e->w + 1;
+    e->num_blocks = (e->h + e->rows_per_block - 1) / e->rows_per_block;
+    e->blocks = (PngBuffer*) calloc(e->num_blocks, sizeof(PngBuffer));
+    e->adlers = (uint32_t*) malloc(e->num_blocks * sizeof(uint32_t));
+    e->num_done = 0;
+
+    papaya_parallel_for(e->num_blocks, encode_block, e);
+
+    size_t total = 0;
+    for (int32_t i = 0; i < e->num_blocks; i++) {
+        total += e->blocks[i].size;
+    }
+    reserve(out, total + 64);
+    for (int32_t i = 0; i < e->num_blocks; i++) {
+        int32_t rows = i < e->num_blocks - 1 ? e->rows_per_block
+                                            : e->h - i * e->rows_per_block;
+        *adler = adler32_combine(*adler, e->adlers[i], stride * rows);
+        put_bytes(out, e->blocks[i].data, e->blocks[i].size);
+        free(e->blocks[i].data);
+    }
+    free(e->blocks);
+    free(e->adlers);
+}
+
+static void put_trailer(PngBuffer* out, uint32_t adler)
+{
+    // Empty final block with fixed codes, then the checksum of the stream
+    uint8_t tail[6] = { 0x03, 0x00, (uint8_t)(adler >> 24),
+                        (uint8_t)(adler >> 16), (uint8_t)(adler >> 8),
+                        (uint8_t)adler };
+    put_chunk(out, "IDAT", tail, 6);
+    put_chunk(out, "IEND", 0, 0);
+}
+
+uint8_t* papaya_encode_png(const uint8_t* img, int32_t w, int32_t h,
+                           int32_t level, size_t* size,
+                           PapayaProgressFn progress, void* progress_data)
+{
+    PngEncoder e;
+    init_encoder(&e, w, level);
+    e.img = img;
+    e.h = h;
+    e.progress = progress;
+    e.progress_data = progress_data;
+
+    PngBuffer out = {};
+    put_header(&out, w, h);
+    uint32_t adler = 1;
+    put_rows(&e, &out, &adler);
+    put_trailer(&out, adler);
+
+    *size = out.size;
+    return out.data;
+}
+
+struct PapayaPngWriter {
+    PngEncoder e;
+    PngBuffer out; // Chunks not yet written
+    uint8_t* up;   // Last row written
+    uint32_t adler;
+    int32_t h, rows; // Rows of the image, and written so far
+    PapayaWriteFn write;
+    void* data;
+    bool ok;
+};
+
+// Hands the buffered chunks to the write callback
+static void flush(PapayaPngWriter* pw)
+{
+    if (pw->ok && pw->out.size) {
+        pw->ok = pw->write(pw->data, pw->out.data, pw->out.size);
+    }
+    pw->out.size = 0;
+}
+
+PapayaPngWriter* papaya_png_writer_begin(int32_t w, int32_t h, int32_t level,
+                                         PapayaWriteFn write, void* data)
+{
+    PapayaPngWriter* pw = (PapayaPngWriter*) calloc(1,
+                                                    sizeof(PapayaPngWriter));
+    init_encoder(&pw->e, w, level);
+    pw->up = (uint8_t*) malloc(4 * (size_t)w);
+    pw->adler = 1;
+    pw->h = h;
+    pw->write = write;
+    pw->data = data;
+    pw->ok = true;
+    put_header(&pw->out, w, h);
+    flush(pw);
+    return pw;
+}
+
+bool papaya_png_writer_rows(PapayaPngWriter* pw, const uint8_t* rows,
+                            int32_t n)
+{
+    if (n > pw->h - pw->rows) { n = pw->h - pw->rows; }
+    if (n <= 0) {
+        return pw->ok;
+    }
+    pw->e.img = rows;
+    pw->e.h = n;
+    put_rows(&pw->e, &pw->out, &pw->adler);
+    flush(pw);
+
+    // The next rows are filtered against the last of these
+    size_t stride = 4 * (size_t)pw->e.w;
+    memcpy(pw->up, rows + stride * (n - 1), stride);
+    pw->e.up = pw->up;
+    pw->rows += n;
+    return pw->ok;
+}
+
+bool papaya_png_writer_end(PapayaPngWriter* pw)
+{
+    put_trailer(&pw->out, pw->adler);
+    flush(pw);
+    bool ok = pw->ok && pw->rows == pw->h;
+    free(pw->out.data);
+    free(pw->up);
+    free(pw);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+
+#define PNG_FAST_BITS 10 // Of the lookup table of Huffman codes
+#define PNG_RING      65536 // Inflated bytes kept, the window and a margin
+#define PNG_IN_BYTES  65536 // Read from the file at a time
+
+/*
+    Huffman code for decoding. Codes of up to PNG_FAST_BITS bits are looked up
+    directly in fast, as bits << 9 | symbol, by their next PNG_FAST_BITS bits;
+    longer ones are searched by length, as in zlib's puff.
+*/
+struct PngDecodeTable {
+    uint16_t fast[1 << PNG_FAST_BITS];
+    uint16_t count[PNG_MAX_CODE_BITS + 1]; // Codes of every length
+    uint16_t symbols[PNG_NUM_LIT + 2];     // Ordered by code
+};
+
+/*
+    Builds the table for the code lengths, or returns false if they are
+    over-subscribed. Incomplete codes are allowed, as a lone distance code.
+*/
+static bool build_decode_table(PngDecodeTable* t, const uint8_t* lens,
+                               int32_t n)
+{
+    memset(t->fast, 0, sizeof(t->fast));
+    memset(t->count, 0, sizeof(t->count));
+    for (int32_t i = 0; i < n; i++) { t->count[lens[i]]++; }
+    t->count[0] = 0;
+
+    int32_t left = 1, offsets[PNG_MAX_CODE_BITS + 2];
+    offsets[1] = 0;
+    for (int32_t b = 1; b <= PNG_MAX_CODE_BITS; b++) {
+        left = 2 * left - t->count[b];
+        if (left < 0) {
+            return false;
+        }
+        offsets[b + 1] = offsets[b] + t->count[b];
+    }
+    for (int32_t i = 0; i < n; i++) {
+        if (lens[i]) { t->symbols[offsets[lens[i]]++] = (uint16_t)i; }
+    }
+
+    uint16_t codes[PNG_NUM_LIT + 2];
+    build_codes(lens, n, codes);
+    for (int32_t i = 0; i < n; i++) {
+        int32_t len = lens[i];
+        if (!len || len > PNG_FAST_BITS) {
+            continue;
+        }
+        for (int32_t j = codes[i]; j < (1 << PNG_FAST_BITS); j += 1 << len) {
+            t->fast[j] = (uint16_t)(len << 9 | i);
+        }
+    }
+    return true;
+}
+
+enum PngInflateState_ {
+    PngInflate_Header, // Of the next block
+    PngInflate_Stored,
+    PngInflate_Codes,
+    PngInflate_Done,
+};
+
+struct PapayaPngReader {
+    PapayaReadFn read;
+    void* data;
+
+    // Input
+    uint8_t in[PNG_IN_BYTES];
+    size_t in_pos, in_len;
+    uint32_t idat_left; // Of the current IDAT chunk
+    bool idat_end; // Once the chunk after the last IDAT has been reached
+    uint64_t bits;
+    int32_t num_bits;
+
+    // Inflate
+    int32_t state;
+    bool last_block;
+    uint32_t stored_left;
+    PngDecodeTable lit, dist;
+    uint8_t ring[PNG_RING];
+    uint64_t produced, consumed; // Bytes of the ring
+
+    // Image
+    int32_t w, h, y;
+    int32_t depth, color, channels;
+    int32_t bpp; // Bytes per pixel, at least 1, for unfiltering
+    size_t row_bytes;
+    uint8_t* row;  // Filter type, then row_bytes
+    uint8_t* prev; // Unfiltered row before it, zeros at the top
+    uint8_t palette[256][4];
+    uint16_t key[3]; // Transparent color, for gray and RGB with tRNS
+    bool has_key;
+    bool failed;
+};
+
+static bool read_input(PapayaPngReader* r, void* p, size_t n)
+{
+    uint8_t* d = (uint8_t*)p;
+    while (n > 0) {
+        if (r->in_pos == r->in_len) {
+            r->in_pos = 0;
+            r->in_len = r->read(r->data, r->in, PNG_IN_BYTES);
+            if (r->in_len == 0) {
+                return false;
+            }
+        }
+        size_t k = r->in_len - r->in_pos < n ? r->in_len - r->in_pos : n;
+        memcpy(d, r->in + r->in_pos, k);
+        r->in_pos += k;
+        d += k;
+        n -= k;
+    }
+    return true;
+}
+
+static uint32_t get_u32_be(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+// Reads the length and type of the next chunk
+static bool read_chunk_header(PapayaPngReader* r, uint32_t* len, char* type)
+{
+    uint8_t hdr[8];
+    if (!read_input(r, hdr, 8)) {
+        return false;
+    }
+    *len = get_u32_be(hdr);
+    memcpy(type, hdr + 4, 4);
+    return *len <= 0x7fffffff;
+}
+
+static bool skip_input(PapayaPngReader* r, size_t n)
+{
+    uint8_t tmp[256];
+    while (n > 0) {
+        size_t k = n < sizeof(tmp) ? n : sizeof(tmp);
+        if (!read_input(r, tmp, k)) {
+            return false;
+        }
+        n -= k;
+    }
+    return true;
+}
+
+/*
+    Next byte of the zlib stream, which continues over consecutive IDAT
+    chunks. CRCs aren't checked. Returns false at the end of the stream,
+    after which reads that need more bits fail.
+*/
+static bool next_byte_slow(PapayaPngReader* r, uint32_t* b)
+{
+    while (r->idat_left == 0) {
+        uint32_t len;
+        char type[4];
+        if (r->idat_end || !skip_input(r, 4) ||
+            !read_chunk_header(r, &len, type) || memcmp(type, "IDAT", 4)) {
+            r->idat_end = true;
+            return false;
+        }
+        r->idat_left = len;
+    }
+    uint8_t v;
+    if (!read_input(r, &v, 1)) {
+        r->idat_end = true;
+        return false;
+    }
+    r->idat_left--;
+    *b = v;
+    return true;
+}
+
+static inline void fill_bits(PapayaPngReader* r)
+{
+    while (r->num_bits <= 56) {
+        uint32_t b;
+        if (r->idat_left && r->in_pos < r->in_len) {
+            b = r->in[r->in_pos++];
+            r->idat_left--;
+        } else if (!next_byte_slow(r, &b)) {
+            return;
+        }
+        r->bits |= (uint64_t)b << r->num_bits;
+        r->num_bits += 8;
+    }
+}
+
+static inline uint32_t get_bits(PapayaPngReader* r, int32_t n)
+{
+    if (r->num_bits < n) { fill_bits(r); }
+    if (r->num_bits < n) {
+        r->failed = true;
+        return 0;
+    }
+    uint32_t v = (uint32_t)(r->bits & ((1ull << n) - 1));
+    r->bits >>= n;
+    r->num_bits -= n;
+    return v;
+}
+
+static inline int32_t decode_symbol(PapayaPngReader* r,
+                                    const PngDecodeTable* t)
+{
+    if (r->num_bits < PNG_MAX_CODE_BITS) { fill_bits(r); }
+    uint32_t e = t->fast[r->bits & ((1 << PNG_FAST_BITS) - 1)];
+    int32_t len = e >> 9;
+    if (!e) {
+        // Canonical codes of each length follow those of the length before
+        int32_t code = 0, first = 0, index = 0;
+        for (len = 1; len <= PNG_MAX_CODE_BITS; len++) {
+            code |= (int32_t)(r->bits >> (len - 1)) & 1;
+            int32_t count = t->count[len];
+            if (code - first < count) {
+                e = t->symbols[index + code - first];
+                break;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    if (len > PNG_MAX_CODE_BITS || len > r->num_bits) {
+        r->failed = true;
+        return 0;
+    }
+    r->bits >>= len;
+    r->num_bits -= len;
+    return e & 511;
+}
+
+// Reads the code lengths of a block with dynamic Huffman codes
+static bool read_dynamic_tables(PapayaPngReader* r)
+{
+    int32_t num_lit = get_bits(r, 5) + 257;
+    int32_t num_dist = get_bits(r, 5) + 1;
+    int32_t num_codelen = get_bits(r, 4) + 4;
+    uint8_t lens[PNG_NUM_LIT + 2 + 32] = {0};
+    for (int32_t i = 0; i < num_codelen; i++) {
+        lens[codelen_order[i]] = (uint8_t)get_bits(r, 3);
+    }
+    PngDecodeTable* t = &r->lit; // Holds the code length code for now
+    if (!build_decode_table(t, lens, PNG_NUM_CODELEN)) {
+        return false;
+    }
+
+    memset(lens, 0, sizeof(lens));
+    for (int32_t i = 0; i < num_lit + num_dist && !r->failed; ) {
+        int32_t sym = decode_symbol(r, t);
+        int32_t repeat = 0;
+        uint8_t len = 0;
+        if (sym < 16) {
+            lens[i++] = (uint8_t)sym;
+            continue;
+        } else if (sym == 16) {
+            if (i == 0) {
+                return false;
+            }
+            len = lens[i - 1];
+            repeat = 3 + get_bits(r, 2);
+        } else if (sym == 17) {
+            repeat = 3 + get_bits(r, 3);
+        } else {
+            repeat = 11 + get_bits(r, 7);
+        }
+        if (i + repeat > num_lit + num_dist) {
+            return false;
+        }
+        memset(lens + i, len, repeat);
+        i += repeat;
+    }
+    return !r->failed && lens[256] &&
+           build_decode_table(&r->lit, lens, num_lit) &&
+           build_decode_table(&r->dist, lens + num_lit, num_dist);
+}
+
+static bool read_block_header(PapayaPngReader* r)
+{
+    r->last_block = get_bits(r, 1) != 0;
+    uint32_t type = get_bits(r, 2);
+    if (type == 0) {
+        // Stored, from the next byte boundary
+        get_bits(r, r->num_bits & 7);
+        uint32_t len = get_bits(r, 16);
+        uint32_t nlen = get_bits(r, 16);
+        if (len != (~nlen & 0xffff)) {
+            return false;
+        }
+        r->stored_left = len;
+        r->state = PngInflate_Stored;
+    } else if (type == 1) {
+        uint8_t lens[PNG_NUM_LIT + 2 + 32];
+        memset(lens, 8, 144);
+        memset(lens + 144, 9, 112);
+        memset(lens + 256, 7, 24);
+        memset(lens + 280, 8, 8);
+        memset(lens + 288, 5, 32);
+        build_decode_table(&r->lit, lens, 288);
+        build_decode_table(&r->dist, lens + 288, 32);
+        r->state = PngInflate_Codes;
+    } else if (type == 2) {
+        if (!read_dynamic_tables(r)) {
+            return false;
+        }
+        r->state = PngInflate_Codes;
+    } else {
+        return false;
+    }
+    return !r->failed;
+}
+
+/*
+    Inflates into the ring until it holds n bytes that haven't been
+    consumed, or the stream ends. Leaves room for one match of unconsumed
+    bytes, so that the bytes matches copy from are never overwritten.
+*/
+static bool inflate_some(PapayaPngReader* r, size_t n)
+{
+    const uint64_t mask = PNG_RING - 1;
+    while (r->produced - r->consumed < n && !r->failed) {
+        if (r->state == PngInflate_Done) {
+            return false;
+        }
+        if (r->state == PngInflate_Header) {
+            if (!read_block_header(r)) {
+                r->failed = true;
+            }
+            continue;
+        }
+        if (r->produced - r->consumed + PNG_MAX_MATCH > PNG_RING - PNG_WINDOW) {
+            return false; // n is larger than the ring can hold
+        }
+
+        if (r->state == PngInflate_Stored) {
+            if (r->stored_left == 0) {
+                r->state = r->last_block ? PngInflate_Done : PngInflate_Header;
+                continue;
+            }
+            r->ring[r->produced++ & mask] = (uint8_t)get_bits(r, 8);
+            r->stored_left--;
+            continue;
+        }
+
+        int32_t sym = decode_symbol(r, &r->lit);
+        if (sym < 256) {
+            r->ring[r->produced++ & mask] = (uint8_t)sym;
+            continue;
+        }
+        if (sym == 256) {
+            r->state = r->last_block ? PngInflate_Done : PngInflate_Header;
+            continue;
+        }
+        sym -= 257;
+        if (sym >= 29) {
+            r->failed = true;
+            break;
+        }
+        int32_t len = len_base[sym] + get_bits(r, len_extra[sym]);
+        int32_t d = decode_symbol(r, &r->dist);
+        if (d >= PNG_NUM_DIST) {
+            r->failed = true;
+            break;
+        }
+        uint32_t dist = dist_base[d] + get_bits(r, dist_extra[d]);
+        if (dist > r->produced) {
+            r->failed = true;
+            break;
+        }
+        for (int32_t i = 0; i < len; i++) {
+            r->ring[r->produced & mask] = r->ring[(r->produced - dist) & mask];
+            r->produced++;
+        }
+    }
+    return !r->failed;
+}
+
+// Takes the next n inflated bytes
+static bool inflate_bytes(PapayaPngReader* r, uint8_t* out, size_t n)
+{
+    const size_t chunk = PNG_RING - PNG_WINDOW - PNG_MAX_MATCH;
+    while (n > 0) {
+        size_t k = n < chunk ? n : chunk;
+        if (!inflate_some(r, k) || r->produced - r->consumed < k) {
+            return false;
+        }
+        for (size_t i = 0; i < k; i++) {
+            out[i] = r->ring[r->consumed++ & (PNG_RING - 1)];
+        }
+        out += k;
+        n -= k;
+    }
+    return true;
+}
+
+PapayaPngReader* papaya_png_reader_begin(PapayaReadFn read, void* data,
+                                         int32_t* w, int32_t* h)
+{
+    PapayaPngReader* r = (PapayaPngReader*) calloc(1,
+                                                   sizeof(PapayaPngReader));
+    r->read = read;
+    r->data = data;
+
+    static const uint8_t signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    uint8_t sig[8], ihdr[13];
+    uint32_t len;
+    char type[4];
+    if (!read_input(r, sig, 8) || memcmp(sig, signature, 8) ||
+        !read_chunk_header(r, &len, type) || memcmp(type, "IHDR", 4) ||
+        len != 13 || !read_input(r, ihdr, 13) || !skip_input(r, 4)) {
+        free(r);
+        return 0;
+    }
+    r->w = (int32_t)get_u32_be(ihdr);
+    r->h = (int32_t)get_u32_be(ihdr + 4);
+    r->depth = ihdr[8];
+    r->color = ihdr[9];
+    static const int8_t channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    r->channels = r->color <= 6 ? channels[r->color] : 0;
+    bool depth_ok = r->depth == 8 || r->depth == 16 ||
+                    ((r->color == 0 || r->color == 3) &&
+                     (r->depth == 1 || r->depth == 2 || r->depth == 4));
+    if (r->w <= 0 || r->h <= 0 || r->w > PNG_MAX_SIZE ||
+        r->h > PNG_MAX_SIZE || !r->channels || !depth_ok ||
+        (r->color == 3 && r->depth == 16) || ihdr[10] || ihdr[11] ||
+        ihdr[12]) {
+        // Interlaced images can't be decoded a row at a time
+        free(r);
+        return 0;
+    }
+
+    for (int32_t i = 0; i < 256; i++) {
+        r->palette[i][3] = 255;
+    }
+    for (;;) {
+        if (!read_chunk_header(r, &len, type)) {
+            free(r);
+            return 0;
+        }
+        if (!memcmp(type, "IDAT", 4)) {
+            r->idat_left = len;
+            break;
+        }
+        uint8_t buf[768];
+        bool ok = true;
+        if (!memcmp(type, "PLTE", 4) && len <= 768 && len % 3 == 0) {
+            ok = read_input(r, buf, len);
+            for (uint32_t i = 0; ok && i < len / 3; i++) {
+                memcpy(r->palette[i], buf + 3 * i, 3);
+            }
+        } else if (!memcmp(type, "tRNS", 4) && len <= 256) {
+            ok = read_input(r, buf, len);
+            if (ok && r->color == 3) {
+                for (uint32_t i = 0; i < len; i++) {
+                    r->palette[i][3] = buf[i];
+                }
+            } else if (ok && len == 2 * (uint32_t)r->channels &&
+                       r->channels != 2 && r->channels != 4) {
+                for (int32_t c = 0; c < r->channels; c++) {
+                    r->key[c] = (uint16_t)(buf[2 * c] << 8 | buf[2 * c + 1]);
+                }
+                r->has_key = true;
+            }
+        } else {
+            ok = skip_input(r, len);
+        }
+        if (!ok || !skip_input(r, 4)) {
+            free(r);
+            return 0;
+        }
+    }
+
+    // zlib header, deflate with no preset dictionary
+    uint32_t cmf = get_bits(r, 8), flg = get_bits(r, 8);
+    if (r->failed || (cmf & 15) != 8 || (cmf << 8 | flg) % 31 || flg & 32) {
+        free(r);
+        return 0;
+    }
+    r->state = PngInflate_Header;
+
+    int32_t bits = r->channels * r->depth;
+    r->bpp = bits < 8 ? 1 : bits / 8;
+    r->row_bytes = ((size_t)r->w * bits + 7) / 8;
+    r->row = (uint8_t*) malloc(r->row_bytes + 1);
+    r->prev = (uint8_t*) calloc(r->row_bytes, 1);
+    if (!r->row || !r->prev) {
+        free(r->row);
+        free(r->prev);
+        free(r);
+        return 0;
+    }
+    *w = r->w;
+    *h = r->h;
+    return r;
+}
+
+// Reverses the filter of r->row in place, against r->prev
+static bool unfilter_row(PapayaPngReader* r)
+{
+    uint8_t* x = r->row + 1;
+    const uint8_t* up = r->prev;
+    int32_t bpp = r->bpp;
+    size_t n = r->row_bytes;
+    switch (r->row[0]) {
+        case 0: break;
+        case 1: {
+            for (size_t i = bpp; i < n; i++) { x[i] += x[i - bpp]; }
+        } break;
+        case 2: {
+            for (size_t i = 0; i < n; i++) { x[i] += up[i]; }
+        } break;
+        case 3: {
+            for (size_t i = 0; i < n; i++) {
+                int32_t a = i >= (size_t)bpp ? x[i - bpp] : 0;
+                x[i] += (uint8_t)((a + up[i]) >> 1);
+            }
+        } break;
+        case 4: {
+            for (size_t i = 0; i < n; i++) {
+                int32_t a = i >= (size_t)bpp ? x[i - bpp] : 0;
+                int32_t c = i >= (size_t)bpp ? up[i - bpp] : 0;
+                x[i] += (uint8_t)paeth(a, up[i], c);
+            }
+        } break;
+        default: return false;
+    }
+    return true;
+}
+
+// Converts the unfiltered row to straight RGBA8, as stb_image does
+static void convert_row(const PapayaPngReader* r, const uint8_t* x,
+                        uint8_t* out)
+{
+    int32_t depth = r->depth;
+    for (int32_t i = 0; i < r->w; i++, out += 4) {
+        uint16_t v[4]; // Samples at their own depth
+        if (depth < 8) {
+            int32_t bit = i * depth;
+            v[0] = (x[bit >> 3] >> (8 - depth - (bit & 7))) &
+                   ((1 << depth) - 1);
+        } else {
+            for (int32_t c = 0; c < r->channels; c++) {
+                v[c] = depth == 8 ? x[i * r->channels + c] :
+                       (uint16_t)(x[2 * (i * r->channels + c)] << 8 |
+                                  x[2 * (i * r->channels + c) + 1]);
+            }
+        }
+
+        if (r->color == 3) {
+            memcpy(out, r->palette[v[0]], 4);
+            continue;
+        }
+        bool keyed = r->has_key;
+        for (int32_t c = 0; c < r->channels && keyed; c++) {
+            keyed = v[c] == r->key[c];
+        }
+        uint8_t s[4];
+        for (int32_t c = 0; c < r->channels; c++) {
+            s[c] = depth == 16 ? (uint8_t)(v[c] >> 8) :
+                   (uint8_t)(v[c] * (255 / ((1 << depth) - 1)));
+        }
+        if (r->channels <= 2) {
+            out[0] = out[1] = out[2] = s[0];
+            out[3] = r->channels == 2 ? s[1] : 255;
+        } else {
+            memcpy(out, s, 3);
+            out[3] = r->channels == 4 ? s[3] : 255;
+        }
+        if (keyed) { out[3] = 0; }
+    }
+}
+
+bool papaya_png_reader_rows(PapayaPngReader* r, uint8_t* out, int32_t n)
+{
+    for (int32_t i = 0; i < n; i++, out += 4 * (size_t)r->w) {
+        if (r->y >= r->h || r->failed ||
+            !inflate_bytes(r, r->row, r->row_bytes + 1) || !unfilter_row(r)) {
+            r->failed = true;
+            return false;
+        }
+        convert_row(r, r->row + 1, out);
+        memcpy(r->prev, r->row + 1, r->row_bytes);
+        r->y++;
+    }
+    return true;
+}
+
+void papaya_png_reader_end(PapayaPngReader* r)
+{
+    free(r->row);
+    free(r->prev);
+    free(r);
+}
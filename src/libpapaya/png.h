@@ -0,0 +1,79 @@
+#pragma once
+
+/*
+    PNG encoder for exporting images, and a streaming decoder.
+
+    Rows are filtered with the same per-row heuristic as stb_image_write. The
+    rows are then split into independent blocks that are deflated in parallel,
+    each ending on a byte boundary with an empty stored block, so that the
+    blocks concatenate into a single zlib stream, as in pigz. Every block goes
+    into its own IDAT chunk, which also spreads the CRCs over the workers.
+    Block boundaries cost a little compression, since matches can't reach
+    into the previous block.
+
+    Images too large to hold whole are written a strip of rows at a time
+    with a PapayaPngWriter, in the same blocks, and read a row at a time with
+    a PapayaPngReader, which keeps only the 32K window of the zlib stream and
+    two rows.
+*/
+
+#include "jobs.h"
+#include <stddef.h>
+
+#define PAPAYA_PNG_DEFAULT_LEVEL 6
+
+/*
+    Encodes the w*h RGBA image img, which holds straight alpha, as a PNG.
+    level trades speed for size: 0 stores the data uncompressed, 1 is the
+    fastest compression and 9 the smallest. progress, if not 0, is called with
+    the completed fraction as blocks finish, from any thread. Returns the
+    encoded file, to be freed with free(), and its size in *size.
+*/
+uint8_t* papaya_encode_png(const uint8_t* img, int32_t w, int32_t h,
+                           int32_t level, size_t* size,
+                           PapayaProgressFn progress, void* progress_data);
+
+/*
+    Writes n bytes to data's destination. Returns false on failure.
+*/
+typedef bool (*PapayaWriteFn)(void* data, const void* p, size_t n);
+
+/*
+    Streaming encoder of a w*h RGBA image, with the output of
+    papaya_encode_png. Strips of straight alpha rows are passed in top to
+    bottom, and every strip is encoded in parallel and written before
+    papaya_png_writer_rows returns. papaya_png_writer_end writes the end of
+    the file and frees the writer. Both return false if a write failed or,
+    for papaya_png_writer_end, if fewer than h rows were passed.
+*/
+struct PapayaPngWriter;
+
+PapayaPngWriter* papaya_png_writer_begin(int32_t w, int32_t h, int32_t level,
+                                         PapayaWriteFn write, void* data);
+bool papaya_png_writer_rows(PapayaPngWriter* pw, const uint8_t* rows,
+                            int32_t n);
+bool papaya_png_writer_end(PapayaPngWriter* pw);
+
+/*
+    Reads up to n bytes from data's source to p, and returns the number read,
+    0 at the end or on failure.
+*/
+typedef size_t (*PapayaReadFn)(void* data, void* p, size_t n);
+
+/*
+    Streaming decoder. papaya_png_reader_begin reads the header and returns
+    the size of the image in w, h, or returns 0 if the file isn't a PNG, is
+    wider or taller than 2^24 pixels, or can't be decoded by rows, e.g.
+    because it is interlaced or its rows can't be allocated.
+    papaya_png_reader_rows decodes the next n rows to out as straight 8-bit
+    RGBA, and returns false if the file is truncated or corrupt. Gray and
+    palette images are expanded, 16-bit samples keep their high byte, and
+    tRNS colors become transparent. CRCs and the Adler-32 of the data aren't
+    checked.
+*/
+struct PapayaPngReader;
+
+PapayaPngReader* papaya_png_reader_begin(PapayaReadFn read, void* data,
+                                         int32_t* w, int32_t* h);
+bool papaya_png_reader_rows(PapayaPngReader* r, uint8_t* out, int32_t n);
+void papaya_png_reader_end(PapayaPngReader* r);
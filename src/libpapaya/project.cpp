@@ -0,0 +1,668 @@
+#include "project.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TILE PAPAYA_IMAGE_TILE_SIZE
+#define TILE_BYTES (4 * TILE * TILE)
+
+/*
+    File layout. All values are little-endian, as on every supported platform,
+    and offsets are from the start of the file. The tables follow the header
+    in this order, each 8-byte aligned, followed by the raw tiles, which start
+    on a page boundary.
+*/
+#define PROJECT_MAGIC "PAPAYAPJ"
+#define PROJECT_VERSION 4
+#define PROJECT_PAGE 4096
+
+struct ProjectHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t width, height;
+    int32_t view_node;
+    uint32_t num_nodes, num_links, num_images;
+    uint32_t strings_size;
+    uint64_t nodes, links, images, tiles, strings; // Offsets of the tables
+    uint64_t num_tiles;
+};
+
+struct ProjectNode {
+    uint32_t type;
+    uint32_t name; // Offset into the string table
+    float pos_x, pos_y;
+    uint8_t is_active;
+    uint8_t invert_r, invert_g, invert_b;
+    uint32_t image;      // Level 0 of a bitmap, followed by its pyramid levels
+    uint32_t num_images; // 0 for nodes without an image
+    float angle;         // Of transforms, see TransformNode
+    float src_x, src_y, dst_x, dst_y;
+    uint32_t filter;
+    float radius;        // Of blurs, see BlurNode
+    float levels[5][4];  // Of levels nodes, in the order of LevelsNode
+};
+
+struct ProjectLink {
+    uint32_t from_node, from_slot; // Output slot
+    uint32_t to_node, to_slot;     // Input slot
+};
+
+struct ProjectImage {
+    int32_t width, height;
+    uint64_t first_tile; // Row-major tiles in the tile table
+};
+
+enum ProjectTile_ {
+    ProjectTile_Transparent,
+    ProjectTile_Raw,   // TILE_BYTES at offset
+    ProjectTile_Solid, // Every pixel, including the padding, is color
+    ProjectTile_COUNT
+};
+
+struct ProjectTile {
+    uint64_t offset;
+    uint32_t encoding;
+    uint8_t color[4];
+};
+
+// Slot layout of init_bitmap_node, init_invert_color_node,
+// init_transform_node, init_blur_node and init_levels_node
+static int32_t num_slots(uint32_t type)
+{
+    return type == PapayaNodeType_InvertColor ? 3 : 2;
+}
+
+static bool is_out_slot(uint32_t slot)
+{
+    return slot == 1;
+}
+
+static uint64_t align(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// -----------------------------------------------------------------------------
+
+struct SnapshotNode {
+    PapayaNodeType_ type;
+    char* name;
+    float pos_x, pos_y;
+    uint8_t is_active;
+    InvertColorNode invert_color;
+    TransformNode transform;
+    BlurNode blur;
+    LevelsNode levels_node;
+    PapayaTiles levels[PAPAYA_MAX_LEVELS]; // Image and pyramid of bitmaps
+    int32_t num_levels;
+};
+
+struct PapayaProjectSnapshot {
+    SnapshotNode* nodes;
+    int32_t num_nodes;
+    ProjectLink* links;
+    int32_t num_links;
+    int32_t width, height;
+    int32_t view_node;
+};
+
+/*
+    Pyramids are stored down to the first level that fits in a single tile,
+    which covers the previews of any zoom level that is useful in practice.
+*/
+static int32_t num_stored_levels(const PapayaTiles* image)
+{
+    int32_t l = 0;
+    while (l < PAPAYA_MAX_LEVELS - 1 &&
+           (papaya_level_size(image->width, l) > TILE ||
+            papaya_level_size(image->height, l) > TILE)) {
+        l++;
+    }
+    return l + 1;
+}
+
+PapayaProjectSnapshot* papaya_project_snapshot(PapayaGraph* g,
+                                               int32_t width, int32_t height,
+                                               int32_t view_node)
+{
+    PapayaProjectSnapshot* s =
+        (PapayaProjectSnapshot*) calloc(1, sizeof(PapayaProjectSnapshot));
+    s->nodes = (SnapshotNode*) calloc(g->num_nodes, sizeof(SnapshotNode));
+    s->num_nodes = g->num_nodes;
+    s->width = width;
+    s->height = height;
+    s->view_node = view_node;
+
+    s->links = (ProjectLink*) malloc(g->num_links * sizeof(ProjectLink));
+    for (int32_t i = 0; i < g->num_links; i++) {
+        const PapayaLink* l = &g->links[i];
+        if (l->from < 0) {
+            continue;
+        }
+        ProjectLink* link = &s->links[s->num_links++];
+        link->from_node = l->from / PAPAYA_MAX_NODE_SLOTS;
+        link->from_slot = l->from % PAPAYA_MAX_NODE_SLOTS;
+        link->to_node = l->to / PAPAYA_MAX_NODE_SLOTS;
+        link->to_slot = l->to % PAPAYA_MAX_NODE_SLOTS;
+    }
+
+    for (int32_t i = 0; i < g->num_nodes; i++) {
+        PapayaNode* node = &g->nodes[i];
+        SnapshotNode* n = &s->nodes[i];
+        size_t len = strlen(node->name) + 1;
+        n->type = node->type;
+        n->name = (char*) malloc(len);
+        memcpy(n->name, node->name, len);
+        n->pos_x = node->pos_x;
+        n->pos_y = node->pos_y;
+        n->is_active = node->is_active;
+
+        if (node->type == PapayaNodeType_InvertColor) {
+            n->invert_color = node->params.invert_color;
+        } else if (node->type == PapayaNodeType_Transform) {
+            n->transform = node->params.transform;
+        } else if (node->type == PapayaNodeType_Blur) {
+            n->blur = node->params.blur;
+        } else if (node->type == PapayaNodeType_Levels) {
+            n->levels_node = node->params.levels;
+        } else if (node->type == PapayaNodeType_Bitmap) {
+            // Brings the pyramid up to date, which only rebuilds the tiles
+            // edited since it was last used
+            BitmapNode* b = &node->params.bitmap;
+            n->num_levels = num_stored_levels(&b->image);
+            papaya_pyramid_update(&b->pyramid, &b->image, n->num_levels - 1);
+            papaya_tiles_copy(&n->levels[0], &b->image);
+            for (int32_t l = 1; l < n->num_levels; l++) {
+                papaya_tiles_copy(&n->levels[l], &b->pyramid.levels[l]);
+            }
+        }
+    }
+    return s;
+}
+
+void papaya_project_release(PapayaProjectSnapshot* s)
+{
+    for (int32_t i = 0; i < s->num_nodes; i++) {
+        SnapshotNode* n = &s->nodes[i];
+        for (int32_t l = 0; l < n->num_levels; l++) {
+            papaya_tiles_destroy(&n->levels[l]);
+        }
+        free(n->name);
+    }
+    free(s->nodes);
+    free(s->links);
+    free(s);
+}
+
+// -----------------------------------------------------------------------------
+
+static ProjectTile encode_tile(const PapayaTile* tile)
+{
+    ProjectTile e = {};
+    if (!tile) {
+        e.encoding = ProjectTile_Transparent;
+        return e;
+    }
+
+    const uint8_t* p = tile->pixels;
+    int32_t i = 4;
+    while (i < TILE_BYTES && p[i] == p[i % 4]) { i++; }
+    if (i == TILE_BYTES) {
+        e.encoding = ProjectTile_Solid;
+        memcpy(e.color, p, 4);
+    } else {
+        e.encoding = ProjectTile_Raw;
+    }
+    return e;
+}
+
+static bool write_at(FILE* f, uint64_t* pos, uint64_t offset, const void* data,
+                     size_t size)
+{
+    static const uint8_t zeros[PROJECT_PAGE] = {0};
+    while (*pos < offset) {
+        size_t n = offset - *pos < PROJECT_PAGE ? offset - *pos : PROJECT_PAGE;
+        if (fwrite(zeros, 1, n, f) != n) { return false; }
+        *pos += n;
+    }
+    if (size && fwrite(data, 1, size, f) != size) {
+        return false;
+    }
+    *pos += size;
+    return true;
+}
+
+bool papaya_project_write(PapayaProjectSnapshot* s, const char* path,
+                          PapayaProgressFn progress, void* progress_data)
+{
+    ProjectHeader h = {};
+    memcpy(h.magic, PROJECT_MAGIC, 8);
+    h.version = PROJECT_VERSION;
+    h.width = s->width;
+    h.height = s->height;
+    h.view_node = s->view_node;
+    h.num_nodes = s->num_nodes;
+    h.num_links = s->num_links;
+
+    // Tables
+    ProjectNode* nodes = (ProjectNode*) calloc(s->num_nodes,
+                                               sizeof(ProjectNode));
+    uint64_t num_tiles = 0;
+    for (int32_t i = 0; i < s->num_nodes; i++) {
+        SnapshotNode* n = &s->nodes[i];
+        ProjectNode* pn = &nodes[i];
+        pn->type = n->type;
+        pn->name = h.strings_size;
+        pn->pos_x = n->pos_x;
+        pn->pos_y = n->pos_y;
+        pn->is_active = n->is_active;
+        pn->invert_r = n->invert_color.invert_r;
+        pn->invert_g = n->invert_color.invert_g;
+        pn->invert_b = n->invert_color.invert_b;
+        pn->angle = n->transform.angle;
+        pn->src_x = n->transform.src_x;
+        pn->src_y = n->transform.src_y;
+        pn->dst_x = n->transform.dst_x;
+        pn->dst_y = n->transform.dst_y;
+        pn->filter = n->transform.filter;
+        pn->radius = n->blur.radius;
+        memcpy(pn->levels, &n->levels_node, sizeof(pn->levels));
+        pn->image = h.num_images;
+        pn->num_images = n->num_levels;
+        h.num_images += n->num_levels;
+        h.strings_size += (uint32_t)strlen(n->name) + 1;
+        for (int32_t l = 0; l < n->num_levels; l++) {
+            num_tiles += (uint64_t)n->levels[l].tiles_x * n->levels[l].tiles_y;
+        }
+    }
+    h.num_tiles = num_tiles;
+
+    ProjectImage* images = (ProjectImage*) malloc(h.num_images *
+                                                  sizeof(ProjectImage));
+    ProjectTile* index = (ProjectTile*) malloc(num_tiles * sizeof(ProjectTile));
+    char* strings = (char*) malloc(h.strings_size);
+
+    h.nodes = align(sizeof(ProjectHeader), 8);
+    h.links = align(h.nodes + s->num_nodes * sizeof(ProjectNode), 8);
+    h.images = align(h.links + s->num_links * sizeof(ProjectLink), 8);
+    h.tiles = align(h.images + h.num_images * sizeof(ProjectImage), 8);
+    h.strings = align(h.tiles + num_tiles * sizeof(ProjectTile), 8);
+    uint64_t data = align(h.strings + h.strings_size, PROJECT_PAGE);
+
+    uint64_t num_raw = 0;
+    uint64_t t = 0;
+    int32_t img = 0;
+    for (int32_t i = 0; i < s->num_nodes; i++) {
+        SnapshotNode* n = &s->nodes[i];
+        memcpy(strings + nodes[i].name, n->name, strlen(n->name) + 1);
+        for (int32_t l = 0; l < n->num_levels; l++) {
+            PapayaTiles* tiles = &n->levels[l];
+            images[img].width = tiles->width;
+            images[img].height = tiles->height;
+            images[img].first_tile = t;
+            img++;
+            for (int32_t k = 0; k < tiles->tiles_x * tiles->tiles_y; k++) {
+                index[t] = encode_tile(tiles->tiles[k]);
+                if (index[t].encoding == ProjectTile_Raw) {
+                    index[t].offset = data + num_raw++ * TILE_BYTES;
+                }
+                t++;
+            }
+        }
+    }
+
+    // Written next to path, since path may be mapped by the open document
+    size_t path_len = strlen(path);
+    char* tmp_path = (char*) malloc(path_len + 5);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    FILE* f = fopen(tmp_path, "wb");
+    uint64_t pos = 0;
+    bool ok = f &&
+        write_at(f, &pos, 0, &h, sizeof(h)) &&
+        write_at(f, &pos, h.nodes, nodes, s->num_nodes * sizeof(ProjectNode)) &&
+        write_at(f, &pos, h.links, s->links,
+                 s->num_links * sizeof(ProjectLink)) &&
+        write_at(f, &pos, h.images, images,
+                 h.num_images * sizeof(ProjectImage)) &&
+        write_at(f, &pos, h.tiles, index, num_tiles * sizeof(ProjectTile)) &&
+        write_at(f, &pos, h.strings, strings, h.strings_size) &&
+        write_at(f, &pos, data, 0, 0);
+
+    uint64_t written = 0;
+    t = 0;
+    for (int32_t i = 0; ok && i < s->num_nodes; i++) {
+        SnapshotNode* n = &s->nodes[i];
+        for (int32_t l = 0; ok && l < n->num_levels; l++) {
+            PapayaTiles* tiles = &n->levels[l];
+            for (int32_t k = 0; ok && k < tiles->tiles_x * tiles->tiles_y;
+                 k++, t++) {
+                if (index[t].encoding != ProjectTile_Raw) {
+                    continue;
+                }
+                ok = write_at(f, &pos, index[t].offset,
+                              tiles->tiles[k]->pixels, TILE_BYTES);
+                if (progress && ++written % 64 == 0) {
+                    progress(progress_data, (float)written / num_raw);
+                }
+            }
+        }
+    }
+
+    if (f && fclose(f) != 0) {
+        ok = false;
+    }
+    if (ok) {
+#ifdef _WIN32
+        remove(path); // rename doesn't replace existing files on Windows
+#endif
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok && f) {
+        remove(tmp_path);
+    }
+
+    free(tmp_path);
+    free(strings);
+    free(index);
+    free(images);
+    free(nodes);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+
+// True if count elements of elem bytes at offset lie within size bytes
+static bool in_file(uint64_t offset, uint64_t count, uint64_t elem,
+                    size_t size)
+{
+    return offset % 8 == 0 && offset <= size &&
+           count <= (size - offset) / elem;
+}
+
+/*
+    Checks the links against the slot layout of the nodes, and checks that the
+    graph has no cycles.
+*/
+static bool check_links(const ProjectHeader* h, const uint8_t* file)
+{
+    const ProjectNode* nodes = (const ProjectNode*)(file + h->nodes);
+    const ProjectLink* links = (const ProjectLink*)(file + h->links);
+    uint32_t n = h->num_nodes;
+    int32_t* inputs = (int32_t*) calloc(n, sizeof(int32_t));  // Unresolved
+    int32_t* order = (int32_t*) calloc(n, sizeof(int32_t));
+    bool* used = (bool*) calloc(3 * (size_t)n, sizeof(bool));
+    bool ok = true;
+
+    for (uint32_t i = 0; ok && i < h->num_links; i++) {
+        const ProjectLink* l = &links[i];
+        ok = l->from_node < n && l->to_node < n &&
+             l->from_slot < (uint32_t)num_slots(nodes[l->from_node].type) &&
+             l->to_slot < (uint32_t)num_slots(nodes[l->to_node].type) &&
+             is_out_slot(l->from_slot) && !is_out_slot(l->to_slot) &&
+             !used[3 * l->to_node + l->to_slot];
+        if (ok) {
+            used[3 * l->to_node + l->to_slot] = true;
+            inputs[l->to_node]++;
+        }
+    }
+
+    // Kahn's algorithm. Nodes left over when it stalls are part of a cycle.
+    int32_t count = 0, done = 0;
+    for (uint32_t i = 0; ok && i < n; i++) {
+        if (!inputs[i]) { order[count++] = i; }
+    }
+    while (ok && done < count) {
+        uint32_t node = order[done++];
+        for (uint32_t i = 0; i < h->num_links; i++) {
+            if (links[i].from_node == node && --inputs[links[i].to_node] == 0) {
+                order[count++] = links[i].to_node;
+            }
+        }
+    }
+    ok = ok && count == (int32_t)n;
+
+    free(inputs);
+    free(order);
+    free(used);
+    return ok;
+}
+
+static bool check_images(const ProjectHeader* h, const uint8_t* file,
+                         size_t size)
+{
+    const ProjectNode* nodes = (const ProjectNode*)(file + h->nodes);
+    const ProjectImage* images = (const ProjectImage*)(file + h->images);
+    const ProjectTile* index = (const ProjectTile*)(file + h->tiles);
+
+    for (uint32_t i = 0; i < h->num_nodes; i++) {
+        const ProjectNode* n = &nodes[i];
+        bool bitmap = n->type == PapayaNodeType_Bitmap;
+        if ((bitmap && (n->num_images < 1 ||
+                        n->num_images > PAPAYA_MAX_LEVELS)) ||
+            (!bitmap && n->num_images != 0) ||
+            n->image > h->num_images ||
+            n->num_images > h->num_images - n->image) {
+            return false;
+        }
+
+        for (uint32_t l = 0; l < n->num_images; l++) {
+            const ProjectImage* img = &images[n->image + l];
+            const ProjectImage* base = &images[n->image];
+            if (base->width <= 0 || base->height <= 0 ||
+                img->width != papaya_level_size(base->width, l) ||
+                img->height != papaya_level_size(base->height, l)) {
+                return false;
+            }
+
+            uint64_t num_tiles = (uint64_t)((img->width + TILE - 1) / TILE) *
+                                 ((img->height + TILE - 1) / TILE);
+            if (img->first_tile > h->num_tiles ||
+                num_tiles > h->num_tiles - img->first_tile) {
+                return false;
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < h->num_tiles; i++) {
+        const ProjectTile* t = &index[i];
+        if (t->encoding >= ProjectTile_COUNT ||
+            (t->encoding == ProjectTile_Raw &&
+             (t->offset > size || size - t->offset < TILE_BYTES))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool papaya_project_info(const uint8_t* file, size_t size,
+                         PapayaProjectInfo* info)
+{
+    if (size < sizeof(ProjectHeader)) {
+        return false;
+    }
+    const ProjectHeader* h = (const ProjectHeader*)file;
+    if (memcmp(h->magic, PROJECT_MAGIC, 8) != 0 ||
+        h->version != PROJECT_VERSION || h->num_nodes == 0 ||
+        h->num_nodes > INT32_MAX / 16 ||
+        h->width <= 0 || h->height <= 0 ||
+        h->view_node < 0 || (uint32_t)h->view_node >= h->num_nodes ||
+        !in_file(h->nodes, h->num_nodes, sizeof(ProjectNode), size) ||
+        !in_file(h->links, h->num_links, sizeof(ProjectLink), size) ||
+        !in_file(h->images, h->num_images, sizeof(ProjectImage), size) ||
+        !in_file(h->tiles, h->num_tiles, sizeof(ProjectTile), size) ||
+        !in_file(h->strings, h->strings_size, 1, size) ||
+        h->strings_size == 0 || file[h->strings + h->strings_size - 1]) {
+        return false;
+    }
+
+    const ProjectNode* nodes = (const ProjectNode*)(file + h->nodes);
+    for (uint32_t i = 0; i < h->num_nodes; i++) {
+        if ((nodes[i].type != PapayaNodeType_Bitmap &&
+             nodes[i].type != PapayaNodeType_InvertColor &&
+             nodes[i].type != PapayaNodeType_Transform &&
+             nodes[i].type != PapayaNodeType_Blur &&
+             nodes[i].type != PapayaNodeType_Levels) ||
+            (nodes[i].type == PapayaNodeType_Transform &&
+             nodes[i].filter >= PapayaFilter_COUNT) ||
+            (nodes[i].type == PapayaNodeType_Blur &&
+             !(nodes[i].radius >= 0.0f)) ||
+            nodes[i].name >= h->strings_size) {
+            return false;
+        }
+    }
+
+    if (!check_images(h, file, size) || !check_links(h, file)) {
+        return false;
+    }
+
+    info->num_nodes = h->num_nodes;
+    info->width = h->width;
+    info->height = h->height;
+    info->view_node = h->view_node;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+
+/*
+    Solid tiles of the same color share a tile, which is copied on write like
+    any other.
+*/
+#define MAX_SOLID_COLORS 64
+
+struct SolidTiles {
+    uint8_t colors[MAX_SOLID_COLORS][4];
+    PapayaTile* tiles[MAX_SOLID_COLORS];
+    int32_t count;
+};
+
+static PapayaTile* solid_tile(SolidTiles* s, const uint8_t* color)
+{
+    for (int32_t i = 0; i < s->count; i++) {
+        if (!memcmp(s->colors[i], color, 4)) {
+            return papaya_tile_ref(s->tiles[i]);
+        }
+    }
+
+    PapayaTile* tile = papaya_tile_alloc();
+    for (int32_t i = 0; i < TILE * TILE; i++) {
+        memcpy(tile->pixels + 4 * i, color, 4);
+    }
+    if (s->count < MAX_SOLID_COLORS) {
+        memcpy(s->colors[s->count], color, 4);
+        s->tiles[s->count++] = papaya_tile_ref(tile);
+    }
+    return tile;
+}
+
+// Fills the transparent image t with the tiles of img
+static void load_tiles(PapayaTiles* t, const ProjectImage* img,
+                       const ProjectTile* index, uint8_t* file,
+                       SolidTiles* solid)
+{
+    for (int32_t i = 0; i < t->tiles_x * t->tiles_y; i++) {
+        const ProjectTile* e = &index[img->first_tile + i];
+        if (e->encoding == ProjectTile_Raw) {
+            t->tiles[i] = papaya_tile_alloc(file + e->offset);
+        } else if (e->encoding == ProjectTile_Solid) {
+            t->tiles[i] = solid_tile(solid, e->color);
+        }
+    }
+}
+
+/*
+    Pyramid levels are up to date with the levels below them, so the ids of
+    the source tiles are recorded as update_level in tiles.cpp would.
+*/
+static void record_src_ids(PapayaPyramid* p, const PapayaTiles* src,
+                           int32_t l)
+{
+    const PapayaTiles* dst = &p->levels[l];
+    size_t num_tiles = (size_t)dst->tiles_x * dst->tiles_y;
+    p->src_ids[l] = (uint64_t*) calloc(4 * num_tiles, sizeof(uint64_t));
+
+    for (size_t i = 0; i < num_tiles; i++) {
+        int32_t tx = 2 * (int32_t)(i % dst->tiles_x);
+        int32_t ty = 2 * (int32_t)(i / dst->tiles_x);
+        for (int32_t j = 0; j < 4; j++) {
+            int32_t x = tx + j % 2;
+            int32_t y = ty + j / 2;
+            if (x < src->tiles_x && y < src->tiles_y) {
+                PapayaTile* tile = src->tiles[y * src->tiles_x + x];
+                p->src_ids[l][4 * i + j] = tile ? tile->id : 0;
+            }
+        }
+    }
+}
+
+void papaya_project_load(uint8_t* file, PapayaGraph* g)
+{
+    const ProjectHeader* h = (const ProjectHeader*)file;
+    const ProjectNode* pn = (const ProjectNode*)(file + h->nodes);
+    const ProjectLink* links = (const ProjectLink*)(file + h->links);
+    const ProjectImage* images = (const ProjectImage*)(file + h->images);
+    const ProjectTile* index = (const ProjectTile*)(file + h->tiles);
+    const char* strings = (const char*)(file + h->strings);
+    SolidTiles solid = {};
+
+    for (uint32_t i = 0; i < h->num_nodes; i++) {
+        PapayaNode* node = &g->nodes[i];
+        const char* name = strings + pn[i].name;
+        if (pn[i].type == PapayaNodeType_Bitmap) {
+            const ProjectImage* img = &images[pn[i].image];
+            BitmapNode* b = &node->params.bitmap;
+            init_bitmap_node(node, name, 0, img->width, img->height, 4);
+            load_tiles(&b->image, img, index, file, &solid);
+
+            b->pyramid.num_levels = pn[i].num_images;
+            for (uint32_t l = 1; l < pn[i].num_images; l++) {
+                const ProjectImage* level = &images[pn[i].image + l];
+                PapayaTiles* t = &b->pyramid.levels[l];
+                papaya_tiles_init(t, 0, level->width, level->height);
+                t->category = PapayaMem_Pyramids;
+                load_tiles(t, level, index, file, &solid);
+                record_src_ids(&b->pyramid,
+                               l == 1 ? &b->image : &b->pyramid.levels[l - 1],
+                               l);
+            }
+        } else if (pn[i].type == PapayaNodeType_Transform) {
+            TransformNode* t = &node->params.transform;
+            init_transform_node(node, name);
+            t->angle = pn[i].angle;
+            t->src_x = pn[i].src_x;
+            t->src_y = pn[i].src_y;
+            t->dst_x = pn[i].dst_x;
+            t->dst_y = pn[i].dst_y;
+            t->filter = (uint8_t)pn[i].filter;
+        } else if (pn[i].type == PapayaNodeType_Blur) {
+            init_blur_node(node, name);
+            node->params.blur.radius = pn[i].radius;
+        } else if (pn[i].type == PapayaNodeType_Levels) {
+            init_levels_node(node, name);
+            memcpy(&node->params.levels, pn[i].levels, sizeof(pn[i].levels));
+        } else {
+            InvertColorNode* ic = &node->params.invert_color;
+            init_invert_color_node(node, name);
+            ic->invert_r = pn[i].invert_r;
+            ic->invert_g = pn[i].invert_g;
+            ic->invert_b = pn[i].invert_b;
+        }
+        node->pos_x = pn[i].pos_x;
+        node->pos_y = pn[i].pos_y;
+        node->is_active = pn[i].is_active;
+    }
+
+    for (int32_t i = 0; i < solid.count; i++) {
+        papaya_tile_release(solid.tiles[i]);
+    }
+
+    // papaya_project_info checked the links for cycles, and loading may run
+    // off the main thread, so they are linked as is
+    for (uint32_t i = 0; i < h->num_links; i++) {
+        const ProjectLink* l = &links[i];
+        papaya_link_slots(&g->nodes[l->from_node].slots[l->from_slot],
+                          &g->nodes[l->to_node].slots[l->to_slot]);
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+/*
+    Project files hold a graph of nodes, with their parameters, links and
+    bitmap images.
+
+    Images are stored as tiles in their in-memory layout, page-aligned, behind
+    an index. Opening a project maps the file and points the tiles into the
+    mapping, so nothing is read or decoded up front. The OS reads in tiles
+    when they are first used, and opening takes the same time whatever the
+    size of the file. Fully transparent tiles and tiles of a single color are
+    compressed to their index entry. The pyramid levels of bitmaps are stored
+    too, so that zoomed out views only read the tiles of a coarse level.
+*/
+
+#include "libpapaya.h"
+#include "jobs.h"
+#include <stddef.h>
+
+struct PapayaProjectSnapshot;
+
+/*
+    Captures the state of the graph for writing. The snapshot shares the tiles
+    of the images, copy on write, so the nodes may be edited while it is being
+    written. width and height are the canvas size, and view_node the index of
+    the node being viewed. Main thread only, like papaya_project_release.
+*/
+PapayaProjectSnapshot* papaya_project_snapshot(PapayaGraph* g,
+                                               int32_t width, int32_t height,
+                                               int32_t view_node);
+void papaya_project_release(PapayaProjectSnapshot* s);
+
+/*
+    Writes the snapshot to path. May be called on any thread. The file is
+    written next to path and moved over it once complete, so path may be the
+    project that the nodes were opened from. Returns false on failure.
+*/
+bool papaya_project_write(PapayaProjectSnapshot* s, const char* path,
+                          PapayaProgressFn progress, void* progress_data);
+
+struct PapayaProjectInfo {
+    int32_t num_nodes;
+    int32_t width, height; // Canvas size
+    int32_t view_node;
+};
+
+/*
+    Checks that the size bytes at file hold a valid project, and if so,
+    describes it in info.
+*/
+bool papaya_project_info(const uint8_t* file, size_t size,
+                         PapayaProjectInfo* info);
+
+/*
+    Initializes the nodes of g, which must have been initialized with
+    info.num_nodes nodes, from a project that passed papaya_project_info. file
+    should be a private, writable mapping of the project file, since tiles
+    written in place write to it, and it must stay mapped until the graph is
+    destroyed. Node names point into file.
+*/
+void papaya_project_load(uint8_t* file, PapayaGraph* g);
@@ -0,0 +1,438 @@
+#include "libpapaya.h"
+#include "jobs.h"
+
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+
+#define TILE PAPAYA_IMAGE_TILE_SIZE
+#define TILE_BYTES (4 * TILE * TILE)
+
+// Atomic, so that images can be split into tiles on background threads
+static std::atomic<uint64_t> next_tile_id(1);
+
+// Pyramids with levels, most recently updated first
+static PapayaPyramid* pyramids_head;
+static PapayaPyramid* pyramids_tail;
+
+/*
+    Unless given, the pixels are allocated along with the tile, so freeing the
+    tile frees them too, and they count towards category
+*/
+static PapayaTile* alloc_tile(uint8_t* pixels = 0,
+                              int32_t category = PapayaMem_Tiles)
+{
+    PapayaTile* tile = (PapayaTile*) malloc(sizeof(PapayaTile) +
+                                            (pixels ? 0 : TILE_BYTES));
+    tile->pixels = pixels ? pixels : (uint8_t*)(tile + 1);
+    tile->id = next_tile_id++;
+    tile->refs = 1;
+    tile->category = pixels ? -1 : category;
+    if (!pixels) { papaya_mem_add(category, TILE_BYTES); }
+    return tile;
+}
+
+static bool is_transparent(const uint8_t* img, int32_t w, int32_t h,
+                           int32_t stride)
+{
+    for (int32_t y = 0; y < h; y++) {
+        const uint8_t* row = img + 4 * (int64_t)y * stride;
+        for (int32_t i = 0; i < 4 * w; i++) {
+            if (row[i]) { return false; }
+        }
+    }
+    return true;
+}
+
+void papaya_tiles_init(PapayaTiles* t, const uint8_t* img, int32_t w,
+                       int32_t h)
+{
+    t->width = w;
+    t->height = h;
+    t->tiles_x = (w + TILE - 1) / TILE;
+    t->tiles_y = (h + TILE - 1) / TILE;
+    t->category = PapayaMem_Tiles;
+    t->tiles = (PapayaTile**) calloc((size_t)t->tiles_x * t->tiles_y,
+                                     sizeof(PapayaTile*));
+    if (!img) {
+        return;
+    }
+
+    for (int32_t i = 0; i < t->tiles_x * t->tiles_y; i++) {
+        PapayaRect r = papaya_tiles_rect(t, i);
+        const uint8_t* src = img + 4 * ((int64_t)r.y * w + r.x);
+        if (!is_transparent(src, r.w, r.h, w)) {
+            papaya_tiles_write_rect(t, r, src, w);
+        }
+    }
+}
+
+void papaya_tiles_init_mapped(PapayaTiles* t, const uint8_t* img, int32_t w,
+                              int32_t h, uint8_t* mem)
+{
+    papaya_tiles_init(t, 0, w, h);
+    if (!img) {
+        return;
+    }
+
+    for (int32_t i = 0; i < t->tiles_x * t->tiles_y; i++) {
+        PapayaRect r = papaya_tiles_rect(t, i);
+        const uint8_t* src = img + 4 * ((int64_t)r.y * w + r.x);
+        if (is_transparent(src, r.w, r.h, w)) {
+            continue;
+        }
+
+        PapayaTile* tile = alloc_tile(mem + (size_t)i * TILE_BYTES);
+        if (r.w < TILE || r.h < TILE) {
+            memset(tile->pixels, 0, TILE_BYTES);
+        }
+        for (int32_t y = 0; y < r.h; y++) {
+            memcpy(tile->pixels + 4 * y * TILE, src + 4 * (int64_t)y * w,
+                   4 * r.w);
+        }
+        t->tiles[i] = tile;
+    }
+}
+
+size_t papaya_tiles_mapped_size(int32_t w, int32_t h)
+{
+    return (size_t)((w + TILE - 1) / TILE) * ((h + TILE - 1) / TILE) *
+           TILE_BYTES;
+}
+
+void papaya_tiles_destroy(PapayaTiles* t)
+{
+    for (int32_t i = 0; i < t->tiles_x * t->tiles_y; i++) {
+        papaya_tile_release(t->tiles[i]);
+    }
+    free(t->tiles);
+    memset(t, 0, sizeof(*t));
+}
+
+void papaya_tiles_copy(PapayaTiles* dst, const PapayaTiles* src)
+{
+    size_t n = (size_t)src->tiles_x * src->tiles_y;
+    *dst = *src;
+    dst->tiles = (PapayaTile**) malloc(n * sizeof(PapayaTile*));
+    for (size_t i = 0; i < n; i++) {
+        dst->tiles[i] = papaya_tile_ref(src->tiles[i]);
+    }
+}
+
+PapayaTile* papaya_tile_alloc(uint8_t* mem)
+{
+    return alloc_tile(mem);
+}
+
+PapayaTile* papaya_tile_ref(PapayaTile* tile)
+{
+    if (tile) { tile->refs++; }
+    return tile;
+}
+
+void papaya_tile_release(PapayaTile* tile)
+{
+    if (tile && --tile->refs == 0) {
+        if (tile->category >= 0) {
+            papaya_mem_add(tile->category, -TILE_BYTES);
+        }
+        free(tile);
+    }
+}
+
+uint8_t* papaya_tiles_write(PapayaTiles* t, int32_t index)
+{
+    PapayaTile* old = t->tiles[index];
+    if (old && old->refs == 1) {
+        old->id = next_tile_id++;
+        return old->pixels;
+    }
+
+    PapayaTile* tile = alloc_tile(0, t->category);
+    if (old) {
+        memcpy(tile->pixels, old->pixels, TILE_BYTES);
+        papaya_tile_release(old);
+    } else {
+        memset(tile->pixels, 0, TILE_BYTES);
+    }
+    t->tiles[index] = tile;
+    return tile->pixels;
+}
+
+PapayaTile* papaya_tiles_swap(PapayaTiles* t, int32_t index, PapayaTile* tile)
+{
+    PapayaTile* old = t->tiles[index];
+    t->tiles[index] = tile;
+    return old;
+}
+
+PapayaRect papaya_tiles_rect(const PapayaTiles* t, int32_t index)
+{
+    PapayaRect r;
+    r.x = (index % t->tiles_x) * TILE;
+    r.y = (index / t->tiles_x) * TILE;
+    r.w = t->width - r.x < TILE ? t->width - r.x : TILE;
+    r.h = t->height - r.y < TILE ? t->height - r.y : TILE;
+    return r;
+}
+
+const uint8_t* papaya_tiles_row(const PapayaTiles* t, int32_t x, int32_t y,
+                                int32_t* n)
+{
+    int32_t tx = x / TILE;
+    int32_t end = (tx + 1) * TILE;
+    *n = (end < t->width ? end : t->width) - x;
+
+    PapayaTile* tile = t->tiles[(y / TILE) * t->tiles_x + tx];
+    if (!tile) {
+        return 0;
+    }
+    return tile->pixels + 4 * ((y % TILE) * TILE + x % TILE);
+}
+
+void papaya_tiles_read(const PapayaTiles* t, PapayaRect r, uint8_t* out,
+                       int32_t stride)
+{
+    for (int32_t y = 0; y < r.h; y++) {
+        uint8_t* o = out + 4 * (int64_t)y * stride;
+        int32_t src_y = r.y + y;
+        if (src_y < 0 || src_y >= t->height) {
+            memset(o, 0, 4 * r.w);
+            continue;
+        }
+
+        for (int32_t x = 0; x < r.w;) {
+            int32_t src_x = r.x + x;
+            int32_t n = r.w - x;
+            const uint8_t* src = 0;
+            if (src_x < 0) {
+                if (n > -src_x) { n = -src_x; }
+            } else if (src_x < t->width) {
+                int32_t run;
+                src = papaya_tiles_row(t, src_x, src_y, &run);
+                if (n > run) { n = run; }
+            }
+
+            if (src) {
+                memcpy(o + 4 * x, src, 4 * n);
+            } else {
+                memset(o + 4 * x, 0, 4 * n);
+            }
+            x += n;
+        }
+    }
+}
+
+void papaya_tiles_write_rect(PapayaTiles* t, PapayaRect r, const uint8_t* src,
+                             int32_t stride)
+{
+    if (r.w <= 0 || r.h <= 0) {
+        return;
+    }
+
+    int32_t tx1 = r.x / TILE, tx2 = (r.x + r.w - 1) / TILE;
+    int32_t ty1 = r.y / TILE, ty2 = (r.y + r.h - 1) / TILE;
+
+    for (int32_t ty = ty1; ty <= ty2; ty++) {
+        for (int32_t tx = tx1; tx <= tx2; tx++) {
+            uint8_t* pixels = papaya_tiles_write(t, ty * t->tiles_x + tx);
+
+            // Part of r inside this tile
+            int32_t tile_x = tx * TILE, tile_y = ty * TILE;
+            int32_t x1 = r.x > tile_x ? r.x : tile_x;
+            int32_t y1 = r.y > tile_y ? r.y : tile_y;
+            int32_t x2 = r.x + r.w < tile_x + TILE ? r.x + r.w : tile_x + TILE;
+            int32_t y2 = r.y + r.h < tile_y + TILE ? r.y + r.h : tile_y + TILE;
+
+            for (int32_t y = y1; y < y2; y++) {
+                memcpy(pixels + 4 * ((y - tile_y) * TILE + x1 - tile_x),
+                       src + 4 * ((int64_t)(y - r.y) * stride + x1 - r.x),
+                       4 * (x2 - x1));
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+int32_t papaya_level_size(int32_t size, int32_t level)
+{
+    int64_t s = ((int64_t)size + ((int64_t)1 << level) - 1) >> level;
+    return s > 1 ? (int32_t)s : 1;
+}
+
+struct DownsampleJob {
+    PapayaTiles* dst;
+    const PapayaTiles* src;
+    int32_t* indices; // Tiles of dst to rebuild
+};
+
+/*
+    Averages the pixels of each 2x2 block of src that lies inside the image.
+    The 2x2 source tiles of a tile are aligned to it, so blocks never straddle
+    tiles. Padding outside the image is cleared.
+*/
+static void downsample_tile(void* data, int32_t i)
+{
+    DownsampleJob* job = (DownsampleJob*) data;
+    int32_t index = job->indices[i];
+    const PapayaTiles* src = job->src;
+    PapayaRect r = papaya_tiles_rect(job->dst, index);
+    uint8_t* out = job->dst->tiles[index]->pixels;
+
+    memset(out, 0, TILE_BYTES);
+    for (int32_t y = 0; y < r.h; y++) {
+        int32_t sy = 2 * (r.y + y);
+        int32_t ny = sy + 1 < src->height ? 2 : 1;
+        for (int32_t x = 0; x < r.w; x++) {
+            int32_t sx = 2 * (r.x + x);
+            int32_t nx = sx + 1 < src->width ? 2 : 1;
+            PapayaTile* tile = src->tiles[(sy / TILE) * src->tiles_x +
+                                          sx / TILE];
+            if (!tile) {
+                continue;
+            }
+
+            const uint8_t* p = tile->pixels +
+                               4 * ((sy % TILE) * TILE + sx % TILE);
+            int32_t n = nx * ny;
+            for (int32_t c = 0; c < 4; c++) {
+                uint32_t sum = p[c];
+                if (nx == 2) { sum += p[4 + c]; }
+                if (ny == 2) { sum += p[4 * TILE + c]; }
+                if (nx == 2 && ny == 2) { sum += p[4 * TILE + 4 + c]; }
+                out[4 * (y * TILE + x) + c] = (uint8_t)((sum + n / 2) / n);
+            }
+        }
+    }
+}
+
+/*
+    Rebuilds the tiles of level l whose source tiles in level l - 1 have been
+    replaced since the last update.
+*/
+static void update_level(PapayaPyramid* p, const PapayaTiles* src, int32_t l)
+{
+    PapayaTiles* dst = &p->levels[l];
+    int32_t num_tiles = dst->tiles_x * dst->tiles_y;
+    int32_t* indices = 0;
+    int32_t count = 0;
+
+    for (int32_t i = 0; i < num_tiles; i++) {
+        int32_t tx = 2 * (i % dst->tiles_x);
+        int32_t ty = 2 * (i / dst->tiles_x);
+        uint64_t* ids = p->src_ids[l] + 4 * i;
+        bool changed = false;
+        bool empty = true;
+
+        for (int32_t j = 0; j < 4; j++) {
+            int32_t x = tx + j % 2;
+            int32_t y = ty + j / 2;
+            PapayaTile* tile = 0;
+            if (x < src->tiles_x && y < src->tiles_y) {
+                tile = src->tiles[y * src->tiles_x + x];
+            }
+            uint64_t id = tile ? tile->id : 0;
+            if (ids[j] != id) { changed = true; }
+            if (tile) { empty = false; }
+            ids[j] = id;
+        }
+        if (!changed) {
+            continue;
+        }
+
+        if (empty) {
+            papaya_tile_release(papaya_tiles_swap(dst, i, 0));
+            continue;
+        }
+
+        // Allocation and reference counts stay on this thread
+        papaya_tiles_write(dst, i);
+        if (!indices) {
+            indices = (int32_t*) malloc(num_tiles * sizeof(int32_t));
+        }
+        indices[count++] = i;
+    }
+
+    if (count) {
+        DownsampleJob job = { dst, src, indices };
+        papaya_parallel_for(count, downsample_tile, &job);
+    }
+    free(indices);
+}
+
+static bool is_linked(PapayaPyramid* p)
+{
+    return p->prev || pyramids_head == p;
+}
+
+static void unlink_pyramid(PapayaPyramid* p)
+{
+    if (!is_linked(p)) {
+        return;
+    }
+    if (p->prev) { p->prev->next = p->next; } else { pyramids_head = p->next; }
+    if (p->next) { p->next->prev = p->prev; } else { pyramids_tail = p->prev; }
+    p->prev = p->next = 0;
+}
+
+static void link_pyramid(PapayaPyramid* p)
+{
+    unlink_pyramid(p);
+    p->next = pyramids_head;
+    if (pyramids_head) { pyramids_head->prev = p; } else { pyramids_tail = p; }
+    pyramids_head = p;
+}
+
+PapayaPyramid* papaya_pyramid_oldest()
+{
+    return pyramids_tail;
+}
+
+void papaya_pyramid_update(PapayaPyramid* p, const PapayaTiles* image,
+                           int32_t level)
+{
+    if (level >= PAPAYA_MAX_LEVELS) { level = PAPAYA_MAX_LEVELS - 1; }
+    if (p->num_levels == 0) { p->num_levels = 1; }
+    if (level > 0) { link_pyramid(p); }
+
+    while (p->num_levels <= level) {
+        int32_t l = p->num_levels++;
+        papaya_tiles_init(&p->levels[l], 0,
+                          papaya_level_size(image->width, l),
+                          papaya_level_size(image->height, l));
+        PapayaTiles* t = &p->levels[l];
+        t->category = PapayaMem_Pyramids;
+        p->src_ids[l] = (uint64_t*) calloc(4 * (size_t)t->tiles_x * t->tiles_y,
+                                           sizeof(uint64_t));
+    }
+
+    for (int32_t l = 1; l <= level; l++) {
+        update_level(p, l == 1 ? image : &p->levels[l - 1], l);
+    }
+}
+
+void papaya_pyramid_destroy(PapayaPyramid* p)
+{
+    unlink_pyramid(p);
+    for (int32_t l = 1; l < p->num_levels; l++) {
+        papaya_tiles_destroy(&p->levels[l]);
+        free(p->src_ids[l]);
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+void papaya_pyramid_copy(PapayaPyramid* dst, const PapayaPyramid* src)
+{
+    memset(dst, 0, sizeof(*dst));
+    dst->num_levels = src->num_levels;
+    dst->last_used = src->last_used;
+    for (int32_t l = 1; l < src->num_levels; l++) {
+        const PapayaTiles* t = &src->levels[l];
+        size_t n = 4 * (size_t)t->tiles_x * t->tiles_y;
+        papaya_tiles_copy(&dst->levels[l], t);
+        dst->src_ids[l] = (uint64_t*) malloc(n * sizeof(uint64_t));
+        memcpy(dst->src_ids[l], src->src_ids[l], n * sizeof(uint64_t));
+    }
+    if (dst->num_levels > 1) { link_pyramid(dst); }
+}
@@ -4,7 +4,9 @@
 #include "components/metrics_window.h"
 #include "components/brush.h"
 #include "components/color_panel.h"
+#include "components/doc_io.h"
 #include "components/eye_dropper.h"
+#include "components/gpu_eval.h"
 #include "components/graph_panel.h"
 #include "libs/stb_image.h"
 #include "libs/stb_image_write.h"
@@ -12,21 +14,61 @@
 #include "libs/mathlib.h"
 #include "libs/linmath.h"
 #include "libpapaya.h"
+#include "jobs.h"
+#include "kernels.h"
+#include "png.h"
 #include "pagl.h"
 #include "gl_lite.h"
 #include <inttypes.h>
+#include <stdio.h>
+
+#define PAPAYA_SETTLE_FRAMES 3
+#define PAPAYA_GPU_DEFAULT_BUDGET_MB 2048
 
 static void compile_shaders(PapayaMemory* mem);
 
+/*
+    Returns storage for the tiles of a w*h bitmap from the document's tile file.
+    Returns 0 if it doesn't fit, in which case the tiles go on the heap.
+*/
+u8* core::alloc_tile_storage(Document* doc, i32 w, i32 h)
+{
+    DocStorage* s = doc->storage;
+    size_t size = papaya_tiles_mapped_size(w, h);
+    if (!s->tile_file || s->tile_file_used + size > s->tile_file_size) {
+        return 0;
+    }
+
+    u8* mem = s->tile_file + s->tile_file_used;
+    s->tile_file_used += size;
+    return mem;
+}
+
+static void release_storage(DocStorage* s)
+{
+    if (--s->refs > 0) {
+        return;
+    }
+    // The tiles of the graph may point into the files
+    papaya_graph_destroy(&s->graph);
+    if (s->tile_file) {
+        platform::unmap_scratch_file(s->tile_file, s->tile_file_size);
+    }
+    if (s->project_file) {
+        platform::unmap_file(s->project_file, s->project_file_size);
+    }
+    free(s->path);
+    free(s);
+}
 
 void core::resize_doc(PapayaMemory* mem, i32 width, i32 height)
 {
     // Free existing texture memory
     if (mem->misc.fbo_sample_tex) {
-        GLCHK( glDeleteTextures(1, &mem->misc.fbo_sample_tex) );
+        pagl_delete_texture(&mem->misc.fbo_sample_tex);
     }
     if (mem->misc.fbo_render_tex) {
-        GLCHK( glDeleteTextures(1, &mem->misc.fbo_render_tex) );
+        pagl_delete_texture(&mem->misc.fbo_render_tex);
     }
 
     // Allocate new memory
@@ -40,34 +82,200 @@ void core::resize_doc(PapayaMemory* mem, i32 width, i32 height)
 
 bool core::open_doc(const char* path, PapayaMemory* mem)
 {
-    timer::start(Timer_ImageOpen);
-    // TODO: Implement
-    timer::stop(Timer_ImageOpen);
-    return true;
+    // Decoded in the background. The document is replaced when done.
+    return doc_io_open(mem, path);
 }
 
+/*
+    Also frees what the document has on the GPU. The document after it, or
+    else the one before it, becomes the current one.
+*/
 void core::close_doc(PapayaMemory* mem)
 {
-    free(mem->doc->nodes);
-    free(mem->doc);
+    Document* doc = mem->doc;
+    if (!doc) {
+        return;
+    }
+    release_gpu_graph(mem->gpu_evaluator, &doc->graph);
+    destroy_graph_panel(doc->graph_panel);
+    if (doc->undo.start) {
+        undo::destroy(mem);
+    }
+    pagl_delete_texture(&mem->misc.canvas_tex);
+
+    i32 index = 0;
+    while (mem->docs[index] != doc) {
+        index++;
+    }
+    mem->num_docs--;
+    memmove(&mem->docs[index], &mem->docs[index + 1],
+            (mem->num_docs - index) * sizeof(Document*));
+    destroy_doc(doc);
+
+    mem->doc = 0;
+    mem->graph_panel = 0;
+    mem->misc.canvas_node = 0;
+    mem->misc.canvas_pending = false;
+    mem->misc.view_tex = 0;
+    if (mem->num_docs > 0) {
+        switch_doc(mem, math::min(index, mem->num_docs - 1));
+    }
+}
+
+Document* core::init_doc(size_t num_nodes)
+{
+    Document* doc = (Document*) calloc(1, sizeof(Document));
+    DocStorage* s = (DocStorage*) calloc(1, sizeof(DocStorage));
+    s->refs = 1;
+    doc->storage = s;
+
+    // Sparse, so only the tiles written to take up space
+    s->tile_file_size = (size_t)1 << (sizeof(void*) >= 8 ? 40 : 30);
+    s->tile_file = (u8*)platform::map_scratch_file(s->tile_file_size);
+    // With room for the nodes that tools add, like crop and rotate
+    papaya_graph_init(&doc->graph, (i32)num_nodes, (i32)num_nodes + 16);
+    return doc;
+}
+
+Document* core::copy_doc(DocStorage* storage, const PapayaGraph* graph)
+{
+    Document* doc = (Document*) calloc(1, sizeof(Document));
+    storage->refs++;
+    doc->storage = storage;
+    papaya_graph_copy(&doc->graph, graph);
+    return doc;
+}
+
+void core::destroy_doc(Document* doc)
+{
+    papaya_graph_destroy(&doc->graph);
+    release_storage(doc->storage);
+    free(doc->name);
+    free(doc);
+}
+
+/*
+    The canvas of the current document is moved between Misc, where the code
+    that draws and evaluates it finds it, and the document
+*/
+static void swap_canvas(Misc* m, DocCanvas* c)
+{
+    DocCanvas t = *c;
+    c->canvas_tex = m->canvas_tex;
+    c->canvas_node = m->canvas_node;
+    c->canvas_tex_w = m->canvas_tex_w;
+    c->canvas_tex_h = m->canvas_tex_h;
+    c->canvas_level = m->canvas_level;
+    c->canvas_eval_level = m->canvas_eval_level;
+    c->canvas_pending = m->canvas_pending;
+    c->view_tex = m->view_tex;
+    c->w = m->w;
+    c->h = m->h;
+
+    m->canvas_tex = t.canvas_tex;
+    m->canvas_node = t.canvas_node;
+    m->canvas_tex_w = t.canvas_tex_w;
+    m->canvas_tex_h = t.canvas_tex_h;
+    m->canvas_level = t.canvas_level;
+    m->canvas_eval_level = t.canvas_eval_level;
+    m->canvas_pending = t.canvas_pending;
+    m->view_tex = t.view_tex;
+    m->w = t.w;
+    m->h = t.h;
+}
+
+void core::add_doc(PapayaMemory* mem, Document* doc, const char* name,
+                   i32 w, i32 h, i32 view_node)
+{
+    // Callers check for room, so that no open document is lost
+    if (mem->num_docs == PAPAYA_MAX_DOCS) {
+        platform::print("No room for another document\n");
+        destroy_doc(doc);
+        return;
+    }
+
+    size_t len = strlen(name) + 1;
+    doc->name = (char*) malloc(len);
+    memcpy(doc->name, name, len);
+    doc->graph_panel = init_graph_panel();
+    doc->graph_panel->cur_node = view_node;
+    doc->canvas.w = w;
+    doc->canvas.h = h;
+    GLCHK( glGenTextures(1, &doc->canvas.canvas_tex) );
+    pagl_bind_texture(0, doc->canvas.canvas_tex);
+    GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR) );
+    GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR) );
+
+    // Fit the image in the window
+    f32 zoom = 0.8f * math::min((f32)mem->window.width / w,
+                                (f32)mem->window.height / h);
+    doc->canvas_size = Vec2((f32)w, (f32)h);
+    doc->canvas_zoom = math::min(zoom, 1.0f);
+    doc->canvas_pos = Vec2((mem->window.width - w * doc->canvas_zoom) / 2.0f,
+                           (mem->window.height - h * doc->canvas_zoom) / 2.0f);
+
+    mem->docs[mem->num_docs++] = doc;
+    switch_doc(mem, mem->num_docs - 1);
+
+    // Marking the whole image as changed shows a preview first
+    for (i32 i = 0; i < doc->graph.num_nodes; i++) {
+        papaya_touch_node(&doc->graph.nodes[i]);
+    }
+    update_canvas(mem);
+}
+
+/*
+    Nothing is evaluated or uploaded for a document whose canvas was complete
+    when it was left, except with GPU evaluation, which redraws what was
+    trimmed in the meantime
+*/
+void core::switch_doc(PapayaMemory* mem, i32 index)
+{
+    Document* doc = mem->docs[index];
+    if (doc == mem->doc) {
+        return;
+    }
+    if (mem->doc) {
+        swap_canvas(&mem->misc, &mem->doc->canvas);
+    }
+    mem->doc = doc;
+    mem->graph_panel = doc->graph_panel;
+    swap_canvas(&mem->misc, &doc->canvas);
+
+    PapayaNode* node = &doc->graph.nodes[mem->graph_panel->cur_node];
+    if (mem->misc.gpu_eval || mem->misc.canvas_node != node) {
+        update_canvas(mem);
+    } else {
+        mem->misc.view_tex = mem->misc.canvas_tex;
+    }
 }
 
 void core::init(PapayaMemory* mem)
 {
+    papaya_jobs_init(0);
+    input_queue::init(&mem->input.queue);
+    papaya_set_profiler(profiler::begin, profiler::end);
+    arena::init(&mem->frame_arena, 16 * 1024 * 1024);
+
     // TODO: Temporary only
+    Document* doc = init_doc(3);
+    int w0, w1, h0, h1, c0, c1;
     {
-        mem->doc = (Document*) calloc(1, sizeof(Document));
-        mem->doc->num_nodes = 3;
-        mem->doc->nodes = (PapayaNode*) calloc(1, mem->doc->num_nodes *
-                                               sizeof(PapayaNode));
-        int w0, w1, h0, h1, c0, c1;
         u8* img0 = stbi_load("/home/apoorvaj/Pictures/o0.png", &w0, &h0, &c0, 4);
         u8* img1 = stbi_load("/home/apoorvaj/Pictures/o2.png", &w1, &h1, &c1, 4);
 
-        PapayaNode* n = mem->doc->nodes;
-        init_bitmap_node(&n[0], "Base image", img0, w0, h0, c0);
+        // Nodes work on premultiplied alpha
+        if (img0) { papaya_premultiply(img0, (i64)w0 * h0); }
+        if (img1) { papaya_premultiply(img1, (i64)w1 * h1); }
+
+        PapayaNode* n = doc->graph.nodes;
+        init_bitmap_node(&n[0], "Base image", img0, w0, h0, c0,
+                         alloc_tile_storage(doc, w0, h0));
         init_invert_color_node(&n[1], "Color inversion");
-        init_bitmap_node(&n[2], "Yellow circle", img1, w1, h1, c1);
+        init_bitmap_node(&n[2], "Yellow circle", img1, w1, h1, c1,
+                         alloc_tile_storage(doc, w1, h1));
+        stbi_image_free(img0);
+        stbi_image_free(img1);
 
         papaya_connect(&n[0].slots[1], &n[1].slots[0]);
         papaya_connect(&n[2].slots[1], &n[1].slots[2]);
@@ -76,20 +284,10 @@ void core::init(PapayaMemory* mem)
         n[1].pos_x = 108; n[1].pos_y = 108;
         n[2].pos_x = 158; n[2].pos_y = 158;
 
-        // Create texture
-        GLCHK( glGenTextures(1, &mem->misc.canvas_tex) );
-        GLCHK( glBindTexture(GL_TEXTURE_2D, mem->misc.canvas_tex) );
-        GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR) );
-        GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR) );
-
-        mem->misc.w = w0;
-        mem->misc.h = h0;
-        mem->doc->canvas_size = Vec2(w0, h0);
-        mem->doc->canvas_zoom = 1.0f;
-        mem->doc->canvas_pos = Vec2((mem->window.width - mem->doc->canvas_size.x) / 2.0f,
-                                    (mem->window.height - mem->doc->canvas_size.y) / 2.0f);
+        GLCHK( glGenBuffers(2, mem->misc.canvas_pbos) );
     }
 
+    pagl_set_program_cache(platform::cache_dir(&mem->frame_arena));
     compile_shaders(mem);
 
     // Init values and load textures
@@ -103,8 +301,9 @@ void core::init(PapayaMemory* mem)
 
         mem->brush = init_brush(mem);
         mem->eye_dropper = init_eye_dropper(mem);
+        mem->gpu_evaluator = init_gpu_evaluator(mem);
         mem->color_panel = init_color_panel(mem);
-        mem->graph_panel = init_graph_panel();
+        mem->doc_io = init_doc_io();
 
         mem->misc.draw_overlay = false;
         mem->misc.show_metrics = false;
@@ -113,6 +312,14 @@ void core::init(PapayaMemory* mem)
         mem->misc.prefs_open = false;
         mem->misc.show_nodes = true;
         mem->misc.preview_image_size = false;
+        mem->misc.png_level = PAPAYA_PNG_DEFAULT_LEVEL;
+        mem->misc.event_driven = true;
+        mem->misc.redraw_frames = PAPAYA_SETTLE_FRAMES;
+
+        // Half of the RAM leaves room for the OS and other programs
+        u64 ram_mb = platform::physical_memory() >> 20;
+        mem->misc.memory_budget_mb = ram_mb ? (i32)(ram_mb / 2) : 4096;
+        mem->misc.gpu_budget_mb = PAPAYA_GPU_DEFAULT_BUDGET_MB;
 
         f32 ortho_mtx[4][4] =
         {
@@ -150,7 +357,7 @@ void core::init(PapayaMemory* mem)
             // Create texture
             GLuint Id_GLuint;
             GLCHK( glGenTextures(1, &Id_GLuint) );
-            GLCHK( glBindTexture(GL_TEXTURE_2D, Id_GLuint) );
+            pagl_bind_texture(0, Id_GLuint);
             GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR) );
             GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR) );
             GLCHK( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ImageWidth, ImageHeight, 0,
@@ -186,7 +393,7 @@ void core::init(PapayaMemory* mem)
         io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
 
         GLCHK( glGenTextures(1, &mem->textures[PapayaTex_Font]) );
-        GLCHK( glBindTexture(GL_TEXTURE_2D, mem->textures[PapayaTex_Font]) );
+        pagl_bind_texture(0, mem->textures[PapayaTex_Font]);
         GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR) );
         GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR) );
         GLCHK( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels) );
@@ -215,7 +422,7 @@ void core::init(PapayaMemory* mem)
     }
 
     // TODO: Temporary
-    update_canvas(mem);
+    add_doc(mem, doc, "Untitled", w0, h0, 0);
 }
 
 void core::destroy(PapayaMemory* mem)
@@ -229,8 +436,17 @@ void core::destroy(PapayaMemory* mem)
 
     destroy_color_panel(mem->color_panel);
     destroy_eye_dropper(mem->eye_dropper);
-    destroy_graph_panel(mem->graph_panel);
+    destroy_doc_io(mem->doc_io);
+    while (mem->num_docs > 0) {
+        close_doc(mem);
+    }
+    destroy_gpu_evaluator(mem->gpu_evaluator);
+
+    pagl_delete_buffer(&mem->misc.canvas_pbos[0]);
+    pagl_delete_buffer(&mem->misc.canvas_pbos[1]);
 
+    arena::destroy(&mem->frame_arena);
+    papaya_jobs_shutdown();
     pagl_destroy();
 }
 
@@ -265,10 +481,54 @@ void core::resize(PapayaMemory* mem, i32 width, i32 height)
     // mem->doc->canvas_pos = Vec2i(x, y);
 }
 
+/*
+    Reports the GPU memory of pagl's objects to libpapaya's accounting, so that
+    all of it is in one place, and keeps within the budgets. Edits add tiles
+    without evaluating anything that would make room, so the CPU budget is
+    also enforced here. Over the GPU budget, the node textures that the view
+    doesn't need are freed.
+*/
+static void update_memory(PapayaMemory* mem)
+{
+    size_t gpu[2];
+    pagl_get_memory(&gpu[0], &gpu[1]);
+    for (i32 i = 0; i < 2; i++) {
+        i32 c = PapayaMem_GpuTextures + i;
+        papaya_mem_add(c, (i64)gpu[i] - (i64)papaya_mem_usage(c));
+    }
+
+    size_t budget = (size_t)mem->misc.memory_budget_mb << 20;
+    if (papaya_get_memory_budget() != budget) {
+        papaya_set_memory_budget(budget);
+    }
+    papaya_trim_memory();
+
+    if (gpu[0] + gpu[1] > (size_t)mem->misc.gpu_budget_mb << 20) {
+        if (mem->misc.gpu_eval) {
+            trim_gpu_evaluator(mem->gpu_evaluator);
+        } else {
+            reset_gpu_evaluator(mem->gpu_evaluator);
+        }
+    }
+}
+
 void core::update(PapayaMemory* mem)
 {
+    PROFILE_ZONE("Update");
+
     // Initialize frame
     {
+        arena::reset(&mem->frame_arena);
+        pagl_gpu_frame();
+        update_memory(mem);
+        if (mem->misc.redraw_frames > 0) { mem->misc.redraw_frames--; }
+
+        Input* in = &mem->input;
+        in->samples = (InputSample*) arena::alloc(
+            &mem->frame_arena, INPUT_QUEUE_SIZE * sizeof(InputSample));
+        in->num_samples = input_queue::pop(&in->queue, in->samples,
+                                           INPUT_QUEUE_SIZE);
+
         // Current mouse info
         {
             mem->mouse.pos = math::round_to_vec2i(ImGui::GetMousePos());
@@ -313,7 +573,7 @@ void core::update(PapayaMemory* mem)
                                 mem->colors[PapayaCol_Clear].b, 1.0f) );
             GLCHK( glClear(GL_COLOR_BUFFER_BIT) );
 
-            GLCHK( glEnable(GL_SCISSOR_TEST) );
+            pagl_set_cap(GL_SCISSOR_TEST, true);
             GLCHK( glScissor(34, 3,
                              (i32)mem->window.width  - 70,
                              (i32)mem->window.height - 58) ); // TODO: Remove magic numbers
@@ -323,7 +583,7 @@ void core::update(PapayaMemory* mem)
                 mem->colors[PapayaCol_Workspace].b, 1.0f) );
             GLCHK( glClear(GL_COLOR_BUFFER_BIT) );
 
-            GLCHK( glDisable(GL_SCISSOR_TEST) );
+            pagl_set_cap(GL_SCISSOR_TEST, false);
         }
 
         // Set projection matrix
@@ -345,48 +605,41 @@ void core::update(PapayaMemory* mem)
         ImGuiWindowFlags flags = mem->window.default_imgui_flags
                                | ImGuiWindowFlags_MenuBar;
         ImGui::Begin("Title Bar Menu", 0, flags);
+
+        // Disabled while a file is being opened or saved, which works on the
+        // current document
+        bool busy = doc_io_busy(mem->doc_io);
         if (ImGui::BeginMenuBar()) {
             ImGui::PushStyleColor(ImGuiCol_WindowBg, mem->colors[PapayaCol_Clear]);
             if (ImGui::BeginMenu("FILE")) {
                 mem->misc.menu_open = true;
 
-                // TODO: Implement
-                /*if (mem->doc) {
-                    // A document is already open
-
-                    if (ImGui::MenuItem("Close")) { close_doc(mem); }
-                    if (ImGui::MenuItem("Save")) {
-                        char* Path = platform::save_file_dialog();
-                        u8* tex = (u8*)malloc(4 * mem->doc->width * mem->doc->height);
-                        if (Path) {
-                            // TODO: Do this on a separate thread. Massively blocks UI for large images.
-                            GLCHK(glBindTexture(GL_TEXTURE_2D,
-                                                mem->doc->final_node->tex_id));
-                            GLCHK(glGetTexImage(GL_TEXTURE_2D, 0,
-                                                GL_RGBA, GL_UNSIGNED_BYTE,
-                                                tex));
-
-                            i32 Result = stbi_write_png(Path, mem->doc->width, mem->doc->height, 4, tex, 4 * mem->doc->width);
-                            if (!Result) {
-                                // TODO: Log: Save failed
-                                platform::print("Save failed\n");
-                            }
-
-                            free(tex);
-                            free(Path);
-                        }
-                    }
-                } else */{
-                // No document open
-
-                    if (ImGui::MenuItem("Open")) {
-                        char* Path = platform::open_file_dialog();
-                        if (Path)
-                        {
-                            open_doc(Path, mem);
-                            free(Path);
-                        }
-                    }
+                // Open documents are never closed to make room
+                bool room = mem->num_docs < PAPAYA_MAX_DOCS;
+                if (ImGui::MenuItem("Open", 0, false, !busy && room)) {
+                    char* path = platform::open_file_dialog(&mem->frame_arena);
+                    if (path) { open_doc(path, mem); }
+                }
+                if (ImGui::MenuItem("Save", 0, false, !busy)) {
+                    char* path = platform::save_file_dialog(&mem->frame_arena);
+                    if (path) { doc_io_save(mem, path); }
+                }
+                ImGui::Separator();
+                // Shares the tiles of the current document, so it is
+                // nearly free until either is edited
+                if (ImGui::MenuItem("Duplicate", 0, false, !busy && room)) {
+                    Document* d = mem->doc;
+                    char name[256];
+                    snprintf(name, sizeof(name), "%s copy", d->name);
+                    add_doc(mem, copy_doc(d->storage, &d->graph), name,
+                            mem->misc.w, mem->misc.h,
+                            (i32)mem->graph_panel->cur_node);
+                }
+                // The workspace always shows a document, so the last one
+                // stays open
+                if (ImGui::MenuItem("Close", 0, false,
+                                    !busy && mem->num_docs > 1)) {
+                    close_doc(mem);
                 }
                 ImGui::Separator();
                 if (ImGui::MenuItem("Quit", "Alt+F4")) { mem->is_running = false; }
@@ -399,12 +652,52 @@ void core::update(PapayaMemory* mem)
                 ImGui::EndMenu();
             }
 
+            if (ImGui::BeginMenu("NODE")) {
+                mem->misc.menu_open = true;
+                if (ImGui::MenuItem("Blur", 0, false, mem->doc != 0)) {
+                    PapayaNode* n = papaya_graph_add_node(&mem->doc->graph);
+                    if (n) {
+                        init_blur_node(n, "Blur");
+                        append_to_current(mem, n);
+                        update_canvas(mem);
+                    } else {
+                        platform::print("No room for another node in the graph\n");
+                    }
+                }
+                if (ImGui::MenuItem("Levels", 0, false, mem->doc != 0)) {
+                    PapayaNode* n = papaya_graph_add_node(&mem->doc->graph);
+                    if (n) {
+                        init_levels_node(n, "Levels");
+                        append_to_current(mem, n);
+                        update_canvas(mem);
+                    } else {
+                        platform::print("No room for another node in the graph\n");
+                    }
+                }
+                ImGui::EndMenu();
+            }
+
             if (ImGui::BeginMenu("VIEW")) {
                 mem->misc.menu_open = true;
                 ImGui::MenuItem("Metrics Window", NULL, &mem->misc.show_metrics);
                 ImGui::MenuItem("Undo Buffer Window", NULL, &mem->misc.show_undo_buffer);
+                if (ImGui::MenuItem("GPU Node Evaluation", NULL,
+                                    &mem->misc.gpu_eval)) {
+                    update_canvas(mem);
+                }
                 ImGui::EndMenu();
             }
+
+            // Tabs of the open documents
+            ImGui::Separator();
+            for (i32 i = 0; i < mem->num_docs; i++) {
+                ImGui::PushID(i);
+                if (ImGui::MenuItem(mem->docs[i]->name, 0,
+                                    mem->docs[i] == mem->doc, !busy)) {
+                    switch_doc(mem, i);
+                }
+                ImGui::PopID();
+            }
             ImGui::EndMenuBar();
             ImGui::PopStyleColor();
         }
@@ -494,7 +787,10 @@ void core::update(PapayaMemory* mem)
     }
 
     if (mem->misc.prefs_open) {
-        prefs::show_panel(mem->color_panel, mem->colors, mem->window);
+        prefs::show_panel(mem->color_panel, mem->colors, mem->window,
+                          &mem->misc.png_level, &mem->misc.event_driven,
+                          &mem->misc.memory_budget_mb,
+                          &mem->misc.gpu_budget_mb);
     }
 
     // Color Picker
@@ -544,6 +840,15 @@ void core::update(PapayaMemory* mem)
         {
             crop_rotate::toolbar(mem);
         }
+        else if (mem->current_tool == PapayaTool_EyeDropper)
+        {
+            const char* sizes[] = { "Point", "3x3 average", "5x5 average" };
+            i32 s = mem->eye_dropper->sample_size / 2;
+            ImGui::PushItemWidth(110);
+            ImGui::Combo("Sample size", &s, sizes, 3);
+            ImGui::PopItemWidth();
+            mem->eye_dropper->sample_size = 2 * s + 1;
+        }
 
         ImGui::End();
 
@@ -558,6 +863,9 @@ void core::update(PapayaMemory* mem)
 
     // Undo/Redo
     {
+        // Commit undo images whose readback has finished
+        undo::update(&mem->doc->undo);
+
         if (ImGui::GetIO().KeyCtrl &&
             ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z))) { // Pop undo op
             // TODO: Clean up this workflow
@@ -569,13 +877,20 @@ void core::update(PapayaMemory* mem)
                 // Redo 
                 mem->doc->undo.current = mem->doc->undo.current->next;
                 mem->doc->undo.current_index++;
+                if (mem->doc->undo.current->op_code == PapayaUndoOp_Tiles) {
+                    undo::swap_tiles(mem->doc->undo.current);
+                    update_canvas(mem);
+                }
                 mem->brush->line_segment_start_uv = mem->doc->undo.current->line_segment_start_uv;
                 refresh = true;
             } else if (!ImGui::GetIO().KeyShift &&
                 mem->doc->undo.current_index > 0 &&
                 mem->doc->undo.current->prev != 0) {
                 // Undo
-                if (mem->doc->undo.current->IsSubRect) {
+                if (mem->doc->undo.current->op_code == PapayaUndoOp_Tiles) {
+                    undo::swap_tiles(mem->doc->undo.current);
+                    update_canvas(mem);
+                } else if (mem->doc->undo.current->IsSubRect) {
                     // undo::pop(mem, true);
                 } else {
                     refresh = true;
@@ -641,7 +956,7 @@ void core::update(PapayaMemory* mem)
 
     // Draw alpha grid
     {
-        glEnable(GL_SCISSOR_TEST);
+        pagl_set_cap(GL_SCISSOR_TEST, true);
         // TODO: Conflate PapayaMesh_AlphaGrid and PapayaMesh_Canvas?
         pagl_transform_quad_mesh(mem->meshes[PapayaMesh_AlphaGrid],
                                  mem->doc->canvas_pos,
@@ -653,7 +968,8 @@ void core::update(PapayaMemory* mem)
         if (mem->current_tool == PapayaTool_CropRotate) // Rotate around center
         {
             mat4x4 r;
-            Vec2 offset = mem->doc->canvas_pos + (mem->doc->canvas_size * 0.5f);
+            Vec2 offset = mem->doc->canvas_pos +
+                          mem->doc->canvas_size * mem->doc->canvas_zoom * 0.5f;
 
             mat4x4_translate_in_place(m, offset.x, offset.y, 0.f);
             mat4x4_rotate_Z(r, m, math::to_radians(90.0f * mem->crop_rotate.base_rotation));
@@ -661,25 +977,33 @@ void core::update(PapayaMemory* mem)
             mat4x4_dup(m, r);
         }
 
-        GLCHK( glEnable(GL_BLEND) );
+        pagl_set_cap(GL_BLEND, true);
         GLCHK( glBlendEquation(GL_FUNC_ADD) );
         GLCHK( glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
 
         f32 inv_aspect = mem->doc->canvas_size.y / mem->doc->canvas_size.x;
+        PaglUniform u[] = {
+            pagl_mat4(&m[0][0]),
+            pagl_color(mem->colors[PapayaCol_AlphaGrid1]),
+            pagl_color(mem->colors[PapayaCol_AlphaGrid2]),
+            pagl_float(mem->doc->canvas_zoom),
+            pagl_float(inv_aspect),
+            pagl_float(math::max(mem->doc->canvas_size.x,
+                                 mem->doc->canvas_size.y)),
+        };
         pagl_draw_mesh(mem->meshes[PapayaMesh_AlphaGrid],
                        mem->shaders[PapayaShader_AlphaGrid],
-                       6,
-                       Pagl_UniformType_Matrix4, m,
-                       Pagl_UniformType_Color, mem->colors[PapayaCol_AlphaGrid1],
-                       Pagl_UniformType_Color, mem->colors[PapayaCol_AlphaGrid2],
-                       Pagl_UniformType_Float, mem->doc->canvas_zoom,
-                       Pagl_UniformType_Float, inv_aspect,
-                       Pagl_UniformType_Float, math::max(mem->doc->canvas_size.x,
-                                                         mem->doc->canvas_size.y));
+                       PAGL_COUNT(u), u);
     }
 
+    // Continue evaluating the canvas where the previous frame left off
+    refine_canvas(mem);
+    refresh_thumbnails(mem);
+
     // Draw canvas
     {
+        PROFILE_ZONE("Draw canvas");
+        PAGL_GPU_ZONE("Draw canvas");
         pagl_transform_quad_mesh(mem->meshes[PapayaMesh_Canvas],
                                  mem->doc->canvas_pos,
                                  mem->doc->canvas_size * mem->doc->canvas_zoom);
@@ -690,7 +1014,8 @@ void core::update(PapayaMemory* mem)
         if (mem->current_tool == PapayaTool_CropRotate) // Rotate around center
         {
             mat4x4 r;
-            Vec2 offset = mem->doc->canvas_pos + (mem->doc->canvas_size * 0.5f);
+            Vec2 offset = mem->doc->canvas_pos +
+                          mem->doc->canvas_size * mem->doc->canvas_zoom * 0.5f;
 
             mat4x4_translate_in_place(m, offset.x, offset.y, 0.f);
             mat4x4_rotate_Z(r, m, mem->crop_rotate.slider_angle + 
@@ -701,18 +1026,19 @@ void core::update(PapayaMemory* mem)
 
         // TODO: Node support 
         // GLCHK( glBindTexture(GL_TEXTURE_2D, mem->doc->final_node->tex_id) );
-        GLCHK( glBindTexture(GL_TEXTURE_2D, mem->misc.canvas_tex) );
+        pagl_bind_texture(0, mem->misc.view_tex);
         GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR ) );
         GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST) );
-        GLCHK( glEnable(GL_BLEND) );
+        pagl_set_cap(GL_BLEND, true);
         GLCHK( glBlendEquation(GL_FUNC_ADD) );
-        GLCHK( glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
+        // Canvas texture holds premultiplied alpha
+        GLCHK( glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA) );
 
+        PaglUniform u[] = { pagl_mat4(&m[0][0]) };
         pagl_draw_mesh(mem->meshes[PapayaMesh_Canvas],
                        mem->shaders[PapayaShader_ImGui],
-                       1,
-                       Pagl_UniformType_Matrix4, m);
-        glDisable(GL_SCISSOR_TEST);
+                       PAGL_COUNT(u), u);
+        pagl_set_cap(GL_SCISSOR_TEST, false);
     }
 
     // TODO: Switch case <------
@@ -742,6 +1068,9 @@ void core::update(PapayaMemory* mem)
 
 EndOfDoc:
 
+    // Background open and save
+    update_doc_io(mem);
+
     metrics_window::update(mem);
 
     ImGui::Render(mem);
@@ -760,17 +1089,46 @@ EndOfDoc:
     }
 }
 
+/*
+    Frames change without input while the canvas is being refined, files or
+    undo images are in flight, the metrics are shown, and while a mouse button
+    is held, for tools that act over time.
+*/
+bool core::needs_redraw(PapayaMemory* mem)
+{
+    if (!mem->misc.event_driven || mem->misc.redraw_frames > 0) {
+        return true;
+    }
+    if (mem->misc.canvas_pending || mem->misc.show_metrics ||
+        doc_io_busy(mem->doc_io) || ImGui::GetIO().WantTextInput) {
+        return true;
+    }
+    if (mem->doc && undo::busy(&mem->doc->undo)) {
+        return true;
+    }
+    for (i32 i = 0; i < 3; i++) {
+        if (mem->mouse.is_down[i]) { return true; }
+    }
+    return false;
+}
+
+/*
+    ImGui takes a few frames to settle after input, e.g. to size windows that
+    just appeared, so input keeps frames coming for a little longer.
+*/
+void core::request_redraw(PapayaMemory* mem)
+{
+    mem->misc.redraw_frames = PAPAYA_SETTLE_FRAMES;
+}
+
 void core::render_imgui(ImDrawData* draw_data, void* mem_ptr)
 {
+    PROFILE_ZONE("Render ImGui");
+    PAGL_GPU_ZONE("Render ImGui");
     PapayaMemory* mem = (PapayaMemory*)mem_ptr;
 
+    // Bindings are tracked by pagl, so only the caps need restoring
     pagl_push_state();
-    // Backup GL state
-    GLint last_program, last_texture, last_array_buffer, last_element_array_buffer;
-    GLCHK( glGetIntegerv(GL_CURRENT_PROGRAM, &last_program) );
-    GLCHK( glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture) );
-    GLCHK( glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &last_array_buffer) );
-    GLCHK( glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &last_element_array_buffer) );
 
     // Setup render state: alpha-blending enabled, no face culling, no depth testing, scissor enabled
     pagl_enable(2, GL_BLEND, GL_SCISSOR_TEST);
@@ -778,23 +1136,21 @@ void core::render_imgui(ImDrawData* draw_data, void* mem_ptr)
     
     GLCHK( glBlendEquation(GL_FUNC_ADD) );
     GLCHK( glBlendFunc    (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
-    GLCHK( glActiveTexture(GL_TEXTURE0) );
 
     // Handle cases of screen coordinates != from framebuffer coordinates (e.g. retina displays)
     ImGuiIO& io     = ImGui::GetIO();
     f32 fb_height = io.DisplaySize.y * io.DisplayFramebufferScale.y;
     draw_data->ScaleClipRects(io.DisplayFramebufferScale);
 
-    GLCHK( glUseProgram      (mem->shaders[PapayaShader_ImGui]->id) );
-    GLCHK( glUniform1i       (mem->shaders[PapayaShader_ImGui]->uniforms[1], 0) );
-    GLCHK( glUniformMatrix4fv(mem->shaders[PapayaShader_ImGui]->uniforms[0], 1, GL_FALSE, &mem->window.proj_mtx[0][0]) );
+    PaglUniform u[] = { pagl_mat4(&mem->window.proj_mtx[0][0]) };
+    pagl_set_uniforms(mem->shaders[PapayaShader_ImGui], PAGL_COUNT(u), u);
 
     for (i32 n = 0; n < draw_data->CmdListsCount; n++)
     {
         const ImDrawList* cmd_list = draw_data->CmdLists[n];
         const ImDrawIdx* idx_buffer_offset = 0;
 
-        GLCHK( glBindBuffer(GL_ARRAY_BUFFER, mem->meshes[PapayaMesh_ImGui]->vbo_handle) );
+        pagl_bind_vbo(mem->meshes[PapayaMesh_ImGui]->vbo_handle);
         GLCHK( glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)cmd_list->VtxBuffer.size() * sizeof(ImDrawVert), (GLvoid*)&cmd_list->VtxBuffer.front(), GL_STREAM_DRAW) );
 
         GLCHK( glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mem->meshes[PapayaMesh_ImGui]->elements_handle) );
@@ -810,7 +1166,7 @@ void core::render_imgui(ImDrawData* draw_data, void* mem_ptr)
             }
             else
             {
-                GLCHK( glBindTexture(GL_TEXTURE_2D, (GLuint)(intptr_t)pcmd->TextureId) );
+                pagl_bind_texture(0, (GLuint)(intptr_t)pcmd->TextureId);
                 GLCHK( glScissor((i32)pcmd->ClipRect.x, (i32)(fb_height - pcmd->ClipRect.w), (i32)(pcmd->ClipRect.z - pcmd->ClipRect.x), (i32)(pcmd->ClipRect.w - pcmd->ClipRect.y)) );
                 GLCHK( glDrawElements(GL_TRIANGLES, (GLsizei)pcmd->ElemCount, GL_UNSIGNED_SHORT, idx_buffer_offset) );
             }
@@ -818,25 +1174,162 @@ void core::render_imgui(ImDrawData* draw_data, void* mem_ptr)
         }
     }
 
-    // Restore modified GL state
-    GLCHK( glUseProgram     (last_program) );
-    GLCHK( glBindTexture    (GL_TEXTURE_2D, last_texture) );
-    GLCHK( glBindBuffer     (GL_ARRAY_BUFFER, last_array_buffer) );
-    GLCHK( glBindBuffer     (GL_ELEMENT_ARRAY_BUFFER, last_element_array_buffer) );
     pagl_pop_state();
 }
 
-void core::update_canvas(PapayaMemory* mem)
+/*
+    Pyramid level whose resolution matches the zoom, i.e. the coarsest level at
+    which canvas pixels are still no larger than screen pixels.
+*/
+static i32 zoom_level(f32 zoom)
+{
+    i32 level = 0;
+    while (zoom <= 0.5f && level < PAPAYA_MAX_LEVELS - 1) {
+        zoom *= 2.0f;
+        level++;
+    }
+    return level;
+}
+
+/*
+    Copies the rect r of img, the w*h output of a node, to canvas_tex.
+*/
+static void upload_canvas(PapayaMemory* mem, const u8* img, i32 w, i32 h,
+                          PapayaRect r)
 {
-        int w = mem->misc.w;
-        int h = mem->misc.h;
-        uint8_t* img = (uint8_t*) malloc(4 * w * h);
-        papaya_evaluate_node(&mem->doc->nodes[mem->graph_panel->cur_node],
-                             w, h, img);
+    PROFILE_ZONE("Upload canvas");
+    PAGL_GPU_ZONE("Upload canvas");
+    pagl_bind_texture(0, mem->misc.canvas_tex);
 
-        GLCHK( glBindTexture(GL_TEXTURE_2D, mem->misc.canvas_tex) );
+    // Storage is only re-specified when the canvas size changes
+    if (mem->misc.canvas_tex_w != w || mem->misc.canvas_tex_h != h) {
         GLCHK( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0,
-                            GL_RGBA, GL_UNSIGNED_BYTE, img) );
+                            GL_RGBA, GL_UNSIGNED_BYTE, 0) );
+        pagl_track_texture(mem->misc.canvas_tex, 4 * (size_t)w * h);
+        mem->misc.canvas_tex_w = w;
+        mem->misc.canvas_tex_h = h;
+    }
+
+    // Stage the updated rect in a pixel buffer, from which the driver copies
+    // to the texture asynchronously. Orphaning the buffer's previous storage
+    // keeps the map from waiting on an upload that is still in flight.
+    size_t row_size = 4 * (size_t)r.w;
+    u32 pbo = mem->misc.canvas_pbos[mem->misc.canvas_pbo_idx];
+    mem->misc.canvas_pbo_idx ^= 1;
+    GLCHK( glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo) );
+    GLCHK( glBufferData(GL_PIXEL_UNPACK_BUFFER, row_size * r.h, 0,
+                        GL_STREAM_DRAW) );
+    pagl_track_buffer(pbo, row_size * r.h);
+    u8* staging = (u8*) glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (staging) {
+        for (i32 y = 0; y < r.h; y++) {
+            memcpy(staging + y * row_size,
+                   img + 4 * ((size_t)(r.y + y) * w + r.x), row_size);
+        }
+        GLCHK( glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) );
+        GLCHK( glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h,
+                               GL_RGBA, GL_UNSIGNED_BYTE, 0) );
+        GLCHK( glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0) );
+    } else {
+        // Mapping failed. Upload synchronously, straight from the cache.
+        GLCHK( glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0) );
+        GLCHK( glPixelStorei(GL_UNPACK_ROW_LENGTH, w) );
+        GLCHK( glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h,
+                               GL_RGBA, GL_UNSIGNED_BYTE,
+                               img + 4 * ((size_t)r.y * w + r.x)) );
+        GLCHK( glPixelStorei(GL_UNPACK_ROW_LENGTH, 0) );
+    }
+}
+
+void core::update_canvas(PapayaMemory* mem)
+{
+    PROFILE_ZONE("Update canvas");
+    int w = mem->misc.w;
+    int h = mem->misc.h;
+    PapayaNode* node = &mem->doc->graph.nodes[mem->graph_panel->cur_node];
+
+    if (mem->misc.gpu_eval) {
+        // Node outputs stay on the GPU. Force a full upload when switching
+        // back to the CPU path, since canvas_tex is not kept up to date.
+        PROFILE_ZONE("GPU evaluation");
+        PAGL_GPU_ZONE("GPU evaluation");
+        mem->misc.view_tex = gpu_evaluate_node(mem->gpu_evaluator, node, w, h);
+        mem->misc.canvas_node = 0;
+        mem->misc.canvas_pending = false;
+        return;
+    }
+    mem->misc.view_tex = mem->misc.canvas_tex;
+
+    // Changes covering a large part of the canvas are first previewed well
+    // below the resolution on screen, which takes a fraction of a frame.
+    // Smaller changes continue at the level being refined, if any.
+    PapayaRect d = node->dirty;
+    i64 x1 = math::max(d.x, 0), y1 = math::max(d.y, 0);
+    i64 x2 = math::min((i64)d.x + d.w, (i64)w);
+    i64 y2 = math::min((i64)d.y + d.h, (i64)h);
+    bool large = x2 > x1 && y2 > y1 && 4 * (x2 - x1) * (y2 - y1) >= (i64)w * h;
+
+    i32 level = mem->misc.canvas_pending ? mem->misc.canvas_eval_level : 0;
+    if (large) {
+        i32 preview = zoom_level(mem->doc->canvas_zoom) + 2;
+        level = math::max(level, math::min(preview, PAPAYA_MAX_LEVELS - 1));
+    }
+    mem->misc.canvas_eval_level = level;
+    mem->misc.canvas_pending = true;
+    refine_canvas(mem);
+}
+
+/*
+    Evaluates the canvas in bands of tile rows until it is complete or the
+    frame's budget is used up. Bands of the level on screen are uploaded as
+    they complete. Other levels are shown once complete, after which the next
+    finer level is started, until the canvas is at full resolution.
+*/
+void core::refine_canvas(PapayaMemory* mem)
+{
+    const f64 budget_ms = 8.0;
+    if (!mem->misc.canvas_pending || mem->misc.gpu_eval) {
+        return;
+    }
+    PROFILE_ZONE("Refine canvas");
+
+    PapayaNode* node = &mem->doc->graph.nodes[mem->graph_panel->cur_node];
+    i32 level = mem->misc.canvas_eval_level;
+    i32 w = papaya_level_size(mem->misc.w, level);
+    i32 h = papaya_level_size(mem->misc.h, level);
+    bool on_screen = mem->misc.canvas_node == node &&
+                     mem->misc.canvas_level == level;
+
+    // Enough rows per band to give every thread a tile
+    i32 tiles_x = (w + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE;
+    i32 rows = math::max(1, papaya_jobs_num_threads() / tiles_x);
+
+    const u8* img;
+    f64 deadline = timer::get_milliseconds() + budget_ms;
+    do {
+        PapayaRect r;
+        img = papaya_evaluate_partial(node, mem->misc.w, mem->misc.h, level,
+                                      rows, &r);
+        if (on_screen && r.w > 0 && r.h > 0) {
+            upload_canvas(mem, img, w, h, r);
+        }
+    } while (papaya_is_dirty(node) && timer::get_milliseconds() < deadline);
+
+    if (papaya_is_dirty(node)) {
+        return;
+    }
+
+    if (!on_screen) {
+        PapayaRect all = { 0, 0, w, h };
+        upload_canvas(mem, img, w, h, all);
+        mem->misc.canvas_node = node;
+        mem->misc.canvas_level = level;
+    }
+    if (level > 0) {
+        mem->misc.canvas_eval_level = level - 1;
+    } else {
+        mem->misc.canvas_pending = false;
+    }
 }
 
 static void compile_shaders(PapayaMemory* mem)
@@ -862,6 +1355,13 @@ static void compile_shaders(PapayaMemory* mem)
 
     mem->misc.vertex_shader = pagl_compile_shader("default vertex", vertex_src,
                                    GL_VERTEX_SHADER);
+    static const char* attribs[] = { "pos", "uv" };
+    static const char* attribs_col[] = { "pos", "uv", "col" };
+    static const PaglUniformDesc uniforms_tex[] = {
+        { Pagl_UniformType_Matrix4, "proj_mtx" },
+        { Pagl_UniformType_Tex0,    "tex" },
+    };
+
     // New image preview
     {
         const char* frag_src =
@@ -880,11 +1380,18 @@ static void compile_shaders(PapayaMemory* mem)
 "       gl_FragColor = (d < 75) ? col1 : col2;                              \n"
 "   }                                                                       \n";
         const char* name = "new-image preview";
+        static const PaglUniformDesc uniforms[] = {
+            { Pagl_UniformType_Matrix4, "proj_mtx" },
+            { Pagl_UniformType_Color,   "col1" },
+            { Pagl_UniformType_Color,   "col2" },
+            { Pagl_UniformType_Float,   "width" },
+            { Pagl_UniformType_Float,   "height" },
+        };
         u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
         mem->shaders[PapayaShader_ImageSizePreview] =
-            pagl_init_program(name, mem->misc.vertex_shader, frag, 2, 5,
-                              "pos", "uv",
-                              "proj_mtx", "col1", "col2", "width", "height");
+            pagl_init_program(name, mem->misc.vertex_shader, frag,
+                              PAGL_COUNT(attribs), attribs,
+                              PAGL_COUNT(uniforms), uniforms);
     }
 
     // Alpha grid
@@ -913,59 +1420,19 @@ static void compile_shaders(PapayaMemory* mem)
 "       gl_FragColor = mix(col1, col2, a);                                  \n"
 "   }                                                                       \n";
         const char* name = "alpha grid";
+        static const PaglUniformDesc uniforms[] = {
+            { Pagl_UniformType_Matrix4, "proj_mtx" },
+            { Pagl_UniformType_Color,   "col1" },
+            { Pagl_UniformType_Color,   "col2" },
+            { Pagl_UniformType_Float,   "zoom" },
+            { Pagl_UniformType_Float,   "inv_aspect" },
+            { Pagl_UniformType_Float,   "max_dim" },
+        };
         u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
         mem->shaders[PapayaShader_AlphaGrid] =
-            pagl_init_program(name, mem->misc.vertex_shader, frag, 2, 6,
-                              "pos", "uv",
-                              "proj_mtx", "col1", "col2", "zoom",
-                              "inv_aspect", "max_dim");
-    }
-
-    // PreMultiply alpha
-    {
-        const char* frag_src =
-"   #version 120                                                            \n"
-"                                                                           \n"
-"   uniform sampler2D tex; // Uniforms[1]                                   \n"
-"                                                                           \n"
-"   varying vec2 frag_uv;                                                   \n"
-"   varying vec4 frag_col;                                                  \n"
-"                                                                           \n"
-"   void main()                                                             \n"
-"   {                                                                       \n"
-"       vec4 col = frag_col * texture2D( tex, frag_uv.st);                  \n"
-"       gl_FragColor = vec4(col.r, col.g, col.b, 1.0) * col.a;              \n"
-"   }                                                                       \n";
-        const char* name = "premultiply alpha";
-        u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
-        mem->shaders[PapayaShader_PreMultiplyAlpha] =
-            pagl_init_program(name, mem->misc.vertex_shader, frag, 3, 2,
-                              "pos", "uv", "col",
-                              "proj_mtx", "tex");
-    }
-
-    // DeMultiply alpha
-    {
-        const char* frag_src =
-"   #version 120                                                            \n"
-"                                                                           \n"
-"   uniform sampler2D tex; // Uniforms[1]                                   \n"
-"                                                                           \n"
-"   varying vec2 frag_uv;                                                   \n"
-"   varying vec4 frag_col;                                                  \n"
-"                                                                           \n"
-"   void main()                                                             \n"
-"   {                                                                       \n"
-"       vec4 col = frag_col * texture2D( tex, frag_uv.st);                  \n"
-"       gl_FragColor = vec4(col.rgb/col.a, col.a);                          \n"
-"   }                                                                       \n";
-
-        const char* name = "demultiply alpha";
-        u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
-        mem->shaders[PapayaShader_DeMultiplyAlpha] =
-            pagl_init_program(name, mem->misc.vertex_shader, frag, 3, 2,
-                              "pos", "uv", "col",
-                              "proj_mtx", "tex");
+            pagl_init_program(name, mem->misc.vertex_shader, frag,
+                              PAGL_COUNT(attribs), attribs,
+                              PAGL_COUNT(uniforms), uniforms);
     }
 
     // default fragment
@@ -986,9 +1453,9 @@ static void compile_shaders(PapayaMemory* mem)
         const char* name = "default fragment";
         u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
         mem->shaders[PapayaShader_ImGui] =
-            pagl_init_program(name, mem->misc.vertex_shader, frag, 3, 2,
-                              "pos", "uv", "col",
-                              "proj_mtx", "tex");
+            pagl_init_program(name, mem->misc.vertex_shader, frag,
+                              PAGL_COUNT(attribs_col), attribs_col,
+                              PAGL_COUNT(uniforms_tex), uniforms_tex);
     }
 
     // Unlit shader
@@ -1009,8 +1476,8 @@ static void compile_shaders(PapayaMemory* mem)
         const char* name = "unlit";
         u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
         mem->shaders[PapayaShader_VertexColor] =
-            pagl_init_program(name, mem->misc.vertex_shader, frag, 3, 2,
-                              "pos", "uv", "col",
-                              "proj_mtx", "tex");
+            pagl_init_program(name, mem->misc.vertex_shader, frag,
+                              PAGL_COUNT(attribs_col), attribs_col,
+                              PAGL_COUNT(uniforms_tex), uniforms_tex);
     }
 }
\ No newline at end of file
@@ -6,12 +6,15 @@
 #include "pagl.h"
 #include "gl_lite.h"
 #include "color_panel.h"
+#include "graph_panel.h"
+#include "libpapaya.h"
+#include "kernels.h"
 
 // This file is currently very rough, because it will be substantially affected
 // by the addition of nodes.
 
 static PaglProgram* compile_cursor_shader(u32 vertex_shader);
-static PaglProgram* compile_stroke_shader(u32 vertex_shader);
+static PaglProgram* compile_dab_shader();
 
 Brush* init_brush(PapayaMemory* mem)
 {
@@ -25,7 +28,12 @@ Brush* init_brush(PapayaMemory* mem)
     b->mesh_cursor = pagl_init_quad_mesh(Vec2(40, 60), Vec2(30, 30),
                                          GL_DYNAMIC_DRAW);
     b->pgm_cursor = compile_cursor_shader(mem->misc.vertex_shader);
-    b->pgm_stroke = compile_stroke_shader(mem->misc.vertex_shader);
+    b->mesh_dab = pagl_init_quad_mesh(Vec2(-1, -1), Vec2(2, 2),
+                                      GL_STATIC_DRAW);
+    b->pgm_dab = compile_dab_shader();
+    b->dab_attrib = GLCHK( glGetAttribLocation(b->pgm_dab->id, "dab") );
+    GLCHK( glGenBuffers(1, &b->dab_vbo) );
+    GLCHK( glGenFramebuffers(1, &b->fbo) );
     return b;
 }
 
@@ -34,7 +42,13 @@ void destroy_brush(Brush* b)
     destroy_brush_meshes(b);
     pagl_destroy_mesh(b->mesh_cursor);
     pagl_destroy_program(b->pgm_cursor);
-    pagl_destroy_program(b->pgm_stroke);
+    pagl_destroy_mesh(b->mesh_dab);
+    pagl_destroy_program(b->pgm_dab);
+    pagl_delete_buffer(&b->dab_vbo);
+    GLCHK( glDeleteFramebuffers(1, &b->fbo) );
+    if (b->stroke_tex) {
+        pagl_delete_texture(&b->stroke_tex);
+    }
 }
 
 void resize_brush_meshes(Brush* b, Vec2 size)
@@ -79,113 +93,257 @@ void visualize_brush_falloff(PapayaMemory* mem)
     ImGui::End();
 }
 
-static void clear_brush_frame_buffer(PapayaMemory* mem)
+/*
+    Prepares the stroke texture for a new stroke. Only the area painted by the
+    previous stroke is cleared, unless the canvas size changed.
+*/
+static void begin_stroke(PapayaMemory* mem)
 {
-    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, mem->misc.fbo) );
-    GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                  GL_TEXTURE_2D, mem->misc.fbo_sample_tex, 0) );
-    GLCHK( glClearColor(0.0f, 0.0f, 0.0f, 0.0f) );
-    GLCHK( glClear(GL_COLOR_BUFFER_BIT) );
-    GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mem->misc.fbo_render_tex, 0) );
+    Brush* b = mem->brush;
+    i32 w = mem->misc.w, h = mem->misc.h;
+    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, b->fbo) );
+
+    if (b->stroke_w != w || b->stroke_h != h) {
+        if (b->stroke_tex) {
+            pagl_delete_texture(&b->stroke_tex);
+        }
+        b->stroke_tex = pagl_alloc_texture(w, h, 0);
+        b->stroke_w = w;
+        b->stroke_h = h;
+        GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                      GL_TEXTURE_2D, b->stroke_tex, 0) );
+        GLCHK( glClearColor(0.0f, 0.0f, 0.0f, 0.0f) );
+        GLCHK( glClear(GL_COLOR_BUFFER_BIT) );
+    } else if (b->paint_area_2.x > b->paint_area_1.x &&
+               b->paint_area_2.y > b->paint_area_1.y) {
+        Vec2i p = b->paint_area_1;
+        Vec2i sz = b->paint_area_2 - b->paint_area_1;
+        pagl_set_cap(GL_SCISSOR_TEST, true);
+        GLCHK( glScissor(p.x, p.y, sz.x, sz.y) );
+        GLCHK( glClearColor(0.0f, 0.0f, 0.0f, 0.0f) );
+        GLCHK( glClear(GL_COLOR_BUFFER_BIT) );
+        pagl_set_cap(GL_SCISSOR_TEST, false);
+    }
     GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, 0) );
+
+    b->paint_area_1 = Vec2i(w, h);
+    b->paint_area_2 = Vec2i(0, 0);
 }
 
-static void draw_brush_stroke(PapayaMemory* mem)
+/*
+    Turns the pointer events of the frame into stroke samples. A pen moves the
+    mouse too, so mouse events are only used when the pen isn't down. Samples
+    within half a pixel of the previous one are merged into it, keeping the
+    later pressure, so that slow strokes and a resting pen don't pile up.
+*/
+static void collect_stroke_samples(PapayaMemory* mem)
 {
-    // TODO: Implement
-#if 0
     Brush* b = mem->brush;
-    mem->misc.draw_overlay = true;
+    Input* in = &mem->input;
+    Document* doc = mem->doc;
+    b->samples = (BrushSample*) arena::alloc(
+        &mem->frame_arena, (in->num_samples + 1) * sizeof(BrushSample));
+    b->num_samples = 0;
+
+    i32 source = InputSource_Mouse;
+    for (i32 i = 0; i < in->num_samples; i++) {
+        if (in->samples[i].source == InputSource_Tablet &&
+            in->samples[i].pressure > 0.0f) {
+            source = InputSource_Tablet;
+            break;
+        }
+    }
 
-    // TODO: Handle shift press for straight brush strokes
+    for (i32 i = 0; i < in->num_samples; i++) {
+        InputSample* s = &in->samples[i];
+        if (s->source != source || s->pressure <= 0.0f) { continue; }
+
+        Vec2 pos = (Vec2(s->x, s->y) - doc->canvas_pos) / doc->canvas_zoom;
+        BrushSample* prev = b->num_samples > 0 ?
+                            &b->samples[b->num_samples - 1] : &b->last_sample;
+        Vec2 d = pos - prev->pos;
+        if (d.x * d.x + d.y * d.y < 0.25f) {
+            prev->pressure = s->pressure;
+            continue;
+        }
 
-    // Bind frame buffer
-    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, mem->misc.fbo) );
-    GLCHK( glViewport(0, 0, mem->doc->canvas_size.x, mem->doc->canvas_size.y) );
-    GLCHK( glDisable(GL_BLEND) );
-    GLCHK( glDisable(GL_SCISSOR_TEST) );
+        BrushSample* out = &b->samples[b->num_samples++];
+        out->pos = pos;
+        out->pressure = s->pressure;
+    }
+}
 
-    {
-        GLCHK( glUseProgram(b->pgm_stroke->id) );
+/*
+    Places dabs at even spacing along the segments from last_sample through
+    the samples. The distance past the last dab carries over to the next
+    frame, so the spacing doesn't depend on the frame rate. out must hold one
+    dab per spacing of the length of the segments, plus one.
+*/
+static i32 place_dabs(Brush* b, f32 spacing, f32 hardness, BrushDab* out)
+{
+    i32 n = 0;
+    BrushSample prev = b->last_sample;
+    for (i32 i = 0; i < b->num_samples; i++) {
+        BrushSample s = b->samples[i];
+        Vec2 d = s.pos - prev.pos;
+        f32 len = sqrtf(d.x * d.x + d.y * d.y);
+
+        f32 t = spacing - b->dab_carry; // Along the segment, to the next dab
+        for (; t <= len; t += spacing) {
+            f32 f = t / len;
+            out[n].pos = prev.pos + d * f;
+            out[n].pressure = prev.pressure + (s.pressure - prev.pressure) * f;
+            out[n].hardness = hardness;
+            n++;
+        }
+        b->dab_carry = len - (t - spacing);
+        prev = s;
+    }
+    return n;
+}
 
-        // TODO: Tidy up the uniform calculation variables
-        f32 w = (f32)mem->doc->canvas_size.x;
-        f32 h = (f32)mem->doc->canvas_size.y;
-        Vec2 c = (b->diameter % 2 == 0 ? Vec2() :
-                  Vec2(0.5f / w, 0.5f / h)); // Pixel correction
+/*
+    Draws the dabs into the stroke texture in one instanced draw, scissored to
+    their bounds. Each dab only shades the pixels of its own quad, so the cost
+    follows the brush size rather than the canvas size. Overlapping dabs keep
+    the highest opacity, as with a single continuous stroke.
+*/
+static void draw_dabs(PapayaMemory* mem, BrushDab* dabs, i32 n)
+{
+    Brush* b = mem->brush;
+    f32 r = b->diameter * 0.5f;
+    f32 x1 = dabs[0].pos.x, y1 = dabs[0].pos.y, x2 = x1, y2 = y1;
+    for (i32 i = 1; i < n; i++) {
+        x1 = math::min(x1, dabs[i].pos.x);
+        y1 = math::min(y1, dabs[i].pos.y);
+        x2 = math::max(x2, dabs[i].pos.x);
+        y2 = math::max(y2, dabs[i].pos.y);
+    }
+    Vec2i p1 = Vec2i(math::clamp((i32)floorf(x1 - r) - 1, 0, b->stroke_w),
+                     math::clamp((i32)floorf(y1 - r) - 1, 0, b->stroke_h));
+    Vec2i p2 = Vec2i(math::clamp((i32)ceilf(x2 + r) + 1, 0, b->stroke_w),
+                     math::clamp((i32)ceilf(y2 + r) + 1, 0, b->stroke_h));
+    if (p2.x <= p1.x || p2.y <= p1.y) {
+        return; // Off the canvas
+    }
+    b->paint_area_1 = Vec2i(math::min(b->paint_area_1.x, p1.x),
+                            math::min(b->paint_area_1.y, p1.y));
+    b->paint_area_2 = Vec2i(math::max(b->paint_area_2.x, p2.x),
+                            math::max(b->paint_area_2.y, p2.y));
+
+    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, b->fbo) );
+    GLCHK( glViewport(0, 0, b->stroke_w, b->stroke_h) );
+    pagl_set_cap(GL_SCISSOR_TEST, true);
+    GLCHK( glScissor(p1.x, p1.y, p2.x - p1.x, p2.y - p1.y) );
+    pagl_set_cap(GL_BLEND, true);
+    GLCHK( glBlendEquation(GL_MAX) );
+
+    mat4x4 proj_mtx;
+    mat4x4_ortho(proj_mtx, 0.f, (f32)b->stroke_w, 0.f, (f32)b->stroke_h,
+                 -1.f, 1.f);
+    Color c = mem->color_panel->current_color;
+    c.a = b->opacity;
+    PaglUniform u[] = { pagl_mat4(&proj_mtx[0][0]), pagl_float(r),
+                        pagl_color(c) };
+    pagl_set_uniforms(b->pgm_dab, PAGL_COUNT(u), u);
+    pagl_bind_vbo(b->mesh_dab->vbo_handle);
+    pagl_set_vertex_attribs(b->pgm_dab);
+
+    u32 loc = (u32)b->dab_attrib;
+    if (glDrawArraysInstanced && glVertexAttribDivisor) {
+        pagl_bind_vbo(b->dab_vbo);
+        GLCHK( glBufferData(GL_ARRAY_BUFFER, n * sizeof(BrushDab), dabs,
+                            GL_STREAM_DRAW) );
+        pagl_enable_attrib(loc, true);
+        GLCHK( glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE,
+                                     sizeof(BrushDab), 0) );
+        GLCHK( glVertexAttribDivisor(loc, 1) );
+        GLCHK( glDrawArraysInstanced(GL_TRIANGLES, 0, 6, n) );
+        GLCHK( glVertexAttribDivisor(loc, 0) );
+        pagl_enable_attrib(loc, false);
+    } else {
+        // Without instancing, the dab is a constant attribute of each draw
+        for (i32 i = 0; i < n; i++) {
+            BrushDab* d = &dabs[i];
+            GLCHK( glVertexAttrib4f(loc, d->pos.x, d->pos.y, d->pressure,
+                                    d->hardness) );
+            GLCHK( glDrawArrays(GL_TRIANGLES, 0, 6) );
+        }
+    }
 
-        Vec2 pos = mem->mouse.uv + c;
-        Vec2 last_pos = (b->draw_line_segment ?
-                         b->line_segment_start_uv : mem->mouse.last_uv) + c;
-        f32 inv_aspect = mem->doc->canvas_size.y / mem->doc->canvas_size.x;
-        pos.y *= inv_aspect;
-        last_pos.y *= inv_aspect;
+    GLCHK( glBlendEquation(GL_FUNC_ADD) );
+    pagl_set_cap(GL_SCISSOR_TEST, false);
+    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, 0) );
+    GLCHK( glViewport(0, 0, (i32)ImGui::GetIO().DisplaySize.x,
+                      (i32)ImGui::GetIO().DisplaySize.y) );
+}
 
-        b->draw_line_segment = false;
+/*
+    Adds the frame's samples to the stroke. The first frame of a stroke also
+    places a dab where it starts, so that a click leaves a mark.
+*/
+static void draw_brush_stroke(PapayaMemory* mem, bool start)
+{
+    Brush* b = mem->brush;
+    collect_stroke_samples(mem);
 
-        f32 hardness;
-        {
-            if (b->anti_alias && b->diameter > 2) {
-                f32 aa_width = 1.0f; // The width of pixels over which the antialiased falloff occurs
-                f32 radius = b->diameter / 2.0f;
-                hardness = math::min(b->hardness, 1.0f - (aa_width / radius));
-            } else {
-                hardness = b->hardness;
-            }
-        }
+    f32 hardness = b->hardness;
+    if (b->anti_alias && b->diameter > 2) {
+        f32 aa_width = 1.0f; // The width of pixels over which the antialiased falloff occurs
+        f32 radius = b->diameter / 2.0f;
+        hardness = math::min(b->hardness, 1.0f - (aa_width / radius));
+    }
 
-        f32 uv_dia = (f32)b->diameter / (mem->doc->canvas_size.x * 2.0f);
-        Color* a = &mem->color_panel->current_color;
-        Color col = Color(a->r, a->g, a->b, b->opacity);
-
-        GLCHK( glDisable(GL_BLEND) );
-
-        f32 proj_mtx[4][4];
-        mat4x4_ortho(proj_mtx, 0.f,
-                     mem->doc->canvas_size.x, 0.f,
-                     mem->doc->canvas_size.y,
-                     -1.f, 1.f);
-
-        pagl_draw_mesh(b->mesh_RTTBrush, b->pgm_stroke, 8,
-                       Pagl_UniformType_Matrix4, &proj_mtx[0][0],
-                       Pagl_UniformType_Tex0, mem->misc.fbo_sample_tex,
-                       Pagl_UniformType_Vec2, pos,
-                       Pagl_UniformType_Vec2, last_pos,
-                       Pagl_UniformType_Float, uv_dia,
-                       Pagl_UniformType_Color, col,
-                       Pagl_UniformType_Float, hardness,
-                       Pagl_UniformType_Float, inv_aspect);
+    f32 spacing = math::max(0.5f, b->diameter * 0.1f);
+    f32 len = 0.0f;
+    BrushSample prev = b->last_sample;
+    for (i32 i = 0; i < b->num_samples; i++) {
+        Vec2 d = b->samples[i].pos - prev.pos;
+        len += sqrtf(d.x * d.x + d.y * d.y);
+        prev = b->samples[i];
+    }
+    i32 max_dabs = (i32)((b->dab_carry + len) / spacing) + 2;
+    BrushDab* dabs = (BrushDab*) arena::alloc(&mem->frame_arena,
+                                              max_dabs * sizeof(BrushDab));
+
+    i32 n = 0;
+    if (start) {
+        dabs[n].pos = b->last_sample.pos;
+        dabs[n].pressure = b->last_sample.pressure;
+        dabs[n].hardness = hardness;
+        n++;
+        b->dab_carry = 0.0f;
+    }
+    n += place_dabs(b, spacing, hardness, dabs + n);
+    if (n > 0) {
+        draw_dabs(mem, dabs, n);
     }
 
-    // Swap textures
-    {
-        u32 temp = mem->misc.fbo_render_tex;
-        mem->misc.fbo_render_tex = mem->misc.fbo_sample_tex;
-        mem->misc.fbo_sample_tex = temp;
-        GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                      GL_TEXTURE_2D, mem->misc.fbo_render_tex,
-                                      0) );
+    if (b->num_samples > 0) {
+        b->last_sample = b->samples[b->num_samples - 1];
     }
+}
 
-    // Reset frame buffer and viewport
-    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, 0) );
-    GLCHK( glViewport(0, 0, (i32)ImGui::GetIO().DisplaySize.x, (i32)ImGui::GetIO().DisplaySize.y) );
+/*
+    Draws the stroke texture over the canvas, until the stroke is merged
+*/
+static void draw_stroke_overlay(PapayaMemory* mem)
+{
+    mat4x4 m;
+    mat4x4_ortho(m, 0.f, (f32)mem->window.width, (f32)mem->window.height, 0.f,
+                 -1.f, 1.f);
+
+    pagl_bind_texture(0, mem->brush->stroke_tex);
+    GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR ) );
+    GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST) );
+    pagl_set_cap(GL_BLEND, true);
+    GLCHK( glBlendEquation(GL_FUNC_ADD) );
+    GLCHK( glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
 
-    // Draw the brush stroke as a blended quad on top of the canvas
-    {
-        GLCHK( glBindTexture  (GL_TEXTURE_2D, (GLuint)(intptr_t)mem->misc.fbo_sample_tex) );
-        GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR ) );
-        GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST) );
-        GLCHK( glEnable(GL_BLEND) );
-        GLCHK( glBlendEquation(GL_FUNC_ADD) );
-        GLCHK( glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
-
-        pagl_draw_mesh(mem->meshes[PapayaMesh_Canvas],
-                       mem->shaders[PapayaShader_ImGui],
-                       1,
-                       Pagl_UniformType_Matrix4, &mem->window.proj_mtx[0][0]);
-    }
-#endif
+    PaglUniform u[] = { pagl_mat4(&m[0][0]) };
+    pagl_draw_mesh(mem->meshes[PapayaMesh_Canvas],
+                   mem->shaders[PapayaShader_ImGui],
+                   PAGL_COUNT(u), u);
 }
 
 static void draw_brush_cursor(PapayaMemory* mem)
@@ -200,22 +358,31 @@ static void draw_brush_cursor(PapayaMemory* mem)
                              - (Vec2(ScaledDiameter,ScaledDiameter) * 0.5f),
                             Vec2(ScaledDiameter,ScaledDiameter));
 
-    GLCHK( glEnable(GL_BLEND) );
+    pagl_set_cap(GL_BLEND, true);
     GLCHK( glBlendEquation(GL_FUNC_ADD) );
     GLCHK( glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
 
-    pagl_draw_mesh(mem->brush->mesh_cursor,
-                   mem->brush->pgm_cursor,
-                   4,
-                   Pagl_UniformType_Matrix4, &mem->window.proj_mtx[0][0],
-                   Pagl_UniformType_Color, Color(1.0f, 0.0f, 0.0f, mem->mouse.is_down[1] ? mem->brush->opacity : 0.0f),
-                   Pagl_UniformType_Float, mem->brush->hardness,
-                   Pagl_UniformType_Float, ScaledDiameter);
+    f32 a = mem->mouse.is_down[1] ? mem->brush->opacity : 0.0f;
+    PaglUniform u[] = {
+        pagl_mat4(&mem->window.proj_mtx[0][0]),
+        pagl_color(Color(1.0f, 0.0f, 0.0f, a)),
+        pagl_float(mem->brush->hardness),
+        pagl_float(ScaledDiameter),
+    };
+    pagl_draw_mesh(mem->brush->mesh_cursor, mem->brush->pgm_cursor,
+                   PAGL_COUNT(u), u);
 }
 
+/*
+    Composites the stroke over the viewed bitmap node. Only the painted area is
+    read back, recorded for undo and marked dirty, so the re-upload of the
+    canvas covers it alone, and a small stroke costs the same on any canvas.
+*/
 static void merge_brush_stroke(PapayaMemory* mem)
 {
+    PROFILE_ZONE("Merge stroke");
     Brush* b = mem->brush;
+    Document* doc = mem->doc;
 
     mem->misc.draw_overlay = false;
     b->being_dragged = false;
@@ -223,16 +390,49 @@ static void merge_brush_stroke(PapayaMemory* mem)
     b->was_straight_drag = false;
     b->line_segment_start_uv = mem->mouse.uv;
 
-    // TODO: Implement the actual merging
+    // TODO: Paint into the bitmap feeding the viewed node
+    PapayaNode* node = &doc->graph.nodes[mem->graph_panel->cur_node];
+    if (node->type != PapayaNodeType_Bitmap) {
+        return;
+    }
+    PapayaTiles* img = &node->params.bitmap.image;
+    Vec2i p1 = b->paint_area_1;
+    Vec2i p2 = Vec2i(math::min(b->paint_area_2.x, img->width),
+                     math::min(b->paint_area_2.y, img->height));
+    if (p2.x <= p1.x || p2.y <= p1.y) {
+        return;
+    }
+    PapayaRect r = { p1.x, p1.y, p2.x - p1.x, p2.y - p1.y };
+    i32 n = r.w * r.h;
+
+    // Rows of the stroke texture are canvas rows, top first
+    u8* stroke = (u8*) arena::alloc(&mem->frame_arena, 4 * (size_t)n);
+    u8* pixels = (u8*) arena::alloc(&mem->frame_arena, 4 * (size_t)n);
+    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, b->fbo) );
+    GLCHK( glReadPixels(r.x, r.y, r.w, r.h, GL_RGBA, GL_UNSIGNED_BYTE,
+                        stroke) );
+    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, 0) );
+    papaya_premultiply(stroke, n);
+
+    if (!doc->undo.start) {
+        undo::init(mem);
+    }
+    undo::push_tiles(&doc->undo, node, r);
+    papaya_tiles_read(img, r, pixels, r.w);
+    papaya_blend_over(stroke, pixels, n);
+    papaya_tiles_write_rect(img, r, pixels, r.w);
+
+    papaya_mark_dirty(node, r);
+    core::update_canvas(mem);
 }
 
 void update_and_render_brush(PapayaMemory* mem)
 {
+    PROFILE_ZONE("Brush");
+    PAGL_GPU_ZONE("Brush");
     Brush* b = mem->brush;
     Mouse* mouse = &mem->mouse;
 
-    draw_brush_cursor(mem);
-
     if (mouse->pressed[1]) {
 
         // Right click started
@@ -274,26 +474,40 @@ void update_and_render_brush(PapayaMemory* mem)
         b->being_dragged = true;
         b->draw_line_segment = (ImGui::GetIO().KeyShift &&
                                 b->line_segment_start_uv.x >= 0.0f);
-        b->paint_area_1 = Vec2i(mem->doc->canvas_size.x + 1,
-                                mem->doc->canvas_size.y + 1);
-        b->paint_area_2 = Vec2i(0,0);
-        clear_brush_frame_buffer(mem);
+        begin_stroke(mem);
 
         ColorPanel* c = mem->color_panel;
         if (c->is_open) {
             c->current_color = c->new_color;
         }
 
+        // Shift-click draws a line from the end of the last stroke
+        Document* doc = mem->doc;
+        b->last_sample.pos = b->draw_line_segment ?
+            b->line_segment_start_uv * doc->canvas_size :
+            (Vec2(mouse->pos.x, mouse->pos.y) - doc->canvas_pos) /
+            doc->canvas_zoom;
+        b->last_sample.pressure = mem->tablet.pressure > 0.0f ?
+                                  mem->tablet.pressure : 1.0f;
+        b->draw_line_segment = false;
+        draw_brush_stroke(mem, true);
+
     } else if (mouse->is_down[0] && b->being_dragged) {
 
         // Left mouse dragged
-        draw_brush_stroke(mem);
+        draw_brush_stroke(mem, false);
 
     } else if (mouse->released[0] && b->being_dragged) {
 
-        // Left click released
+        // Left click released, after the samples up to the release
+        draw_brush_stroke(mem, false);
         merge_brush_stroke(mem);
     }
+
+    if (b->being_dragged) {
+        draw_stroke_overlay(mem);
+    }
+    draw_brush_cursor(mem);
 }
 
 static PaglProgram* compile_cursor_shader(u32 vertex_shader)
@@ -330,104 +544,80 @@ static PaglProgram* compile_cursor_shader(u32 vertex_shader)
 
     const char* name = "brush cursor";
     u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
-    return pagl_init_program(name, vertex_shader, frag, 2, 4,
-                             "pos", "uv",
-                             "proj_mtx", "brush_col", "hardness",
-                             "pixel_sz");
+    static const char* attribs[] = { "pos", "uv" };
+    static const PaglUniformDesc uniforms[] = {
+        { Pagl_UniformType_Matrix4, "proj_mtx" },
+        { Pagl_UniformType_Color,   "brush_col" },
+        { Pagl_UniformType_Float,   "hardness" },
+        { Pagl_UniformType_Float,   "pixel_sz" },
+    };
+    return pagl_init_program(name, vertex_shader, frag,
+                             PAGL_COUNT(attribs), attribs,
+                             PAGL_COUNT(uniforms), uniforms);
 }
 
-static PaglProgram* compile_stroke_shader(u32 vertex_shader)
+/*
+    Each dab is an instance of a quad from -1 to 1, scaled by the radius and
+    moved to the dab. Without instancing, the dab attribute is a constant.
+*/
+static PaglProgram* compile_dab_shader()
 {
-    const char* frag_src =
+    const char* vert_src =
 "   #version 120                                                            \n"
+"   uniform mat4 proj_mtx; // uniforms[0]                                   \n"
+"   uniform float radius;  // uniforms[1]                                   \n"
 "                                                                           \n"
-"   #define M_PI 3.1415926535897932384626433832795                          \n"
-"                                                                           \n"
-"   uniform sampler2D tex;    // uniforms[1]                                \n"
-"   uniform vec2 cur_pos;     // uniforms[2]                                \n"
-"   uniform vec2 last_pos;    // uniforms[3]                                \n"
-"   uniform float radius;     // uniforms[4]                                \n"
-"   uniform vec4 brush_col;   // uniforms[5]                                \n"
-"   uniform float hardness;   // uniforms[6]                                \n"
-"   uniform float inv_aspect; // uniforms[7]                                \n"
-"                                                                           \n"
-"   varying vec2 frag_uv;                                                   \n"
+"   attribute vec2 pos;    // attributes[0]                                 \n"
+"   attribute vec2 uv;     // attributes[1]                                 \n"
+"   attribute vec4 dab;    // Center, pressure, hardness                    \n"
 "                                                                           \n"
-"   bool isnan(float val)                                                   \n"
-"   {                                                                       \n"
-"       return !( val < 0.0 || 0.0 < val || val == 0.0 );                   \n"
-"   }                                                                       \n"
+"   varying vec2 local;                                                     \n"
+"   varying float pressure;                                                 \n"
+"   varying float hardness;                                                 \n"
 "                                                                           \n"
-"   void line(vec2 p1, vec2 p2, vec2 uv, float radius,                      \n"
-"             out float distLine, out float distp1)                         \n"
+"   void main()                                                             \n"
 "   {                                                                       \n"
-"       if (distance(p1,p2) <= 0.0) {                                       \n"
-"           distLine = distance(uv, p1);                                    \n"
-"           distp1 = 0.0;                                                   \n"
-"           return;                                                         \n"
-"       }                                                                   \n"
-"                                                                           \n"
-"       float a = abs(distance(p1, uv));                                    \n"
-"       float b = abs(distance(p2, uv));                                    \n"
-"       float c = abs(distance(p1, p2));                                    \n"
-"       float d = sqrt(c*c + radius*radius);                                \n"
-"                                                                           \n"
-"       vec2 a1 = normalize(uv - p1);                                       \n"
-"       vec2 b1 = normalize(uv - p2);                                       \n"
-"       vec2 c1 = normalize(p2 - p1);                                       \n"
-"       if (dot(a1,c1) < 0.0) {                                             \n"
-"           distLine = a;                                                   \n"
-"           distp1 = 0.0;                                                   \n"
-"           return;                                                         \n"
-"       }                                                                   \n"
+"       local = uv * 2.0 - 1.0;                                             \n"
+"       pressure = dab.z;                                                   \n"
+"       hardness = dab.w;                                                   \n"
+"       gl_Position = proj_mtx * vec4(dab.xy + pos * radius, 0, 1);         \n"
+"   }                                                                       \n";
+
+    const char* frag_src =
+"   #version 120                                                            \n"
 "                                                                           \n"
-"       if (dot(b1,c1) > 0.0) {                                             \n"
-"           distLine = b;                                                   \n"
-"           distp1 = 1.0;                                                   \n"
-"           return;                                                         \n"
-"       }                                                                   \n"
+"   #define M_PI 3.1415926535897932384626433832795                          \n"
 "                                                                           \n"
-"       float p = (a + b + c) * 0.5;                                        \n"
-"       float h = 2.0 / c * sqrt( p * (p-a) * (p-b) * (p-c) );              \n"
+"   uniform vec4 brush_col; // uniforms[2]                                  \n"
 "                                                                           \n"
-"       if (isnan(h)) {                                                     \n"
-"           distLine = 0.0;                                                 \n"
-"           distp1 = a / c;                                                 \n"
-"       } else {                                                            \n"
-"           distLine = h;                                                   \n"
-"           distp1 = sqrt(a*a - h*h) / c;                                   \n"
-"       }                                                                   \n"
-"   }                                                                       \n"
+"   varying vec2 local;                                                     \n"
+"   varying float pressure;                                                 \n"
+"   varying float hardness;                                                 \n"
 "                                                                           \n"
 "   void main()                                                             \n"
 "   {                                                                       \n"
-"       vec4 t = texture2D(tex, frag_uv.st);                                \n"
-"                                                                           \n"
-"       float distLine, distp1;                                             \n"
-"       vec2 aspect_uv = vec2(frag_uv.x, frag_uv.y * inv_aspect);           \n"
-"       line(last_pos, cur_pos, aspect_uv, radius, distLine, distp1);       \n"
-"                                                                           \n"
-"       float scale = 1.0 / (2.0 * radius * (1.0 - hardness));              \n"
-"       float period = M_PI * scale;                                        \n"
-"       float phase = (1.0 - scale * 2.0 * radius) * M_PI * 0.5;            \n"
-"       float alpha = cos((period * distLine) + phase);                     \n"
-"                                                                           \n"
-"       if (distLine < radius - (0.5/scale)) {                              \n"
+"       float dist = length(local);                                         \n"
+"       float scale = 1.0 / max(1.0 - hardness, 0.0001);                    \n"
+"       float alpha = cos(M_PI * 0.5 * (1.0 + scale * (dist - 1.0)));       \n"
+"       if (dist < hardness) {                                              \n"
 "           alpha = 1.0;                                                    \n"
-"       } else if (distLine > radius) {                                     \n"
+"       } else if (dist > 1.0) {                                            \n"
 "           alpha = 0.0;                                                    \n"
 "       }                                                                   \n"
-"                                                                           \n"
-"       float final_alpha = max(t.a, alpha * brush_col.a);                  \n"
-"                                                                           \n"
-"       // TODO: Needs improvement. Self-intersection corners look weird.   \n"
 "       gl_FragColor = vec4(brush_col.rgb,                                  \n"
-"                           clamp(final_alpha,0.0,1.0));                    \n"
+"                           alpha * brush_col.a * pressure);                \n"
 "   }                                                                       \n";
-    const char* name = "brush stroke";
+
+    const char* name = "brush dab";
+    u32 vert = pagl_compile_shader(name, vert_src, GL_VERTEX_SHADER);
     u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
-    return pagl_init_program(name, vertex_shader, frag, 2, 8,
-                             "pos", "uv",
-                             "proj_mtx", "tex", "cur_pos", "last_pos", "radius",
-                             "brush_col", "hardness", "inv_aspect");
+    static const char* attribs[] = { "pos", "uv" };
+    static const PaglUniformDesc uniforms[] = {
+        { Pagl_UniformType_Matrix4, "proj_mtx" },
+        { Pagl_UniformType_Float,   "radius" },
+        { Pagl_UniformType_Color,   "brush_col" },
+    };
+    return pagl_init_program(name, vert, frag,
+                             PAGL_COUNT(attribs), attribs,
+                             PAGL_COUNT(uniforms), uniforms);
 }
@@ -6,6 +6,18 @@ struct PapayaMemory;
 struct PaglMesh;
 struct PaglProgram;
 
+struct BrushSample {
+    Vec2 pos; // Canvas pixels
+    f32 pressure;
+};
+
+// One stamp of the brush tip. Matches the dab attribute of the dab shader.
+struct BrushDab {
+    Vec2 pos; // Canvas pixels
+    f32 pressure;
+    f32 hardness; // Adjusted for antialiasing
+};
+
 struct Brush {
     i32 diameter;
     i32 max_diameter;
@@ -13,6 +25,7 @@ struct Brush {
     f32 hardness; // Range: [0.0, 1.0]
     bool anti_alias;
 
+    // Bounds of the dabs drawn into the stroke texture, in canvas pixels
     Vec2i paint_area_1, paint_area_2;
 
     // TODO: Move some of this stuff to the Mouse struct?
@@ -29,11 +42,26 @@ struct Brush {
     bool straight_drag_snap_y;
     Vec2 straight_drag_start_uv;
 
+    // Stroke samples of this frame, from the frame arena. The stroke runs from
+    // last_sample through samples, which then becomes their last one.
+    BrushSample* samples;
+    i32 num_samples;
+    BrushSample last_sample;
+    f32 dab_carry; // Distance walked since the last dab
+
+    // The stroke is drawn into stroke_tex, at canvas resolution, until merged
+    u32 fbo;
+    u32 stroke_tex;
+    i32 stroke_w, stroke_h;
+
     PaglMesh* mesh_cursor;
     PaglMesh* mesh_RTTBrush; // TODO: Use a canvas mesh instead
     PaglMesh* mesh_RTTAdd;   // 
     PaglProgram* pgm_cursor;
-    PaglProgram* pgm_stroke;
+    PaglMesh* mesh_dab;
+    PaglProgram* pgm_dab;
+    u32 dab_vbo;     // Dabs of the frame, one per instance
+    i32 dab_attrib;
 };
 
 
@@ -262,17 +262,20 @@ void render_color_panel(PapayaMemory* mem)
     ColorPanel* c = mem->color_panel;
 
     // Draw hue picker
-    pagl_draw_mesh(c->mesh_hue, c->pgm_hue,
-                   2,
-                   Pagl_UniformType_Matrix4, &mem->window.proj_mtx[0][0],
-                   Pagl_UniformType_Float, mem->color_panel->cursor_h);
+    PaglUniform hue[] = {
+        pagl_mat4(&mem->window.proj_mtx[0][0]),
+        pagl_float(mem->color_panel->cursor_h),
+    };
+    pagl_draw_mesh(c->mesh_hue, c->pgm_hue, PAGL_COUNT(hue), hue);
 
     // Draw saturation-value picker
-    pagl_draw_mesh(c->mesh_sat_val, c->pgm_sat_val,
-                   3,
-                   Pagl_UniformType_Matrix4, &mem->window.proj_mtx[0][0],
-                   Pagl_UniformType_Float, mem->color_panel->cursor_h,
-                   Pagl_UniformType_Vec2, mem->color_panel->cursor_sv);
+    PaglUniform sat_val[] = {
+        pagl_mat4(&mem->window.proj_mtx[0][0]),
+        pagl_float(mem->color_panel->cursor_h),
+        pagl_vec2(mem->color_panel->cursor_sv),
+    };
+    pagl_draw_mesh(c->mesh_sat_val, c->pgm_sat_val, PAGL_COUNT(sat_val),
+                   sat_val);
 }
 
 static PaglProgram* compile_hue_shader(u32 vertex_shader)
@@ -305,9 +308,14 @@ static PaglProgram* compile_hue_shader(u32 vertex_shader)
 
     const char* name = "color picker hue strip";
     u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
-    return pagl_init_program(name, vertex_shader, frag, 2, 2,
-                             "pos", "uv",
-                             "proj_mtx", "cursor");
+    static const char* attribs[] = { "pos", "uv" };
+    static const PaglUniformDesc uniforms[] = {
+        { Pagl_UniformType_Matrix4, "proj_mtx" },
+        { Pagl_UniformType_Float,   "cursor" },
+    };
+    return pagl_init_program(name, vertex_shader, frag,
+                             PAGL_COUNT(attribs), attribs,
+                             PAGL_COUNT(uniforms), uniforms);
 }
 
 static PaglProgram* compile_sat_val_shader(u32 vertex_shader)
@@ -348,7 +356,13 @@ static PaglProgram* compile_sat_val_shader(u32 vertex_shader)
 
     const char* name = "color picker SV box";
     u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
-    return pagl_init_program(name, vertex_shader, frag, 2, 3,
-                             "pos", "uv",
-                             "proj_mtx", "hue", "cursor");
+    static const char* attribs[] = { "pos", "uv" };
+    static const PaglUniformDesc uniforms[] = {
+        { Pagl_UniformType_Matrix4, "proj_mtx" },
+        { Pagl_UniformType_Float,   "hue" },
+        { Pagl_UniformType_Vec2,    "cursor" },
+    };
+    return pagl_init_program(name, vertex_shader, frag,
+                             PAGL_COUNT(attribs), attribs,
+                             PAGL_COUNT(uniforms), uniforms);
 }
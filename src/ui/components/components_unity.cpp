@@ -0,0 +1,16 @@
+/*
+    All UI components as a single translation unit, for unity builds. See
+    build/linux/makefile. Keep in sync with the sources listed there.
+*/
+
+#include "components/crop_rotate.cpp"
+#include "components/metrics_window.cpp"
+#include "components/brush.cpp"
+#include "components/color_panel.cpp"
+#include "components/doc_io.cpp"
+#include "components/eye_dropper.cpp"
+#include "components/gpu_eval.cpp"
+#include "components/graph_panel.cpp"
+#include "components/node_properties_panel.cpp"
+#include "components/prefs.cpp"
+#include "components/undo.cpp"
@@ -9,6 +9,8 @@
 #include "pagl.h"
 #include "gl_lite.h"
 #include "brush.h"
+#include "graph_panel.h"
+#include "libpapaya.h"
 
 void crop_rotate::init(PapayaMemory* mem)
 {
@@ -17,120 +19,93 @@ void crop_rotate::init(PapayaMemory* mem)
     m->type = GL_LINE_LOOP;
     m->index_count = 4;
     GLCHK( glGenBuffers(1, &m->vbo_handle) );
-    GLCHK( glBindBuffer(GL_ARRAY_BUFFER, m->vbo_handle) );
+    pagl_bind_vbo(m->vbo_handle);
     GLCHK( glBufferData(GL_ARRAY_BUFFER, sizeof(ImDrawVert) * m->index_count,
                         0, GL_DYNAMIC_DRAW) );
     mem->meshes[PapayaMesh_CropOutline] = m; // TODO: Own this mesh
+    mem->crop_rotate.filter = PapayaFilter_Bicubic;
 }
 
 void crop_rotate::toolbar(PapayaMemory* mem)
 {
-    // TODO: Implement
-#if 0
+    CropRotate* cr = &mem->crop_rotate;
     ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(3, 0));
-    if (ImGui::Button("-90")) { mem->crop_rotate.base_rotation--; }
+    if (ImGui::Button("-90")) { cr->base_rotation--; }
     ImGui::SameLine();
-    if (ImGui::Button("+90")) { mem->crop_rotate.base_rotation++; }
+    if (ImGui::Button("+90")) { cr->base_rotation++; }
     ImGui::SameLine();
     ImGui::PopStyleVar();
 
     ImGui::PushItemWidth(85);
-    ImGui::SliderAngle("Rotate", &mem->crop_rotate.slider_angle, -45.0f, 45.0f);
+    ImGui::SliderAngle("Rotate", &cr->slider_angle, -45.0f, 45.0f);
+    ImGui::SameLine();
+    const char* filters[] = { "Bilinear", "Bicubic", "Lanczos" };
+    ImGui::Combo("Filter", &cr->filter, filters, PapayaFilter_COUNT);
     ImGui::PopItemWidth();
 
     ImGui::SameLine(ImGui::GetWindowWidth() - 94); // TODO: Magic number alert
     ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(2, 0));
 
     if (ImGui::Button("Apply")) {
-        bool size_changed = (mem->crop_rotate.base_rotation % 2 != 0);
-
-        // Swap render texture and document texture handles
-        if (size_changed) {
-            i32 temp = mem->cur_doc->width;
-            mem->cur_doc->width  = mem->cur_doc->height;
-            mem->cur_doc->height = temp;
-
-            mat4x4_ortho(mem->cur_doc->proj_mtx,
-                         0.f, (f32)mem->cur_doc->width,
-                         0.f, (f32)mem->cur_doc->height,
-                         -1.f, 1.f);
-            mem->cur_doc->inverse_aspect = (f32)mem->cur_doc->height /
-                                      (f32)mem->cur_doc->width;
-            GLCHK( glDeleteTextures(1, &mem->misc.fbo_sample_tex) );
-            mem->misc.fbo_sample_tex = pagl_alloc_texture(mem->cur_doc->width,
-                                                          mem->cur_doc->height,
-                                                          0);
-        }
-
-        GLCHK( glDisable(GL_BLEND) );
-        GLCHK( glViewport(0, 0, mem->cur_doc->width, mem->cur_doc->height) );
-
-        // Bind and clear the frame buffer
-        GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, mem->misc.fbo) );
-        GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                      GL_TEXTURE_2D, mem->misc.fbo_sample_tex, 0) );
-
-        GLCHK( glClearColor(0.0f, 0.0f, 0.0f, 0.0f) );
-        GLCHK( glClear(GL_COLOR_BUFFER_BIT) );
-
-        mat4x4 m, r;
-        // Rotate around center
-        {
-            Vec2 offset = Vec2(mem->cur_doc->width  * 0.5f,
-                               mem->cur_doc->height * 0.5f);
-            mat4x4_dup(m, mem->cur_doc->proj_mtx);
-            mat4x4_translate_in_place(m, offset.x, offset.y, 0.f);
-            // mat4x4_rotate_Z(r, m, math::to_radians(-90));
-            mat4x4_rotate_Z(r, m, mem->crop_rotate.slider_angle +
-                            math::to_radians(90.0f * mem->crop_rotate.base_rotation));
-            if (size_changed) {
-                mat4x4_translate_in_place(r, -offset.y, -offset.x, 0.f);
-            } else {
-                mat4x4_translate_in_place(r, -offset.x, -offset.y, 0.f);
-            }
-        }
-
-        // Draw the image onto the frame buffer
-        GLCHK( glBindBuffer(GL_ARRAY_BUFFER, mem->brush->mesh_RTTAdd->vbo_handle) );
-        GLCHK( glUseProgram(mem->shaders[PapayaShader_DeMultiplyAlpha]->id) );
-        GLCHK( glUniformMatrix4fv(mem->shaders[PapayaShader_ImGui]->uniforms[0],
-                                  1, GL_FALSE, (GLfloat*)r) );
-        pagl_set_vertex_attribs(mem->shaders[PapayaShader_DeMultiplyAlpha]);
-        GLCHK( glBindTexture(GL_TEXTURE_2D, (GLuint)(intptr_t)mem->cur_doc->final_node->tex_id) );
-        GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR) );
-        GLCHK( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR) );
-        GLCHK( glDrawArrays (GL_TRIANGLES, 0, 6) );
-
-        u32 temp = mem->misc.fbo_sample_tex;
-        mem->misc.fbo_sample_tex = mem->cur_doc->final_node->tex_id;
-        mem->cur_doc->final_node->tex_id = temp;
-
-        if (size_changed) {
-            core::resize_doc(mem, mem->cur_doc->width, mem->cur_doc->height);
-
-            // Reposition canvas to maintain apparent position
-            i32 delta = math::round_to_int((mem->cur_doc->height - mem->cur_doc->width)
-                    * 0.5f * mem->cur_doc->canvas_zoom);
-            mem->cur_doc->canvas_pos.x += delta;
-            mem->cur_doc->canvas_pos.y -= delta;
-        }
-
-        // Reset stuff
-        GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, 0) );
-        GLCHK( glViewport(0, 0, (i32)ImGui::GetIO().DisplaySize.x, (i32)ImGui::GetIO().DisplaySize.y) );
-
-        mem->crop_rotate.slider_angle = 0.f;
-        mem->crop_rotate.base_rotation = 0;
+        apply(mem);
     }
 
     ImGui::SameLine();
     if (ImGui::Button("Cancel")) {
-        mem->crop_rotate.slider_angle = 0.f;
-        mem->crop_rotate.base_rotation = 0;
+        cr->slider_angle = 0.f;
+        cr->base_rotation = 0;
     }
 
     ImGui::PopStyleVar();
-#endif
+}
+
+/*
+    Bakes the previewed rotation into a transform node after the current one,
+    which becomes the current node. Turns by an odd multiple of 90 degrees
+    swap the width and height of the document.
+*/
+void crop_rotate::apply(PapayaMemory* mem)
+{
+    CropRotate* cr = &mem->crop_rotate;
+    PapayaGraph* graph = &mem->doc->graph;
+    PapayaNode* n = papaya_graph_add_node(graph);
+    if (!n) {
+        platform::print("No room for another node in the graph\n");
+        return;
+    }
+
+    i32 w = mem->misc.w, h = mem->misc.h;
+    bool size_changed = (cr->base_rotation % 2 != 0);
+    i32 new_w = size_changed ? h : w;
+    i32 new_h = size_changed ? w : h;
+
+    init_transform_node(n, "Crop and rotate");
+    TransformNode* t = &n->params.transform;
+    t->angle = cr->slider_angle +
+               math::to_radians(90.0f * cr->base_rotation);
+    t->src_x = w * 0.5f;
+    t->src_y = h * 0.5f;
+    t->dst_x = new_w * 0.5f;
+    t->dst_y = new_h * 0.5f;
+    t->filter = (u8)cr->filter;
+    append_to_current(mem, n);
+
+    if (size_changed) {
+        mem->misc.w = new_w;
+        mem->misc.h = new_h;
+        mem->doc->canvas_size = Vec2((f32)new_w, (f32)new_h);
+        core::resize_doc(mem, new_w, new_h);
+
+        // Reposition canvas to maintain apparent position
+        i32 delta = math::round_to_int((new_h - new_w) * 0.5f *
+                                       mem->doc->canvas_zoom);
+        mem->doc->canvas_pos.x += delta;
+        mem->doc->canvas_pos.y -= delta;
+    }
+
+    cr->slider_angle = 0.f;
+    cr->base_rotation = 0;
+    core::update_canvas(mem);
 }
 
 void crop_rotate::crop_outline(PapayaMemory* mem)
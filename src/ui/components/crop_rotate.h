@@ -8,6 +8,7 @@ struct PapayaMemory; // TODO: Remove. Manage struct knowledge on a need-to-know-
 struct CropRotate {
     i32 base_rotation; // Multiply this by 90 to get the rotation in degrees
     f32 slider_angle;
+    i32 filter; // PapayaFilter_ of the transform that apply adds
     Vec2 top_left;
     Vec2 bot_right;
 
@@ -24,6 +25,7 @@ struct CropRotate {
 namespace crop_rotate {
     void init(PapayaMemory* mem);
     void toolbar(PapayaMemory* mem);
+    void apply(PapayaMemory* mem);
     void crop_outline(PapayaMemory* mem);
 }
 
@@ -0,0 +1,388 @@
+#include "components/doc_io.h"
+
+#include "ui.h"
+#include "components/graph_panel.h"
+#include "libs/stb_image.h"
+#include "libs/imgui/imgui.h"
+#include "libs/mathlib.h"
+#include "libpapaya.h"
+#include "jobs.h"
+#include "kernels.h"
+#include "png.h"
+#include "project.h"
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+enum DocIoOp_ {
+    DocIoOp_None,
+    DocIoOp_Open,
+    DocIoOp_Snapshot, // Saving, waiting for the canvas to be complete
+    DocIoOp_Save
+};
+
+struct DocIo {
+    DocIoOp_ op;
+    PapayaTask* task;
+    char* path;
+
+    // Shared with the job. Only progress may be read before the job is done.
+    std::atomic<f32> progress;
+    bool failed;
+    Document* doc; // Opened document
+    i32 view_node; // Of the opened document
+    u8* pixels;    // Snapshot being saved as a PNG
+    PapayaProjectSnapshot* project; // Snapshot being saved as a project
+    i32 w, h;
+    i32 level;     // PNG compression level
+};
+
+DocIo* init_doc_io()
+{
+    return new DocIo();
+}
+
+static void reset(DocIo* io)
+{
+    if (io->task) {
+        papaya_wait(io->task);
+    }
+    if (io->doc) {
+        core::destroy_doc(io->doc);
+    }
+    free(io->path);
+    free(io->pixels);
+    if (io->project) {
+        papaya_project_release(io->project);
+    }
+
+    io->op = DocIoOp_None;
+    io->task = 0;
+    io->path = 0;
+    io->progress = 0.0f;
+    io->failed = false;
+    io->doc = 0;
+    io->view_node = 0;
+    io->pixels = 0;
+    io->project = 0;
+}
+
+void destroy_doc_io(DocIo* io)
+{
+    reset(io);
+    delete io;
+}
+
+bool doc_io_busy(DocIo* io)
+{
+    return io->op != DocIoOp_None;
+}
+
+bool doc_io_is_project(const char* path)
+{
+    const char* ext = ".papaya";
+    size_t n = strlen(path), e = strlen(ext);
+    if (n < e) {
+        return false;
+    }
+    for (size_t i = 0; i < e; i++) {
+        char c = path[n - e + i];
+        if (c >= 'A' && c <= 'Z') { c += 'a' - 'A'; }
+        if (c != ext[i]) { return false; }
+    }
+    return true;
+}
+
+static char* copy_string(const char* s)
+{
+    size_t n = strlen(s) + 1;
+    char* c = (char*) malloc(n);
+    memcpy(c, s, n);
+    return c;
+}
+
+static const char* file_name(const char* path)
+{
+    const char* name = path;
+    for (const char* c = path; *c; c++) {
+        if (*c == '/' || *c == '\\') { name = c + 1; }
+    }
+    return name;
+}
+
+// -----------------------------------------------------------------------------
+
+/*
+    Nothing is read here beyond the tables of the project. Its tiles are read
+    as they are first used.
+*/
+static void open_project(DocIo* io)
+{
+    size_t size = 0;
+    u8* file = (u8*) platform::map_file(io->path, &size);
+    PapayaProjectInfo info;
+    if (!file || !papaya_project_info(file, size, &info)) {
+        if (file) { platform::unmap_file(file, size); }
+        io->failed = true;
+        return;
+    }
+
+    Document* doc = core::init_doc(info.num_nodes);
+    papaya_project_load(file, &doc->graph);
+    doc->storage->project_file = file;
+    doc->storage->project_file_size = size;
+
+    io->doc = doc;
+    io->view_node = info.view_node;
+    io->w = info.width;
+    io->h = info.height;
+    io->progress = 1.0f;
+}
+
+/*
+    The file is read in chunks to report progress, then decoded from memory.
+    stb_image takes int lengths, so files over 2 GB aren't supported.
+*/
+static void open_job(void* data, i32 index)
+{
+    PROFILE_ZONE("Open");
+    DocIo* io = (DocIo*) data;
+    const size_t chunk = 1024 * 1024;
+    if (doc_io_is_project(io->path)) {
+        open_project(io);
+        return;
+    }
+
+    FILE* f = fopen(io->path, "rb");
+    if (!f) {
+        io->failed = true;
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    u8* file = size > 0 ? (u8*) malloc(size) : 0;
+
+    size_t read = 0;
+    while (file && read < (size_t)size) {
+        size_t n = fread(file + read, 1, math::min(chunk, (size_t)size - read),
+                         f);
+        if (n == 0) { break; }
+        read += n;
+        io->progress = 0.5f * read / size;
+    }
+    fclose(f);
+
+    i32 w = 0, h = 0, c = 0;
+    u8* img = 0;
+    if (file && read == (size_t)size) {
+        img = stbi_load_from_memory(file, (i32)size, &w, &h, &c, 4);
+    }
+    free(file);
+    if (!img) {
+        io->failed = true;
+        return;
+    }
+    io->progress = 0.8f;
+
+    // Nodes work on premultiplied alpha
+    papaya_premultiply(img, (i64)w * h);
+    io->progress = 0.9f;
+
+    // Nothing else references the new document yet, so it is built here
+    Document* doc = core::init_doc(1);
+    PapayaNode* node = &doc->graph.nodes[0];
+    init_bitmap_node(node, "Image", img, w, h, 4,
+                     core::alloc_tile_storage(doc, w, h));
+    node->pos_x = 108;
+    node->pos_y = 108;
+    stbi_image_free(img);
+
+    io->doc = doc;
+    io->w = w;
+    io->h = h;
+    io->progress = 1.0f;
+}
+
+bool doc_io_open(PapayaMemory* mem, const char* path)
+{
+    DocIo* io = mem->doc_io;
+    if (doc_io_busy(io)) {
+        return false;
+    }
+    // Nothing is closed to make room, so with every tab in use the file is
+    // refused before any work is done
+    if (mem->num_docs == PAPAYA_MAX_DOCS) {
+        platform::print("No room for another document\n");
+        return false;
+    }
+
+    // A file that is open already is copied from the storage of its
+    // documents, which takes no I/O, and only shares its tiles
+    for (i32 i = 0; i < mem->num_docs; i++) {
+        DocStorage* s = mem->docs[i]->storage;
+        if (s->path && !strcmp(s->path, path)) {
+            Document* doc = core::copy_doc(s, &s->graph);
+            core::add_doc(mem, doc, file_name(path), s->w, s->h,
+                          s->view_node);
+            return true;
+        }
+    }
+
+    io->op = DocIoOp_Open;
+    io->path = copy_string(path);
+    io->task = papaya_run_async(open_job, io);
+    return true;
+}
+
+static void finish_open(PapayaMemory* mem)
+{
+    PROFILE_ZONE("Finish open");
+    DocIo* io = mem->doc_io;
+    if (io->failed) {
+        platform::print("Open failed\n");
+        return;
+    }
+
+    // The graph as opened is kept for opening the file again. Copying it
+    // changes reference counts, so it happens here, on the main thread.
+    Document* doc = io->doc;
+    DocStorage* s = doc->storage;
+    io->doc = 0;
+    s->path = io->path;
+    io->path = 0;
+    s->view_node = io->view_node;
+    s->w = io->w;
+    s->h = io->h;
+    papaya_graph_copy(&s->graph, &doc->graph);
+    core::add_doc(mem, doc, file_name(s->path), io->w, io->h,
+                  io->view_node);
+}
+
+// -----------------------------------------------------------------------------
+
+static void save_progress(void* data, f32 done)
+{
+    DocIo* io = (DocIo*) data;
+    io->progress = 0.1f + 0.8f * done;
+}
+
+/*
+    The encoder spreads the compression over all threads, so that saving
+    large images takes seconds instead of minutes.
+*/
+static void save_job(void* data, i32 index)
+{
+    PROFILE_ZONE("Save");
+    DocIo* io = (DocIo*) data;
+    papaya_unpremultiply(io->pixels, io->pixels, (i64)io->w * io->h);
+    io->progress = 0.1f;
+
+    size_t size;
+    u8* png = papaya_encode_png(io->pixels, io->w, io->h, io->level, &size,
+                                save_progress, io);
+    FILE* f = fopen(io->path, "wb");
+    io->failed = !f || fwrite(png, 1, size, f) != size;
+    if (f && fclose(f) != 0) {
+        io->failed = true;
+    }
+    free(png);
+    io->progress = 1.0f;
+}
+
+static void save_project_job(void* data, i32 index)
+{
+    PROFILE_ZONE("Save project");
+    DocIo* io = (DocIo*) data;
+    io->failed = !papaya_project_write(io->project, io->path, save_progress,
+                                       io);
+    io->progress = 1.0f;
+}
+
+bool doc_io_save(PapayaMemory* mem, const char* path)
+{
+    DocIo* io = mem->doc_io;
+    if (doc_io_busy(io)) {
+        return false;
+    }
+
+    // Documents opened from the file no longer match it
+    for (i32 i = 0; i < mem->num_docs; i++) {
+        DocStorage* s = mem->docs[i]->storage;
+        if (s->path && !strcmp(s->path, path)) {
+            free(s->path);
+            s->path = 0;
+            papaya_graph_destroy(&s->graph);
+        }
+    }
+
+    io->path = copy_string(path);
+    if (doc_io_is_project(path)) {
+        Document* doc = mem->doc;
+        io->project = papaya_project_snapshot(&doc->graph,
+                                              mem->misc.w, mem->misc.h,
+                                              (i32)mem->graph_panel->cur_node);
+        io->op = DocIoOp_Save;
+        io->task = papaya_run_async(save_project_job, io);
+        return true;
+    }
+
+    io->op = DocIoOp_Snapshot;
+    io->level = mem->misc.png_level;
+    return true;
+}
+
+/*
+    Copies the output of the viewed node once the canvas holds all of it at
+    full resolution, so that taking the snapshot doesn't evaluate anything.
+    When nodes are evaluated on the GPU, the CPU evaluation runs here instead.
+*/
+static void take_snapshot(PapayaMemory* mem)
+{
+    DocIo* io = mem->doc_io;
+    if (!mem->misc.gpu_eval &&
+        (mem->misc.canvas_pending || mem->misc.canvas_level != 0)) {
+        return;
+    }
+
+    PapayaNode* node = &mem->doc->graph.nodes[mem->graph_panel->cur_node];
+    io->w = mem->misc.w;
+    io->h = mem->misc.h;
+    size_t size = 4 * (size_t)io->w * io->h;
+    io->pixels = (u8*) malloc(size);
+    memcpy(io->pixels, papaya_evaluate_cached(node, io->w, io->h, 0), size);
+
+    io->op = DocIoOp_Save;
+    io->task = papaya_run_async(save_job, io);
+}
+
+// -----------------------------------------------------------------------------
+
+void update_doc_io(PapayaMemory* mem)
+{
+    DocIo* io = mem->doc_io;
+    if (io->op == DocIoOp_Snapshot) {
+        take_snapshot(mem);
+    } else if (io->task && papaya_task_done(io->task)) {
+        papaya_wait(io->task);
+        io->task = 0;
+        if (io->op == DocIoOp_Open) {
+            finish_open(mem);
+        } else if (io->failed) {
+            platform::print("Save failed\n");
+        }
+        reset(io);
+    }
+
+    if (!doc_io_busy(io)) {
+        return;
+    }
+
+    const char* name = file_name(io->path);
+    ImGui::SetNextWindowSize(ImVec2(300, 50));
+    ImGui::SetNextWindowPos(ImVec2(40, mem->window.height - 60.0f));
+    ImGui::Begin("File progress", 0, mem->window.default_imgui_flags);
+    ImGui::Text("%s %s", io->op == DocIoOp_Open ? "Opening" : "Saving", name);
+    ImGui::ProgressBar(io->progress);
+    ImGui::End();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "libs/types.h"
+
+struct PapayaMemory;
+
+/*
+    Opening and saving of documents, either as images or as projects, which
+    keep the whole node graph (see project.h in libpapaya). Reading, decoding
+    and encoding run as background jobs while the UI keeps running, and their
+    progress is shown in a small window. Only one operation runs at a time.
+*/
+struct DocIo;
+
+DocIo* init_doc_io();
+void destroy_doc_io(DocIo* io); // Waits for the operation in progress
+bool doc_io_busy(DocIo* io);
+bool doc_io_is_project(const char* path); // By the .papaya extension
+
+/*
+    Starts opening the image or project at path, as a new document, which is
+    added once the image has been decoded or the project mapped. A file that
+    is open already is added right away from the storage of its documents,
+    as long as it hasn't been saved over since. Paths are compared as given.
+    Returns false if an operation is in progress, or if PAPAYA_MAX_DOCS
+    documents are open already, none of which is closed to make room.
+*/
+bool doc_io_open(PapayaMemory* mem, const char* path);
+
+/*
+    Starts saving the document as a project, or else the output of the viewed
+    node as a PNG at path. Projects are snapshotted right away, while images
+    are snapshotted once the canvas has been refined to full resolution. After
+    that, editing may continue. Returns false if an operation is in progress.
+*/
+bool doc_io_save(PapayaMemory* mem, const char* path);
+
+/*
+    Finishes completed operations and draws the progress. Called every frame.
+*/
+void update_doc_io(PapayaMemory* mem);
@@ -5,6 +5,7 @@
 #include "pagl.h"
 #include "gl_lite.h"
 #include "color_panel.h"
+#include "libpapaya.h"
 
 static PaglProgram* compile_shaders(u32 vertex_shader);
 
@@ -13,24 +14,137 @@ EyeDropper* init_eye_dropper(PapayaMemory* mem)
     EyeDropper* e = (EyeDropper*) calloc(sizeof(*e), 1);
     e->mesh = pagl_init_quad_mesh(Vec2(40, 60), Vec2(30, 30), GL_DYNAMIC_DRAW);
     e->pgm = compile_shaders(mem->misc.vertex_shader);
+    e->sample_size = 1;
+    GLCHK( glGenBuffers(1, &e->pbo) );
+    GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, e->pbo) );
+    GLCHK( glBufferData(GL_PIXEL_PACK_BUFFER, 4 * 5 * 5, 0, GL_STREAM_READ) );
+    GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, 0) );
     return e;
 }
 
 void destroy_eye_dropper(EyeDropper* e)
 {
+    if (e->fence) { GLCHK( glDeleteSync((GLsync)e->fence) ); }
+    GLCHK( glDeleteBuffers(1, &e->pbo) );
     pagl_destroy_mesh(e->mesh);
     pagl_destroy_program(e->pgm);
     free(e);
 }
 
+/*
+    Averages the premultiplied RGBA pixels of the w*h image in the square of
+    side n centered on x, y, clipped to the image. False if the square is
+    entirely outside.
+*/
+static bool average_pixels(const u8* img, i32 w, i32 h, i32 x, i32 y, i32 n,
+                           Color* col)
+{
+    i32 x1 = math::max(x - n / 2, 0), x2 = math::min(x + n / 2 + 1, w);
+    i32 y1 = math::max(y - n / 2, 0), y2 = math::min(y + n / 2 + 1, h);
+    if (x2 <= x1 || y2 <= y1) {
+        return false;
+    }
+
+    u32 sum[4] = {};
+    for (i32 j = y1; j < y2; j++) {
+        for (i32 i = x1; i < x2; i++) {
+            const u8* p = img + 4 * ((size_t)j * w + i);
+            for (i32 c = 0; c < 4; c++) { sum[c] += p[c]; }
+        }
+    }
+
+    // Picked colors are opaque, so transparent pixels give their color
+    // without the alpha
+    f32 a = (f32)sum[3];
+    *col = a > 0.0f ? Color(sum[0] / a, sum[1] / a, sum[2] / a)
+                   : Color(0.0f, 0.0f, 0.0f);
+    return true;
+}
+
+/*
+    Samples the output of the canvas node in its cache, which is what the
+    canvas shows, at the level it is on screen. False if it isn't there.
+*/
+static bool sample_canvas(PapayaMemory* mem, Color* col)
+{
+    PapayaNode* node = mem->misc.canvas_node;
+    if (mem->misc.gpu_eval || !node) {
+        return false;
+    }
+    PapayaCache* c = &node->cache;
+    if (!c->data || c->channels != 4 || c->level != mem->misc.canvas_level) {
+        return false;
+    }
+
+    i32 x = (i32)floorf(mem->mouse.uv.x * mem->misc.w);
+    i32 y = (i32)floorf(mem->mouse.uv.y * mem->misc.h);
+    if (x < 0 || y < 0 || x >= mem->misc.w || y >= mem->misc.h) {
+        return false;
+    }
+    return average_pixels(c->data, c->w, c->h, x >> c->level, y >> c->level,
+                          mem->eye_dropper->sample_size, col);
+}
+
+/*
+    Returns the average of the last readback of the window that has
+    finished, and starts the next one around the mouse.
+*/
+static Color sample_window(PapayaMemory* mem)
+{
+    EyeDropper* e = mem->eye_dropper;
+
+    if (e->fence) {
+        GLenum status = glClientWaitSync((GLsync)e->fence,
+                                         GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            return e->read_color; // Still in flight
+        }
+        GLCHK( glDeleteSync((GLsync)e->fence) );
+        e->fence = 0;
+
+        GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, e->pbo) );
+        u8* pixels = (u8*) glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (pixels) {
+            // The window has no alpha to speak of. Rows are bottom-up, which
+            // doesn't matter for an average.
+            for (i32 i = 0; i < e->read_w * e->read_h; i++) {
+                pixels[4 * i + 3] = 255;
+            }
+            average_pixels(pixels, e->read_w, e->read_h, e->read_w / 2,
+                           e->read_h / 2, 5, &e->read_color);
+            GLCHK( glUnmapBuffer(GL_PIXEL_PACK_BUFFER) );
+        }
+        GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, 0) );
+    }
+
+    i32 n = e->sample_size;
+    i32 x = mem->mouse.pos.x - n / 2;
+    i32 y = mem->window.height - 1 - mem->mouse.pos.y - n / 2;
+    i32 x1 = math::max(x, 0), x2 = math::min(x + n, mem->window.width);
+    i32 y1 = math::max(y, 0), y2 = math::min(y + n, mem->window.height);
+    if (x2 > x1 && y2 > y1) {
+        e->read_w = x2 - x1;
+        e->read_h = y2 - y1;
+        GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, e->pbo) );
+        GLCHK( glReadPixels(x1, y1, e->read_w, e->read_h, GL_RGBA,
+                            GL_UNSIGNED_BYTE, 0) );
+        GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, 0) );
+        e->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    return e->read_color;
+}
+
 void update_and_render_eye_dropper(PapayaMemory* mem)
 {
-    // Get pixel color
-    f32 pix[3] = { 0 };
-    GLCHK( glReadPixels((i32)mem->mouse.pos.x,
-                        mem->window.height - (i32)mem->mouse.pos.y,
-                        1, 1, GL_RGB, GL_FLOAT, pix) );
-    Color col = Color(pix[0], pix[1], pix[2]);
+    // Nothing is sampled until the color is needed
+    if (!mem->mouse.is_down[0] && !mem->mouse.released[0]) {
+        return;
+    }
+
+    Color col;
+    if (!sample_canvas(mem, &col)) {
+        col = sample_window(mem);
+    }
 
     if (mem->mouse.is_down[0]) {
         Vec2 sz = Vec2(230,230);
@@ -40,15 +154,17 @@ void update_and_render_eye_dropper(PapayaMemory* mem)
         pagl_push_state();
         pagl_enable(1, GL_SCISSOR_TEST);
         
-        GLCHK( glEnable(GL_BLEND) );
+        pagl_set_cap(GL_BLEND, true);
         GLCHK( glBlendEquation(GL_FUNC_ADD) );
         GLCHK( glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
 
+        PaglUniform u[] = {
+            pagl_mat4(&mem->window.proj_mtx[0][0]),
+            pagl_color(col),
+            pagl_color(mem->color_panel->new_color),
+        };
         pagl_draw_mesh(mem->eye_dropper->mesh, mem->eye_dropper->pgm,
-                       3,
-                       Pagl_UniformType_Matrix4, &mem->window.proj_mtx[0][0],
-                       Pagl_UniformType_Color, col,
-                       Pagl_UniformType_Color, mem->color_panel->new_color);
+                       PAGL_COUNT(u), u);
         pagl_pop_state();
     } else if (mem->mouse.released[0]) {
         color_panel_set_color(col, mem->color_panel, mem->color_panel->is_open);
@@ -76,7 +192,13 @@ static PaglProgram* compile_shaders(u32 vertex_shader)
 
     const char* name = "eye dropper cursor";
     u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
-    return pagl_init_program(name, vertex_shader, frag, 2, 3,
-                               "pos", "uv",
-                               "proj_mtx", "col1", "col2");
+    static const char* attribs[] = { "pos", "uv" };
+    static const PaglUniformDesc uniforms[] = {
+        { Pagl_UniformType_Matrix4, "proj_mtx" },
+        { Pagl_UniformType_Color,   "col1" },
+        { Pagl_UniformType_Color,   "col2" },
+    };
+    return pagl_init_program(name, vertex_shader, frag,
+                             PAGL_COUNT(attribs), attribs,
+                             PAGL_COUNT(uniforms), uniforms);
 }
@@ -6,9 +6,21 @@ struct PapayaMemory;
 struct PaglMesh;
 struct PaglProgram;
 
+/*
+    Picks colors from the document, as evaluated for the canvas. Where the
+    evaluated pixels aren't on the CPU, in GPU evaluation mode or outside the
+    document, the window is read instead, through a pixel buffer that is
+    mapped frames later, so neither waits for the GPU.
+*/
 struct EyeDropper {
     PaglMesh* mesh;
     PaglProgram* pgm;
+    i32 sample_size; // Side of the square of pixels averaged. 1, 3 or 5.
+
+    u32 pbo;
+    void* fence; // GLsync signalled when the readback is in pbo. 0 if none.
+    i32 read_w, read_h; // Of the readback in flight
+    Color read_color; // Average of the last finished readback
 };
 
 EyeDropper* init_eye_dropper(PapayaMemory* mem);
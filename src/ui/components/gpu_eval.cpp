@@ -0,0 +1,571 @@
+
+#include "gpu_eval.h"
+#include "libs/linmath.h"
+#include "ui.h"
+#include "libpapaya.h"
+#include "pagl.h"
+#include "gl_lite.h"
+
+static void compile_shaders(GpuEvaluator* g, u32 vertex_shader);
+
+GpuEvaluator* init_gpu_evaluator(PapayaMemory* mem)
+{
+    GpuEvaluator* g = (GpuEvaluator*) calloc(sizeof(*g), 1);
+    u8 transparent[4] = { 0, 0, 0, 0 };
+
+    GLCHK( glGenFramebuffers(1, &g->fbo) );
+    g->empty_tex = pagl_alloc_texture(1, 1, transparent);
+    g->mesh = pagl_init_quad_mesh(Vec2(0, 0), Vec2(1, 1), GL_STATIC_DRAW);
+    compile_shaders(g, mem->misc.vertex_shader);
+    return g;
+}
+
+void destroy_gpu_evaluator(GpuEvaluator* g)
+{
+    reset_gpu_evaluator(g);
+    free(g->nodes);
+
+    GLCHK( glDeleteFramebuffers(1, &g->fbo) );
+    pagl_delete_texture(&g->empty_tex);
+    pagl_destroy_mesh(g->mesh);
+    pagl_destroy_program(g->pgm_bitmap);
+    pagl_destroy_program(g->pgm_invert_color);
+    pagl_destroy_program(g->pgm_transform);
+    pagl_destroy_program(g->pgm_blur);
+    pagl_destroy_program(g->pgm_levels);
+    free(g);
+}
+
+void reset_gpu_evaluator(GpuEvaluator* g)
+{
+    for (i32 i = 0; i < g->num_nodes; i++) {
+        GpuNodeTex* t = &g->nodes[i];
+        if (t->tex) { pagl_delete_texture(&t->tex); }
+        if (t->src_tex) { pagl_delete_texture(&t->src_tex); }
+        if (t->aux_tex) { pagl_delete_texture(&t->aux_tex); }
+        free(t->tile_ids);
+    }
+    g->num_nodes = 0;
+}
+
+void trim_gpu_evaluator(GpuEvaluator* g)
+{
+    for (i32 i = 0; i < g->num_nodes; i++) {
+        GpuNodeTex* t = &g->nodes[i];
+        if (t->last_used == g->stamp) {
+            continue;
+        }
+        if (t->tex) { pagl_delete_texture(&t->tex); }
+        if (t->src_tex) { pagl_delete_texture(&t->src_tex); }
+        if (t->aux_tex) { pagl_delete_texture(&t->aux_tex); }
+        free(t->tile_ids);
+        t->tile_ids = 0;
+        t->valid = false;
+    }
+}
+
+void release_gpu_graph(GpuEvaluator* g, const PapayaGraph* graph)
+{
+    i32 kept = 0;
+    for (i32 i = 0; i < g->num_nodes; i++) {
+        GpuNodeTex* t = &g->nodes[i];
+        if (t->node < graph->nodes ||
+            t->node >= graph->nodes + graph->max_nodes) {
+            g->nodes[kept++] = *t;
+            continue;
+        }
+        if (t->tex) { pagl_delete_texture(&t->tex); }
+        if (t->src_tex) { pagl_delete_texture(&t->src_tex); }
+        if (t->aux_tex) { pagl_delete_texture(&t->aux_tex); }
+        free(t->tile_ids);
+    }
+    g->num_nodes = kept;
+}
+
+static i32 find_node_tex(GpuEvaluator* g, PapayaNode* node)
+{
+    for (i32 i = 0; i < g->num_nodes; i++) {
+        if (g->nodes[i].node == node) { return i; }
+    }
+
+    if (g->num_nodes == g->max_nodes) {
+        g->max_nodes = g->max_nodes ? 2 * g->max_nodes : 16;
+        g->nodes = (GpuNodeTex*) realloc(g->nodes,
+                                         g->max_nodes * sizeof(GpuNodeTex));
+    }
+    GpuNodeTex* t = &g->nodes[g->num_nodes];
+    memset(t, 0, sizeof(*t));
+    t->node = node;
+    return g->num_nodes++;
+}
+
+static bool is_passthrough(PapayaNode* node, i32 w, i32 h)
+{
+    PapayaTiles* img = &node->params.bitmap.image;
+    return node->type == PapayaNodeType_Bitmap &&
+           !papaya_slot_source(&node->slots[0]) &&
+           img->width == w && img->height == h;
+}
+
+/*
+    Uploads the tiles of the bitmap that have been replaced since the last
+    upload. Tiles are copied on write, so a tile with an unchanged id has
+    unchanged pixels, and undoing an edit re-uploads only the tiles it swaps.
+*/
+static void upload_tiles(GpuNodeTex* t, PapayaTiles* img)
+{
+    static u8 transparent[4 * PAPAYA_IMAGE_TILE_SIZE * PAPAYA_IMAGE_TILE_SIZE];
+    i32 num_tiles = img->tiles_x * img->tiles_y;
+
+    if (!t->src_tex) {
+        t->src_tex = pagl_alloc_texture(img->width, img->height, 0);
+        t->tile_ids = (u64*) malloc(num_tiles * sizeof(u64));
+        for (i32 i = 0; i < num_tiles; i++) {
+            t->tile_ids[i] = UINT64_MAX; // Not uploaded yet
+        }
+    }
+
+    pagl_bind_texture(0, t->src_tex);
+    GLCHK( glPixelStorei(GL_UNPACK_ROW_LENGTH, PAPAYA_IMAGE_TILE_SIZE) );
+    for (i32 i = 0; i < num_tiles; i++) {
+        PapayaTile* tile = img->tiles[i];
+        u64 id = tile ? tile->id : 0;
+        if (t->tile_ids[i] == id) {
+            continue;
+        }
+
+        PapayaRect r = papaya_tiles_rect(img, i);
+        GLCHK( glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h,
+                               GL_RGBA, GL_UNSIGNED_BYTE,
+                               tile ? tile->pixels : transparent) );
+        t->tile_ids[i] = id;
+    }
+    GLCHK( glPixelStorei(GL_UNPACK_ROW_LENGTH, 0) );
+}
+
+static u32 evaluate(GpuEvaluator* g, PapayaNode* node, i32 w, i32 h);
+
+static u32 evaluate_input(GpuEvaluator* g, PapayaNode* node, i32 slot,
+                          i32 w, i32 h)
+{
+    PapayaSlot* from = papaya_slot_source(&node->slots[slot]);
+    return from ? evaluate(g, from->node, w, h) : g->empty_tex;
+}
+
+static u32 evaluate(GpuEvaluator* g, PapayaNode* node, i32 w, i32 h)
+{
+    i32 idx = find_node_tex(g, node);
+    GpuNodeTex* t = &g->nodes[idx];
+    bool passthrough = is_passthrough(node, w, h);
+    t->last_used = g->stamp;
+
+    if (t->valid && t->generation == node->generation &&
+        t->w == w && t->h == h) {
+        return passthrough ? t->src_tex : t->tex;
+    }
+
+    if (node->type == PapayaNodeType_Bitmap) {
+        upload_tiles(t, &node->params.bitmap.image);
+    }
+
+    if (passthrough) {
+        t->w = w;
+        t->h = h;
+        t->generation = node->generation;
+        t->valid = true;
+        return t->src_tex;
+    }
+
+    // Inputs may add entries to g->nodes, so t is re-fetched afterwards
+    u32 in0 = g->empty_tex;
+    u32 in1 = g->empty_tex;
+    switch (node->type) {
+        case PapayaNodeType_Bitmap: {
+            in0 = evaluate_input(g, node, 0, w, h);
+        } break;
+        case PapayaNodeType_InvertColor: {
+            in0 = evaluate_input(g, node, 0, w, h);
+            in1 = evaluate_input(g, node, 2, w, h);
+        } break;
+        case PapayaNodeType_Transform:
+        case PapayaNodeType_Blur:
+        case PapayaNodeType_Levels: {
+            in0 = evaluate_input(g, node, 0, w, h);
+        } break;
+    }
+    t = &g->nodes[idx];
+
+    if (t->tex && (t->w != w || t->h != h)) {
+        pagl_delete_texture(&t->tex);
+        if (t->aux_tex) { pagl_delete_texture(&t->aux_tex); }
+    }
+    if (!t->tex) {
+        t->tex = pagl_alloc_texture(w, h, 0);
+    }
+    if (!t->aux_tex && node->type == PapayaNodeType_Blur) {
+        t->aux_tex = pagl_alloc_texture(w, h, 0);
+    }
+
+    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, g->fbo) );
+    GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_TEXTURE_2D, t->tex, 0) );
+    GLCHK( glViewport(0, 0, w, h) );
+
+    mat4x4 m;
+    mat4x4_ortho(m, 0.f, 1.f, 0.f, 1.f, -1.f, 1.f);
+
+    switch (node->type) {
+        case PapayaNodeType_Bitmap: {
+            PapayaTiles* img = &node->params.bitmap.image;
+            PaglUniform u[] = {
+                pagl_mat4(&m[0][0]),
+                pagl_tex0(in0),
+                pagl_tex1(t->src_tex),
+                pagl_vec2(Vec2((f32)w / img->width, (f32)h / img->height)),
+            };
+            pagl_draw_mesh(g->mesh, g->pgm_bitmap, PAGL_COUNT(u), u);
+        } break;
+        case PapayaNodeType_InvertColor: {
+            InvertColorNode* i = &node->params.invert_color;
+            bool masked = papaya_slot_source(&node->slots[2]) != 0;
+            PaglUniform u[] = {
+                pagl_mat4(&m[0][0]),
+                pagl_tex0(in0),
+                pagl_tex1(in1),
+                pagl_color(Color(i->invert_r ? 1.0f : 0.0f,
+                                 i->invert_g ? 1.0f : 0.0f,
+                                 i->invert_b ? 1.0f : 0.0f)),
+                pagl_float(masked ? 1.0f : 0.0f),
+            };
+            pagl_draw_mesh(g->mesh, g->pgm_invert_color, PAGL_COUNT(u), u);
+        } break;
+        case PapayaNodeType_Transform: {
+            TransformNode* tr = &node->params.transform;
+            PaglUniform u[] = {
+                pagl_mat4(&m[0][0]),
+                pagl_tex0(in0),
+                pagl_vec2(Vec2((f32)w, (f32)h)),
+                pagl_vec2(Vec2(tr->src_x, tr->src_y)),
+                pagl_vec2(Vec2(tr->dst_x, tr->dst_y)),
+                pagl_float(tr->angle),
+                pagl_float((f32)tr->filter),
+            };
+            pagl_draw_mesh(g->mesh, g->pgm_transform, PAGL_COUNT(u), u);
+        } break;
+        case PapayaNodeType_Blur: {
+            // Horizontally into aux_tex, then vertically into tex
+            f32 radius = node->params.blur.radius;
+            for (i32 pass = 0; pass < 2; pass++) {
+                if (pass == 0) {
+                    GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER,
+                                                  GL_COLOR_ATTACHMENT0,
+                                                  GL_TEXTURE_2D, t->aux_tex,
+                                                  0) );
+                } else {
+                    GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER,
+                                                  GL_COLOR_ATTACHMENT0,
+                                                  GL_TEXTURE_2D, t->tex, 0) );
+                }
+                PaglUniform u[] = {
+                    pagl_mat4(&m[0][0]),
+                    pagl_tex0(pass == 0 ? in0 : t->aux_tex),
+                    pagl_vec2(Vec2((f32)w, (f32)h)),
+                    pagl_vec2(pass == 0 ? Vec2(1, 0) : Vec2(0, 1)),
+                    pagl_float(radius),
+                };
+                pagl_draw_mesh(g->mesh, g->pgm_blur, PAGL_COUNT(u), u);
+            }
+        } break;
+        case PapayaNodeType_Levels: {
+            LevelsNode* l = &node->params.levels;
+            PaglUniform u[] = {
+                pagl_mat4(&m[0][0]),
+                pagl_tex0(in0),
+                pagl_color(Color(l->in_black[0], l->in_black[1],
+                                 l->in_black[2], l->in_black[3])),
+                pagl_color(Color(l->in_white[0], l->in_white[1],
+                                 l->in_white[2], l->in_white[3])),
+                pagl_color(Color(l->gamma[0], l->gamma[1],
+                                 l->gamma[2], l->gamma[3])),
+                pagl_color(Color(l->out_black[0], l->out_black[1],
+                                 l->out_black[2], l->out_black[3])),
+                pagl_color(Color(l->out_white[0], l->out_white[1],
+                                 l->out_white[2], l->out_white[3])),
+            };
+            pagl_draw_mesh(g->mesh, g->pgm_levels, PAGL_COUNT(u), u);
+        } break;
+    }
+
+    t->w = w;
+    t->h = h;
+    t->generation = node->generation;
+    t->valid = true;
+    return t->tex;
+}
+
+u32 gpu_evaluate_node(GpuEvaluator* g, PapayaNode* node, i32 w, i32 h)
+{
+    i32 viewport[4];
+    GLCHK( glGetIntegerv(GL_VIEWPORT, viewport) );
+    pagl_push_state();
+    pagl_disable(1, GL_BLEND);
+    pagl_disable(1, GL_SCISSOR_TEST);
+
+    g->stamp++;
+    u32 tex = evaluate(g, node, w, h);
+
+    GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, 0) );
+    GLCHK( glViewport(viewport[0], viewport[1], viewport[2], viewport[3]) );
+    pagl_pop_state();
+    return tex;
+}
+
+static void compile_shaders(GpuEvaluator* g, u32 vertex_shader)
+{
+    static const char* attribs[] = { "pos", "uv" };
+
+    // Bitmap node. Composites the image over the input, both premultiplied.
+    {
+        const char* frag_src =
+"   #version 120                                                            \n"
+"                                                                           \n"
+"   uniform sampler2D dst; // Uniforms[1]                                   \n"
+"   uniform sampler2D img; // Uniforms[2]                                   \n"
+"   uniform vec2 scale;    // Uniforms[3]                                   \n"
+"                                                                           \n"
+"   varying vec2 frag_uv;                                                   \n"
+"                                                                           \n"
+"   void main()                                                             \n"
+"   {                                                                       \n"
+"       vec2 uv = frag_uv * scale;                                          \n"
+"       vec4 s = texture2D(img, uv);                                        \n"
+"       if (uv.x > 1.0 || uv.y > 1.0) { s = vec4(0.0); }                    \n"
+"       vec4 d = texture2D(dst, frag_uv);                                   \n"
+"       gl_FragColor = s + d * (1.0 - s.a);                                 \n"
+"   }                                                                       \n";
+
+        const char* name = "bitmap node";
+        u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
+        static const PaglUniformDesc uniforms[] = {
+            { Pagl_UniformType_Matrix4, "proj_mtx" },
+            { Pagl_UniformType_Tex0,    "dst" },
+            { Pagl_UniformType_Tex1,    "img" },
+            { Pagl_UniformType_Vec2,    "scale" },
+        };
+        g->pgm_bitmap = pagl_init_program(name, vertex_shader, frag,
+                                          PAGL_COUNT(attribs), attribs,
+                                          PAGL_COUNT(uniforms), uniforms);
+    }
+
+    // Invert color node. Without a mask, all channels are inverted.
+    {
+        const char* frag_src =
+"   #version 120                                                            \n"
+"                                                                           \n"
+"   uniform sampler2D tex;  // Uniforms[1]                                  \n"
+"   uniform sampler2D mask; // Uniforms[2]                                  \n"
+"   uniform vec4 channels;  // Uniforms[3]                                  \n"
+"   uniform float use_mask; // Uniforms[4]                                  \n"
+"                                                                           \n"
+"   varying vec2 frag_uv;                                                   \n"
+"                                                                           \n"
+"   void main()                                                             \n"
+"   {                                                                       \n"
+"       vec4 c = texture2D(tex, frag_uv);                                   \n"
+"       vec3 t = vec3(1.0);                                                 \n"
+"       if (use_mask > 0.5) {                                               \n"
+"           t = texture2D(mask, frag_uv).a * channels.rgb;                  \n"
+"       }                                                                   \n"
+"       gl_FragColor = vec4(mix(c.rgb, vec3(c.a) - c.rgb, t), c.a);         \n"
+"   }                                                                       \n";
+
+        const char* name = "invert color node";
+        u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
+        static const PaglUniformDesc uniforms[] = {
+            { Pagl_UniformType_Matrix4, "proj_mtx" },
+            { Pagl_UniformType_Tex0,    "tex" },
+            { Pagl_UniformType_Tex1,    "mask" },
+            { Pagl_UniformType_Color,   "channels" },
+            { Pagl_UniformType_Float,   "use_mask" },
+        };
+        g->pgm_invert_color = pagl_init_program(name, vertex_shader, frag,
+                                                PAGL_COUNT(attribs), attribs,
+                                                PAGL_COUNT(uniforms), uniforms);
+    }
+
+    // Transform node. Reads the input pixels around the position turned back
+    // by the angle, with the filter of the CPU evaluation, see libpapaya.cpp.
+    // Pixels outside the input are transparent.
+    {
+        const char* frag_src =
+"   #version 120                                                            \n"
+"                                                                           \n"
+"   uniform sampler2D tex; // Uniforms[1]                                   \n"
+"   uniform vec2 size;     // Uniforms[2]                                   \n"
+"   uniform vec2 src;      // Uniforms[3]                                   \n"
+"   uniform vec2 dst;      // Uniforms[4]                                   \n"
+"   uniform float angle;   // Uniforms[5]                                   \n"
+"   uniform float filter;  // Uniforms[6]. PapayaFilter_                    \n"
+"                                                                           \n"
+"   varying vec2 frag_uv;                                                   \n"
+"                                                                           \n"
+"   float weight(float x)                                                   \n"
+"   {                                                                       \n"
+"       x = abs(x);                                                         \n"
+"       if (filter < 0.5) { return max(1.0 - x, 0.0); }                     \n"
+"       if (filter < 1.5) {                                                 \n"
+"           if (x < 1.0) { return (1.5 * x - 2.5) * x * x + 1.0; }          \n"
+"           if (x < 2.0) { return ((-0.5*x + 2.5) * x - 4.0) * x + 2.0; }   \n"
+"           return 0.0;                                                     \n"
+"       }                                                                   \n"
+"       if (x < 1e-5) { return 1.0; }                                       \n"
+"       if (x >= 3.0) { return 0.0; }                                       \n"
+"       float t = 3.14159265 * x;                                           \n"
+"       return 3.0 * sin(t) * sin(t / 3.0) / (t * t);                       \n"
+"   }                                                                       \n"
+"                                                                           \n"
+"   void main()                                                             \n"
+"   {                                                                       \n"
+"       float c = cos(angle), s = sin(angle);                               \n"
+"       vec2 q = frag_uv * size - dst;                                      \n"
+"       vec2 p = src + vec2(c * q.x + s * q.y, c * q.y - s * q.x) - 0.5;    \n"
+"       vec2 f = floor(p);                                                  \n"
+"       vec4 sum = vec4(0.0);                                               \n"
+"       float total_x = 0.0, total_y = 0.0;                                 \n"
+"       for (int i = -2; i <= 3; i++) {                                     \n"
+"           total_x += weight(float(i) - (p.x - f.x));                      \n"
+"           total_y += weight(float(i) - (p.y - f.y));                      \n"
+"       }                                                                   \n"
+"       for (int j = -2; j <= 3; j++) {                                     \n"
+"           float wy = weight(float(j) - (p.y - f.y));                      \n"
+"           float y = f.y + float(j);                                       \n"
+"           if (wy == 0.0 || y < 0.0 || y >= size.y) { continue; }          \n"
+"           for (int i = -2; i <= 3; i++) {                                 \n"
+"               float wx = weight(float(i) - (p.x - f.x));                  \n"
+"               float x = f.x + float(i);                                   \n"
+"               if (wx == 0.0 || x < 0.0 || x >= size.x) { continue; }      \n"
+"               sum += wx * wy * texture2D(tex, (vec2(x, y) + 0.5) / size); \n"
+"           }                                                               \n"
+"       }                                                                   \n"
+"       sum /= total_x * total_y;                                           \n"
+"       float a = clamp(sum.a, 0.0, 1.0);                                   \n"
+"       gl_FragColor = vec4(clamp(sum.rgb, vec3(0.0), vec3(a)), a);         \n"
+"   }                                                                       \n";
+
+        const char* name = "transform node";
+        u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
+        static const PaglUniformDesc uniforms[] = {
+            { Pagl_UniformType_Matrix4, "proj_mtx" },
+            { Pagl_UniformType_Tex0,    "tex" },
+            { Pagl_UniformType_Vec2,    "size" },
+            { Pagl_UniformType_Vec2,    "src" },
+            { Pagl_UniformType_Vec2,    "dst" },
+            { Pagl_UniformType_Float,   "angle" },
+            { Pagl_UniformType_Float,   "filter" },
+        };
+        g->pgm_transform = pagl_init_program(name, vertex_shader, frag,
+                                             PAGL_COUNT(attribs), attribs,
+                                             PAGL_COUNT(uniforms), uniforms);
+    }
+
+    // Blur node. One pass of the separable Gaussian, along dir. Radii are
+    // three standard deviations, as on the CPU, which only approximates
+    // large radii by box passes. Pixels outside the input are transparent.
+    {
+        const char* frag_src =
+"   #version 120                                                            \n"
+"                                                                           \n"
+"   uniform sampler2D tex; // Uniforms[1]                                   \n"
+"   uniform vec2 size;     // Uniforms[2]                                   \n"
+"   uniform vec2 dir;      // Uniforms[3]                                   \n"
+"   uniform float radius;  // Uniforms[4]                                   \n"
+"                                                                           \n"
+"   varying vec2 frag_uv;                                                   \n"
+"                                                                           \n"
+"   void main()                                                             \n"
+"   {                                                                       \n"
+"       float r = floor(radius);                                            \n"
+"       float k = r < 1.0 ? 0.0 : -4.5 / (radius * radius);                 \n"
+"       vec2 p = frag_uv * size;                                            \n"
+"       vec4 sum = texture2D(tex, frag_uv);                                 \n"
+"       float total = 1.0;                                                  \n"
+"       for (int i = 1; i < 4096; i++) {                                    \n"
+"           float x = float(i);                                             \n"
+"           if (x > r) { break; }                                           \n"
+"           float w = exp(k * x * x);                                       \n"
+"           vec2 a = p + dir * x, b = p - dir * x;                          \n"
+"           if (a.x < size.x && a.y < size.y) {                             \n"
+"               sum += w * texture2D(tex, a / size);                        \n"
+"           }                                                               \n"
+"           if (b.x > 0.0 && b.y > 0.0) {                                   \n"
+"               sum += w * texture2D(tex, b / size);                        \n"
+"           }                                                               \n"
+"           total += 2.0 * w;                                               \n"
+"       }                                                                   \n"
+"       gl_FragColor = sum / total;                                         \n"
+"   }                                                                       \n";
+
+        const char* name = "blur node";
+        u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
+        static const PaglUniformDesc uniforms[] = {
+            { Pagl_UniformType_Matrix4, "proj_mtx" },
+            { Pagl_UniformType_Tex0,    "tex" },
+            { Pagl_UniformType_Vec2,    "size" },
+            { Pagl_UniformType_Vec2,    "dir" },
+            { Pagl_UniformType_Float,   "radius" },
+        };
+        g->pgm_blur = pagl_init_program(name, vertex_shader, frag,
+                                        PAGL_COUNT(attribs), attribs,
+                                        PAGL_COUNT(uniforms), uniforms);
+    }
+
+    // Levels node. Computes the curves that the CPU tabulates, see
+    // compile_levels in libpapaya.cpp, on the straight colors. The alpha
+    // components of the parameters adjust all three channels.
+    {
+        const char* frag_src =
+"   #version 120                                                            \n"
+"                                                                           \n"
+"   uniform sampler2D tex;  // Uniforms[1]                                  \n"
+"   uniform vec4 in_black;  // Uniforms[2]                                  \n"
+"   uniform vec4 in_white;  // Uniforms[3]                                  \n"
+"   uniform vec4 gamma;     // Uniforms[4]                                  \n"
+"   uniform vec4 out_black; // Uniforms[5]                                  \n"
+"   uniform vec4 out_white; // Uniforms[6]                                  \n"
+"                                                                           \n"
+"   varying vec2 frag_uv;                                                   \n"
+"                                                                           \n"
+"   vec3 curve(vec3 x, vec3 lo, vec3 hi, vec3 g, vec3 o_lo, vec3 o_hi)      \n"
+"   {                                                                       \n"
+"       vec3 t = clamp((x - lo) / max(hi - lo, vec3(1e-6)), 0.0, 1.0);      \n"
+"       t = pow(t, 1.0 / max(g, vec3(0.01)));                               \n"
+"       return clamp(o_lo + t * (o_hi - o_lo), 0.0, 1.0);                   \n"
+"   }                                                                       \n"
+"                                                                           \n"
+"   void main()                                                             \n"
+"   {                                                                       \n"
+"       vec4 c = texture2D(tex, frag_uv);                                   \n"
+"       vec3 s = c.a > 0.0 ? clamp(c.rgb / c.a, 0.0, 1.0) : vec3(0.0);      \n"
+"       s = curve(s, in_black.rgb, in_white.rgb, gamma.rgb,                 \n"
+"                 out_black.rgb, out_white.rgb);                            \n"
+"       s = curve(s, in_black.aaa, in_white.aaa, gamma.aaa,                 \n"
+"                 out_black.aaa, out_white.aaa);                            \n"
+"       gl_FragColor = vec4(s * c.a, c.a);                                  \n"
+"   }                                                                       \n";
+
+        const char* name = "levels node";
+        u32 frag = pagl_compile_shader(name, frag_src, GL_FRAGMENT_SHADER);
+        static const PaglUniformDesc uniforms[] = {
+            { Pagl_UniformType_Matrix4, "proj_mtx" },
+            { Pagl_UniformType_Tex0,    "tex" },
+            { Pagl_UniformType_Color,   "in_black" },
+            { Pagl_UniformType_Color,   "in_white" },
+            { Pagl_UniformType_Color,   "gamma" },
+            { Pagl_UniformType_Color,   "out_black" },
+            { Pagl_UniformType_Color,   "out_white" },
+        };
+        g->pgm_levels = pagl_init_program(name, vertex_shader, frag,
+                                          PAGL_COUNT(attribs), attribs,
+                                          PAGL_COUNT(uniforms), uniforms);
+    }
+}
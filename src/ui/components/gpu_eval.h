@@ -0,0 +1,69 @@
+#pragma once
+
+#include "libs/types.h"
+
+struct PapayaMemory;
+struct PapayaGraph;
+struct PapayaNode;
+struct PaglMesh;
+struct PaglProgram;
+
+/*
+    GPU counterpart of libpapaya's node evaluation. Every node type maps to a
+    fragment shader, and node outputs stay in textures between evaluations, so
+    nothing is read back or re-uploaded except edited bitmap tiles. A node is
+    redrawn only when its generation has changed since it was last drawn.
+*/
+
+struct GpuNodeTex {
+    PapayaNode* node;
+    u32 tex; // Output of the node
+    u32 src_tex; // Bitmap image, for bitmap nodes
+    u32 aux_tex; // Horizontal pass, for blur nodes
+    u64* tile_ids; // Ids of the bitmap tiles in src_tex. 0 for transparent.
+    i32 w, h;
+    u64 generation; // Generation of the node that tex corresponds to
+    u64 last_used; // Stamp of the last evaluation that reached the node
+    bool valid;
+};
+
+struct GpuEvaluator {
+    u32 fbo;
+    u32 empty_tex; // Transparent 1x1 texture bound to unconnected inputs
+    PaglMesh* mesh;
+    PaglProgram* pgm_bitmap;
+    PaglProgram* pgm_invert_color;
+    PaglProgram* pgm_transform;
+    PaglProgram* pgm_blur;
+    PaglProgram* pgm_levels;
+    GpuNodeTex* nodes;
+    i32 num_nodes, max_nodes;
+    u64 stamp; // Incremented by every gpu_evaluate_node
+};
+
+GpuEvaluator* init_gpu_evaluator(PapayaMemory* mem);
+void destroy_gpu_evaluator(GpuEvaluator* g);
+
+/*
+    Frees all node textures. Has to be called before nodes are destroyed.
+*/
+void reset_gpu_evaluator(GpuEvaluator* g);
+
+/*
+    Frees the textures of the nodes of the graph, e.g. of a document being
+    closed, and keeps those of other graphs
+*/
+void release_gpu_graph(GpuEvaluator* g, const PapayaGraph* graph);
+
+/*
+    Frees the textures of the nodes that the last evaluation didn't reach, to
+    make room on the GPU. They are redrawn, and bitmaps re-uploaded, if they
+    are evaluated again.
+*/
+void trim_gpu_evaluator(GpuEvaluator* g);
+
+/*
+    Brings the node's texture up to date and returns it. The texture is owned by
+    the evaluator. The default frame buffer is bound on return.
+*/
+u32 gpu_evaluate_node(GpuEvaluator* g, PapayaNode* node, i32 w, i32 h);
@@ -1,6 +1,7 @@
 
 #include "components/graph_panel.h"
 
+#include <algorithm>
 #include <math.h>
 
 #include "ui.h"
@@ -9,9 +10,14 @@
 #include "libs/imgui/imgui.h"
 #include "libs/mathlib.h"
 #include "libpapaya.h"
+#include "jobs.h"
+#include "kernels.h"
+#include "pagl.h"
+#include "gl_lite.h"
 
 const Vec2 node_sz = Vec2(36, 36);
 const f32 slot_radius = 4.0f;
+const f32 grid_cell_sz = 64.0f; // Not smaller than a node
 
 GraphPanel* init_graph_panel()
 {
@@ -20,6 +26,7 @@ GraphPanel* init_graph_panel()
     g->node_properties_panel_height = 200.0f;
     g->width = 300.0f;
     g->cur_node = 0;
+    g->levels_channel = PAPAYA_LEVELS_ALL;
     g->dragged_slot = 0;
     g->displaced_slot = 0;
     return g;
@@ -27,9 +34,123 @@ GraphPanel* init_graph_panel()
 
 void destroy_graph_panel(GraphPanel* g)
 {
+    reset_graph_panel(g);
+    free(g->stats);
     free(g);
 }
 
+void reset_graph_panel(GraphPanel* g)
+{
+    for (i32 i = 0; g->thumbs && i < g->grid.num_nodes; i++) {
+        if (g->thumbs[i].tex) { pagl_delete_texture(&g->thumbs[i].tex); }
+    }
+    free(g->thumbs);
+    g->thumbs = 0;
+    g->thumb_node = 0;
+    g->stats_node = 0;
+    free(g->grid.nodes);
+    free(g->grid.found);
+    g->grid.nodes = 0;
+    g->grid.found = 0;
+    g->grid.num_nodes = 0;
+    g->grid.num_found = 0;
+}
+
+static i32 grid_cell(f32 v)
+{
+    return (i32)floorf(v / grid_cell_sz);
+}
+
+static u32 grid_bucket(i32 x, i32 y)
+{
+    return ((u32)x * 73856093u ^ (u32)y * 19349663u) &
+           (GRAPH_GRID_BUCKETS - 1);
+}
+
+static void grid_insert(GraphGrid* gr, PapayaNode* nodes, i32 i)
+{
+    GridNode* gn = &gr->nodes[i];
+    gn->cell_x = grid_cell(nodes[i].pos_x);
+    gn->cell_y = grid_cell(nodes[i].pos_y);
+    u32 b = grid_bucket(gn->cell_x, gn->cell_y);
+    gn->next = gr->heads[b];
+    gr->heads[b] = i;
+}
+
+static void grid_remove(GraphGrid* gr, i32 i)
+{
+    GridNode* gn = &gr->nodes[i];
+    i32* p = &gr->heads[grid_bucket(gn->cell_x, gn->cell_y)];
+    while (*p != i) {
+        p = &gr->nodes[*p].next;
+    }
+    *p = gn->next;
+}
+
+static void build_grid(GraphPanel* g, PapayaGraph* graph)
+{
+    PROFILE_ZONE("Build node grid");
+    reset_graph_panel(g);
+    GraphGrid* gr = &g->grid;
+    i32 n = graph->num_nodes;
+    gr->nodes = (GridNode*) calloc(n, sizeof(GridNode));
+    gr->found = (i32*) malloc(n * sizeof(i32));
+    g->thumbs = (NodeThumb*) calloc(n, sizeof(NodeThumb));
+    for (i32 b = 0; b < GRAPH_GRID_BUCKETS; b++) {
+        gr->heads[b] = -1;
+    }
+    for (i32 i = 0; i < n; i++) {
+        grid_insert(gr, graph->nodes, i);
+    }
+    gr->num_nodes = n;
+}
+
+/*
+    Moves the node to the cell it has been dragged into, if it has left its old
+    one
+*/
+static void grid_update(GraphGrid* gr, PapayaNode* nodes, i32 i)
+{
+    GridNode* gn = &gr->nodes[i];
+    if (grid_cell(nodes[i].pos_x) != gn->cell_x ||
+        grid_cell(nodes[i].pos_y) != gn->cell_y) {
+        grid_remove(gr, i);
+        grid_insert(gr, nodes, i);
+    }
+}
+
+/*
+    Finds the nodes whose top-left corner is within lo and hi, in graph space,
+    into gr->found. The found nodes are marked with the stamp of the query.
+*/
+static void grid_query(GraphGrid* gr, PapayaNode* nodes, Vec2 lo, Vec2 hi)
+{
+    gr->stamp++;
+    gr->num_found = 0;
+    i32 x0 = grid_cell(lo.x), x1 = grid_cell(hi.x);
+    i32 y0 = grid_cell(lo.y), y1 = grid_cell(hi.y);
+
+    for (i32 y = y0; y <= y1; y++) {
+        for (i32 x = x0; x <= x1; x++) {
+            i32 i = gr->heads[grid_bucket(x, y)];
+            for (; i >= 0; i = gr->nodes[i].next) {
+                GridNode* gn = &gr->nodes[i];
+                PapayaNode* n = &nodes[i];
+                if (gn->cell_x != x || gn->cell_y != y ||
+                    n->pos_x < lo.x || n->pos_x > hi.x ||
+                    n->pos_y < lo.y || n->pos_y > hi.y) {
+                    continue; // Another cell in the bucket, or out of range
+                }
+                gn->stamp = gr->stamp;
+                gr->found[gr->num_found++] = i;
+            }
+        }
+    }
+
+    // In the order of the nodes, which is the order they're drawn in
+    std::sort(gr->found, gr->found + gr->num_found);
+}
+
 static Vec2 get_slot_pos(PapayaSlot* slot)
 {
     return Vec2(slot->node->pos_x, slot->node->pos_y)
@@ -41,10 +162,12 @@ static PapayaSlot* find_snapped_slot(PapayaMemory* mem, Vec2 offset)
 {
     Vec2 m = mem->mouse.pos;
     PapayaNode* snapped_node = 0; // Snapped node
+    GraphGrid* gr = &mem->graph_panel->grid;
 
     // Find the node that is currently being moused over
-    for (size_t i = 0; i < mem->doc->num_nodes; i++) {
-        PapayaNode* n = &mem->doc->nodes[i];
+    grid_query(gr, mem->doc->graph.nodes, m - offset - node_sz, m - offset);
+    for (i32 k = 0; k < gr->num_found; k++) {
+        PapayaNode* n = &mem->doc->graph.nodes[gr->found[k]];
 
         Vec2 p = offset + Vec2(n->pos_x, n->pos_y);
         if (m.x >= p.x &&
@@ -111,15 +234,65 @@ static void draw_link(PapayaSlot* a, PapayaSlot* b, PapayaMemory* mem,
                               4.0f); // Link thickness
 }
 
+/*
+    Draws the link from the output slot b to the input slot t, unless it is
+    being dragged or is out of view. The curve bends at most 20 pixels away
+    from the box of its two ends.
+*/
+static void draw_visible_link(PapayaSlot* b, PapayaSlot* t, PapayaMemory* mem,
+                              Vec2 offset, Vec2 view_lo, Vec2 view_hi,
+                              ImDrawList* draw_list)
+{
+    GraphPanel* g = mem->graph_panel;
+    if (g->dragged_slot &&
+        !g->dragged_slot->is_out &&
+        g->dragged_slot->node == t->node) {
+        // This link is being dragged. Skip the normal drawing and
+        // handle this in the link interaction code
+        return;
+    }
+
+    Vec2 v1 = get_slot_pos(b), v2 = get_slot_pos(t);
+    const f32 bend = 20.0f;
+    if (math::max(v1.x, v2.x) + bend < view_lo.x ||
+        math::min(v1.x, v2.x) - bend > view_hi.x ||
+        math::max(v1.y, v2.y) + bend < view_lo.y ||
+        math::min(v1.y, v2.y) - bend > view_hi.y) {
+        return;
+    }
+
+    draw_link(b, t, mem, offset, draw_list);
+}
+
+/*
+    Only visits the nodes in view, found in the grid. Links are drawn with the
+    visible node at either end. Links between two nodes out of view aren't
+    drawn, even where they cross it.
+*/
 static void draw_nodes(PapayaMemory* mem)
 {
     GraphPanel* g = mem->graph_panel;
+    PapayaGraph* graph = &mem->doc->graph;
     Vec2 offset = ImGui::GetCursorScreenPos() + g->scroll_pos;
     ImDrawList* draw_list = ImGui::GetWindowDrawList();
     size_t hovered_node = -1;
 
-    for (size_t i = 0; i < mem->doc->num_nodes; i++) {
-        PapayaNode* n = &mem->doc->nodes[i];
+    if (g->grid.num_nodes != graph->num_nodes) {
+        build_grid(g, graph);
+    }
+
+    // View in graph space. Nodes are found by their top-left corner, so the
+    // query extends by a node and its slots beyond the view.
+    Vec2 view_lo = Vec2(ImGui::GetWindowPos()) - offset;
+    Vec2 view_hi = view_lo + Vec2(ImGui::GetWindowSize());
+    Vec2 margin = node_sz + Vec2(slot_radius, slot_radius);
+    grid_query(&g->grid, graph->nodes, view_lo - margin, view_hi + margin);
+    u32 stamp = g->grid.stamp;
+    g->visible_stamp = stamp;
+
+    for (i32 k = 0; k < g->grid.num_found; k++) {
+        size_t i = (size_t)g->grid.found[k];
+        PapayaNode* n = &graph->nodes[i];
         Vec2 pos = offset + Vec2(n->pos_x - 1, n->pos_y - 1);
 
         ImGui::PushID(i);
@@ -140,11 +313,12 @@ static void draw_nodes(PapayaMemory* mem)
                                         ImColor(150,150,150,150)));
 
             if (ImGui::IsItemActive() && ImGui::IsMouseDragging(0)) {
-                if (!s->to[0] || s->is_out) {
+                PapayaSlot* from = papaya_slot_source(s);
+                if (!from || s->is_out) {
                     g->dragged_slot = s;
                 } else {
                     g->displaced_slot = s;
-                    g->dragged_slot = s->to[0];
+                    g->dragged_slot = from;
                 }
             }
             ImGui::PopID();
@@ -165,6 +339,7 @@ static void draw_nodes(PapayaMemory* mem)
             if (ImGui::IsMouseDragging(0)) {
                 n->pos_x += ImGui::GetIO().MouseDelta.x;
                 n->pos_y += ImGui::GetIO().MouseDelta.y;
+                grid_update(&g->grid, graph->nodes, (i32)i);
             }
         }
 
@@ -193,42 +368,33 @@ static void draw_nodes(PapayaMemory* mem)
             ImColor c = (hovered_node == i ||
                          g->cur_node == i) ?
                 ImColor(220,163,89, 150) : ImColor(60,60,60);
-            // TODO: Optimization: Use mipmaps here.
-            // TODO: Unstretch aspect ratio
-            ImGui::Image(0, node_sz, Vec2(0,0), Vec2(1,1),
-                         ImVec4(1,1,1,1), c);
+            ImGui::Image((void*)(intptr_t)g->thumbs[i].tex, node_sz,
+                         Vec2(0,0), Vec2(1,1), ImVec4(1,1,1,1), c);
         }
         ImGui::EndGroup();
 
-        // Incoming links
+        // Incoming links, and outgoing ones to nodes out of view, which
+        // don't draw their own
         draw_list->ChannelsSetCurrent(0);
 
         for (int j = 0; j < n->num_slots; j++) {
-
-            PapayaSlot* t = &n->slots[j];
-            if (t->is_out) {
-                continue;
-            }
-
-            PapayaSlot* b = t->to[0];
-            if (!b) {
+            PapayaSlot* s = &n->slots[j];
+            if (!s->is_out) {
+                PapayaSlot* b = papaya_slot_source(s);
+                if (b) {
+                    draw_visible_link(b, s, mem, offset, view_lo, view_hi,
+                                      draw_list);
+                }
                 continue;
             }
 
-            if (g->dragged_slot &&
-                !g->dragged_slot->is_out &&
-                g->dragged_slot->node == n) {
-                // This link is being dragged. Skip the normal drawing and
-                // handle this in the link interaction code
-                continue;
+            for (i32 l = s->link; l >= 0; l = graph->links[l].next) {
+                i32 to = graph->links[l].to;
+                if (g->grid.nodes[to / PAPAYA_MAX_NODE_SLOTS].stamp != stamp) {
+                    draw_visible_link(s, &graph->slots[to], mem, offset,
+                                      view_lo, view_hi, draw_list);
+                }
             }
-
-            if (g->displaced_slot &&
-                g->displaced_slot->node == n) {
-                // continue;
-            } 
-
-            draw_link(b, t, mem, offset, draw_list);
         }
 
         ImGui::PopID();
@@ -251,7 +417,8 @@ static void draw_nodes(PapayaMemory* mem)
 
             } else if (g->displaced_slot) {
                 // Disconnection
-                papaya_disconnect(g->displaced_slot, g->displaced_slot->to[0]);
+                papaya_disconnect(g->displaced_slot,
+                                  papaya_slot_source(g->displaced_slot));
             }
 
             g->dragged_slot = 0;
@@ -265,6 +432,7 @@ static void draw_nodes(PapayaMemory* mem)
 
 void draw_graph_panel(PapayaMemory* mem)
 {
+    PROFILE_ZONE("Graph panel");
     GraphPanel* g = mem->graph_panel;
 
     ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, Vec2(5, 5));
@@ -342,3 +510,119 @@ void draw_graph_panel(PapayaMemory* mem)
     ImGui::PopStyleVar(2);
     ImGui::PopStyleColor();
 }
+
+/*
+    Fits the w*h premultiplied image into the thumbnail, keeping its aspect
+    ratio, and uploads it. Every pixel averages 2x2 samples of the image, so
+    images of about twice the thumbnail's size are filtered well.
+*/
+static void update_thumb(NodeThumb* t, const u8* img, i32 w, i32 h)
+{
+    const i32 sz = GRAPH_THUMB_SIZE;
+    u8 px[4 * sz * sz] = {};
+    f32 scale = (f32)math::max(w, h) / sz; // Image pixels per thumbnail pixel
+    i32 fw = math::max(1, (i32)(w / scale));
+    i32 fh = math::max(1, (i32)(h / scale));
+    i32 x0 = (sz - fw) / 2, y0 = (sz - fh) / 2;
+
+    for (i32 y = 0; y < fh; y++) {
+        for (i32 x = 0; x < fw; x++) {
+            u32 sum[4] = {};
+            for (i32 k = 0; k < 4; k++) {
+                i32 sx = math::min((i32)((x + 0.25f + 0.5f * (k & 1)) * scale),
+                                   w - 1);
+                i32 sy = math::min((i32)((y + 0.25f + 0.5f * (k >> 1)) *
+                                         scale), h - 1);
+                const u8* p = img + 4 * ((size_t)sy * w + sx);
+                for (i32 c = 0; c < 4; c++) { sum[c] += p[c]; }
+            }
+            u8* q = px + 4 * ((y0 + y) * sz + x0 + x);
+            for (i32 c = 0; c < 4; c++) { q[c] = (u8)((sum[c] + 2) / 4); }
+        }
+    }
+    papaya_unpremultiply(px, px, sz * sz);
+
+    if (!t->tex) {
+        t->tex = pagl_alloc_texture(sz, sz, px);
+        return;
+    }
+    pagl_bind_texture(0, t->tex);
+    GLCHK( glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, sz, sz, GL_RGBA,
+                           GL_UNSIGNED_BYTE, px) );
+}
+
+void refresh_thumbnails(PapayaMemory* mem)
+{
+    const f64 budget_ms = 2.0;
+    GraphPanel* g = mem->graph_panel;
+    PapayaGraph* graph = &mem->doc->graph;
+    i32 n = g->grid.num_nodes;
+    i32 w = mem->misc.w, h = mem->misc.h;
+    if (mem->misc.canvas_pending || mem->misc.gpu_eval || n == 0 ||
+        n != graph->num_nodes || w <= 0 || h <= 0) {
+        return;
+    }
+    PROFILE_ZONE("Refresh thumbnails");
+
+    // The coarsest level that is at least twice the thumbnail's size
+    i32 level = 0;
+    while (level < PAPAYA_MAX_LEVELS - 1 &&
+           math::max(papaya_level_size(w, level + 1),
+                     papaya_level_size(h, level + 1)) >= 2 * GRAPH_THUMB_SIZE) {
+        level++;
+    }
+    i32 lw = papaya_level_size(w, level), lh = papaya_level_size(h, level);
+    i32 tiles_x = (lw + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE;
+    i32 rows = math::max(1, papaya_jobs_num_threads() / tiles_x);
+
+    f64 deadline = timer::get_milliseconds() + budget_ms;
+    for (i32 k = 0; k < n; k++) {
+        i32 i = (g->thumb_node + k) % n;
+        PapayaNode* node = &graph->nodes[i];
+        NodeThumb* t = &g->thumbs[i];
+        if (g->grid.nodes[i].stamp != g->visible_stamp ||
+            (t->tex && t->generation == node->generation)) {
+            continue;
+        }
+
+        // An up-to-date cache at any level is as good as an evaluation.
+        // The canvas node always has one here, and is never re-evaluated at
+        // another level, which would discard the canvas.
+        PapayaCache* c = &node->cache;
+        if (c->data && c->channels == 4 && !papaya_is_dirty(node) &&
+            c->generation == node->generation) {
+            update_thumb(t, c->data, c->w, c->h);
+            t->generation = node->generation;
+            continue;
+        }
+        if (i == (i32)g->cur_node) {
+            continue;
+        }
+
+        if (timer::get_milliseconds() >= deadline) {
+            g->thumb_node = i;
+            return;
+        }
+        const u8* img;
+        do {
+            img = papaya_evaluate_partial(node, w, h, level, rows, 0);
+        } while (papaya_is_dirty(node) &&
+                 timer::get_milliseconds() < deadline);
+        if (papaya_is_dirty(node)) {
+            g->thumb_node = i; // Continued in the next frame
+            return;
+        }
+        update_thumb(t, img, lw, lh);
+        t->generation = node->generation;
+    }
+}
+
+void append_to_current(PapayaMemory* mem, PapayaNode* n)
+{
+    PapayaGraph* graph = &mem->doc->graph;
+    PapayaNode* cur = &graph->nodes[mem->graph_panel->cur_node];
+    n->pos_x = cur->pos_x;
+    n->pos_y = cur->pos_y - 50;
+    papaya_connect(&cur->slots[1], &n->slots[0]);
+    mem->graph_panel->cur_node = n - graph->nodes;
+}
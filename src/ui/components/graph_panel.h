@@ -3,17 +3,87 @@
 #include "libs/types.h"
 
 struct PapayaMemory;
+struct PapayaNode;
 struct PapayaSlot;
+struct PapayaStats;
+
+/*
+    Uniform grid over the node positions, so that hit tests and drawing only
+    visit the nodes near the mouse and in view. A node is in the cell that its
+    top-left corner is in. Cells are hashed into a fixed number of buckets, so
+    the graph may extend arbitrarily far in any direction.
+*/
+struct GridNode {
+    i32 next; // Next node in the same bucket. -1 for the last.
+    i32 cell_x, cell_y;
+    u32 stamp; // Of the last query that found the node
+};
+
+#define GRAPH_GRID_BUCKETS 4096 // Power of two
+
+struct GraphGrid {
+    i32 heads[GRAPH_GRID_BUCKETS]; // First node of each bucket. -1 if empty.
+    GridNode* nodes;
+    i32 num_nodes; // Indexed. 0 until the grid is built for the document.
+    u32 stamp;
+    i32* found; // Nodes found by the last query, in increasing order
+    i32 num_found;
+};
+
+/*
+    Thumbnail of a node's output, drawn in its box. Thumbnails are made from
+    evaluations at a pyramid level of about twice their size, or from the
+    node's cache when it has an up-to-date one, e.g. for the node on the
+    canvas. The pixels are straight alpha, as ImGui blends them.
+*/
+#define GRAPH_THUMB_SIZE 36
+
+struct NodeThumb {
+    u32 tex; // GRAPH_THUMB_SIZE square. 0 until the first refresh.
+    u64 generation; // Of the node when tex was made
+};
 
 struct GraphPanel {
     Vec2 scroll_pos;
     f32 node_properties_panel_height;
+    i32 levels_channel; // Edited in the properties of levels nodes
     f32 width;
     size_t cur_node; // Index of current node
     PapayaSlot* dragged_slot;
     PapayaSlot* displaced_slot;
+    GraphGrid grid;
+    u32 visible_stamp; // Grid stamp of the nodes drawn in the last frame
+
+    NodeThumb* thumbs; // Per node, allocated along with the grid
+    i32 thumb_node; // Node whose thumbnail is refreshed next
+
+    // Statistics shown in the node properties, of the output of stats_node
+    // at its generation stats_generation. Allocated on first use.
+    PapayaStats* stats;
+    PapayaNode* stats_node;
+    u64 stats_generation;
 };
 
 GraphPanel* init_graph_panel();
 void destroy_graph_panel(GraphPanel* g);
 void draw_graph_panel(PapayaMemory* mem);
+
+/*
+    Drops the spatial index of the document's nodes. Has to be called before
+    the document is replaced.
+*/
+void reset_graph_panel(GraphPanel* g);
+
+/*
+    Brings the thumbnails of the nodes drawn in the last frame up to date,
+    one node at a time, within a small budget per frame. Evaluations from
+    previous frames are continued. Waits while the canvas is being evaluated,
+    which has priority.
+*/
+void refresh_thumbnails(PapayaMemory* mem);
+
+/*
+    Places a node that was just added to the document's graph above the
+    current node, feeds it the current node's output and makes it current
+*/
+void append_to_current(PapayaMemory* mem, PapayaNode* n);
@@ -2,7 +2,51 @@
 #include "metrics_window.h"
 #include "ui.h"
 #include "libs/imgui/imgui.h"
-#include <inttypes.h>
+#include "libpapaya.h"
+#include "pagl.h"
+
+#include <stdio.h>
+
+/*
+    Draws a row for the profiler zone node, followed by its children if it is
+    expanded. Thread roots are expanded by default. Zones with a GPU zone of
+    the same name show its time too.
+*/
+static void draw_zone(i32 node)
+{
+    ProfileStats s;
+    profiler::get_stats(node, &s);
+    bool is_root = s.num_samples == 0;
+    ImGuiTreeNodeFlags flags = is_root ? ImGuiTreeNodeFlags_DefaultOpen : 0;
+    if (profiler::first_child(node) < 0) {
+        flags |= ImGuiTreeNodeFlags_Leaf;
+    }
+
+    bool open = ImGui::TreeNodeEx((void*)(intptr_t)node, flags, "%s",
+                                  profiler::get_name(node));
+    ImGui::NextColumn();
+    f64 gpu_ms;
+    if (is_root) {
+        for (i32 i = 0; i < 6; i++) { ImGui::NextColumn(); }
+    } else {
+        ImGui::Text("%.3f", s.last_ms);                     ImGui::NextColumn();
+        ImGui::Text("%.3f", s.min_ms);                      ImGui::NextColumn();
+        ImGui::Text("%.3f", s.avg_ms);                      ImGui::NextColumn();
+        ImGui::Text("%.3f", s.p99_ms);                      ImGui::NextColumn();
+        if (pagl_gpu_ms(profiler::get_name(node), &gpu_ms)) {
+            ImGui::Text("%.3f", gpu_ms);
+        }                                                   ImGui::NextColumn();
+        ImGui::Text("%u", s.last_calls);                    ImGui::NextColumn();
+    }
+
+    if (open) {
+        for (i32 c = profiler::first_child(node); c >= 0;
+             c = profiler::next_sibling(c)) {
+            draw_zone(c);
+        }
+        ImGui::TreePop();
+    }
+}
 
 void metrics_window::update(PapayaMemory* mem)
 {
@@ -14,24 +58,78 @@ void metrics_window::update(PapayaMemory* mem)
     // Profiler
     // ========
     if (ImGui::CollapsingHeader("Profiler", 0, true, true)) {
-        ImGui::Columns(3, "profilercolumns");
+        const char* trace_path = "papaya_trace.json";
+        bool tracing = profiler::is_tracing();
+        if (ImGui::Checkbox("Record trace", &tracing)) {
+            if (tracing) {
+                profiler::trace_start();
+            } else if (!profiler::trace_stop(trace_path)) {
+                platform::print("Writing the trace failed\n");
+            }
+        }
+        ImGui::SameLine();
+        ImGui::TextDisabled("Chrome trace JSON, to %s", trace_path);
+
+        ImGui::Columns(7, "profilercolumns");
         ImGui::Separator();
-        ImGui::Text("Name");                                ImGui::NextColumn();
-        ImGui::Text("Cycles");                              ImGui::NextColumn();
-        ImGui::Text("Millisecs");                           ImGui::NextColumn();
+        ImGui::Text("Zone");                                ImGui::NextColumn();
+        ImGui::Text("Last ms");                             ImGui::NextColumn();
+        ImGui::Text("Min");                                 ImGui::NextColumn();
+        ImGui::Text("Avg");                                 ImGui::NextColumn();
+        ImGui::Text("P99");                                 ImGui::NextColumn();
+        ImGui::Text("GPU ms");                              ImGui::NextColumn();
+        ImGui::Text("Calls");                               ImGui::NextColumn();
         ImGui::Separator();
 
-        for (i32 i = 0; i < Timer_COUNT; i++) {
-            ImGui::Text("%s", get_timer_name(i));           ImGui::NextColumn();
-            ImGui::Text("%" PRIu64,
-                timers[i].elapsed_cycles);                  ImGui::NextColumn();
-            ImGui::Text("%f", timers[i].elapsed_ms);        ImGui::NextColumn();
+        for (i32 n = profiler::first_child(-1); n >= 0;
+             n = profiler::next_sibling(n)) {
+            draw_zone(n);
         }
 
         ImGui::Columns(1);
         ImGui::Separator();
     }
 
+    // ======
+    // Memory
+    // ======
+    if (ImGui::CollapsingHeader("Memory", 0, true, true)) {
+        size_t total[2] = {};
+        ImGui::Columns(3, "memorycolumns");
+        ImGui::Separator();
+        ImGui::Text("Name");                                ImGui::NextColumn();
+        ImGui::Text("KB");                                  ImGui::NextColumn();
+        ImGui::Text("Peak KB");                             ImGui::NextColumn();
+        ImGui::Separator();
+        for (i32 i = 0; i < PapayaMem_COUNT; i++) {
+            size_t usage = papaya_mem_usage(i);
+            total[i >= PAPAYA_MEM_FIRST_GPU] += usage;
+            ImGui::Text("%s", papaya_mem_name(i));          ImGui::NextColumn();
+            ImGui::Text("%zu", usage / 1024);               ImGui::NextColumn();
+            ImGui::Text("%zu", papaya_mem_peak(i) / 1024);  ImGui::NextColumn();
+        }
+        ImGui::Separator();
+        ImGui::Text("Frame arena");                         ImGui::NextColumn();
+                                                            ImGui::NextColumn();
+        ImGui::Text("%zu",
+            mem->frame_arena.high_water / 1024);            ImGui::NextColumn();
+        ImGui::Columns(1);
+        ImGui::Separator();
+
+        // Usage against the budgets
+        const char* names[] = { "CPU", "GPU" };
+        size_t budget[] = { (size_t)mem->misc.memory_budget_mb << 20,
+                            (size_t)mem->misc.gpu_budget_mb << 20 };
+        for (i32 i = 0; i < 2; i++) {
+            char label[64];
+            snprintf(label, sizeof(label), "%s %zu of %zu MB", names[i],
+                     total[i] >> 20, budget[i] >> 20);
+            f32 fraction = (f32)((f64)total[i] / budget[i]);
+            ImGui::ProgressBar(fraction > 1.0f ? 1.0f : fraction,
+                               ImVec2(-1, 0), label);
+        }
+    }
+
     // =====
     // Input
     // =====
@@ -1,13 +1,111 @@
 #include "components/node_properties_panel.h"
 
 #include "libpapaya.h"
+#include "jobs.h"
 #include "ui.h"
 #include "components/graph_panel.h"
+#include "libs/mathlib.h"
 
+/*
+    Brings the panel's statistics of the node's output up to date, at the
+    coarsest level of at least 256 pixels across, within a small budget per
+    frame. Waits while the canvas is being evaluated, which has priority.
+    Returns false while they aren't up to date.
+*/
+static bool refresh_stats(PapayaMemory* mem, PapayaNode* node)
+{
+    const f64 budget_ms = 2.0;
+    GraphPanel* g = mem->graph_panel;
+    if (g->stats_node == node && g->stats_generation == node->generation) {
+        return true;
+    }
+    i32 w = mem->misc.w, h = mem->misc.h;
+    if (mem->misc.canvas_pending || w <= 0 || h <= 0) {
+        return false;
+    }
+
+    i32 level = 0;
+    while (level < PAPAYA_MAX_LEVELS - 1 &&
+           math::max(papaya_level_size(w, level + 1),
+                     papaya_level_size(h, level + 1)) >= 256) {
+        level++;
+    }
+    i32 lw = papaya_level_size(w, level);
+    i32 tiles_x = (lw + PAPAYA_TILE_SIZE - 1) / PAPAYA_TILE_SIZE;
+    i32 rows = math::max(1, papaya_jobs_num_threads() / tiles_x);
+
+    if (!g->stats) {
+        g->stats = (PapayaStats*) malloc(sizeof(PapayaStats));
+    }
+    f64 deadline = timer::get_milliseconds() + budget_ms;
+    do {
+        if (papaya_node_stats(node, w, h, level, rows, g->stats)) {
+            g->stats_node = node;
+            g->stats_generation = node->generation;
+            return true;
+        }
+    } while (timer::get_milliseconds() < deadline);
+    return false;
+}
+
+// Value below which the given fraction of the counted pixels are
+static f32 percentile(const u32* histogram, u64 count, f64 fraction)
+{
+    u64 target = (u64)(count * fraction), sum = 0;
+    for (i32 v = 0; v < 256; v++) {
+        sum += histogram[v];
+        if (sum > target) { return v / 255.0f; }
+    }
+    return 1.0f;
+}
+
+/*
+    Histogram of the levels node's input, for the edited channel, and a
+    button that stretches every channel to the full range, ignoring the
+    darkest and lightest 0.1% of the pixels
+*/
+static void draw_levels_histogram(PapayaMemory* mem, PapayaNode* n)
+{
+    PapayaSlot* from = papaya_slot_source(&n->slots[0]);
+    if (!from) {
+        return;
+    }
+    refresh_stats(mem, from->node);
+    PapayaStats* s = mem->graph_panel->stats;
+    if (mem->graph_panel->stats_node != from->node) {
+        return; // Shown once the first statistics are in
+    }
+
+    i32 c = mem->graph_panel->levels_channel;
+    f32 values[256];
+    f32 top = 1.0f;
+    for (i32 v = 0; v < 256; v++) {
+        values[v] = c == PAPAYA_LEVELS_ALL ?
+                    (f32)s->histogram[0][v] + s->histogram[1][v] +
+                    s->histogram[2][v] : (f32)s->histogram[c][v];
+        top = math::max(top, values[v]);
+    }
+    ImGui::PlotHistogram("##Histogram", values, 256, 0, 0, 0.0f, top,
+                         ImVec2(ImGui::GetContentRegionAvailWidth(), 60));
+
+    if (ImGui::Button("Auto")) {
+        LevelsNode* l = &n->params.levels;
+        for (i32 ch = 0; ch < 3; ch++) {
+            f32 lo = percentile(s->histogram[ch], s->count[ch], 0.001);
+            f32 hi = percentile(s->histogram[ch], s->count[ch], 0.999);
+            if (lo < hi) {
+                l->in_black[ch] = lo;
+                l->in_white[ch] = hi;
+            }
+        }
+        papaya_touch_node(n);
+        core::update_canvas(mem);
+    }
+}
 
 void draw_node_properties_panel(PapayaMemory* mem, Vec2 pos, Vec2 sz)
 {
-    PapayaNode* n = &mem->doc->nodes[mem->graph_panel->cur_node];
+    PapayaNode* n = &mem->doc->graph.nodes[mem->graph_panel->cur_node];
 
     ImGui::SetNextWindowPos(pos);
     ImGui::SetNextWindowSize(sz);
@@ -28,11 +126,47 @@ void draw_node_properties_panel(PapayaMemory* mem, Vec2 pos, Vec2 sz)
             bool* g = (bool*)((char*)&n->params.invert_color.invert_g);
             bool* b = (bool*)((char*)&n->params.invert_color.invert_b);
 
-            if (ImGui::Checkbox("Invert red channel", r)) {
+            if (ImGui::Checkbox("Invert red channel", r) ||
+                ImGui::Checkbox("Invert green channel", g) ||
+                ImGui::Checkbox("Invert blue channel", b)) {
+                papaya_touch_node(n);
+                core::update_canvas(mem);
+            }
+        } break;
+
+        case PapayaNodeType_Transform: {
+            TransformNode* t = &n->params.transform;
+            const char* filters[] = { "Bilinear", "Bicubic", "Lanczos" };
+            i32 filter = t->filter;
+            if (ImGui::SliderAngle("Angle", &t->angle, -180.0f, 180.0f) ||
+                ImGui::Combo("Filter", &filter, filters, PapayaFilter_COUNT)) {
+                t->filter = (u8)filter;
+                papaya_touch_node(n);
                 core::update_canvas(mem);
-            } else if (ImGui::Checkbox("Invert green channel", g)) {
+            }
+        } break;
+
+        case PapayaNodeType_Blur: {
+            if (ImGui::SliderFloat("Radius", &n->params.blur.radius,
+                                   0.0f, 200.0f, "%.1f px")) {
+                papaya_touch_node(n);
                 core::update_canvas(mem);
-            } else if (ImGui::Checkbox("Invert blue channel", b)) {
+            }
+        } break;
+
+        case PapayaNodeType_Levels: {
+            LevelsNode* l = &n->params.levels;
+            const char* channels[] = { "Red", "Green", "Blue", "RGB" };
+            i32* c = &mem->graph_panel->levels_channel;
+            ImGui::Combo("Channel", c, channels, 4);
+            draw_levels_histogram(mem, n);
+            if (ImGui::SliderFloat("Input black", &l->in_black[*c], 0, 1) |
+                ImGui::SliderFloat("Input white", &l->in_white[*c], 0, 1) |
+                ImGui::SliderFloat("Gamma", &l->gamma[*c], 0.1f, 10.0f,
+                                   "%.2f", 3.0f) |
+                ImGui::SliderFloat("Output black", &l->out_black[*c], 0, 1) |
+                ImGui::SliderFloat("Output white", &l->out_white[*c], 0, 1)) {
+                papaya_touch_node(n);
                 core::update_canvas(mem);
             }
         } break;
@@ -5,7 +5,9 @@
 #include "ui.h"
 #include "components/color_panel.h"
 
-void prefs::show_panel(ColorPanel* color_panel, Color* colors, Layout& layout)
+void prefs::show_panel(ColorPanel* color_panel, Color* colors, Layout& layout,
+                       i32* png_level, bool* event_driven,
+                       i32* memory_budget_mb, i32* gpu_budget_mb)
 {
     f32 width = 400.0f;
     ImGui::SetNextWindowPos(ImVec2((f32)layout.width - 36 - width, 58));
@@ -37,7 +39,20 @@ void prefs::show_panel(ColorPanel* color_panel, Color* colors, Layout& layout)
 
         ImGui::BeginChild("B", Vec2(ImGui::GetContentRegionAvailWidth(), 0), false);
 
-        if (current_category == 1) {
+        if (current_category == 0) {
+            // General
+            ImGui::PushItemWidth(120);
+            ImGui::SliderInt("PNG compression level", png_level, 0, 9);
+            ImGui::PopItemWidth();
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("0 saves fastest, 9 saves smallest");
+            }
+            ImGui::Checkbox("Redraw only on changes", event_driven);
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Saves power while idle. Turn off to "
+                                  "redraw continuously.");
+            }
+        } else if (current_category == 1) {
             // Appearance
             const char* colorNames[] = {
                 "Window color",
@@ -81,6 +96,22 @@ void prefs::show_panel(ColorPanel* color_panel, Color* colors, Layout& layout)
                 ImGui::SameLine();
                 ImGui::Text("%s", colorNames[i]);
             }
+        } else if (current_category == 2) {
+            // Memory
+            ImGui::PushItemWidth(120);
+            ImGui::DragInt("Memory budget", memory_budget_mb, 16.0f, 256,
+                           1024 * 1024, "%.0f MB");
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Node caches and pyramids are freed to "
+                                  "stay within it, for all open documents");
+            }
+            ImGui::DragInt("GPU budget", gpu_budget_mb, 16.0f, 64,
+                           64 * 1024, "%.0f MB");
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Textures of nodes that aren't shown are "
+                                  "freed to stay within it");
+            }
+            ImGui::PopItemWidth();
         }
         ImGui::EndChild();
     }
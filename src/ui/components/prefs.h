@@ -7,5 +7,7 @@ struct ColorPanel;
 struct Layout;
 
 namespace prefs {
-    void show_panel(ColorPanel* color_panel, Color* colors, Layout& layout);
+    void show_panel(ColorPanel* color_panel, Color* colors, Layout& layout,
+                    i32* png_level, bool* event_driven,
+                    i32* memory_budget_mb, i32* gpu_budget_mb);
 }
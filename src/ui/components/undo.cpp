@@ -7,224 +7,696 @@
 #include "ui.h"
 #include "pagl.h"
 #include "gl_lite.h"
-#include "brush.h"
+#include "libpapaya.h"
+#include "jobs.h"
 
-void undo::init(PapayaMemory* mem)
+#include <inttypes.h>
+
+static i8* reserve_block(UndoBuffer* undo, u64 buf_size, i8** new_top);
+static void append_block(UndoBuffer* undo, i8* block, i8* new_top);
+
+static size_t image_size(UndoData* data)
 {
-    size_t size = 512 * 1024 * 1024;
-    size_t min_size = 3 * (sizeof(UndoData) + 8 * mem->doc->canvas_size.x *
-                           mem->doc->canvas_size.y);
-    mem->doc->undo.size = math::max(size, min_size);
+    return (data->IsSubRect ? 8 : 4) * (size_t)data->size.x * data->size.y;
+}
 
-    mem->doc->undo.start = malloc((size_t)mem->doc->undo.size);
-    mem->doc->undo.current_index = -1;
+static size_t stored_size(UndoData* data)
+{
+    if (data->op_code == PapayaUndoOp_Tiles) {
+        return data->num_tiles * sizeof(UndoTile);
+    }
+    return data->compressed_size ? (size_t)data->compressed_size :
+                                   image_size(data);
+}
 
-    // TODO: Near-duplicate code from brush release. Combine.
-    // Additive render-to-texture
-    {
-        GLCHK( glDisable(GL_SCISSOR_TEST) );
-        GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, mem->misc.fbo) );
-        GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                      GL_TEXTURE_2D, mem->misc.fbo_render_tex,
-                                      0) );
+/*
+    Blocks are padded to 8 bytes, so that the headers of the blocks following
+    them stay aligned
+*/
+static size_t padded_block_size(size_t data_size)
+{
+    return (sizeof(UndoData) + data_size + 7) & ~(size_t)7;
+}
+
+/*
+    Drops the references held by a block that leaves the buffer
+*/
+static void release_block(UndoData* block)
+{
+    if (block->op_code != PapayaUndoOp_Tiles) {
+        return;
+    }
+
+    UndoTile* tiles = (UndoTile*)((i8*)block + sizeof(UndoData));
+    for (u32 i = 0; i < block->num_tiles; i++) {
+        papaya_tile_release(tiles[i].tile);
+    }
+}
+
+/*
+    Images are compressed with a run-length encoding of whole pixels. Every
+    packet starts with a byte n. If n < 128, n + 1 literal pixels follow.
+    Otherwise, one pixel follows that is repeated n - 126 times. For blocks
+    holding the images both after and before a brush stroke, the after image
+    is XORed with the before image first, so that untouched pixels turn into
+    runs of zeros.
+*/
+static inline u32 delta_pixel(const u8* src, const u8* xor_src, size_t i)
+{
+    u32 p;
+    memcpy(&p, src + 4 * i, 4);
+    if (xor_src) {
+        u32 q;
+        memcpy(&q, xor_src + 4 * i, 4);
+        p ^= q;
+    }
+    return p;
+}
+
+static size_t max_rle_size(size_t num_pixels)
+{
+    return 4 * num_pixels + num_pixels / 128 + 1;
+}
+
+static size_t rle_encode(const u8* src, const u8* xor_src, size_t n, u8* out)
+{
+    u8* o = out;
+    size_t i = 0;
+    while (i < n) {
+        u32 p = delta_pixel(src, xor_src, i);
+        size_t run = 1;
+        while (i + run < n && run < 129 &&
+               delta_pixel(src, xor_src, i + run) == p) {
+            run++;
+        }
+
+        if (run >= 2) {
+            *o++ = (u8)(run + 126);
+            memcpy(o, &p, 4);
+            o += 4;
+            i += run;
+            continue;
+        }
+
+        // Literals, up to where the next run starts
+        u8* header = o++;
+        size_t count = 0;
+        u32 next = p;
+        do {
+            memcpy(o, &next, 4);
+            o += 4;
+            count++;
+            if (i + count == n) { break; }
+            p = next;
+            next = delta_pixel(src, xor_src, i + count);
+        } while (count < 128 && next != p);
+
+        if (next == p && i + count < n) {
+            // The last literal starts a run
+            o -= 4;
+            count--;
+        }
+        *header = (u8)(count - 1);
+        i += count;
+    }
+    return o - out;
+}
+
+static const u8* rle_decode(const u8* in, u8* dst, size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        u8 header = *in++;
+        if (header < 128) {
+            size_t count = header + 1;
+            memcpy(dst + 4 * i, in, 4 * count);
+            in += 4 * count;
+            i += count;
+        } else {
+            size_t count = header - 126;
+            for (size_t j = 0; j < count; j++) {
+                memcpy(dst + 4 * (i + j), in, 4);
+            }
+            in += 4;
+            i += count;
+        }
+    }
+    return in;
+}
+
+static void compress_block(void* data, i32 index)
+{
+    UndoReadback* r = (UndoReadback*)data;
+    UndoData* block = r->packed_block;
+    const u8* img = (u8*)block + sizeof(UndoData);
+    size_t n = (size_t)block->size.x * block->size.y;
+
+    if (block->IsSubRect) {
+        size_t after = rle_encode(img, img + 4 * n, n, r->packed);
+        r->packed_size = after + rle_encode(img + 4 * n, 0, n,
+                                            r->packed + after);
+    } else {
+        r->packed_size = rle_encode(img, 0, n, r->packed);
+    }
+}
+
+/*
+    Writes the image of a compressed block to dst, which must hold image_size
+    bytes.
+*/
+static void decompress_block(UndoData* block, u8* dst)
+{
+    const u8* in = (u8*)block + sizeof(UndoData);
+    size_t n = (size_t)block->size.x * block->size.y;
+    in = rle_decode(in, dst, n);
+
+    if (block->IsSubRect) {
+        rle_decode(in, dst + 4 * n, n);
+        for (size_t i = 0; i < 4 * n; i++) {
+            dst[i] ^= dst[4 * n + i];
+        }
+    }
+}
+
+static void start_compression(UndoReadback* r, UndoData* block)
+{
+    size_t n = (size_t)block->size.x * block->size.y;
+    size_t capacity = (block->IsSubRect ? 2 : 1) * max_rle_size(n);
+    if (r->packed_capacity < capacity) {
+        free(r->packed);
+        r->packed = (u8*)malloc(capacity);
+        r->packed_capacity = capacity;
+    }
+
+    r->packed_block = block;
+    r->task = papaya_run_async(compress_block, r);
+}
+
+/*
+    Copies the compressed image into its block, if that saves space and no
+    block has been pushed after it. Returns false if the compression isn't
+    done yet and wait is false.
+*/
+static bool finish_compression(UndoBuffer* undo, UndoReadback* r, bool wait)
+{
+    if (!r->packed_block) { return true; }
+    if (!wait && !papaya_task_done(r->task)) { return false; }
+
+    papaya_wait(r->task);
+    UndoData* block = r->packed_block;
+    r->packed_block = 0;
+    r->task = 0;
+
+    if (block != undo->last || r->packed_size >= image_size(block)) {
+        return true;
+    }
+
+    memcpy((i8*)block + sizeof(UndoData), r->packed, r->packed_size);
+    block->compressed_size = r->packed_size;
+
+    // Blocks of a mirrored buffer may end past the end of the buffer
+    i8* end = (i8*)block + padded_block_size(r->packed_size);
+    if (end > (i8*)undo->start + undo->size) { end -= undo->size; }
+    undo->top = end;
+    return true;
+}
+
+static void cancel_compression(UndoReadback* r)
+{
+    if (!r->packed_block) { return; }
+    papaya_wait(r->task);
+    r->packed_block = 0;
+    r->task = 0;
+}
+
+/*
+    Maps the readback's pixel buffer into its block. Returns false if the GPU
+    isn't done yet and wait is false.
+*/
+static bool commit_readback(UndoBuffer* undo, UndoReadback* r, bool wait)
+{
+    if (!r->block) { return true; }
+
+    if (!wait) {
+        GLenum status = glClientWaitSync((GLsync)r->fence,
+                                         GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status == GL_TIMEOUT_EXPIRED) { return false; }
+    }
 
-        GLCHK( glViewport(0, 0, mem->doc->canvas_size.x, mem->doc->canvas_size.y) );
-        GLCHK( glUseProgram(mem->shaders[PapayaShader_ImGui]->id) );
+    // Mapping waits for the readback if it's still in flight
+    GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo) );
+    void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (pixels) {
+        memcpy((i8*)r->block + sizeof(UndoData), pixels, r->size);
+        GLCHK( glUnmapBuffer(GL_PIXEL_PACK_BUFFER) );
+    }
+    GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, 0) );
 
-        f32 proj_mtx[4][4];
-        mat4x4_ortho(proj_mtx, 0.f,
-                     mem->doc->canvas_size.x, 0.f,
-                     mem->doc->canvas_size.y,
-                     -1.f, 1.f);
+    GLCHK( glDeleteSync((GLsync)r->fence) );
+    r->fence = 0;
 
-        GLCHK( glUniformMatrix4fv(mem->shaders[PapayaShader_ImGui]->uniforms[0],
-                                  1, GL_FALSE, &proj_mtx[0][0]) );
+    if (undo->compress && pixels) {
+        finish_compression(undo, r, true);
+        start_compression(r, r->block);
+    }
+    r->block = 0;
+    return true;
+}
 
-        GLCHK( glBindBuffer(GL_ARRAY_BUFFER, mem->brush->mesh_RTTAdd->vbo_handle) );
-        pagl_set_vertex_attribs(mem->shaders[PapayaShader_ImGui]);
+static void cancel_readback(UndoReadback* r)
+{
+    if (!r->block) { return; }
+    GLCHK( glDeleteSync((GLsync)r->fence) );
+    r->fence = 0;
+    r->block = 0;
+}
 
-        // GLCHK( glBindTexture(GL_TEXTURE_2D,
-        //                      (GLuint)(intptr_t)mem->doc->texture_id) );
-        // GLCHK( glDrawArrays (GL_TRIANGLES, 0, 6) );
+static bool is_spilled(UndoBuffer* undo, UndoData* block)
+{
+    return undo->spill.base && (i8*)block >= undo->spill.base &&
+           (i8*)block < undo->spill.base + undo->spill.used;
+}
 
-        undo::push(&mem->doc->undo, &mem->profile,
-                   Vec2i(0,0), Vec2i(mem->doc->canvas_size.x,
-                                     mem->doc->canvas_size.y),
-                   0, Vec2());
+static UndoData* oldest_block(UndoBuffer* undo)
+{
+    if (undo->spill.count) { return (UndoData*)undo->spill.base; }
+    return undo->count ? undo->base : 0;
+}
 
-        // u32 temp = mem->misc.fbo_render_tex;
-        // mem->misc.fbo_render_tex = mem->doc->texture_id;
-        GLCHK( glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                      GL_TEXTURE_2D, mem->misc.fbo_render_tex,
-                                      0) );
-        // mem->doc->texture_id = temp;
+/*
+    Drops all spilled blocks, to make room once the scratch file is full
+*/
+static void drop_spill(UndoBuffer* undo)
+{
+    UndoData* b = (UndoData*)undo->spill.base;
+    for (size_t i = 0; i < undo->spill.count; i++) {
+        release_block(b);
+        b = b->next;
+    }
+    if (b) { b->prev = 0; }
 
-        GLCHK( glBindFramebuffer(GL_FRAMEBUFFER, 0) );
-        GLCHK( glViewport(0, 0, mem->doc->canvas_size.x, mem->doc->canvas_size.y) );
+    undo->count -= undo->spill.count;
+    undo->current_index -= undo->spill.count;
+    undo->spill.count = 0;
+    undo->spill.used = 0;
+}
+
+/*
+    Appends the base block to the scratch file and links the copy into the
+    history in its place. Returns false if there is no scratch file.
+*/
+static bool spill_base(UndoBuffer* undo)
+{
+    UndoSpill* s = &undo->spill;
+    UndoData* block = undo->base;
+    size_t size = padded_block_size(stored_size(block));
+    if (!s->base || size > s->capacity) {
+        return false;
+    }
+    if (s->used + size > s->capacity) {
+        drop_spill(undo);
+    }
+
+    // Blocks are contiguous, see reserve_block
+    UndoData* copy = (UndoData*)(s->base + s->used);
+    memcpy(copy, block, size);
+    s->used += size;
+    s->count++;
+
+    if (copy->prev) { copy->prev->next = copy; }
+    if (copy->next) { copy->next->prev = copy; }
+    if (undo->current == block) { undo->current = copy; }
+    if (undo->last == block) { undo->last = copy; }
+    return true;
+}
+
+/*
+    Moves the oldest block out of the buffer, into the scratch file if there is
+    one. Work on the block that is in flight is finished or cancelled first, so
+    that it doesn't overwrite whatever reuses the memory.
+*/
+static void evict_base(UndoBuffer* undo)
+{
+    for (i32 i = 0; i < PAPAYA_UNDO_READBACKS; i++) {
+        if (undo->readbacks[i].block == undo->base) {
+            commit_readback(undo, &undo->readbacks[i], true);
+        }
+        if (undo->readbacks[i].packed_block == undo->base) {
+            cancel_compression(&undo->readbacks[i]);
+        }
+    }
 
-        GLCHK( glDisable(GL_BLEND) );
+    UndoData* next = undo->base->next;
+    if (!spill_base(undo)) {
+        release_block(undo->base);
+        if (next) { next->prev = 0; }
+        undo->count--;
+        undo->current_index--;
     }
+    undo->base = next;
+}
+
+/*
+    The history starts with an op that records nothing, standing for the
+    document as it was opened, so that the first real op can be undone.
+    Brush strokes record only the tiles they touch, so the buffer doesn't
+    need to hold snapshots of the canvas.
+*/
+void undo::init(PapayaMemory* mem)
+{
+    UndoBuffer* undo = &mem->doc->undo;
+    undo->size = 512 * 1024 * 1024;
+
+    // Blocks that reach past the end of a mirrored buffer continue at its
+    // start. Without the mirror, such blocks are moved to the start instead.
+    undo->start = platform::alloc_mirrored(&undo->size);
+    undo->mirrored = (undo->start != 0);
+    if (!undo->start) {
+        undo->start = malloc((size_t)undo->size);
+    }
+    undo->current_index = -1;
+    undo->compress = true;
+
+    // Sparse, so a generous size costs nothing until it's written to
+    UndoSpill* spill = &undo->spill;
+    spill->capacity = (size_t)1 << (sizeof(void*) >= 8 ? 36 : 29);
+    spill->base = (i8*)platform::map_scratch_file(spill->capacity);
+    if (!spill->base) { spill->capacity = 0; }
+    for (i32 i = 0; i < PAPAYA_UNDO_READBACKS; i++) {
+        GLCHK( glGenBuffers(1, &undo->readbacks[i].pbo) );
+    }
+
+    i8* new_top;
+    i8* block = reserve_block(undo, padded_block_size(0), &new_top);
+    UndoData data = {};
+    data.op_code = PapayaUndoOp_Tiles;
+    data.prev = undo->last;
+    data.line_segment_start_uv = Vec2(-1.0f, -1.0f);
+    memcpy(block, &data, sizeof(UndoData));
+    append_block(undo, block, new_top);
 }
 
 void undo::destroy(PapayaMemory* mem)
 {
-    free(mem->doc->undo.start);
+    for (i32 i = 0; i < PAPAYA_UNDO_READBACKS; i++) {
+        UndoReadback* r = &mem->doc->undo.readbacks[i];
+        cancel_readback(r);
+        cancel_compression(r);
+        pagl_delete_buffer(&r->pbo);
+        free(r->packed);
+        r->packed = 0;
+        r->packed_capacity = 0;
+    }
+
+    for (UndoData* b = oldest_block(&mem->doc->undo); b; b = b->next) {
+        release_block(b);
+    }
+    if (mem->doc->undo.spill.base) {
+        platform::unmap_scratch_file(mem->doc->undo.spill.base,
+                                     mem->doc->undo.spill.capacity);
+    }
+    memset(&mem->doc->undo.spill, 0, sizeof(UndoSpill));
+
+    if (mem->doc->undo.mirrored) {
+        platform::free_mirrored(mem->doc->undo.start, mem->doc->undo.size);
+    } else {
+        free(mem->doc->undo.start);
+    }
+    papaya_mem_add(PapayaMem_Undo, -(i64)mem->doc->undo.written);
+    mem->doc->undo.written = 0;
     mem->doc->undo.start = mem->doc->undo.top = 0;
     mem->doc->undo.base = mem->doc->undo.current = mem->doc->undo.last = 0;
     mem->doc->undo.size = mem->doc->undo.count = 0;
     mem->doc->undo.current_index = -1;
 }
 
-// This function reads from the frame buffer and hence needs the appropriate frame buffer to be
-// bound before it is called.
-void undo::push(UndoBuffer* undo, Profile* profile, Vec2i pos, Vec2i size,
-                i8* pre_brush_img, Vec2 line_segment_start_uv)
+/*
+    Makes room for a block of size bytes on top of the current block, evicting
+    the oldest blocks and discarding the redo history as needed. Returns the
+    block and writes the top of the buffer after it to new_top. The block is
+    contiguous even if it wraps, since the memory past the end of a mirrored
+    buffer maps back to its start.
+*/
+static i8* reserve_block(UndoBuffer* undo, u64 buf_size, i8** new_top)
 {
     if (undo->top == 0) {
         // Buffer is empty
         undo->base = (UndoData*)undo->start;
         undo->top  = undo->start;
     } else if (undo->current->next != 0) {
-        // Not empty and not at end. Reposition for overwrite.
-        u64 bytes_to_right =
-            (i8*)undo->start + undo->size - (i8*)undo->current;
-        u64 img_size = (undo->current->IsSubRect ? 8 : 4) *
-            undo->current->size.x * undo->current->size.y;
-        u64 block_size = sizeof(UndoData) + img_size;
-        if (bytes_to_right >= block_size) {
-            undo->top = (i8*)undo->current + block_size;
+        // Not empty and not at end. Reposition for overwrite. Readbacks into
+        // the discarded blocks are finished first, so that they can't land
+        // on top of the new block later.
+        undo::flush(undo);
+        for (UndoData* b = undo->current->next; b; b = b->next) {
+            release_block(b);
+        }
+        u64 block_size = padded_block_size(stored_size(undo->current));
+        if (is_spilled(undo, undo->current)) {
+            // Everything in the buffer is discarded
+            undo->spill.used = (i8*)undo->current + block_size -
+                               undo->spill.base;
+            undo->spill.count = undo->current_index + 1;
+            undo->base = 0;
+            undo->top = undo->start;
         } else {
-            undo->top = (i8*)undo->start + block_size - bytes_to_right;
+            u64 bytes_to_right =
+                (i8*)undo->start + undo->size - (i8*)undo->current;
+            if (bytes_to_right >= block_size) {
+                undo->top = (i8*)undo->current + block_size;
+            } else {
+                undo->top = (i8*)undo->start + block_size - bytes_to_right;
+            }
         }
+        undo->current->next = 0;
         undo->last = undo->current;
         undo->count = undo->current_index + 1;
     }
 
-    UndoData data = {};
-    data.op_code = PapayaUndoOp_Brush;
-    data.prev = undo->last;
-    data.pos = pos;
-    data.size = size;
-    data.IsSubRect = (pre_brush_img != 0);
-    data.line_segment_start_uv = line_segment_start_uv;
-
-    u64 buf_size = sizeof(UndoData) +
-        size.x * size.y * (data.IsSubRect ? 8 : 4);
-    void* buf = malloc((size_t)buf_size);
-
-    timer::start(Timer_GetUndoImage);
-    memcpy(buf, &data, sizeof(UndoData));
-    GLCHK( glReadPixels(pos.x, pos.y, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, (i8*)buf + sizeof(UndoData)) );
-    timer::stop(Timer_GetUndoImage);
-
-    if (data.IsSubRect) {
-        memcpy((i8*)buf + sizeof(UndoData) + 4 * size.x * size.y, pre_brush_img, 4 * size.x * size.y);
-    }
-
     u64 bytes_to_right = (i8*)undo->start + undo->size - (i8*)undo->top;
-    if (bytes_to_right < sizeof(UndoData)) // Not enough space for UndoData. Go to start.
+    if (bytes_to_right < sizeof(UndoData) ||
+        (bytes_to_right < buf_size && !undo->mirrored)) // Not enough space. Go to start.
     {
         // Reposition the base pointer
         while (((i8*)undo->base >= (i8*)undo->top ||
             (i8*)undo->base < (i8*)undo->start + buf_size) &&
-            undo->count > 0)
+            undo->count > undo->spill.count)
         {
-            undo->base = undo->base->next;
-            undo->base->prev = 0;
-            undo->count--;
-            undo->current_index--;
+            evict_base(undo);
         }
 
         undo->top = undo->start;
-        memcpy(undo->top, buf, (size_t)buf_size);
-
-        if (undo->last) { undo->last->next = (UndoData*)undo->top; }
-        undo->last = (UndoData*)undo->top;
-        undo->top = (i8*)undo->top + buf_size;
+        *new_top = (i8*)undo->top + buf_size;
     }
-    else if (bytes_to_right < buf_size) // Enough space for UndoData, but not for image. Split image data.
+    else if (bytes_to_right < buf_size) // Enough space for UndoData, but not for image. Image runs into the mirror.
     {
         // Reposition the base pointer
         while (((i8*)undo->base >= (i8*)undo->top ||
             (i8*)undo->base  <  (i8*)undo->start + buf_size - bytes_to_right) &&
-            undo->count > 0)
+            undo->count > undo->spill.count)
         {
-            undo->base = undo->base->next;
-            undo->base->prev = 0;
-            undo->count--;
-            undo->current_index--;
+            evict_base(undo);
         }
 
-        memcpy(undo->top, buf, (size_t)bytes_to_right);
-        memcpy(undo->start, (i8*)buf + bytes_to_right, (size_t)(buf_size - bytes_to_right));
-
-        if (bytes_to_right == 0) { undo->top = undo->start; }
-
-        if (undo->last) { undo->last->next = (UndoData*)undo->top; }
-        undo->last = (UndoData*)undo->top;
-        undo->top = (i8*)undo->start + buf_size - bytes_to_right;
+        *new_top = (i8*)undo->start + buf_size - bytes_to_right;
     }
     else // Enough space for everything. Simply append.
     {
         // Reposition the base pointer
         while ((i8*)undo->base >= (i8*)undo->top &&
             (i8*)undo->base < (i8*)undo->top + buf_size &&
-            undo->count > 0)
+            undo->count > undo->spill.count)
         {
-            undo->base = undo->base->next;
-            undo->base->prev = 0;
-            undo->count--;
-            undo->current_index--;
+            evict_base(undo);
         }
 
-        memcpy(undo->top, buf, (size_t)buf_size);
+        *new_top = (i8*)undo->top + buf_size;
+    }
+
+    return (i8*)undo->top;
+}
 
-        if (undo->last) { undo->last->next = (UndoData*)undo->top; }
-        undo->last = (UndoData*)undo->top;
-        undo->top = (i8*)undo->top + buf_size;
+/*
+    Pages of the buffer stay resident once written, so the buffer counts
+    towards the memory in use up to the furthest it has been written
+*/
+static void count_written(UndoBuffer* undo, i8* end)
+{
+    size_t n = (size_t)(end - (i8*)undo->start);
+    if (n > undo->size) { n = undo->size; }
+    if (n > undo->written) {
+        papaya_mem_add(PapayaMem_Undo, (i64)(n - undo->written));
+        undo->written = n;
     }
+}
 
-    free(buf);
+static void append_block(UndoBuffer* undo, i8* block, i8* new_top)
+{
+    count_written(undo, new_top);
+    if (undo->count == undo->spill.count) {
+        // Buffer was empty
+        undo->base = (UndoData*)block;
+    }
+    if (undo->last) { undo->last->next = (UndoData*)block; }
+    undo->last = (UndoData*)block;
+    undo->top = new_top;
 
     undo->current = undo->last;
     undo->count++;
     undo->current_index++;
 }
 
+// This function reads from the frame buffer and hence needs the appropriate frame buffer to be
+// bound before it is called.
+void undo::push(UndoBuffer* undo, Vec2i pos, Vec2i size,
+                i8* pre_brush_img, Vec2 line_segment_start_uv)
+{
+    PROFILE_ZONE("Undo push");
+    bool is_sub_rect = (pre_brush_img != 0);
+    u64 buf_size = padded_block_size(size.x * size.y * (is_sub_rect ? 8 : 4));
+
+    // Make room for the block first, so that the image can be read straight
+    // into the buffer
+    i8* new_top;
+    i8* block = reserve_block(undo, buf_size, &new_top);
+
+    UndoData data = {};
+    data.op_code = PapayaUndoOp_Brush;
+    data.prev = undo->last;
+    data.pos = pos;
+    data.size = size;
+    data.IsSubRect = is_sub_rect;
+    data.line_segment_start_uv = line_segment_start_uv;
+    memcpy(block, &data, sizeof(UndoData));
+
+    // Read into a pixel buffer without waiting for the GPU. If all readbacks
+    // are in flight, the oldest one is finished first.
+    profiler::begin("GetUndoImage");
+    UndoReadback* r = &undo->readbacks[undo->next_readback];
+    undo->next_readback = (undo->next_readback + 1) % PAPAYA_UNDO_READBACKS;
+    commit_readback(undo, r, true);
+    finish_compression(undo, r, true);
+
+    r->block = (UndoData*)block;
+    r->size = 4 * size.x * size.y;
+    GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo) );
+    GLCHK( glBufferData(GL_PIXEL_PACK_BUFFER, r->size, 0, GL_STREAM_READ) );
+    pagl_track_buffer(r->pbo, r->size);
+    GLCHK( glReadPixels(pos.x, pos.y, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, 0) );
+    GLCHK( glBindBuffer(GL_PIXEL_PACK_BUFFER, 0) );
+    r->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    profiler::end();
+
+    if (data.IsSubRect) {
+        memcpy(block + sizeof(UndoData) + 4 * size.x * size.y, pre_brush_img, 4 * size.x * size.y);
+    }
+
+    append_block(undo, block, new_top);
+}
+
+void undo::push_tiles(UndoBuffer* undo, PapayaNode* node, PapayaRect r)
+{
+    PROFILE_ZONE("Undo push");
+    PapayaTiles* img = &node->params.bitmap.image;
+    i32 x1 = math::max(r.x, 0);
+    i32 y1 = math::max(r.y, 0);
+    i32 x2 = math::min(r.x + r.w, img->width);
+    i32 y2 = math::min(r.y + r.h, img->height);
+    if (x2 <= x1 || y2 <= y1) {
+        return;
+    }
+
+    i32 tx1 = x1 / PAPAYA_IMAGE_TILE_SIZE;
+    i32 ty1 = y1 / PAPAYA_IMAGE_TILE_SIZE;
+    i32 tx2 = (x2 - 1) / PAPAYA_IMAGE_TILE_SIZE;
+    i32 ty2 = (y2 - 1) / PAPAYA_IMAGE_TILE_SIZE;
+    u32 num_tiles = (tx2 - tx1 + 1) * (ty2 - ty1 + 1);
+
+    i8* new_top;
+    i8* block = reserve_block(undo, padded_block_size(num_tiles *
+                                                      sizeof(UndoTile)),
+                              &new_top);
+
+    UndoData data = {};
+    data.op_code = PapayaUndoOp_Tiles;
+    data.prev = undo->last;
+    data.pos = Vec2i(x1, y1);
+    data.size = Vec2i(x2 - x1, y2 - y1);
+    data.line_segment_start_uv = Vec2(-1.0f, -1.0f);
+    data.node = node;
+    data.num_tiles = num_tiles;
+    memcpy(block, &data, sizeof(UndoData));
+
+    UndoTile* tiles = (UndoTile*)(block + sizeof(UndoData));
+    for (i32 ty = ty1; ty <= ty2; ty++) {
+        for (i32 tx = tx1; tx <= tx2; tx++) {
+            i32 index = ty * img->tiles_x + tx;
+            tiles->index = index;
+            tiles->tile = papaya_tile_ref(img->tiles[index]);
+            tiles++;
+        }
+    }
+
+    append_block(undo, block, new_top);
+}
+
+void undo::swap_tiles(UndoData* block)
+{
+    if (block->num_tiles == 0) {
+        return; // The first op, or an empty one
+    }
+    PapayaTiles* img = &block->node->params.bitmap.image;
+    UndoTile* tiles = (UndoTile*)((i8*)block + sizeof(UndoData));
+    for (u32 i = 0; i < block->num_tiles; i++) {
+        tiles[i].tile = papaya_tiles_swap(img, tiles[i].index, tiles[i].tile);
+        papaya_mark_dirty(block->node, papaya_tiles_rect(img, tiles[i].index));
+    }
+}
+
 void undo::pop(PapayaMemory* mem, bool load_pre_brush_image)
 {
     UndoBuffer* undo = &mem->doc->undo;
     UndoData data = {};
-    i8* img = 0;
-    bool alloc_used = false;
 
+    undo::flush(undo);
     memcpy(&data, undo->current, sizeof(UndoData));
 
-    size_t bytes_to_right = (i8*)undo->start + undo->size - (i8*)undo->current;
-    size_t img_size =
-        (undo->current->IsSubRect ? 8 : 4) * data.size.x * data.size.y;
-    if (bytes_to_right - sizeof(UndoData) >= img_size) {
-        // Image is contiguously stored
-        img = (i8*)undo->current + sizeof(UndoData);
-    } else {
-        // Image is split
-        alloc_used = true;
-        img = (i8*)malloc(img_size);
-        memcpy(img,
-               (i8*)undo->current + sizeof(UndoData), 
-               (size_t)bytes_to_right - sizeof(UndoData));
-        memcpy((i8*)img + bytes_to_right - sizeof(UndoData),
-               undo->start,
-               (size_t)(img_size - (bytes_to_right - sizeof(UndoData))));
+    // Images are always contiguous, see undo::push
+    i8* img = (i8*)undo->current + sizeof(UndoData);
+    if (data.compressed_size) {
+        img = (i8*)arena::alloc(&mem->frame_arena, image_size(&data));
+        decompress_block(undo->current, (u8*)img);
     }
-
     // GLCHK( glBindTexture(GL_TEXTURE_2D, mem->doc->texture_id) );
     // GLCHK( glTexSubImage2D(GL_TEXTURE_2D, 0, data.pos.x, data.pos.y,
     //                        data.size.x, data.size.y, GL_RGBA, GL_UNSIGNED_BYTE, 
     //                        img + (load_pre_brush_image ? 
     //                               4 * data.size.x * data.size.y : 0)) );
+}
+
+void undo::update(UndoBuffer* undo)
+{
+    for (i32 i = 0; i < PAPAYA_UNDO_READBACKS; i++) {
+        commit_readback(undo, &undo->readbacks[i], false);
+        finish_compression(undo, &undo->readbacks[i], false);
+    }
+}
 
-    if (alloc_used) { free(img); }
+void undo::flush(UndoBuffer* undo)
+{
+    for (i32 i = 0; i < PAPAYA_UNDO_READBACKS; i++) {
+        commit_readback(undo, &undo->readbacks[i], true);
+        finish_compression(undo, &undo->readbacks[i], true);
+    }
+}
+
+bool undo::busy(UndoBuffer* undo)
+{
+    for (i32 i = 0; i < PAPAYA_UNDO_READBACKS; i++) {
+        UndoReadback* r = &undo->readbacks[i];
+        if (r->block || r->packed_block) { return true; }
+    }
+    return false;
 }
 
 void undo::visualize_undo_buffer(PapayaMemory* mem)
@@ -262,6 +734,8 @@ void undo::visualize_undo_buffer(PapayaMemory* mem)
     ImGui::TextColored(Color(1.0f,1.0f,0.0f,1.0f), "Top     %" PRIu64, TopOffset);
     ImGui::Text("Count   %lu", mem->doc->undo.count);
     ImGui::Text("Index   %lu", mem->doc->undo.current_index);
+    ImGui::Text("Spilled %lu (%" PRIu64 " bytes)", mem->doc->undo.spill.count,
+                (u64)mem->doc->undo.spill.used);
 
     ImGui::End();
 }
@@ -3,10 +3,14 @@
 #include "libs/types.h"
 
 struct PapayaMemory;
-struct Profile;
+struct PapayaTask;
+struct PapayaNode;
+struct PapayaTile;
+struct PapayaRect;
 
 enum PapayaUndoOp_ {
     PapayaUndoOp_Brush,
+    PapayaUndoOp_Tiles,
     PapayaUndoOp_COUNT
 };
 
@@ -17,7 +21,52 @@ struct UndoData {
     Vec2i pos, size; // Position and size of the suffixed data block
     bool IsSubRect; // If true, then the suffixed image data contains two subrects - before and after the brush
     Vec2 line_segment_start_uv;
-    // Image data goes after this
+    u64 compressed_size; // Size of the compressed image data. 0 if stored raw.
+    PapayaNode* node; // Bitmap node whose tiles are stored, for PapayaUndoOp_Tiles
+    u32 num_tiles;
+    // Image data or UndoTiles go after this
+};
+
+/*
+    Tile of a bitmap node replaced by an undo op. Swapping it with the node's
+    tile at index toggles between the states before and after the op.
+*/
+struct UndoTile {
+    i32 index;
+    PapayaTile* tile; // Holds a reference. 0 for a transparent tile.
+};
+
+#define PAPAYA_UNDO_READBACKS 3
+
+/*
+    Image readback in flight. Pixels are read into a pixel buffer and copied
+    into the block once the GPU is done, so that undo::push doesn't stall. The
+    image is then compressed on a background thread, and the block shrinks to
+    the compressed size if no other block has been pushed after it meanwhile.
+*/
+struct UndoReadback {
+    UndoData* block; // Block awaiting its image. 0 if the readback is unused.
+    u32 pbo;
+    void* fence; // GLsync signalled when the pixels are in pbo
+    size_t size; // Bytes of image data
+
+    UndoData* packed_block; // Block being compressed. 0 if none.
+    PapayaTask* task;
+    u8* packed; // Compressed image. Grows as needed and is reused.
+    size_t packed_capacity, packed_size;
+};
+
+/*
+    Second tier of the history. Blocks evicted from the buffer are appended to
+    a memory-mapped scratch file instead of being dropped, and stay linked into
+    the history, so undoing that far back reads them from the mapping and the
+    OS pages them in on demand. Spilled blocks are always the oldest ones.
+*/
+struct UndoSpill {
+    i8* base; // 0 if no scratch file could be mapped
+    size_t capacity;
+    size_t used;
+    size_t count; // Number of spilled blocks
 };
 
 struct UndoBuffer {
@@ -27,16 +76,40 @@ struct UndoBuffer {
     UndoData* current; // Pointer to the current location in the undo stack. Goes back and forth during undo-redo.
     UndoData* last;    // Last undo data block in the buffer. Should be located just before Top.
     size_t size;  // Size of the undo buffer in bytes
-    size_t count;  // Number of undo ops in buffer
-    size_t current_index; // Index of the current undo data block from the beginning
+    size_t count;  // Number of undo ops, including spilled ones
+    size_t current_index; // Index of the current undo data block from the oldest spilled one
+    bool mirrored; // If true, the memory is mapped twice in a row, so blocks can run past the end
+    UndoReadback readbacks[PAPAYA_UNDO_READBACKS]; // Used in turn
+    i32 next_readback;
+    bool compress; // Compress images of new blocks
+    UndoSpill spill;
+    size_t written; // Furthest offset ever written, counted in PapayaMem_Undo
+
 };
 
 namespace undo {
     void init(PapayaMemory* mem);
     void destroy(PapayaMemory* mem);
-    void push(UndoBuffer* undo, Profile* profile, Vec2i pos, Vec2i size,
+    void push(UndoBuffer* undo, Vec2i pos, Vec2i size,
               i8* pre_brush_img, Vec2 line_segment_start_uv);
     void pop(PapayaMemory* mem, bool load_pre_brush_image);
+
+    // Records the tiles of the bitmap node that overlap r. Has to be called
+    // before they are edited, and the edit then copies the recorded tiles on
+    // write, so the op costs one reference per tile rather than a snapshot.
+    // Blocks point to their node, so the node must outlive the history.
+    void push_tiles(UndoBuffer* undo, PapayaNode* node, PapayaRect r);
+
+    // Swaps the tiles of a PapayaUndoOp_Tiles block with the node's tiles.
+    // Undoes the op if it is in effect, and redoes it otherwise.
+    void swap_tiles(UndoData* block);
+
+    // Copies the images of finished readbacks and compressions into their
+    // blocks. update never blocks, while flush waits for all work in flight.
+    void update(UndoBuffer* undo);
+    void flush(UndoBuffer* undo);
+    // Whether readbacks or compressions are in flight, for update to finish
+    bool busy(UndoBuffer* undo);
     void visualize_undo_buffer(PapayaMemory* mem);
 }
 
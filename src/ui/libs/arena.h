@@ -0,0 +1,99 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Linear allocator for scratch memory with a bounded lifetime, e.g. one frame.
+    Allocations are bumped off a single block and are all released at once by
+    arena::reset. Allocations that don't fit go to overflow blocks, and the next
+    reset grows the main block to the high-water mark, so a steady workload
+    stops touching the heap after its first few frames.
+*/
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size;
+    // Data goes after this
+};
+
+struct Arena {
+    uint8_t* base;
+    size_t size;       // Capacity of base
+    size_t used;       // Bytes used since the last reset, including overflow
+    size_t high_water; // Largest value of used across resets
+    ArenaBlock* overflow;
+};
+
+namespace arena {
+    void init(Arena* a, size_t size);
+    void destroy(Arena* a);
+    void* alloc(Arena* a, size_t size); // 16-byte aligned. Never returns 0.
+    void reset(Arena* a);
+}
+
+#endif // ARENA_H
+
+// =============================================================================
+
+#ifdef ARENA_IMPLEMENTATION
+
+#include <stdlib.h>
+
+#define ARENA_ALIGNMENT 16
+
+void arena::init(Arena* a, size_t size)
+{
+    a->base = (uint8_t*) malloc(size);
+    a->size = size;
+    a->used = a->high_water = 0;
+    a->overflow = 0;
+}
+
+void arena::destroy(Arena* a)
+{
+    reset(a);
+    free(a->base);
+    a->base = 0;
+    a->size = 0;
+}
+
+void* arena::alloc(Arena* a, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size_t offset = a->used;
+    a->used += size;
+    if (a->used > a->high_water) { a->high_water = a->used; }
+
+    if (offset + size <= a->size) {
+        return a->base + offset;
+    }
+
+    // Doesn't fit. The header is padded to keep the data aligned.
+    size_t header = (sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) &
+                    ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock* b = (ArenaBlock*) malloc(header + size);
+    b->next = a->overflow;
+    b->size = size;
+    a->overflow = b;
+    return (uint8_t*)b + header;
+}
+
+void arena::reset(Arena* a)
+{
+    if (a->overflow) {
+        while (a->overflow) {
+            ArenaBlock* next = a->overflow->next;
+            free(a->overflow);
+            a->overflow = next;
+        }
+
+        // Grow so that the peak usage seen so far fits without overflowing
+        free(a->base);
+        a->size = a->high_water;
+        a->base = (uint8_t*) malloc(a->size);
+    }
+    a->used = 0;
+}
+
+#endif // ARENA_IMPLEMENTATION
@@ -383,7 +383,7 @@ typedef enum
 #endif // wintab.h
 // -----------------------------------------------------------------------------
 
-#define PACKETDATA PK_X | PK_Y | PK_BUTTONS | PK_NORMAL_PRESSURE
+#define PACKETDATA PK_X | PK_Y | PK_BUTTONS | PK_NORMAL_PRESSURE | PK_TIME
 #define PACKETMODE 0
 
 // -----------------------------------------------------------------------------
@@ -580,6 +580,7 @@ typedef struct
     int32_t PosX, PosY;
     float   Pressure; // Range: 0.0f to 1.0f
     int32_t Buttons; // Bit field. Use with the EasyTab_Buttons_ enum.
+    uint32_t Time;   // Of the last event, in milliseconds
 
     int32_t RangeX, RangeY;
     int32_t MaxPressure;
@@ -752,6 +753,7 @@ EasyTabResult EasyTab_HandleEvent(XEvent* Event)
     EasyTab->PosX     = MotionEvent->x;
     EasyTab->PosY     = MotionEvent->y;
     EasyTab->Pressure = (float)MotionEvent->axis_data[2] / (float)EasyTab->MaxPressure;
+    EasyTab->Time     = (uint32_t)MotionEvent->time;
     return EASYTAB_OK;
 }
 
@@ -931,6 +933,7 @@ EasyTabResult EasyTab_HandleEvent(HWND Window, UINT Message, LPARAM LParam, WPAR
 
         EasyTab->Pressure = (float)Packet.pkNormalPressure / (float)EasyTab->MaxPressure;
         EasyTab->Buttons = Packet.pkButtons;
+        EasyTab->Time = Packet.pkTime;
         return EASYTAB_OK;
     }
 
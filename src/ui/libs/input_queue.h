@@ -0,0 +1,80 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+    Queue of the pointer events between two frames. Tablets report at a few
+    hundred hertz, and reading their state once per frame only keeps the last
+    event of each frame, so the platform layers push every event here as they
+    handle it, and each frame pops the whole batch.
+
+    One thread pushes and one pops. Neither takes a lock, so the producer may
+    also be a thread that only reads input. When the queue is full, new
+    samples are dropped until the next frame pops it.
+*/
+enum InputSource_ {
+    InputSource_Mouse,
+    InputSource_Tablet
+};
+
+struct InputSample {
+    double time;    // Milliseconds, from the event. Only differences matter.
+    float x, y;     // Window coordinates
+    float pressure; // 0 to 1. For the mouse, 1 while the left button is down.
+    int32_t source; // InputSource_
+};
+
+#define INPUT_QUEUE_SIZE 4096 // Power of two
+
+struct InputQueue {
+    InputSample samples[INPUT_QUEUE_SIZE];
+    std::atomic<uint32_t> head; // Next sample to write. Written by push.
+    std::atomic<uint32_t> tail; // Next sample to read. Written by pop.
+};
+
+namespace input_queue {
+    void init(InputQueue* q);
+    // Returns false if the sample was dropped
+    bool push(InputQueue* q, const InputSample& s);
+    // Moves up to max samples to out, oldest first. Returns how many.
+    int32_t pop(InputQueue* q, InputSample* out, int32_t max);
+}
+
+#endif // INPUT_QUEUE_H
+
+// =============================================================================
+
+#ifdef INPUT_QUEUE_IMPLEMENTATION
+
+void input_queue::init(InputQueue* q)
+{
+    q->head.store(0, std::memory_order_relaxed);
+    q->tail.store(0, std::memory_order_relaxed);
+}
+
+bool input_queue::push(InputQueue* q, const InputSample& s)
+{
+    uint32_t head = q->head.load(std::memory_order_relaxed);
+    if (head - q->tail.load(std::memory_order_acquire) >= INPUT_QUEUE_SIZE) {
+        return false;
+    }
+    q->samples[head & (INPUT_QUEUE_SIZE - 1)] = s;
+    q->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+int32_t input_queue::pop(InputQueue* q, InputSample* out, int32_t max)
+{
+    uint32_t tail = q->tail.load(std::memory_order_relaxed);
+    uint32_t avail = q->head.load(std::memory_order_acquire) - tail;
+    int32_t n = avail < (uint32_t)max ? (int32_t)avail : max;
+    for (int32_t i = 0; i < n; i++) {
+        out[i] = q->samples[(tail + i) & (INPUT_QUEUE_SIZE - 1)];
+    }
+    q->tail.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+#endif // INPUT_QUEUE_IMPLEMENTATION
@@ -35,3 +35,8 @@
 #define TIMER_IMPLEMENTATION
 #include "timer.h"
 
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+
+#define INPUT_QUEUE_IMPLEMENTATION
+#include "input_queue.h"
@@ -1,98 +1,149 @@
-
 #ifndef TIMER_H
 #define TIMER_H
 
-#include <stdint.h>
+/*
+    Clocks and a hierarchical profiler.
 
-struct Timer {
-    uint64_t start_cycles, stop_cycles, elapsed_cycles;
-    double start_ms, stop_ms, elapsed_ms;
-};
+    Code is profiled by marking zones, which nest:
 
-#define TIMER_LIST \
-    /* timer name */ \
-    TME(Startup) \
-    TME(Frame) \
-    TME(Sleep) \
-    TME(ImageOpen) \
-    TME(GetUndoImage) \
-    TME(COUNT) \
-    /* end */
-
-enum Timer_ {
-#define TME(name) Timer_##name,
-    TIMER_LIST
-#undef TME
-};
+        void f() {
+            PROFILE_ZONE("f");
+            ...
+        }
+
+    Entering and leaving a zone appends a timestamp to a ring buffer owned by
+    the calling thread, which costs a read of the cycle counter and no locks,
+    so zones may be marked on any thread. Once per frame, the main thread
+    calls profiler::collect(), which replays the new events of every thread
+    into a tree of zones keyed by their names along the path from the thread's
+    root. Each node of the tree keeps the time spent in it over the last
+    PROFILE_HISTORY frames in which it ran, from which profiler::get_stats()
+    derives the rolling min, avg and p99.
+
+    For looking at a capture offline, every zone that ends between
+    profiler::trace_start() and profiler::trace_stop() is also kept, and
+    written out as Chrome trace event JSON, which chrome://tracing and
+    Perfetto open.
+
+    Zone names must be string literals, or otherwise outlive the profiler.
+*/
+
+#include <stdint.h>
+
+#define PROFILE_HISTORY 256
 
 namespace timer {
+    // Calibrates the cycle counter. Call once, on the main thread.
     void init();
+    // Milliseconds per tick of the platform's performance counter
     double get_freq();
     double get_milliseconds();
-    void start(Timer_ timer);
-    void stop(Timer_ timer);
+    uint64_t get_cycles();
+    double cycles_to_ms(uint64_t cycles);
+}
+
+struct ProfileStats {
+    double last_ms;     // In the last frame that the zone ran in
+    double min_ms, avg_ms, p99_ms;
+    uint32_t last_calls;
+    int32_t num_samples;
+};
+
+namespace profiler {
+    // Zones that can't be scopes, e.g. the frame of a main loop
+    void begin(const char* name);
+    void end();
+
+    // Main thread, once per frame
+    void collect();
+
+    /*
+        The tree is walked with first_child and next_sibling, starting from
+        first_child(-1), which is the root of the first thread seen. Valid on
+        the main thread until the next collect().
+    */
+    int32_t first_child(int32_t node);
+    int32_t next_sibling(int32_t node);
+    const char* get_name(int32_t node);
+    void get_stats(int32_t node, ProfileStats* stats);
+
+    /*
+        Main thread. The trace holds the zones collected in between, and
+        trace_stop() returns false if path can't be written.
+    */
+    void trace_start();
+    bool trace_stop(const char* path);
+    bool is_tracing();
 }
 
-const char* get_timer_name(int idx);
+struct ProfileScope {
+    ProfileScope(const char* name) { profiler::begin(name); }
+    ~ProfileScope() { profiler::end(); }
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_ZONE(name) \
+    ProfileScope PROFILE_JOIN(profile_zone_, __LINE__)(name)
 
-extern Timer timers[Timer_COUNT];
 #endif // TIMER_H
 
 // =======================================================================================
 
 #ifdef TIMER_IMPLEMENTATION
 
-Timer timers[Timer_COUNT];
-double tick_freq;
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-// TODO: Add things needed to implement rdtsc on Windows
 #if defined(_WIN32)
 
     #define NOMINMAX
     #define WIN32_LEAN_AND_MEAN
     #include <Windows.h>
+    #include <intrin.h>
+    #define TIMER_HAS_RDTSC
 
-#elif defined(__linux__)
+#else
 
-    #include <x86intrin.h>
     #include <time.h>
+    #if defined(__x86_64__) || defined(__i386__)
+        #include <x86intrin.h>
+        #define TIMER_HAS_RDTSC
+    #endif
 
-#elif defined(__APPLE__)
+#endif
 
-    #if defined(__x86_64__)
-        static __inline__ unsigned long long __rdtsc()
-        {
-            unsigned Hi, Lo;
-            __asm__ __volatile__("rdtsc" : "=a"(Lo), "=d"(Hi));
-            return ((unsigned long long)Lo) | (((unsigned long long)Hi) << 32);
-        }
-    #elif defined(__i386__)
-        static __inline__ unsigned long long __rdtsc()
-        {
-            unsigned long long int Result;
-            __asm__ volatile(".byte 0x0f, 0x31" : "=A"(Result));
-            return Result;
-        }
-    #else
-        #error "No __rdtsc implementation"
-    #endif
+static double tick_freq;
+static struct ProfileRing* get_ring();
 
-#endif // __APPLE__
+// The cycle counter is calibrated against the monotonic clock at init, and
+// the calibration is refined on every collect as the interval grows.
+static uint64_t calib_cycles;
+static double calib_ms;
+static double ms_per_cycle;
 
 void timer::init()
 {
-#if defined (__linux__)
-
-    // TODO: Verify whether this is correct
-    tick_freq = 1.0;
-
-#elif defined (_WIN32)
-
+#if defined(_WIN32)
     int64_t ticks_per_second;
     QueryPerformanceFrequency((LARGE_INTEGER *)&ticks_per_second);
     tick_freq = 1000.0 / ticks_per_second;
-
+#else
+    tick_freq = 1e-6; // get_milliseconds() reads nanoseconds
 #endif
+
+    // The main thread gets the first ring
+    get_ring();
+
+    calib_ms = get_milliseconds();
+    calib_cycles = get_cycles();
+    double ms;
+    do {
+        ms = get_milliseconds();
+    } while (ms - calib_ms < 5.0);
+    ms_per_cycle = (ms - calib_ms) / (double)(get_cycles() - calib_cycles);
 }
 
 double timer::get_freq()
@@ -102,50 +153,427 @@ double timer::get_freq()
 
 double timer::get_milliseconds()
 {
-#if defined(__linux__)
+#if defined(_WIN32)
+
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    return (double)ticks.QuadPart * tick_freq;
+
+#else
 
     timespec time;
     clock_gettime(CLOCK_MONOTONIC, &time);
-    return (double)(time.tv_sec * 1000 + time.tv_nsec / 1000000);
-
-#elif defined(_WIN32)
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
 
-    LARGE_INTEGER ms;
-    QueryPerformanceCounter(&ms);
-    return (double)ms.QuadPart;
+#endif
+}
 
+uint64_t timer::get_cycles()
+{
+#if defined(TIMER_HAS_RDTSC)
+    return __rdtsc();
 #else
-    #error "Clock millisecond API not implemented on this platform"
+    // No cycle counter available. Nanoseconds work as well.
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
 #endif
 }
 
-
-void timer::start(Timer_ timer)
+double timer::cycles_to_ms(uint64_t cycles)
 {
-    timers[timer].start_ms = get_milliseconds();
-    timers[timer].start_cycles = __rdtsc();
+    return cycles * ms_per_cycle;
 }
 
-void timer::stop(Timer_ timer)
+static void refine_calibration()
 {
-    timers[timer].stop_cycles = __rdtsc();
-    timers[timer].stop_ms = get_milliseconds();
-    timers[timer].elapsed_cycles = timers[timer].stop_cycles -
-                                   timers[timer].start_cycles;
-    timers[timer].elapsed_ms = (timers[timer].stop_ms - timers[timer].start_ms) *
-                               tick_freq;
+    double ms = timer::get_milliseconds();
+    uint64_t cycles = timer::get_cycles();
+    if (ms - calib_ms > 100.0) {
+        ms_per_cycle = (ms - calib_ms) / (double)(cycles - calib_cycles);
+    }
 }
 
-static const char* timer_names[] = {
-#define TME(name) #name,
-    TIMER_LIST
-#undef TME
+// -----------------------------------------------------------------------------
+
+#define PROFILE_MAX_THREADS 64
+#define PROFILE_MAX_NODES 1024
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_RING_SIZE 16384 // Events per thread. Power of two.
+
+/*
+    An event enters the zone name, or leaves the innermost zone if name is 0.
+*/
+struct ProfileEvent {
+    uint64_t cycles;
+    const char* name;
 };
 
-const char* get_timer_name(int idx)
+/*
+    Written only by its thread, read by collect(). Events are published by
+    advancing head, after which the writer may overwrite them once it gets
+    PROFILE_RING_SIZE events ahead, so the reader checks head again after
+    copying them out.
+*/
+struct ProfileRing {
+    ProfileEvent events[PROFILE_RING_SIZE];
+    std::atomic<uint64_t> head;
+
+    // Used by collect() only
+    int32_t index;
+    uint64_t tail;
+    int32_t root;
+    int32_t depth;
+    int32_t stack[PROFILE_MAX_DEPTH];
+    uint64_t start[PROFILE_MAX_DEPTH];
+};
+
+struct ProfileNode {
+    const char* name;
+    int32_t parent, first_child, last_child, next_sibling;
+
+    // Accumulated by the collect in progress
+    uint64_t cycles;
+    uint32_t calls;
+
+    float samples[PROFILE_HISTORY]; // Ring of per-frame totals, in ms
+    int32_t num_samples, next_sample;
+    uint32_t last_calls;
+};
+
+static std::atomic<ProfileRing*> rings[PROFILE_MAX_THREADS];
+static std::atomic<int32_t> num_rings;
+static thread_local ProfileRing* own_ring;
+static thread_local bool own_ring_failed;
+
+static ProfileNode* nodes;
+static int32_t num_nodes;
+static int32_t first_root = -1, last_root = -1;
+static char root_names[PROFILE_MAX_THREADS][16];
+
+#define PROFILE_MAX_TRACE (1 << 22) // Zones kept by a trace, 24 bytes each
+
+struct TraceZone {
+    uint64_t start, cycles;
+    int32_t node, thread;
+};
+
+static bool tracing;
+static uint64_t trace_begin;
+static TraceZone* trace;
+static int32_t trace_size, trace_capacity;
+
+static ProfileRing* get_ring()
 {
-    return timer_names[idx];
+    if (own_ring || own_ring_failed) {
+        return own_ring;
+    }
+
+    int32_t idx = num_rings.fetch_add(1);
+    if (idx >= PROFILE_MAX_THREADS) {
+        own_ring_failed = true;
+        return 0;
+    }
+    ProfileRing* r = (ProfileRing*) calloc(1, sizeof(ProfileRing));
+    r->root = -1;
+    r->index = idx;
+    rings[idx].store(r, std::memory_order_release);
+    own_ring = r;
+    return r;
 }
 
-#endif // TIMER_IMPLEMENTATION
+static void push_event(const char* name)
+{
+    ProfileRing* r = get_ring();
+    if (!r) { return; }
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    ProfileEvent* e = &r->events[h & (PROFILE_RING_SIZE - 1)];
+    e->cycles = timer::get_cycles();
+    e->name = name;
+    r->head.store(h + 1, std::memory_order_release);
+}
 
+void profiler::begin(const char* name)
+{
+    push_event(name);
+}
+
+void profiler::end()
+{
+    push_event(0);
+}
+
+static int32_t add_node(int32_t parent, const char* name)
+{
+    if (num_nodes == PROFILE_MAX_NODES) {
+        return -1;
+    }
+    if (!nodes) {
+        nodes = (ProfileNode*) calloc(PROFILE_MAX_NODES, sizeof(ProfileNode));
+    }
+
+    int32_t n = num_nodes++;
+    ProfileNode* node = &nodes[n];
+    node->name = name;
+    node->parent = parent;
+    node->first_child = node->last_child = node->next_sibling = -1;
+
+    if (parent < 0) {
+        if (last_root >= 0) { nodes[last_root].next_sibling = n; }
+        else { first_root = n; }
+        last_root = n;
+    } else {
+        ProfileNode* p = &nodes[parent];
+        if (p->last_child >= 0) { nodes[p->last_child].next_sibling = n; }
+        else { p->first_child = n; }
+        p->last_child = n;
+    }
+    return n;
+}
+
+static int32_t find_child(int32_t parent, const char* name)
+{
+    for (int32_t c = nodes[parent].first_child; c >= 0;
+         c = nodes[c].next_sibling) {
+        // The same literal may have different addresses in different units
+        if (nodes[c].name == name || !strcmp(nodes[c].name, name)) {
+            return c;
+        }
+    }
+    return add_node(parent, name);
+}
+
+static void add_trace_zone(ProfileRing* r, int32_t depth, uint64_t cycles)
+{
+    if (r->start[depth] < trace_begin) {
+        return; // Entered before the trace started
+    }
+    if (trace_size == trace_capacity) {
+        if (trace_capacity == PROFILE_MAX_TRACE) { return; }
+        trace_capacity = trace_capacity ? 2 * trace_capacity : 4096;
+        trace = (TraceZone*) realloc(trace,
+                                     trace_capacity * sizeof(TraceZone));
+    }
+    TraceZone* z = &trace[trace_size++];
+    z->start = r->start[depth];
+    z->cycles = cycles;
+    z->node = r->stack[depth];
+    z->thread = r->index;
+}
+
+/*
+    Zones that overflow the tree, or the stack, are still entered so that the
+    events leaving them pair up, but aren't timed.
+*/
+static void replay(ProfileRing* r, const ProfileEvent* e)
+{
+    if (e->name) {
+        int32_t parent = r->depth ? r->stack[r->depth - 1] : r->root;
+        int32_t n = parent >= 0 ? find_child(parent, e->name) : -1;
+        if (r->depth < PROFILE_MAX_DEPTH) {
+            r->stack[r->depth] = n;
+            r->start[r->depth] = e->cycles;
+        }
+        r->depth++;
+    } else if (r->depth > 0) {
+        r->depth--;
+        if (r->depth < PROFILE_MAX_DEPTH && r->stack[r->depth] >= 0) {
+            ProfileNode* node = &nodes[r->stack[r->depth]];
+            uint64_t cycles = e->cycles - r->start[r->depth];
+            node->cycles += cycles;
+            node->calls++;
+            if (tracing) {
+                add_trace_zone(r, r->depth, cycles);
+            }
+        }
+    }
+}
+
+void profiler::collect()
+{
+    static ProfileEvent copy[PROFILE_RING_SIZE];
+    refine_calibration();
+
+    int32_t n = num_rings.load();
+    if (n > PROFILE_MAX_THREADS) { n = PROFILE_MAX_THREADS; }
+    for (int32_t i = 0; i < n; i++) {
+        ProfileRing* r = rings[i].load(std::memory_order_acquire);
+        if (!r) { continue; } // Still being registered
+
+        if (r->root < 0) {
+            if (i == 0) {
+                snprintf(root_names[i], 16, "Main thread");
+            } else {
+                snprintf(root_names[i], 16, "Thread %d", i);
+            }
+            r->root = add_node(-1, root_names[i]);
+            if (r->root < 0) { continue; }
+        }
+
+        // Events that the writer may have overwritten while being copied
+        // are dropped, and the open zones are then no longer known
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t tail = r->tail;
+        if (head - tail > PROFILE_RING_SIZE) {
+            tail = head - PROFILE_RING_SIZE;
+        }
+        for (uint64_t t = tail; t < head; t++) {
+            copy[t - tail] = r->events[t & (PROFILE_RING_SIZE - 1)];
+        }
+        uint64_t now = r->head.load(std::memory_order_acquire);
+        // The writer may be storing event now, over event now - size
+        uint64_t valid = now >= PROFILE_RING_SIZE ?
+                         now - PROFILE_RING_SIZE + 1 : 0;
+        uint64_t first = tail > valid ? tail : valid;
+        if (first != r->tail) {
+            r->depth = 0;
+        }
+        for (uint64_t t = first; t < head; t++) {
+            replay(r, &copy[t - tail]);
+        }
+        r->tail = head;
+    }
+
+    for (int32_t i = 0; i < num_nodes; i++) {
+        ProfileNode* node = &nodes[i];
+        if (!node->calls) { continue; }
+        node->samples[node->next_sample] = (float)
+            timer::cycles_to_ms(node->cycles);
+        node->next_sample = (node->next_sample + 1) % PROFILE_HISTORY;
+        if (node->num_samples < PROFILE_HISTORY) { node->num_samples++; }
+        node->last_calls = node->calls;
+        node->cycles = 0;
+        node->calls = 0;
+    }
+}
+
+int32_t profiler::first_child(int32_t node)
+{
+    if (node < 0) {
+        return num_nodes ? first_root : -1;
+    }
+    return nodes[node].first_child;
+}
+
+int32_t profiler::next_sibling(int32_t node)
+{
+    return nodes[node].next_sibling;
+}
+
+const char* profiler::get_name(int32_t node)
+{
+    return nodes[node].name;
+}
+
+static int compare_floats(const void* a, const void* b)
+{
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Thread roots aren't zones themselves, so they have no samples.
+*/
+void profiler::get_stats(int32_t node, ProfileStats* stats)
+{
+    ProfileNode* p = &nodes[node];
+    memset(stats, 0, sizeof(*stats));
+    stats->num_samples = p->num_samples;
+    stats->last_calls = p->last_calls;
+    if (!p->num_samples) {
+        return;
+    }
+
+    float sorted[PROFILE_HISTORY];
+    memcpy(sorted, p->samples, p->num_samples * sizeof(float));
+    qsort(sorted, p->num_samples, sizeof(float), compare_floats);
+
+    double sum = 0.0;
+    for (int32_t i = 0; i < p->num_samples; i++) {
+        sum += sorted[i];
+    }
+    int32_t last = (p->next_sample + PROFILE_HISTORY - 1) % PROFILE_HISTORY;
+    int32_t p99 = (99 * p->num_samples + 99) / 100 - 1;
+    stats->last_ms = p->samples[last];
+    stats->min_ms = sorted[0];
+    stats->avg_ms = sum / p->num_samples;
+    stats->p99_ms = sorted[p99];
+}
+
+void profiler::trace_start()
+{
+    tracing = true;
+    trace_begin = timer::get_cycles();
+    trace_size = 0;
+}
+
+bool profiler::is_tracing()
+{
+    return tracing;
+}
+
+/*
+    Zone names are expected to be plain, but are escaped anyway to keep the
+    file valid.
+*/
+static void write_json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/*
+    Zones are written as complete events, with times in microseconds from the
+    start of the trace.
+*/
+bool profiler::trace_stop(const char* path)
+{
+    tracing = false;
+
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    int32_t n = num_rings.load();
+    if (n > PROFILE_MAX_THREADS) { n = PROFILE_MAX_THREADS; }
+    for (int32_t i = 0; i < n; i++) {
+        ProfileRing* r = rings[i].load(std::memory_order_acquire);
+        if (!r || r->root < 0) { continue; }
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                   "\"tid\":%d,\"args\":{\"name\":", i);
+        write_json_string(f, root_names[i]);
+        fprintf(f, "}},\n");
+    }
+    for (int32_t i = 0; i < trace_size; i++) {
+        TraceZone* z = &trace[i];
+        fprintf(f, "{\"name\":");
+        write_json_string(f, nodes[z->node].name);
+        fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                   "\"ts\":%.3f,\"dur\":%.3f},\n",
+                z->thread,
+                1000.0 * timer::cycles_to_ms(z->start - trace_begin),
+                1000.0 * timer::cycles_to_ms(z->cycles));
+    }
+    // The metadata event for the trace ends the list without a comma
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+               "\"args\":{\"name\":\"Papaya\"}}\n]}\n");
+
+    free(trace);
+    trace = 0;
+    trace_size = trace_capacity = 0;
+    return fclose(f) == 0;
+}
+
+#endif // TIMER_IMPLEMENTATION
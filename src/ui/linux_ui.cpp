@@ -5,8 +5,13 @@
 #include <stdio.h>
 #include <time.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #ifdef USE_GTK
 #include <gtk/gtk.h>
+#include <gdk/gdkx.h>
 #endif
 
 #include "gl_lite.h"
@@ -61,7 +66,7 @@ void platform::set_cursor_visibility(bool visible)
     }
 }
 
-char* platform::open_file_dialog()
+char* platform::open_file_dialog(Arena* arena)
 {
 #ifdef USE_GTK
     GtkWidget *dialog =
@@ -74,13 +79,14 @@ char* platform::open_file_dialog()
     gtk_file_filter_add_pattern(filter, "*.[pP][nN][gG]");
     gtk_file_filter_add_pattern(filter, "*.[jJ][pP][gG]");
     gtk_file_filter_add_pattern(filter, "*.[jJ][pP][eE][gG]");
+    gtk_file_filter_add_pattern(filter, "*.papaya");
     gtk_file_chooser_add_filter(chooser, filter);
 
     char *out_file_name = 0;
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         gchar *gtk_file_name = gtk_file_chooser_get_filename(chooser);
         int file_name_len = strlen(gtk_file_name) + 1; // +1 for terminator
-        out_file_name = (char*)malloc(file_name_len);
+        out_file_name = (char*)arena::alloc(arena, file_name_len);
         strcpy(out_file_name, gtk_file_name);
         g_free(gtk_file_name);
     }
@@ -93,7 +99,7 @@ char* platform::open_file_dialog()
 #endif
 }
 
-char* platform::save_file_dialog()
+char* platform::save_file_dialog(Arena* arena)
 {
 #if USE_GTK
     GtkWidget *dialog =
@@ -104,6 +110,7 @@ char* platform::save_file_dialog()
     GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
     GtkFileFilter *filter = gtk_file_filter_new();
     gtk_file_filter_add_pattern(filter, "*.[pP][nN][gG]");
+    gtk_file_filter_add_pattern(filter, "*.papaya");
     gtk_file_chooser_add_filter(chooser, filter);
     gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
     gtk_file_chooser_set_filename(chooser, "untitled.png"); // what if the user saves a file that already has a name?
@@ -112,7 +119,7 @@ char* platform::save_file_dialog()
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         gchar *gtk_file_name = gtk_file_chooser_get_filename(chooser);
         int file_name_len = strlen(gtk_file_name) + 1; // +1 for terminator
-        out_file_name = (char*)malloc(file_name_len);
+        out_file_name = (char*)arena::alloc(arena, file_name_len);
         strcpy(out_file_name, gtk_file_name);
         g_free(gtk_file_name);
     }
@@ -125,6 +132,163 @@ char* platform::save_file_dialog()
 #endif
 }
 
+void* platform::alloc_mirrored(size_t* size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *size = (*size + page - 1) / page * page;
+
+    int fd = memfd_create("papaya_mirror", 0);
+    if (fd < 0) { return 0; }
+    if (ftruncate(fd, (off_t)*size) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    // Reserve a range for both mappings, then map the file over each half
+    u8* base = (u8*)mmap(0, 2 * *size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    void* a = mmap(base, *size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, 0);
+    void* b = mmap(base + *size, *size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd); // The mappings keep the memory alive
+
+    if (a != base || b != base + *size) {
+        munmap(base, 2 * *size);
+        return 0;
+    }
+    return base;
+}
+
+void platform::free_mirrored(void* mem, size_t size)
+{
+    munmap(mem, 2 * size);
+}
+
+void* platform::map_scratch_file(size_t size)
+{
+    const char* dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/papaya-XXXXXX", dir ? dir : "/tmp");
+
+    int fd = mkstemp(path);
+    if (fd < 0) { return 0; }
+    unlink(path); // Deleted once the mapping is gone
+
+    void* mem = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        mem = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_NORESERVE, fd, 0);
+    }
+    close(fd);
+    return mem == MAP_FAILED ? 0 : mem;
+}
+
+void platform::unmap_scratch_file(void* mem, size_t size)
+{
+    munmap(mem, size);
+}
+
+void* platform::map_file(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return 0; }
+
+    // Private pages are only allocated when written to, so no swap is reserved
+    struct stat st;
+    void* mem = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = (size_t)st.st_size;
+        mem = mmap(0, *size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    }
+    close(fd);
+    return mem == MAP_FAILED ? 0 : mem;
+}
+
+void platform::unmap_file(void* mem, size_t size)
+{
+    munmap(mem, size);
+}
+
+char* platform::cache_dir(Arena* arena)
+{
+    const char* base = getenv("XDG_CACHE_HOME");
+    const char* sub = "";
+    if (!base || !base[0]) {
+        base = getenv("HOME");
+        sub = "/.cache";
+        if (!base || !base[0]) { return 0; }
+    }
+
+    size_t len = strlen(base) + strlen(sub) + strlen("/papaya") + 1;
+    char* path = (char*)arena::alloc(arena, len);
+    snprintf(path, len, "%s%s", base, sub);
+    mkdir(path, 0700);
+    strcat(path, "/papaya");
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) { return 0; }
+    return path;
+}
+
+u64 platform::physical_memory()
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0) { return 0; }
+    return (u64)pages * (u64)page_size;
+}
+
+// =================================================================================================
+
+static void queue_pointer(PapayaMemory* mem, Time time, i32 x, i32 y,
+                          f32 pressure, i32 source)
+{
+    InputSample s = { (f64)time, (f32)x, (f32)y, pressure, source };
+    input_queue::push(&mem->input.queue, s);
+}
+
+/*
+    Blocks until there are X events, which include tablet events, or until GTK
+    has events of its own.
+*/
+static void wait_for_events()
+{
+    if (XPending(xlib_display)) { return; }
+    pollfd fds[2] = {};
+    i32 num_fds = 1;
+    fds[0].fd = ConnectionNumber(xlib_display);
+    fds[0].events = POLLIN;
+#ifdef USE_GTK
+    fds[1].fd = ConnectionNumber(gdk_x11_get_default_xdisplay());
+    fds[1].events = POLLIN;
+    num_fds++;
+    if (gtk_events_pending()) { return; }
+#endif
+    while (poll(fds, num_fds, -1) < 0 && errno == EINTR) {}
+}
+
+/*
+    Sleeps until the absolute time, in timer::get_milliseconds. Absolute
+    deadlines keep late wakeups from adding up over frames, and the kernel
+    wakes within tens of microseconds of them.
+*/
+static void sleep_until(f64 ms)
+{
+    timespec t;
+    t.tv_sec = (time_t)(ms / 1000.0);
+    t.tv_nsec = (long)((ms - t.tv_sec * 1000.0) * 1000000.0);
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0) == EINTR) {}
+}
+
 // =================================================================================================
 
 int main(int argc, char **argv)
@@ -132,9 +296,10 @@ int main(int argc, char **argv)
     PapayaMemory* mem = (PapayaMemory*) calloc(1, sizeof(*mem));
     XVisualInfo* xlib_visual_info;
     Atom xlib_delete_window_atom;
+    f64 refresh_rate = 60.0;
 
-    timer::init(); // TODO: Check linux timer manual. Is this correct?
-    timer::start(Timer_Startup);
+    timer::init();
+    profiler::begin("Startup");
 
     // Initialize GTK for Open/Save file dialogs
 #ifdef USE_GTK
@@ -251,6 +416,8 @@ int main(int argc, char **argv)
         // Display vsync if possible
         typedef void SwapIntervalEXTproc(Display*, GLXDrawable, i32);
         SwapIntervalEXTproc* glXSwapIntervalEXT = 0;
+        typedef Bool GetMscRateOMLproc(Display*, GLXDrawable, i32*, i32*);
+        GetMscRateOMLproc* glXGetMscRateOML = 0;
         void* libGL = dlopen("libGL.so", RTLD_LAZY);
         if (libGL) {
             glXSwapIntervalEXT =
@@ -258,6 +425,17 @@ int main(int argc, char **argv)
             if (glXSwapIntervalEXT) {
                 glXSwapIntervalEXT(xlib_display, xlib_window, 0);
             }
+
+            // Frames are paced to the display's refresh rate, since swaps
+            // don't wait for vsync
+            glXGetMscRateOML =
+                (GetMscRateOMLproc*) dlsym(libGL, "glXGetMscRateOML");
+            i32 num, den;
+            if (glXGetMscRateOML &&
+                glXGetMscRateOML(xlib_display, xlib_window, &num, &den) &&
+                num > 0 && den > 0) {
+                refresh_rate = (f64)num / den;
+            }
         }
     }
 
@@ -267,23 +445,37 @@ int main(int argc, char **argv)
     core::init(mem);
     ImGui::GetIO().RenderDrawListsFn = core::render_imgui;
 
-    timer::stop(Timer_Startup);
+    profiler::end();
 
 #ifdef PAPAYA_DEFAULT_IMAGE
     core::open_doc(PAPAYA_DEFAULT_IMAGE, mem);
 #endif
 
     mem->is_running = true;
+    f64 next_frame = timer::get_milliseconds();
 
     while (mem->is_running) {
-        timer::start(Timer_Frame);
+        if (!core::needs_redraw(mem)) {
+            PROFILE_ZONE("Wait for events");
+            wait_for_events();
+            next_frame = timer::get_milliseconds();
+        }
+
+        profiler::collect();
+        profiler::begin("Frame");
 
         // Event handling
         while (XPending(xlib_display)) {
             XEvent event;
             XNextEvent(xlib_display, &event);
+            core::request_redraw(mem);
 
-            if (EasyTab_HandleEvent(&event) == EASYTAB_OK) { continue; }
+            if (EasyTab_HandleEvent(&event) == EASYTAB_OK) {
+                queue_pointer(mem, EasyTab->Time, EasyTab->PosX,
+                              EasyTab->PosY, EasyTab->Pressure,
+                              InputSource_Tablet);
+                continue;
+            }
             if (easykey_handle_event(&event, xlib_display) == EASYKEY_OK) { continue; }
 
             switch (event.type) {
@@ -302,11 +494,21 @@ int main(int argc, char **argv)
                 case MotionNotify: {
                     ImGui::GetIO().MousePos.x = event.xmotion.x;
                     ImGui::GetIO().MousePos.y = event.xmotion.y;
+                    queue_pointer(mem, event.xmotion.time, event.xmotion.x,
+                                  event.xmotion.y,
+                                  (event.xmotion.state & Button1Mask) ? 1 : 0,
+                                  InputSource_Mouse);
                 } break;
 
                 case ButtonPress:
                 case ButtonRelease: {
                     i32 Button = event.xbutton.button;
+                    if (Button == 1) {
+                        queue_pointer(mem, event.xbutton.time, event.xbutton.x,
+                                      event.xbutton.y,
+                                      event.type == ButtonPress ? 1 : 0,
+                                      InputSource_Mouse);
+                    }
                     if 		(Button == 1) { Button = 0; } // This section maps Xlib's button indices (Left = 1, Middle = 2, Right = 3)
                     else if (Button == 2) { Button = 2; } // to Papaya's button indices              (Left = 0, Right = 1, Middle = 2)
                     else if (Button == 3) { Button = 1; } //
@@ -346,23 +548,33 @@ int main(int argc, char **argv)
         // Update and render
         {
             core::update(mem);
+            profiler::begin("Swap buffers");
             glXSwapBuffers(xlib_display, xlib_window);
+            profiler::end();
         }
 
 #ifdef USE_GTK
-        // Run a GTK+ loop, and *don't* block if there are no events pending
-        gtk_main_iteration_do(FALSE);
+        // Run the pending GTK+ events, and *don't* block if there are none
+        profiler::begin("GTK events");
+        while (gtk_events_pending()) {
+            gtk_main_iteration_do(FALSE);
+        }
+        profiler::end();
 #endif
 
         // End Of Frame
-        timer::stop(Timer_Frame);
-        f64 FrameRate =
-            (mem->current_tool == PapayaTool_Brush && mem->mouse.is_down[0]) ?
-            500.0 : 60.0;
-        f64 FrameTime = 1000.0 / FrameRate;
-        f64 SleepTime = FrameTime - timers[Timer_Frame].elapsed_ms;
-        timers[Timer_Sleep].elapsed_ms = SleepTime;
-        if (SleepTime > 0) { usleep((u32)SleepTime * 1000); }
+        profiler::end();
+
+        // A frame that ran late starts the next one right away, instead of
+        // trying to catch up
+        f64 now = timer::get_milliseconds();
+        next_frame += 1000.0 / refresh_rate;
+        if (next_frame < now) {
+            next_frame = now;
+        } else if (core::needs_redraw(mem)) {
+            PROFILE_ZONE("Sleep");
+            sleep_until(next_frame);
+        }
     }
 
     core::destroy(mem);
@@ -1,29 +1,37 @@
 #pragma once
 
-#if !defined(_DEBUG ) // TODO: Make this work for gcc
-#define PAPAYARELEASE // User-ready release mode
-#endif // !_DEBUG
+// User-ready release mode. MSVC defines _DEBUG in debug builds, and the
+// makefile defines NDEBUG in its optimized configurations.
+#if (defined(_MSC_VER) && !defined(_DEBUG)) || defined(NDEBUG)
+#define PAPAYARELEASE
+#endif
 
 #include "libs/types.h"
+#include "libs/arena.h"
 #include "libs/timer.h"
 #include "libs/easytab.h"
+#include "libs/input_queue.h"
 #include "libs/imgui/imgui.h"
 
 #include "components/crop_rotate.h"
 #include "components/prefs.h"
 #include "components/undo.h"
+#include "libpapaya.h"
 
 struct ImDrawData;
 
 struct Brush;
 struct ColorPanel;
+struct DocIo;
 struct EyeDropper;
+struct GpuEvaluator;
 struct GraphPanel;
 
-struct PapayaNode;
 struct PaglMesh;
 struct PaglProgram;
 
+#define PAPAYA_MAX_DOCS 16
+
 enum PapayaTex_ {
     PapayaTex_Font,
     PapayaTex_UI,
@@ -58,8 +66,6 @@ enum PapayaShader_ {
     PapayaShader_VertexColor,
     PapayaShader_ImageSizePreview,
     PapayaShader_AlphaGrid,
-    PapayaShader_PreMultiplyAlpha,
-    PapayaShader_DeMultiplyAlpha,
     PapayaShader_COUNT
 };
 
@@ -104,17 +110,60 @@ struct Layout {
 //     UndoBuffer undo;
 // };
 
+/*
+    Images of the file a document was opened from, shared by every document
+    opened from the same file and by their duplicates, so that their bitmaps
+    share tiles, which are copied on write. Keeps the graph as it was opened,
+    from which the file is opened again without reading it. Only used on the
+    main thread once a document holds it.
+*/
+struct DocStorage {
+    i32 refs; // One per document
+    char* path; // Of the file. 0 if graph doesn't match it, e.g. after saving.
+    PapayaGraph graph; // As opened. No nodes until the document is shown.
+    i32 view_node;
+    i32 w, h;
+
+    // Scratch file that holds the tiles of the bitmap nodes, so that images of
+    // any size only keep the tiles in use resident. 0 if it couldn't be mapped.
+    u8* tile_file;
+    size_t tile_file_size, tile_file_used;
+
+    // Mapping of the project the document was opened from, which the tiles of
+    // its bitmaps point into. 0 if it wasn't opened from a project.
+    u8* project_file;
+    size_t project_file_size;
+};
+
+/*
+    Canvas of a document that isn't the current one. The current document's
+    is in Misc. Switching back to a document shows its canvas as it was left,
+    without evaluating anything.
+*/
+struct DocCanvas {
+    u32 canvas_tex;
+    PapayaNode* canvas_node;
+    i32 canvas_tex_w, canvas_tex_h;
+    i32 canvas_level, canvas_eval_level;
+    bool canvas_pending;
+    u32 view_tex;
+    i32 w, h;
+};
+
 struct Document {
-    PapayaNode* nodes;
-    size_t num_nodes;
+    PapayaGraph graph;
     PapayaNode* view_node; // Node that is being evaluated and viewed
     PapayaNode* edit_node; // Node that is being edited
+    char* name; // Shown on the document's tab
 
     Vec2 canvas_pos;
     Vec2 canvas_size;
     f32 canvas_zoom;
 
     UndoBuffer undo;
+    DocStorage* storage;
+    GraphPanel* graph_panel; // Set while the document is shown
+    DocCanvas canvas; // While another document is the current one
 };
 
 struct Mouse {
@@ -140,6 +189,13 @@ struct Tablet {
     i32 buttons;
 };
 
+// Pointer events, pushed by the platform layer as it handles them
+struct Input {
+    InputQueue queue;
+    InputSample* samples; // Events since the last frame, from the frame arena
+    i32 num_samples;
+};
+
 struct Profile {
     i64 current_time; // Used on Windows.
     f32 last_frame_time; // Used on Linux. TODO: Combine this var and the one above.
@@ -158,6 +214,20 @@ struct Misc {
     bool preview_image_size;
     i32 preview_width, preview_height;
     u32 canvas_tex; // Temporarily used for visualization during node bringup
+    PapayaNode* canvas_node; // Node whose output canvas_tex holds
+    i32 canvas_tex_w, canvas_tex_h; // Size of the storage of canvas_tex
+    i32 canvas_level; // Pyramid level of canvas_tex. 0 is full resolution.
+    i32 canvas_eval_level; // Level being evaluated for canvas_tex
+    bool canvas_pending; // Evaluation continues over the following frames
+    u32 canvas_pbos[2]; // Staging buffers for canvas_tex uploads, used in turn
+    i32 canvas_pbo_idx;
+    u32 view_tex; // Texture drawn on the canvas. canvas_tex or a GPU output.
+    bool gpu_eval; // Evaluate nodes with the GpuEvaluator instead of the CPU
+    i32 png_level; // Compression level of saved PNGs, 0 to 9
+    i32 memory_budget_mb; // For the CPU memory of all documents together
+    i32 gpu_budget_mb; // Over this, unused node textures are freed
+    bool event_driven; // Wait for input between frames when nothing changes
+    i32 redraw_frames; // Frames still to be drawn after the last input
     i32 w, h;
     u32 vertex_shader;
 };
@@ -169,9 +239,13 @@ struct PapayaMemory {
     Keyboard keyboard;
     Mouse mouse;
     Tablet tablet;
+    Input input;
     Profile profile;
 
-    Document* doc;
+    Document* docs[PAPAYA_MAX_DOCS]; // Open documents, in the order of the tabs
+    i32 num_docs;
+    Document* doc; // Current document, one of docs
+    Arena frame_arena; // Scratch memory. Reset at the start of every frame.
 
     u32 textures[PapayaTex_COUNT];
     Color colors[PapayaCol_COUNT];
@@ -184,8 +258,10 @@ struct PapayaMemory {
 
     Brush* brush;
     EyeDropper* eye_dropper;
+    GpuEvaluator* gpu_evaluator;
     ColorPanel* color_panel;
-    GraphPanel* graph_panel;
+    GraphPanel* graph_panel; // Of the current document
+    DocIo* doc_io;
 
     Misc misc;
 };
@@ -196,10 +272,35 @@ namespace core {
     void resize(PapayaMemory* mem, i32 width, i32 height);
     void update(PapayaMemory* mem);
     void render_imgui(ImDrawData* draw_data, void* mem_ptr);
+
+    // The platform layers draw frames only when needs_redraw is true, and
+    // otherwise wait for input, after which they call request_redraw. Frames
+    // are then paced to the display's refresh rate.
+    bool needs_redraw(PapayaMemory* mem);
+    void request_redraw(PapayaMemory* mem);
     bool open_doc(const char* path, PapayaMemory* mem);
-    void close_doc(PapayaMemory* mem);
+    void close_doc(PapayaMemory* mem); // Closes the current document
+
+    // Documents not shown yet, e.g. while being opened, may be built on any
+    // thread
+    Document* init_doc(size_t num_nodes);
+    void destroy_doc(Document* doc);
+    u8* alloc_tile_storage(Document* doc, i32 w, i32 h);
+
+    // Document that shares storage and copies graph, whose bitmaps share
+    // their tiles. Main thread only.
+    Document* copy_doc(DocStorage* storage, const PapayaGraph* graph);
+
+    // Adds a w*h document and makes it the current one. name is copied.
+    // Callers check that there is room for another, see PAPAYA_MAX_DOCS, as
+    // otherwise doc is destroyed instead.
+    void add_doc(PapayaMemory* mem, Document* doc, const char* name,
+                 i32 w, i32 h, i32 view_node);
+    void switch_doc(PapayaMemory* mem, i32 index);
+
     void resize_doc(PapayaMemory* mem, i32 width, i32 height);
     void update_canvas(PapayaMemory* mem);
+    void refine_canvas(PapayaMemory* mem);
 }
 
 namespace platform
@@ -209,6 +310,32 @@ namespace platform
     void stop_mouse_capture();
     void set_mouse_position(i32 x, i32 y);
     void set_cursor_visibility(bool Visible);
-    char* open_file_dialog();
-    char* save_file_dialog();
+    // The returned path is allocated from the arena
+    char* open_file_dialog(Arena* arena);
+    char* save_file_dialog(Arena* arena);
+
+    // Maps the same memory twice in a row, so that writes past the end of the
+    // first mapping land at its start. size is rounded up to the allocation
+    // granularity. Returns 0 if unsupported.
+    void* alloc_mirrored(size_t* size);
+    void free_mirrored(void* mem, size_t size);
+
+    // Maps a temporary file that is deleted once unmapped. The file is sparse,
+    // so only the pages written to take up disk space, and the OS writes them
+    // back and drops them from RAM as it sees fit. Returns 0 on failure.
+    void* map_scratch_file(size_t size);
+    void unmap_scratch_file(void* mem, size_t size);
+
+    // Maps the file at path copy on write: writes go to private copies of the
+    // pages and never reach the file. The OS reads pages in on first access.
+    // Returns 0 on failure.
+    void* map_file(const char* path, size_t* size);
+    void unmap_file(void* mem, size_t size);
+
+    // Per-user directory for caches, created if missing. The path is
+    // allocated from the arena. Returns 0 if there is none.
+    char* cache_dir(Arena* arena);
+
+    // Installed RAM, in bytes. Returns 0 if unknown.
+    u64 physical_memory();
 }
@@ -7,6 +7,7 @@
 #undef GetWindowFont // Windows API macro clashes with ImGui function
 
 #include "ui.h"
+#include "components/doc_io.h"
 
 #include "gl_lite.h"
 #include "libs/imgui/imgui.h"
@@ -25,6 +26,21 @@ static RECT windows_work_area; // Needed because WS_POPUP by default maximizes t
 
 // =================================================================================================
 
+/*
+    Sleeps until the absolute time, in timer::get_milliseconds. Sleep only
+    counts whole scheduler ticks, so the last millisecond is spent yielding.
+*/
+static void sleep_until(f64 ms)
+{
+    f64 left = ms - timer::get_milliseconds();
+    if (left > 1.0) {
+        Sleep((DWORD)(left - 1.0));
+    }
+    while (timer::get_milliseconds() < ms) {
+        Sleep(0);
+    }
+}
+
 void platform::print(const char* msg)
 {
     OutputDebugString((LPCSTR)msg);
@@ -52,15 +68,16 @@ void platform::set_cursor_visibility(bool visible)
     ShowCursor(visible);
 }
 
-char* platform::open_file_dialog()
+char* platform::open_file_dialog(Arena* arena)
 {
     const i32 file_name_size = MAX_PATH;
-    char* file_name = (char*)malloc(file_name_size);
+    char* file_name = (char*)arena::alloc(arena, file_name_size);
 
     OPENFILENAME dialog_params = {};
     dialog_params.lStructSize = sizeof(OPENFILENAME);
     dialog_params.hwndOwner = GetActiveWindow();
-    dialog_params.lpstrFilter = "JPEG\0*.jpg;*.jpeg\0PNG\0*.png\0";
+    dialog_params.lpstrFilter = "JPEG\0*.jpg;*.jpeg\0PNG\0*.png\0"
+                                "Papaya project\0*.papaya\0";
     dialog_params.nFilterIndex = 2;
     dialog_params.lpstrFile = file_name;
     dialog_params.lpstrFile[0] = '\0';
@@ -69,24 +86,19 @@ char* platform::open_file_dialog()
 
     BOOL result = GetOpenFileNameA(&dialog_params); // TODO: Unicode support?
 
-    if (result) {
-        return file_name;
-    } else {
-        free(file_name);
-        return 0;
-    }
+    return result ? file_name : 0;
 }
 
-char* platform::save_file_dialog()
+char* platform::save_file_dialog(Arena* arena)
 {
     const i32 file_nameSize = MAX_PATH;
-    char* file_name = (char*)malloc(file_nameSize);
+    char* file_name = (char*)arena::alloc(arena, file_nameSize);
 
     OPENFILENAME dialog_params = {};
     dialog_params.lStructSize = sizeof(OPENFILENAME);
     dialog_params.hwndOwner = GetActiveWindow();
-    dialog_params.lpstrFilter = "PNG\0*.png\0";
-    dialog_params.nFilterIndex = 2;
+    dialog_params.lpstrFilter = "PNG\0*.png\0Papaya project\0*.papaya\0";
+    dialog_params.nFilterIndex = 1;
     dialog_params.lpstrFile = file_name;
     dialog_params.lpstrFile[0] = '\0';
     dialog_params.nMaxFile = file_nameSize;
@@ -95,7 +107,13 @@ char* platform::save_file_dialog()
     BOOL result = GetSaveFileNameA(&dialog_params); // TODO: Unicode support?
 
     // Suffix .png if required
-    {
+    if (doc_io_is_project(file_name)) {
+        // Keep the project extension
+    } else if (dialog_params.nFilterIndex == 2) {
+        if (strlen(file_name) <= file_nameSize - 8) {
+            strcat(file_name, ".papaya");
+        }
+    } else {
         size_t len = strlen(file_name);
         if (len <= file_nameSize - 4 &&                                   //
             !((file_name[len-4] == '.') &&                                // Ugh.
@@ -110,19 +128,152 @@ char* platform::save_file_dialog()
     sprintf(buffer, "%s\n", file_name);
     OutputDebugStringA(buffer);
 
-    if (result) {
-        return file_name;
-    } else {
-        free(file_name);
+    return result ? file_name : 0;
+}
+
+void* platform::alloc_mirrored(size_t* size)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t granularity = info.dwAllocationGranularity;
+    *size = (*size + granularity - 1) / granularity * granularity;
+
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE,
+                                        (DWORD)((u64)*size >> 32),
+                                        (DWORD)(*size & 0xffffffff), 0);
+    if (!mapping) { return 0; }
+
+    // Find a free range by reserving and releasing it, then map both views
+    // into it. Another thread may take the range in between, so retry.
+    for (i32 attempt = 0; attempt < 8; attempt++) {
+        u8* base = (u8*)VirtualAlloc(0, 2 * *size, MEM_RESERVE, PAGE_NOACCESS);
+        if (!base) { break; }
+        VirtualFree(base, 0, MEM_RELEASE);
+
+        void* a = MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, *size,
+                                  base);
+        void* b = MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, *size,
+                                  base + *size);
+        if (a == base && b == base + *size) {
+            CloseHandle(mapping); // The views keep the memory alive
+            return base;
+        }
+        if (a) { UnmapViewOfFile(a); }
+        if (b) { UnmapViewOfFile(b); }
+    }
+
+    CloseHandle(mapping);
+    return 0;
+}
+
+void platform::free_mirrored(void* mem, size_t size)
+{
+    UnmapViewOfFile(mem);
+    UnmapViewOfFile((u8*)mem + size);
+}
+
+void* platform::map_scratch_file(size_t size)
+{
+    char dir[MAX_PATH], path[MAX_PATH];
+    if (!GetTempPathA(MAX_PATH, dir) ||
+        !GetTempFileNameA(dir, "pap", 0, path)) {
+        return 0;
+    }
+
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0,
+                              CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY |
+                              FILE_FLAG_DELETE_ON_CLOSE, 0);
+    if (file == INVALID_HANDLE_VALUE) { return 0; }
+
+    // Without this, sizing the mapping would allocate the whole file
+    DWORD bytes;
+    DeviceIoControl(file, FSCTL_SET_SPARSE, 0, 0, 0, 0, &bytes, 0);
+
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READWRITE,
+                                        (DWORD)((u64)size >> 32),
+                                        (DWORD)size, 0);
+    CloseHandle(file); // The mapping keeps the file open
+    if (!mapping) { return 0; }
+
+    void* mem = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    CloseHandle(mapping);
+    return mem;
+}
+
+void platform::unmap_scratch_file(void* mem, size_t size)
+{
+    UnmapViewOfFile(mem);
+}
+
+void* platform::map_file(const char* path, size_t* size)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_DELETE, 0,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) { return 0; }
+
+    LARGE_INTEGER file_size;
+    HANDLE mapping = 0;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        *size = (size_t)file_size.QuadPart;
+        mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+    }
+    CloseHandle(file); // The mapping keeps the file open
+    if (!mapping) { return 0; }
+
+    void* mem = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    return mem;
+}
+
+void platform::unmap_file(void* mem, size_t size)
+{
+    UnmapViewOfFile(mem);
+}
+
+char* platform::cache_dir(Arena* arena)
+{
+    char base[MAX_PATH];
+    DWORD len = GetEnvironmentVariableA("LOCALAPPDATA", base, MAX_PATH);
+    if (!len || len >= MAX_PATH) { return 0; }
+
+    char* path = (char*)arena::alloc(arena, len + sizeof("\\Papaya"));
+    sprintf(path, "%s\\Papaya", base);
+    if (!CreateDirectoryA(path, 0) &&
+        GetLastError() != ERROR_ALREADY_EXISTS) {
         return 0;
     }
+    return path;
+}
+
+u64 platform::physical_memory()
+{
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status)) { return 0; }
+    return (u64)status.ullTotalPhys;
 }
 
 // =================================================================================================
 
+static void queue_pointer(DWORD time, i32 x, i32 y, f32 pressure, i32 source)
+{
+    InputSample s = { (f64)time, (f32)x, (f32)y, pressure, source };
+    input_queue::push(&mem.input.queue, s);
+}
+
+static void queue_mouse(LPARAM l_param, f32 pressure)
+{
+    queue_pointer(GetMessageTime(), GET_X_LPARAM(l_param),
+                  GET_Y_LPARAM(l_param), pressure, InputSource_Mouse);
+}
+
 static LRESULT CALLBACK Win32MainWindowCallback(HWND window, UINT msg, WPARAM w_param, LPARAM l_param)
 {
     if (EasyTab_HandleEvent(window, msg, l_param, w_param) == EASYTAB_OK) {
+        queue_pointer(EasyTab->Time, EasyTab->PosX, EasyTab->PosY,
+                      EasyTab->Pressure, InputSource_Tablet);
         return true;  // Tablet input
     }
 
@@ -133,11 +284,13 @@ static LRESULT CALLBACK Win32MainWindowCallback(HWND window, UINT msg, WPARAM w_
         // Mouse
         case WM_LBUTTONDOWN: {
             io.MouseDown[0] = true;
+            queue_mouse(l_param, 1);
             return true;
         } break;
 
         case WM_LBUTTONUP: {
             io.MouseDown[0] = false;
+            queue_mouse(l_param, 0);
             return true;
         } break;
 
@@ -174,6 +327,7 @@ static LRESULT CALLBACK Win32MainWindowCallback(HWND window, UINT msg, WPARAM w_
             TrackMouseEvent(&track_param);
             io.MousePos.x = (signed short)(l_param);
             io.MousePos.y = (signed short)(l_param >> 16);
+            queue_mouse(l_param, (w_param & MK_LBUTTON) ? 1 : 0);
             return true;
         } break;
 
@@ -326,9 +480,10 @@ static LRESULT CALLBACK Win32MainWindowCallback(HWND window, UINT msg, WPARAM w_
 int CALLBACK WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR cmd_line, int show_code)
 {
     timer::init();
+    f64 refresh_rate = 60.0;
 
     QueryPerformanceCounter((LARGE_INTEGER *)&mem.profile);
-    timer::start(Timer_Startup);
+    profiler::begin("Startup");
 
     mem.is_running = true;
 
@@ -449,6 +604,11 @@ int CALLBACK WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR cmd_line
 
         // Disable vsync
         //if (wglewIsSupported("WGL_EXT_swap_control")) { wglSwapIntervalEXT(0); }
+
+        // Frames are paced to the display's refresh rate. 0 and 1 mean the
+        // hardware's default.
+        i32 vrefresh = GetDeviceCaps(device_context, VREFRESH);
+        if (vrefresh > 1) { refresh_rate = vrefresh; }
     }
 
     // Initialize tablet
@@ -485,7 +645,7 @@ int CALLBACK WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR cmd_line
     mem.window.title_bar_buttons_width = 109;
     mem.window.title_bar_height = 30;
 
-    timer::stop(Timer_Startup);
+    profiler::end();
 
     // Handle command line arguments (if present)
     if (strlen(cmd_line)) {
@@ -505,14 +665,24 @@ int CALLBACK WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR cmd_line
     core::open_doc(PAPAYA_DEFAULT_IMAGE, &mem);
 #endif // PAPAYA_DEFAULT_IMAGE
 
+    f64 next_frame = timer::get_milliseconds();
     while (mem.is_running) {
-        timer::start(Timer_Frame);
+        // Tablet packets arrive as messages too
+        if (!core::needs_redraw(&mem)) {
+            PROFILE_ZONE("Wait for events");
+            WaitMessage();
+            next_frame = timer::get_milliseconds();
+        }
+
+        profiler::collect();
+        profiler::begin("Frame");
 
         // Windows message handling
         {
             MSG msg;
             while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE))
             {
+                core::request_redraw(&mem);
                 if (msg.message == WM_QUIT) {
                     mem.is_running = false;
                 }
@@ -652,16 +822,23 @@ int CALLBACK WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR cmd_line
 
         // ImGui::ShowTestWindow();
         core::update(&mem);
+        profiler::begin("Swap buffers");
         SwapBuffers(device_context);
+        profiler::end();
 
     EndOfFrame:
-        timer::stop(Timer_Frame);
-        f64 frame_rate = (mem.current_tool == PapayaTool_Brush && mem.mouse.is_down[0]) ?
-                           500.0 : 60.0;
-        f64 frame_time = 1000.0 / frame_rate;
-        f64 sleep_time = frame_time - timers[Timer_Frame].elapsed_ms;
-        timers[Timer_Sleep].elapsed_ms = sleep_time;
-        if (sleep_time > 0) { Sleep((i32)sleep_time); }
+        profiler::end();
+
+        // A frame that ran late starts the next one right away, instead of
+        // trying to catch up
+        f64 now = timer::get_milliseconds();
+        next_frame += 1000.0 / refresh_rate;
+        if (next_frame < now) {
+            next_frame = now;
+        } else if (core::needs_redraw(&mem)) {
+            PROFILE_ZONE("Sleep");
+            sleep_until(next_frame);
+        }
     }
 
     core::destroy(&mem);